@@ -0,0 +1,172 @@
+/*
+ * gbsplay is a Gameboy sound player
+ *
+ * 2003-2021 (C) by Tobias Diedrich <ranma+gbsplay@tdiedrich.de>
+ *                  Christian Garbs <mitch@cgarbs.de>
+ *
+ * Licensed under GNU GPL v1 or, at your option, any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+
+#include "common.h"
+#include "libgbs.h"
+#include "util.h"
+
+/*
+ * Compare the render time of the synthesis backends.  SYNTH_STEP pays
+ * per level change and SYNTH_OVERSAMPLE per output sample, so a noise
+ * channel is swept from dense to sparse to find the crossover, with
+ * examples/nightmode.gbs as a real world reference.
+ */
+
+#define BENCH_RATE    44100
+#define BENCH_SECONDS 60
+#define BENCH_STEP_MS 1000
+#define BENCH_SONGS   10
+#define BENCH_FILE    "bench_gbs.tmp"
+#define BENCH_GBS_LEN (0x70 + 0x8000 - 0x400)  /* two ROM banks */
+
+/* Load address of the generated GBS, init at 0x400, play at 0x420 */
+static const uint8_t bench_code[] = {
+	0x47,             /* ld b,a: subsong */
+	0x3e, 0x80,       /* ld a,0x80 */
+	0xe0, 0x26,       /* ldh (NR52),a: sound on */
+	0x3e, 0xff,       /* ld a,0xff */
+	0xe0, 0x25,       /* ldh (NR51),a: all channels to both sides */
+	0x3e, 0x77,       /* ld a,0x77 */
+	0xe0, 0x24,       /* ldh (NR50),a: full volume */
+	0x3e, 0xf0,       /* ld a,0xf0 */
+	0xe0, 0x21,       /* ldh (NR42),a: noise at full volume */
+	0x78,             /* ld a,b */
+	0xcb, 0x37,       /* swap a: subsong is the clock shift */
+	0xe0, 0x22,       /* ldh (NR43),a */
+	0x3e, 0x80,       /* ld a,0x80 */
+	0xe0, 0x23,       /* ldh (NR44),a: trigger */
+	0xc9,             /* ret */
+};
+
+static long bench_write_gbs(const char *name)
+{
+	uint8_t *buf = calloc(1, BENCH_GBS_LEN);
+	FILE *f;
+	long ok;
+
+	if (buf == NULL)
+		return false;
+	memcpy(buf, "GBS", 3);
+	buf[0x03] = 1;            /* version */
+	buf[0x04] = BENCH_SONGS;
+	buf[0x05] = 1;            /* first song */
+	buf[0x06] = 0x00;         /* load */
+	buf[0x07] = 0x04;
+	buf[0x08] = 0x00;         /* init */
+	buf[0x09] = 0x04;
+	buf[0x0a] = 0x20;         /* play */
+	buf[0x0b] = 0x04;
+	buf[0x0c] = 0xfe;         /* stack */
+	buf[0x0d] = 0xff;
+	strcpy((char *)&buf[0x10], "noise sweep");
+	memcpy(&buf[0x70], bench_code, sizeof(bench_code));
+	buf[0x70 + 0x20] = 0xc9; /* play: ret */
+
+	f = fopen(name, "wb");
+	if (f == NULL) {
+		free(buf);
+		return false;
+	}
+	ok = fwrite(buf, BENCH_GBS_LEN, 1, f) == 1;
+	free(buf);
+	return fclose(f) == 0 && ok;
+}
+
+static void bench_sound(struct gbs* const gbs, struct gbs_output_buffer *buf, void *priv)
+{
+	UNUSED(gbs);
+	UNUSED(priv);
+
+	buf->pos = 0;
+}
+
+/* CPU seconds to render BENCH_SECONDS of a subsong, negative on error */
+static double bench_run(const char *name, long subsong, enum gbs_synthesis synthesis)
+{
+	struct gbs_output_buffer buf;
+	struct gbs *gbs;
+	clock_t start;
+	long ms;
+
+	memset(&buf, 0, sizeof(buf));
+	buf.bytes = 8192;
+	buf.data = malloc(buf.bytes);
+	gbs = gbs_open(name);
+	if (buf.data == NULL || gbs == NULL) {
+		free(buf.data);
+		return -1;
+	}
+	gbs_set_sound_callback(gbs, bench_sound, NULL);
+	gbs_configure_output(gbs, &buf, BENCH_RATE);
+	gbs_set_filter(gbs, FILTER_OFF);
+	gbs_configure(gbs, subsong, BENCH_SECONDS, 0, 0, 0);
+	if (!gbs_set_synthesis(gbs, synthesis) || !gbs_init(gbs, subsong)) {
+		gbs_close(gbs);
+		free(buf.data);
+		return -1;
+	}
+
+	start = clock();
+	for (ms = 0; ms < BENCH_SECONDS * 1000; ms += BENCH_STEP_MS)
+		gbs_step(gbs, BENCH_STEP_MS);
+
+	gbs_close(gbs);
+	free(buf.data);
+	return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+static long bench_line(const char *label, const char *name, long subsong)
+{
+	double step = bench_run(name, subsong, SYNTH_STEP);
+	double oversample = bench_run(name, subsong, SYNTH_OVERSAMPLE);
+
+	if (step < 0 || oversample < 0)
+		return false;
+	printf("%-20s %8.3f %10.3f %7.2f\n", label, step, oversample, oversample / step);
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	char label[32];
+	long subsong;
+
+	UNUSED(argc);
+
+	i18n_init();
+	if (!bench_write_gbs(BENCH_FILE)) {
+		fprintf(stderr, "%s: could not write %s\n", argv[0], BENCH_FILE);
+		exit(1);
+	}
+
+	printf("CPU seconds for %ds at %dHz\n", BENCH_SECONDS, BENCH_RATE);
+	printf("%-20s %8s %10s %7s\n", "content", "step", "oversample", "ratio");
+	for (subsong = 0; subsong < BENCH_SONGS; subsong++) {
+		/* NR43 divisor 0 clocks the noise LFSR at 524288Hz >> shift */
+		snprintf(label, sizeof(label), "noise %ldHz", 524288L >> subsong);
+		if (!bench_line(label, BENCH_FILE, subsong)) {
+			fprintf(stderr, "%s: benchmark setup failed\n", argv[0]);
+			unlink(BENCH_FILE);
+			exit(2);
+		}
+	}
+	unlink(BENCH_FILE);
+
+	if (!bench_line("examples/nightmode", "examples/nightmode.gbs", 0)) {
+		fprintf(stderr, "%s: benchmark setup failed\n", argv[0]);
+		exit(2);
+	}
+	return 0;
+}
@@ -33,18 +33,23 @@ struct cfg_option {
 /* default values */
 
 struct player_cfg cfg = {
+	.cpu_core = CFG_CPU_CACHED,
 	.fadeout = 3,
 	.filter_type = CFG_FILTER_DMG,
+	.length_cache = 0,
 	.loop_mode = LOOP_OFF,
 	.output_filename = "gbsplay-%s.%e",
 	.play_mode = PLAY_MODE_LINEAR,
+	.quality = CFG_QUALITY_NORMAL,
 	.refresh_delay = 33, // ms
 	.requested_endian = PLUGOUT_ENDIAN_AUTOSELECT,
+	.requested_format = CFG_FORMAT_S16,
 	.requested_rate = 44100,
 	.silence_timeout = 2,
 	.sound_name = PLUGOUT_DEFAULT,
 	.subsong_gap = 2,
 	.subsong_timeout = 2*60,
+	.synthesis = CFG_SYNTH_STEP,
 	.verbosity = 3,
 };
 
@@ -59,19 +64,24 @@ static void cfg_string_until_newline(void* const ptr);
 
 /* configuration directives */
 static const struct cfg_option options[] = {
+	{ "cpu_core", &cfg.cpu_core, cfg_string },
 	{ "endian", &cfg.requested_endian, cfg_endian },
 	{ "fadeout", &cfg.fadeout, cfg_long },
 	{ "filter_type", &cfg.filter_type, cfg_string },
+	{ "length_cache", &cfg.length_cache, cfg_bool_as_int },
 	{ "loop", &cfg.loop_mode, cfg_bool_as_int },
 	{ "loop_mode", &cfg.loop_mode, cfg_loop_mode },
 	{ "output_filename", &cfg.output_filename, cfg_string_until_newline },
 	{ "output_plugin", &cfg.sound_name, cfg_string },
 	{ "play_mode", &cfg.play_mode, cfg_play_mode },
+	{ "quality", &cfg.quality, cfg_string },
 	{ "rate", &cfg.requested_rate, cfg_long },
 	{ "refresh_delay", &cfg.refresh_delay, cfg_long },
+	{ "sample_format", &cfg.requested_format, cfg_string },
 	{ "silence_timeout", &cfg.silence_timeout, cfg_long },
 	{ "subsong_gap", &cfg.subsong_gap, cfg_long },
 	{ "subsong_timeout", &cfg.subsong_timeout, cfg_long },
+	{ "synthesis", &cfg.synthesis, cfg_string },
 	{ "verbosity", &cfg.verbosity, cfg_long },
 	{ NULL, NULL, NULL }
 };
@@ -425,6 +435,7 @@ struct player_cfg initial_cfg;
 
 #define ASSERT_CFG_EQUAL(actual, expected) do { \
 		ASSERT_STRUCT_EQUAL("%ld", fadeout,          actual, expected); \
+		ASSERT_STRUCT_EQUAL("%d",  length_cache,     actual, expected); \
 		ASSERT_STRUCT_EQUAL("%d",  loop_mode,        actual, expected); \
 		ASSERT_STRUCT_EQUAL("%d",  play_mode,        actual, expected); \
 		ASSERT_STRUCT_EQUAL("%ld", refresh_delay,    actual, expected); \
@@ -434,24 +445,36 @@ struct player_cfg initial_cfg;
 		ASSERT_STRUCT_EQUAL("%ld", subsong_gap,      actual, expected); \
 		ASSERT_STRUCT_EQUAL("%ld", subsong_timeout,  actual, expected); \
 		ASSERT_STRUCT_EQUAL("%ld", verbosity,        actual, expected); \
+		ASSERT_STRUCT_STRING_EQUAL(cpu_core,         actual, expected); \
 		ASSERT_STRUCT_STRING_EQUAL(filter_type,      actual, expected); \
 		ASSERT_STRUCT_STRING_EQUAL(output_filename,  actual, expected); \
+		ASSERT_STRUCT_STRING_EQUAL(quality,          actual, expected); \
+		ASSERT_STRUCT_STRING_EQUAL(requested_format, actual, expected); \
 		ASSERT_STRUCT_STRING_EQUAL(sound_name,       actual, expected); \
+		ASSERT_STRUCT_STRING_EQUAL(synthesis,        actual, expected); \
 } while(0)
 
 test void save_initial_cfg() {
 	initial_cfg = cfg;
+	initial_cfg.cpu_core        = strdup(cfg.cpu_core);
 	initial_cfg.filter_type     = strdup(cfg.filter_type);
 	initial_cfg.output_filename = strdup(cfg.output_filename);
+	initial_cfg.quality         = strdup(cfg.quality);
+	initial_cfg.requested_format = strdup(cfg.requested_format);
 	initial_cfg.sound_name      = strdup(cfg.sound_name);
+	initial_cfg.synthesis       = strdup(cfg.synthesis);
 };
 TEST(save_initial_cfg);
 
 test void restore_initial_cfg() {
 	cfg = initial_cfg;
+	cfg.cpu_core        = strdup(initial_cfg.cpu_core);
 	cfg.filter_type     = strdup(initial_cfg.filter_type);
 	cfg.output_filename = strdup(initial_cfg.output_filename);
+	cfg.quality         = strdup(initial_cfg.quality);
+	cfg.requested_format = strdup(initial_cfg.requested_format);
 	cfg.sound_name      = strdup(initial_cfg.sound_name);
+	cfg.synthesis       = strdup(initial_cfg.synthesis);
 };
 
 test void write_test_gbsplayrc_n(unsigned int n, ...) {
@@ -482,6 +505,7 @@ test void delete_test_gbsplayrc() {
 
 test void test_parse_check_defaults() {
 	ASSERT_EQUAL("fadeout %ld",            cfg.fadeout,          3L);
+	ASSERT_EQUAL("length_cache %d",        cfg.length_cache,     0);
 	ASSERT_EQUAL("loop_mode %d",           cfg.loop_mode,        LOOP_OFF);
 	ASSERT_EQUAL("play_mode %d",           cfg.play_mode,        PLAY_MODE_LINEAR);
 	ASSERT_EQUAL("rate %ld",               cfg.requested_rate,   44100L);
@@ -491,9 +515,13 @@ test void test_parse_check_defaults() {
 	ASSERT_EQUAL("subsong_gap %ld",        cfg.subsong_gap,      2L);
 	ASSERT_EQUAL("subsong_timeout %ld",    cfg.subsong_timeout,  120L);
 	ASSERT_EQUAL("verbosity %ld",          cfg.verbosity,        3L);
+	ASSERT_STRING_EQUAL("cpu_core",        cfg.cpu_core,         CFG_CPU_CACHED);
 	ASSERT_STRING_EQUAL("filter_type",     cfg.filter_type,      CFG_FILTER_DMG);
 	ASSERT_STRING_EQUAL("output_filename", cfg.output_filename,  "gbsplay-%s.%e");
+	ASSERT_STRING_EQUAL("quality",         cfg.quality,          CFG_QUALITY_NORMAL);
+	ASSERT_STRING_EQUAL("sample_format",   cfg.requested_format, CFG_FORMAT_S16);
 	// "sound_name" depends on compile options and configure defaults, skip it
+	ASSERT_STRING_EQUAL("synthesis",       cfg.synthesis,        CFG_SYNTH_STEP);
 }
 TEST(test_parse_check_defaults);
 
@@ -529,19 +557,24 @@ TEST(test_parse_empty_configuration);
 test void test_parse_complete_configuration() {
 	// given
 	restore_initial_cfg();
-	write_test_gbsplayrc_n(13,
+	write_test_gbsplayrc_n(18,
+			       "cpu_core=interp",
 			       "endian=little",
 			       "fadeout=0",
 			       "filter_type=cgb",
+			       "length_cache=1",
 			       "loop=1",
 			       "output_filename=gbs-%D.%s",
 			       "output_plugin=altmidi",
 			       "play_mode=shuffle",
+			       "quality=hq",
 			       "rate=12345",
 			       "refresh_delay=987",
+			       "sample_format=float",
 			       "silence_timeout=19",
 			       "subsong_gap=23",
 			       "subsong_timeout=42",
+			       "synthesis=oversample",
 			       "verbosity=5");
 
 	// when
@@ -549,6 +582,7 @@ test void test_parse_complete_configuration() {
 
 	// then
 	ASSERT_EQUAL("fadeout %ld",            cfg.fadeout,          0L);
+	ASSERT_EQUAL("length_cache %d",        cfg.length_cache,     1);
 	ASSERT_EQUAL("loop_mode %d",           cfg.loop_mode,        LOOP_RANGE);
 	ASSERT_EQUAL("play_mode %d",           cfg.play_mode,        PLAY_MODE_SHUFFLE);
 	ASSERT_EQUAL("refresh_delay %ld",      cfg.refresh_delay,    987L);
@@ -558,9 +592,13 @@ test void test_parse_complete_configuration() {
 	ASSERT_EQUAL("subsong_gap %ld",        cfg.subsong_gap,      23L);
 	ASSERT_EQUAL("subsong_timeout %ld",    cfg.subsong_timeout,  42L);
 	ASSERT_EQUAL("verbosity %ld",          cfg.verbosity,        5L);
+	ASSERT_STRING_EQUAL("cpu_core",        cfg.cpu_core,         CFG_CPU_INTERP);
 	ASSERT_STRING_EQUAL("filter_type",     cfg.filter_type,      CFG_FILTER_CGB);
 	ASSERT_STRING_EQUAL("output_filename", cfg.output_filename, "gbs-%D.%s");
+	ASSERT_STRING_EQUAL("quality",         cfg.quality,          CFG_QUALITY_HQ);
+	ASSERT_STRING_EQUAL("sample_format",   cfg.requested_format, CFG_FORMAT_FLOAT);
 	ASSERT_STRING_EQUAL("sound_name",      cfg.sound_name,       "altmidi");
+	ASSERT_STRING_EQUAL("synthesis",       cfg.synthesis,        CFG_SYNTH_OVERSAMPLE);
 }
 TEST(test_parse_complete_configuration);
 
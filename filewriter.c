@@ -20,10 +20,11 @@
 #include "test.h"
 
 #define FILENAME_SIZE 256
+#define STEM_FILENAME_DEFAULT "gbsplay-%s-ch%c.%e"
 
 static char filename[FILENAME_SIZE];
 
-int expand_filename(const char* const filename_template, const unsigned int filename_size, const char* const extension, const int subsong) {
+int expand_filename(const char* const filename_template, const unsigned int filename_size, const char* const extension, const int subsong, const int channel) {
 	char* const last = filename + filename_size - 1;
 	const char *src;
 	char *dst;
@@ -47,6 +48,11 @@ int expand_filename(const char* const filename_template, const unsigned int file
 				dst += snprintf(dst, last + 1 - dst, "%s", extension);
 				break;
 
+			case 'c': // %c -> channel number, empty if not writing per-channel files
+				if (channel)
+					dst += snprintf(dst, last + 1 - dst, "%d", channel);
+				break;
+
 			default:
 				fprintf(stderr, _("Unknown placeholder %%%c in filename pattern could not be expanded.\n"), *src);
 				*(dst) = 0;
@@ -67,10 +73,15 @@ int expand_filename(const char* const filename_template, const unsigned int file
 	return 0;
 }
 
-FILE* file_open(const char* const extension, const int subsong) {
+FILE* file_open_channel(const char* const extension, const int subsong, const int channel) {
+	const char *filename_template = cfg.output_filename;
 	FILE* file = NULL;
 
-	if (expand_filename(cfg.output_filename, FILENAME_SIZE, extension, subsong)  != 0)
+	/* per-channel files would overwrite each other without %c */
+	if (channel && strstr(filename_template, "%c") == NULL)
+		filename_template = STEM_FILENAME_DEFAULT;
+
+	if (expand_filename(filename_template, FILENAME_SIZE, extension, subsong, channel)  != 0)
 		goto error;
 
 	if ((file = fopen(filename, "wb")) == NULL)
@@ -85,6 +96,10 @@ error:
 	return NULL;
 }
 
+FILE* file_open(const char* const extension, const int subsong) {
+	return file_open_channel(extension, subsong, 0);
+}
+
 /************************* tests ************************/
 
 #ifdef ENABLE_TEST
@@ -109,7 +124,7 @@ test void test_expand_filename_default_template_ok(void) {
 	// given
 
 	// when
-	int result = expand_filename("gbsplay-%s.%e", TEST_FILENAME_SIZE, "wav", 0);
+	int result = expand_filename("gbsplay-%s.%e", TEST_FILENAME_SIZE, "wav", 0, 0);
 
 	// then
 	ASSERT_RC_OK(result);
@@ -122,7 +137,7 @@ test void test_expand_filename_leading_zeroes_ok(void) {
 	// given
 
 	// when
-	int result = expand_filename("gbsplay-%S.%e", TEST_FILENAME_SIZE, "wav", 3);
+	int result = expand_filename("gbsplay-%S.%e", TEST_FILENAME_SIZE, "wav", 3, 0);
 
 	// then
 	ASSERT_RC_OK(result);
@@ -135,7 +150,7 @@ test void test_expand_filename_multiple_placeholders_ok(void) {
 	// given
 
 	// when
-	int result = expand_filename("%e.%s-%S-%s.foo", TEST_FILENAME_SIZE, "wav", 49);
+	int result = expand_filename("%e.%s-%S-%s.foo", TEST_FILENAME_SIZE, "wav", 49, 0);
 
 	// then
 	ASSERT_RC_OK(result);
@@ -148,7 +163,7 @@ test void test_expand_filename_unknown_percent_sequence_fail(void) {
 	// given
 
 	// when
-	int result = expand_filename("gbsplay-%?.%e", TEST_FILENAME_SIZE, "wav", 5);
+	int result = expand_filename("gbsplay-%?.%e", TEST_FILENAME_SIZE, "wav", 5, 0);
 
 	// then
 	ASSERT_RC_FAILED(result);
@@ -157,11 +172,37 @@ test void test_expand_filename_unknown_percent_sequence_fail(void) {
 }
 TEST(test_expand_filename_unknown_percent_sequence_fail);
 
+test void test_expand_filename_channel_ok(void) {
+	// given
+
+	// when
+	int result = expand_filename("gbsplay-%s-ch%c.%e", TEST_FILENAME_SIZE, "wav", 1, 3);
+
+	// then
+	ASSERT_RC_OK(result);
+	ASSERT_STRING_EQUAL("filename", filename, "gbsplay-2-ch3.wav");
+	ASSERT_CANARY_OK();
+}
+TEST(test_expand_filename_channel_ok);
+
+test void test_expand_filename_channel_without_channel_ok(void) {
+	// given
+
+	// when
+	int result = expand_filename("gbsplay-%s%c.%e", TEST_FILENAME_SIZE, "wav", 1, 0);
+
+	// then
+	ASSERT_RC_OK(result);
+	ASSERT_STRING_EQUAL("filename", filename, "gbsplay-2.wav");
+	ASSERT_CANARY_OK();
+}
+TEST(test_expand_filename_channel_without_channel_ok);
+
 test void test_expand_filename_too_long_after_expansion_fail(void) {
 	// given
 
 	// when
-	int result = expand_filename("gbsplay-%s.%e", TEST_FILENAME_SIZE, "superlongextension", 10);
+	int result = expand_filename("gbsplay-%s.%e", TEST_FILENAME_SIZE, "superlongextension", 10, 0);
 
 	// then
 	ASSERT_RC_FAILED(result);
@@ -174,7 +215,7 @@ test void test_expand_filename_template_longer_than_target_fail(void) {
 	// given
 
 	// when
-	int result = expand_filename("aaaaabbbbbcccccdddddeeeee", TEST_FILENAME_SIZE, "ext", 0);
+	int result = expand_filename("aaaaabbbbbcccccdddddeeeee", TEST_FILENAME_SIZE, "ext", 0, 0);
 
 	// then
 	ASSERT_RC_FAILED(result);
@@ -14,5 +14,6 @@
 #include "common.h"
 
 FILE* file_open(const char* const extension, const int subsong);
+FILE* file_open_channel(const char* const extension, const int subsong, const int channel);
 
 #endif
@@ -16,6 +16,8 @@
 #include <assert.h>
 
 #include "gbcpu.h"
+#include "gbjit.h"
+#include "gbstate.h"
 
 #if DEBUG == 1
 static const char regnames[12] = "BCDEHLFASPPC";
@@ -59,14 +61,20 @@ static void none_put(void *priv, uint32_t addr, uint8_t val)
 void gbcpu_init_struct(struct gbcpu* const gbcpu) {
 	for (uint16_t i = 0; i < GBCPU_LOOKUP_SIZE; i++) {
 		gbcpu->getlookup[i].get = &none_get;
+		gbcpu->getlookup[i].ptr = NULL;
 		gbcpu->putlookup[i].put = &none_put;
+		gbcpu->putlookup[i].ptr = NULL;
 	}
+	gbcpu->blocks = NULL;
+	gbcpu->jit = NULL;
 }
 
 static inline uint32_t mem_get(struct gbcpu* const gbcpu, uint32_t addr)
 {
 	struct get_entry *e = &gbcpu->getlookup[(addr >> 8) & 0xff];
 	gbcpu->cycles += 4;
+	if (e->ptr)
+		return e->ptr[addr & 0xff];
 	return e->get(e->priv, addr);
 }
 
@@ -74,6 +82,10 @@ static inline void mem_put(struct gbcpu* const gbcpu, uint32_t addr, uint32_t va
 {
 	struct put_entry *e = &gbcpu->putlookup[(addr >> 8) & 0xff];
 	gbcpu->cycles += 4;
+	if (e->ptr) {
+		e->ptr[addr & 0xff] = val;
+		return;
+	}
 	e->put(e->priv, addr, val);
 }
 
@@ -174,6 +186,101 @@ static void op_res(struct gbcpu* const gbcpu, uint32_t op)
 	put_reg(gbcpu, reg, get_reg(gbcpu, reg) & ~(1 << bit));
 }
 
+/*
+ * Lazy flags.  Arithmetic records its operands in lf_* instead of
+ * computing F right away, as most results are overwritten before
+ * anything looks at them.  Everything else that reads or partially
+ * updates F calls flags_sync() first.  The LF_* operations are listed
+ * in gbcpu.h.
+ */
+
+/*
+ * The flag computations on plain values, shared by the gbcpu based
+ * helpers below and the threaded interpreter, which keeps the lazy
+ * flag state in locals.
+ */
+static inline long lf_carry(uint8_t lf_op, uint8_t a, uint8_t b, uint8_t c, uint8_t f)
+{
+	switch (lf_op) {
+		case LF_ADD: return a + b + c > 0xff;
+		case LF_SUB: return a - b - c < 0;
+		case LF_INC:
+		case LF_DEC: return (c & CF) != 0;
+		default: return (f & CF) != 0;
+	}
+}
+
+/* flag bits left alone by INC and DEC */
+static inline uint8_t lf_kept(uint8_t lf_op, uint8_t a, uint8_t b, uint8_t c, uint8_t f)
+{
+	switch (lf_op) {
+		case LF_NONE: return f & ~(ZF | NF | HF);
+		case LF_INC:
+		case LF_DEC: return c;
+		default: return lf_carry(lf_op, a, b, c, f) ? CF : 0;
+	}
+}
+
+static inline uint8_t lf_eval(uint8_t lf_op, long a, long b, long c)
+{
+	uint8_t f = 0;
+
+	switch (lf_op) {
+		case LF_ADD:
+			if (a + b + c > 0xff) f |= CF;
+			if ((a & 15) + (b & 15) + c > 15) f |= HF;
+			if (((a + b + c) & 0xff) == 0) f |= ZF;
+			break;
+		case LF_SUB:
+			f = NF;
+			if (a - b - c < 0) f |= CF;
+			if ((a & 15) - (b & 15) - c < 0) f |= HF;
+			if (((a - b - c) & 0xff) == 0) f |= ZF;
+			break;
+		case LF_INC:
+			f = c;
+			if (a == 0xff) f |= ZF;
+			if ((a & 15) == 15) f |= HF;
+			break;
+		case LF_DEC:
+			f = c | NF;
+			if (a == 0x01) f |= ZF;
+			if ((a & 15) == 0) f |= HF;
+			break;
+	}
+	return f;
+}
+
+static inline long flags_carry(const struct gbcpu* const gbcpu)
+{
+	return lf_carry(gbcpu->lf_op, gbcpu->lf_a, gbcpu->lf_b, gbcpu->lf_c, gbcpu->regs.rn.f);
+}
+
+static inline uint8_t flags_kept(const struct gbcpu* const gbcpu)
+{
+	return lf_kept(gbcpu->lf_op, gbcpu->lf_a, gbcpu->lf_b, gbcpu->lf_c, gbcpu->regs.rn.f);
+}
+
+static void flags_eval(struct gbcpu* const gbcpu)
+{
+	gbcpu->regs.rn.f = lf_eval(gbcpu->lf_op, gbcpu->lf_a, gbcpu->lf_b, gbcpu->lf_c);
+	gbcpu->lf_op = LF_NONE;
+}
+
+static inline void flags_sync(struct gbcpu* const gbcpu)
+{
+	if (gbcpu->lf_op != LF_NONE)
+		flags_eval(gbcpu);
+}
+
+static inline void flags_lazy(struct gbcpu* const gbcpu, uint8_t lf_op, uint8_t a, uint8_t b, uint8_t c)
+{
+	gbcpu->lf_op = lf_op;
+	gbcpu->lf_a = a;
+	gbcpu->lf_b = b;
+	gbcpu->lf_c = c;
+}
+
 static void op_bit(struct gbcpu* const gbcpu, uint32_t op)
 {
 	long reg = op & 7;
@@ -218,6 +325,7 @@ static void op_rla(struct gbcpu* const gbcpu, uint32_t op, const struct opinfo *
 	UNUSED(op);
 	UNUSED(oi);
 
+	flags_sync(gbcpu);
 	DPRINTF(" \t%s", oi->name);
 	res  = gbcpu->regs.rn.a;
 	res  = res << 1;
@@ -258,6 +366,7 @@ static void op_rlca(struct gbcpu* const gbcpu, uint32_t op, const struct opinfo
 	UNUSED(op);
 	UNUSED(oi);
 
+	flags_sync(gbcpu);
 	DPRINTF(" \t%s", oi->name);
 	res  = gbcpu->regs.rn.a;
 	res  = res << 1;
@@ -306,6 +415,7 @@ static void op_rra(struct gbcpu* const gbcpu, uint32_t op, const struct opinfo *
 	UNUSED(op);
 	UNUSED(oi);
 
+	flags_sync(gbcpu);
 	DPRINTF(" \t%s", oi->name);
 	res  = gbcpu->regs.rn.a;
 	res  = res >> 1;
@@ -338,6 +448,7 @@ static void op_rrca(struct gbcpu* const gbcpu, uint32_t op, const struct opinfo
 	UNUSED(op);
 	UNUSED(oi);
 
+	flags_sync(gbcpu);
 	DPRINTF(" \t%s", oi->name);
 	res  = gbcpu->regs.rn.a;
 	res  = res >> 1;
@@ -417,6 +528,8 @@ static void op_cbprefix(struct gbcpu* const gbcpu, uint32_t op, const struct opi
 	REGS16_W(gbcpu->regs, PC, pc + 1);
 	op = mem_get(gbcpu, pc);
 	DPRINTF("%02x", op);
+	if (op < 0x80)
+		flags_sync(gbcpu); /* rotates, shifts and BIT */
 	switch (op >> 6) {
 		case 0: cbops[(op >> 3) & 7].fn(gbcpu, op, &cbops[(op >> 3) & 7]);
 			return;
@@ -486,6 +599,7 @@ static void op_ld_hlsp(struct gbcpu* const gbcpu, uint32_t op, const struct opin
 	UNUSED(op);
 	UNUSED(oi);
 
+	flags_sync(gbcpu);
 	if (ofs>0) DPRINTF(" \t%s  HL, SP+0x%02x", oi->name, ofs);
 	else DPRINTF(" \t%s  HL, SP-0x%02x", oi->name, -ofs);
 	REGS16_W(gbcpu->regs, HL, new);
@@ -581,6 +695,73 @@ static void op_ldh(struct gbcpu* const gbcpu, uint32_t op, const struct opinfo *
 	}
 }
 
+static inline void alu_add(struct gbcpu* const gbcpu, uint8_t val)
+{
+	flags_lazy(gbcpu, LF_ADD, gbcpu->regs.rn.a, val, 0);
+	gbcpu->regs.rn.a += val;
+}
+
+static inline void alu_adc(struct gbcpu* const gbcpu, uint8_t val)
+{
+	uint8_t c = flags_carry(gbcpu);
+
+	flags_lazy(gbcpu, LF_ADD, gbcpu->regs.rn.a, val, c);
+	gbcpu->regs.rn.a += val + c;
+}
+
+static inline uint8_t alu_cp(struct gbcpu* const gbcpu, uint8_t val)
+{
+	flags_lazy(gbcpu, LF_SUB, gbcpu->regs.rn.a, val, 0);
+	return gbcpu->regs.rn.a - val;
+}
+
+static inline void alu_sub(struct gbcpu* const gbcpu, uint8_t val)
+{
+	gbcpu->regs.rn.a = alu_cp(gbcpu, val);
+}
+
+static inline void alu_sbc(struct gbcpu* const gbcpu, uint8_t val)
+{
+	uint8_t c = flags_carry(gbcpu);
+
+	flags_lazy(gbcpu, LF_SUB, gbcpu->regs.rn.a, val, c);
+	gbcpu->regs.rn.a -= val + c;
+}
+
+static inline void alu_and(struct gbcpu* const gbcpu, uint8_t val)
+{
+	gbcpu->regs.rn.a &= val;
+	gbcpu->regs.rn.f = HF;
+	if (gbcpu->regs.rn.a == 0) gbcpu->regs.rn.f |= ZF;
+	gbcpu->lf_op = LF_NONE;
+}
+
+static inline void alu_or(struct gbcpu* const gbcpu, uint8_t val)
+{
+	gbcpu->regs.rn.a |= val;
+	gbcpu->regs.rn.f = 0;
+	if (gbcpu->regs.rn.a == 0) gbcpu->regs.rn.f |= ZF;
+	gbcpu->lf_op = LF_NONE;
+}
+
+static inline void alu_xor(struct gbcpu* const gbcpu, uint8_t val)
+{
+	gbcpu->regs.rn.a ^= val;
+	gbcpu->regs.rn.f = 0;
+	if (gbcpu->regs.rn.a == 0) gbcpu->regs.rn.f |= ZF;
+	gbcpu->lf_op = LF_NONE;
+}
+
+static inline void alu_inc(struct gbcpu* const gbcpu, uint8_t old)
+{
+	flags_lazy(gbcpu, LF_INC, old, 0, flags_kept(gbcpu));
+}
+
+static inline void alu_dec(struct gbcpu* const gbcpu, uint8_t old)
+{
+	flags_lazy(gbcpu, LF_DEC, old, 0, flags_kept(gbcpu));
+}
+
 static void op_inc(struct gbcpu* const gbcpu, uint32_t op, const struct opinfo *oi)
 {
 	long reg = (op >> 3) & 7;
@@ -594,9 +775,7 @@ static void op_inc(struct gbcpu* const gbcpu, uint32_t op, const struct opinfo *
 	old = res = get_reg(gbcpu, reg);
 	res++;
 	put_reg(gbcpu, reg, res);
-	gbcpu->regs.rn.f &= ~(NF | ZF | HF);
-	if (res == 0) gbcpu->regs.rn.f |= ZF;
-	if ((old & 15) > (res & 15)) gbcpu->regs.rn.f |= HF;
+	alu_inc(gbcpu, old);
 }
 
 static void op_inc16(struct gbcpu* const gbcpu, uint32_t op, const struct opinfo *oi)
@@ -629,10 +808,7 @@ static void op_dec(struct gbcpu* const gbcpu, uint32_t op, const struct opinfo *
 	old = res = get_reg(gbcpu, reg);
 	res--;
 	put_reg(gbcpu, reg, res);
-	gbcpu->regs.rn.f |= NF;
-	gbcpu->regs.rn.f &= ~(ZF | HF);
-	if (res == 0) gbcpu->regs.rn.f |= ZF;
-	if ((old & 15) < (res & 15)) gbcpu->regs.rn.f |= HF;
+	alu_dec(gbcpu, old);
 }
 
 static void op_dec16(struct gbcpu* const gbcpu, uint32_t op, const struct opinfo *oi)
@@ -661,6 +837,7 @@ static void op_add_sp_imm(struct gbcpu* const gbcpu, uint32_t op, const struct o
 	UNUSED(op);
 	UNUSED(oi);
 
+	flags_sync(gbcpu);
 	DPRINTF(" \t%s SP, %02x", oi->name, imm);
 	new += imm;
 	REGS16_W(gbcpu->regs, SP, new);
@@ -674,37 +851,22 @@ static void op_add_sp_imm(struct gbcpu* const gbcpu, uint32_t op, const struct o
 
 static void op_add(struct gbcpu* const gbcpu, uint32_t op, const struct opinfo *oi)
 {
-	uint8_t old = gbcpu->regs.rn.a;
-	uint8_t new;
-
 	UNUSED(oi);
 
 	DPRINTF(" \t%s A, ", oi->name);
 	print_reg(op & 7);
-	gbcpu->regs.rn.a += get_reg(gbcpu, op & 7);
-	new = gbcpu->regs.rn.a;
-	gbcpu->regs.rn.f = 0;
-	if (old > new) gbcpu->regs.rn.f |= CF;
-	if ((old & 15) > (new & 15)) gbcpu->regs.rn.f |= HF;
-	if (new == 0) gbcpu->regs.rn.f |= ZF;
+	alu_add(gbcpu, get_reg(gbcpu, op & 7));
 }
 
 static void op_add_imm(struct gbcpu* const gbcpu, uint32_t op, const struct opinfo *oi)
 {
 	uint8_t imm = get_imm8(gbcpu);
-	uint8_t old = gbcpu->regs.rn.a;
-	uint8_t new = old;
 
 	UNUSED(op);
 	UNUSED(oi);
 
 	DPRINTF(" \t%s A, $0x%02x", oi->name, imm);
-	new += imm;
-	gbcpu->regs.rn.a = new;
-	gbcpu->regs.rn.f = 0;
-	if (old > new) gbcpu->regs.rn.f |= CF;
-	if ((old & 15) > (new & 15)) gbcpu->regs.rn.f |= HF;
-	if (new == 0) gbcpu->regs.rn.f |= ZF;
+	alu_add(gbcpu, imm);
 }
 
 static void op_add_hl(struct gbcpu* const gbcpu, uint32_t op, const struct opinfo *oi)
@@ -715,6 +877,7 @@ static void op_add_hl(struct gbcpu* const gbcpu, uint32_t op, const struct opinf
 
 	UNUSED(oi);
 
+	flags_sync(gbcpu);
 	reg += reg > 2; /* skip over AF */
 	DPRINTF(" \t%s HL, %s", oi->name, regnamech16[reg]);
 
@@ -731,150 +894,82 @@ static void op_add_hl(struct gbcpu* const gbcpu, uint32_t op, const struct opinf
 
 static void op_adc(struct gbcpu* const gbcpu, uint32_t op, const struct opinfo *oi)
 {
-	uint8_t reg = get_reg(gbcpu, op & 7);
-	uint8_t old = gbcpu->regs.rn.a;
-	long new = old;
-	long c = (gbcpu->regs.rn.f & CF) > 0;
-
 	UNUSED(oi);
 
 	DPRINTF(" \t%s A, ", oi->name);
 	print_reg(op & 7);
-	new += reg;
-	new += c;
-	gbcpu->regs.rn.f = 0;
-	gbcpu->regs.rn.a = new;
-	if (new > 0xff) gbcpu->regs.rn.f |= CF;
-	if ((old & 15) + (reg & 15) + c > 15) gbcpu->regs.rn.f |= HF;
-	if (gbcpu->regs.rn.a == 0) gbcpu->regs.rn.f |= ZF;
+	alu_adc(gbcpu, get_reg(gbcpu, op & 7));
 }
 
 static void op_adc_imm(struct gbcpu* const gbcpu, uint32_t op, const struct opinfo *oi)
 {
 	uint8_t imm = get_imm8(gbcpu);
-	uint8_t old = gbcpu->regs.rn.a;
-	long new = old;
-	long c = (gbcpu->regs.rn.f & CF) > 0;
 
 	UNUSED(op);
 	UNUSED(oi);
 
 	DPRINTF(" \t%s A, $0x%02x", oi->name, imm);
-	new += imm;
-	new += c;
-	gbcpu->regs.rn.f = 0;
-	gbcpu->regs.rn.a = new;
-	if (new > 0xff) gbcpu->regs.rn.f |= CF;
-	if ((old & 15) + (imm & 15) + c > 15) gbcpu->regs.rn.f |= HF;
-	if (gbcpu->regs.rn.a == 0) gbcpu->regs.rn.f |= ZF;
+	alu_adc(gbcpu, imm);
 }
 
 static void op_cp(struct gbcpu* const gbcpu, uint32_t op, const struct opinfo *oi)
 {
-	uint8_t old = gbcpu->regs.rn.a;
-	uint8_t new = old;
-
 	UNUSED(oi);
 
 	DPRINTF(" \t%s A, ", oi->name);
 	print_reg(op & 7);
-	new -= get_reg(gbcpu, op & 7);
-	gbcpu->regs.rn.f = NF;
-	if (old < new) gbcpu->regs.rn.f |= CF;
-	if ((old & 15) < (new & 15)) gbcpu->regs.rn.f |= HF;
-	if (new == 0) gbcpu->regs.rn.f |= ZF;
+	alu_cp(gbcpu, get_reg(gbcpu, op & 7));
 }
 
 static void op_cp_imm(struct gbcpu* const gbcpu, uint32_t op, const struct opinfo *oi)
 {
 	uint8_t imm = get_imm8(gbcpu);
-	uint8_t old = gbcpu->regs.rn.a;
-	uint8_t new = old;
 
 	UNUSED(op);
 	UNUSED(oi);
 
 	DPRINTF(" \t%s A, $0x%02x", oi->name, imm);
-	new -= imm;
-	gbcpu->regs.rn.f = NF;
-	if (old < new) gbcpu->regs.rn.f |= CF;
-	if ((old & 15) < (new & 15)) gbcpu->regs.rn.f |= HF;
-	if (new == 0) gbcpu->regs.rn.f |= ZF;
+	alu_cp(gbcpu, imm);
 }
 
 static void op_sub(struct gbcpu* const gbcpu, uint32_t op, const struct opinfo *oi)
 {
-	uint8_t old = gbcpu->regs.rn.a;
-	uint8_t new;
-
 	UNUSED(oi);
 
 	DPRINTF(" \t%s A, ", oi->name);
 	print_reg(op & 7);
-	gbcpu->regs.rn.a -= get_reg(gbcpu, op & 7);
-	new = gbcpu->regs.rn.a;
-	gbcpu->regs.rn.f = NF;
-	if (old < new) gbcpu->regs.rn.f |= CF;
-	if ((old & 15) < (new & 15)) gbcpu->regs.rn.f |= HF;
-	if (new == 0) gbcpu->regs.rn.f |= ZF;
+	alu_sub(gbcpu, get_reg(gbcpu, op & 7));
 }
 
 static void op_sub_imm(struct gbcpu* const gbcpu, uint32_t op, const struct opinfo *oi)
 {
 	uint8_t imm = get_imm8(gbcpu);
-	uint8_t old = gbcpu->regs.rn.a;
-	uint8_t new = old;
 
 	UNUSED(op);
 	UNUSED(oi);
 
 	DPRINTF(" \t%s A, $0x%02x", oi->name, imm);
-	new -= imm;
-	gbcpu->regs.rn.a = new;
-	gbcpu->regs.rn.f = NF;
-	if (old < new) gbcpu->regs.rn.f |= CF;
-	if ((old & 15) < (new & 15)) gbcpu->regs.rn.f |= HF;
-	if (new == 0) gbcpu->regs.rn.f |= ZF;
+	alu_sub(gbcpu, imm);
 }
 
 static void op_sbc(struct gbcpu* const gbcpu, uint32_t op, const struct opinfo *oi)
 {
-	uint8_t reg = get_reg(gbcpu, op & 7);
-	uint8_t old = gbcpu->regs.rn.a;
-	long new = old + 0x100;
-	long c = (gbcpu->regs.rn.f & CF) > 0;
-
 	UNUSED(oi);
 
 	DPRINTF(" \t%s A, ", oi->name);
 	print_reg(op & 7);
-	new -= reg;
-	new -= c;
-	gbcpu->regs.rn.a = new;
-	gbcpu->regs.rn.f = NF;
-	if (new < 0x100) gbcpu->regs.rn.f |= CF;
-	if ((old & 15) - (reg & 15) - c < 0) gbcpu->regs.rn.f |= HF;
-	if (gbcpu->regs.rn.a == 0) gbcpu->regs.rn.f |= ZF;
+	alu_sbc(gbcpu, get_reg(gbcpu, op & 7));
 }
 
 static void op_sbc_imm(struct gbcpu* const gbcpu, uint32_t op, const struct opinfo *oi)
 {
 	uint8_t imm = get_imm8(gbcpu);
-	uint8_t old = gbcpu->regs.rn.a;
-	long new = old + 0x100;
-	long c = (gbcpu->regs.rn.f & CF) > 0;
 
 	UNUSED(op);
 	UNUSED(oi);
 
 	DPRINTF(" \t%s A, $0x%02x", oi->name, imm);
-	new -= imm;
-	new -= c;
-	gbcpu->regs.rn.a = new;
-	gbcpu->regs.rn.f = NF;
-	if (new < 0x100) gbcpu->regs.rn.f |= CF;
-	if ((old & 15) - (imm & 15) - c < 0) gbcpu->regs.rn.f |= HF;
-	if (gbcpu->regs.rn.a == 0) gbcpu->regs.rn.f |= ZF;
+	alu_sbc(gbcpu, imm);
 }
 
 static void op_and(struct gbcpu* const gbcpu, uint32_t op, const struct opinfo *oi)
@@ -883,9 +978,7 @@ static void op_and(struct gbcpu* const gbcpu, uint32_t op, const struct opinfo *
 
 	DPRINTF(" \t%s A, ", oi->name);
 	print_reg(op & 7);
-	gbcpu->regs.rn.a &= get_reg(gbcpu, op & 7);
-	gbcpu->regs.rn.f = HF;
-	if (gbcpu->regs.rn.a == 0) gbcpu->regs.rn.f |= ZF;
+	alu_and(gbcpu, get_reg(gbcpu, op & 7));
 }
 
 static void op_and_imm(struct gbcpu* const gbcpu, uint32_t op, const struct opinfo *oi)
@@ -896,9 +989,7 @@ static void op_and_imm(struct gbcpu* const gbcpu, uint32_t op, const struct opin
 	UNUSED(oi);
 
 	DPRINTF(" \t%s A, $0x%02x", oi->name, imm);
-	gbcpu->regs.rn.a &= imm;
-	gbcpu->regs.rn.f = HF;
-	if (gbcpu->regs.rn.a == 0) gbcpu->regs.rn.f |= ZF;
+	alu_and(gbcpu, imm);
 }
 
 static void op_or(struct gbcpu* const gbcpu, uint32_t op, const struct opinfo *oi)
@@ -907,9 +998,7 @@ static void op_or(struct gbcpu* const gbcpu, uint32_t op, const struct opinfo *o
 
 	DPRINTF(" \t%s A, ", oi->name);
 	print_reg(op & 7);
-	gbcpu->regs.rn.a |= get_reg(gbcpu, op & 7);
-	gbcpu->regs.rn.f = 0;
-	if (gbcpu->regs.rn.a == 0) gbcpu->regs.rn.f |= ZF;
+	alu_or(gbcpu, get_reg(gbcpu, op & 7));
 }
 
 static void op_or_imm(struct gbcpu* const gbcpu, uint32_t op, const struct opinfo *oi)
@@ -920,9 +1009,7 @@ static void op_or_imm(struct gbcpu* const gbcpu, uint32_t op, const struct opinf
 	UNUSED(oi);
 
 	DPRINTF(" \t%s A, $0x%02x", oi->name, imm);
-	gbcpu->regs.rn.a |= imm;
-	gbcpu->regs.rn.f = 0;
-	if (gbcpu->regs.rn.a == 0) gbcpu->regs.rn.f |= ZF;
+	alu_or(gbcpu, imm);
 }
 
 static void op_xor(struct gbcpu* const gbcpu, uint32_t op, const struct opinfo *oi)
@@ -931,9 +1018,7 @@ static void op_xor(struct gbcpu* const gbcpu, uint32_t op, const struct opinfo *
 
 	DPRINTF(" \t%s A, ", oi->name);
 	print_reg(op & 7);
-	gbcpu->regs.rn.a ^= get_reg(gbcpu, op & 7);
-	gbcpu->regs.rn.f = 0;
-	if (gbcpu->regs.rn.a == 0) gbcpu->regs.rn.f |= ZF;
+	alu_xor(gbcpu, get_reg(gbcpu, op & 7));
 }
 
 static void op_xor_imm(struct gbcpu* const gbcpu, uint32_t op, const struct opinfo *oi)
@@ -944,9 +1029,7 @@ static void op_xor_imm(struct gbcpu* const gbcpu, uint32_t op, const struct opin
 	UNUSED(oi);
 
 	DPRINTF(" \t%s A, $0x%02x", oi->name, imm);
-	gbcpu->regs.rn.a ^= imm;
-	gbcpu->regs.rn.f = 0;
-	if (gbcpu->regs.rn.a == 0) gbcpu->regs.rn.f |= ZF;
+	alu_xor(gbcpu, imm);
 }
 
 static void op_push(struct gbcpu* const gbcpu, uint32_t op, const struct opinfo *oi)
@@ -968,6 +1051,7 @@ static void op_push_af(struct gbcpu* const gbcpu, uint32_t op, const struct opin
 	UNUSED(op);
 	UNUSED(oi);
 
+	flags_sync(gbcpu);
 	tmp |= gbcpu->regs.rn.f;
 	push(gbcpu, tmp);
 	// 4 extra cycles.
@@ -994,6 +1078,7 @@ static void op_pop_af(struct gbcpu* const gbcpu, uint32_t op, const struct opinf
 
 	gbcpu->regs.rn.f = tmp & 0xf0;
 	gbcpu->regs.rn.a = tmp >> 8;
+	gbcpu->lf_op = LF_NONE;
 	DPRINTF(" \t%s %s\t", oi->name, regnamech16[op >> 4 & 3]);
 }
 
@@ -1002,6 +1087,7 @@ static void op_cpl(struct gbcpu* const gbcpu, uint32_t op, const struct opinfo *
 	UNUSED(op);
 	UNUSED(oi);
 
+	flags_sync(gbcpu);
 	DPRINTF(" \t%s", oi->name);
 	gbcpu->regs.rn.a = ~gbcpu->regs.rn.a;
 	gbcpu->regs.rn.f |= NF | HF;
@@ -1012,6 +1098,7 @@ static void op_ccf(struct gbcpu* const gbcpu, uint32_t op, const struct opinfo *
 	UNUSED(op);
 	UNUSED(oi);
 
+	flags_sync(gbcpu);
 	DPRINTF(" \t%s", oi->name);
 	gbcpu->regs.rn.f ^= CF;
 	gbcpu->regs.rn.f &= ~(NF | HF);
@@ -1022,6 +1109,7 @@ static void op_scf(struct gbcpu* const gbcpu, uint32_t op, const struct opinfo *
 	UNUSED(op);
 	UNUSED(oi);
 
+	flags_sync(gbcpu);
 	DPRINTF(" \t%s", oi->name);
 	gbcpu->regs.rn.f |= CF;
 	gbcpu->regs.rn.f &= ~(NF | HF);
@@ -1048,6 +1136,7 @@ static void op_call_cond(struct gbcpu* const gbcpu, uint32_t op, const struct op
 
 	UNUSED(oi);
 
+	flags_sync(gbcpu);
 	DPRINTF(" \t%s %s 0x%04x", oi->name, conds[cond], ofs);
 	switch (cond) {
 		case 0: if ((gbcpu->regs.rn.f & ZF) != 0) return; break;
@@ -1090,6 +1179,7 @@ static void op_ret_cond(struct gbcpu* const gbcpu, uint32_t op, const struct opi
 
 	UNUSED(oi);
 
+	flags_sync(gbcpu);
 	// 4 extra cycles.
 	gbcpu->cycles += 4;
 	DPRINTF(" \t%s %s", oi->name, conds[cond]);
@@ -1165,6 +1255,7 @@ static void op_jr_cond(struct gbcpu* const gbcpu, uint32_t op, const struct opin
 
 	UNUSED(oi);
 
+	flags_sync(gbcpu);
 	if (ofs < 0) DPRINTF(" \t%s %s $-0x%02x", oi->name, conds[cond], -ofs);
 	else DPRINTF(" \t%s %s $+0x%02x", oi->name, conds[cond], ofs);
 	switch (cond) {
@@ -1207,6 +1298,7 @@ static void op_jp_cond(struct gbcpu* const gbcpu, uint32_t op, const struct opin
 
 	UNUSED(oi);
 
+	flags_sync(gbcpu);
 	DPRINTF(" \t%s %s 0x%04x", oi->name, conds[cond], ofs);
 	switch (cond) {
 		case 0: if ((gbcpu->regs.rn.f & ZF) != 0) return; break;
@@ -1244,11 +1336,13 @@ static void op_nop(struct gbcpu* const gbcpu, uint32_t op, const struct opinfo *
 static void op_daa(struct gbcpu* const gbcpu, uint32_t op, const struct opinfo *oi)
 {
 	long a = gbcpu->regs.rn.a;
-	long f = gbcpu->regs.rn.f;
+	long f;
 
 	UNUSED(op);
 	UNUSED(oi);
 
+	flags_sync(gbcpu);
+	f = gbcpu->regs.rn.f;
 	if (f & NF) {
 		if (f & HF) {
 			a -= 0x06;
@@ -1534,11 +1628,355 @@ static const struct opinfo ops[256] = {
 	OPINFO("RST", &op_rst          , 4, 4),		/* opcode ff */
 };
 
+/*
+ * Predecoded block cache.
+ *
+ * Straight-line code in ROM pages is decoded once into blocks of
+ * handlers with register indices, immediates and jump targets already
+ * extracted.  A block never crosses a page boundary and ends at the
+ * first control transfer.  Each block remembers the page data it was
+ * decoded from, so after a bank switch the lookup simply misses.  Pages
+ * that can be written to (RAM) are never cached.
+ */
+
+#define GBCPU_BLOCK_INSNS 16
+#define GBCPU_BLOCK_CACHE_SIZE 256
+
+struct gbcpu_insn;
+
+typedef void (*pre_fn)(struct gbcpu* const gbcpu, const struct gbcpu_insn *in);
+
+struct gbcpu_insn {
+	pre_fn fn;
+	uint16_t next;  /* address of the following instruction */
+	uint16_t imm;   /* immediate operand or jump target */
+	uint8_t op;
+	uint8_t len;
+	uint8_t r1;     /* pre-resolved register indices */
+	uint8_t r2;
+};
+
+struct gbcpu_block {
+	const uint8_t *page;
+	uint16_t pc;
+	uint8_t count;
+	struct gbcpu_insn insn[GBCPU_BLOCK_INSNS];
+};
+
+#define BE 0x80  /* instruction ends a block */
+
+/* instruction lengths as consumed by the handlers, 0 for unknown opcodes */
+static const uint8_t opdecode[256] = {
+	1, 3, 1, 1, 1, 1, 2, 1, 3, 1, 1, 1, 1, 1, 2, 1,	/* 00-0f */
+	1|BE, 3, 1, 1, 1, 1, 2, 1, 2|BE, 1, 1, 1, 1, 1, 2, 1,	/* 10-1f */
+	2|BE, 3, 1, 1, 1, 1, 2, 1, 2|BE, 1, 1, 1, 1, 1, 2, 1,	/* 20-2f */
+	2|BE, 3, 1, 1, 1, 1, 2, 1, 2|BE, 1, 1, 1, 1, 1, 2, 1,	/* 30-3f */
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,	/* 40-4f */
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,	/* 50-5f */
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,	/* 60-6f */
+	1, 1, 1, 1, 1, 1, 1|BE, 1, 1, 1, 1, 1, 1, 1, 1, 1,	/* 70-7f */
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,	/* 80-8f */
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,	/* 90-9f */
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,	/* a0-af */
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,	/* b0-bf */
+	1|BE, 1, 3|BE, 3|BE, 3|BE, 1, 2, 1|BE, 1|BE, 1|BE, 3|BE, 2, 3|BE, 3|BE, 2, 1|BE,	/* c0-cf */
+	1|BE, 1, 3|BE, 0, 3|BE, 1, 2, 1|BE, 1|BE, 1|BE, 3|BE, 0, 3|BE, 0, 2, 1|BE,	/* d0-df */
+	2, 1, 1, 0, 0, 1, 2, 1|BE, 2, 1|BE, 3, 0, 0, 0, 2, 1|BE,	/* e0-ef */
+	2, 1, 1, 1, 0, 1, 2, 1|BE, 2, 1, 3, 1, 0, 0, 2, 1|BE,	/* f0-ff */
+};
+
+static inline long cond_met(struct gbcpu* const gbcpu, uint32_t op)
+{
+	flags_sync(gbcpu);
+	switch ((op >> 3) & 3) {
+		case 0: return (gbcpu->regs.rn.f & ZF) == 0;
+		case 1: return (gbcpu->regs.rn.f & ZF) != 0;
+		case 2: return (gbcpu->regs.rn.f & CF) == 0;
+		default: return (gbcpu->regs.rn.f & CF) != 0;
+	}
+}
+
+/* opcode and operands were fetched at decode time, account for them */
+static inline void pre_fetched(struct gbcpu* const gbcpu, const struct gbcpu_insn *in)
+{
+	REGS16_W(gbcpu->regs, PC, in->next);
+	gbcpu->cycles = 4 * in->len;
+}
+
+static void pre_generic(struct gbcpu* const gbcpu, const struct gbcpu_insn *in)
+{
+	/* let the interpreter handler fetch its operands itself */
+	REGS16_W(gbcpu->regs, PC, in->next - in->len + 1);
+	gbcpu->cycles = 4;
+	ops[in->op].fn(gbcpu, in->op, &ops[in->op]);
+}
+
+static void pre_ld(struct gbcpu* const gbcpu, const struct gbcpu_insn *in)
+{
+	pre_fetched(gbcpu, in);
+	gbcpu->regs.ri[in->r1] = gbcpu->regs.ri[in->r2];
+}
+
+static void pre_ld_imm8(struct gbcpu* const gbcpu, const struct gbcpu_insn *in)
+{
+	pre_fetched(gbcpu, in);
+	gbcpu->regs.ri[in->r1] = in->imm;
+}
+
+static void pre_ld_imm16(struct gbcpu* const gbcpu, const struct gbcpu_insn *in)
+{
+	pre_fetched(gbcpu, in);
+	REGS16_W(gbcpu->regs, in->r1, in->imm);
+}
+
+static void pre_inc(struct gbcpu* const gbcpu, const struct gbcpu_insn *in)
+{
+	uint8_t old = gbcpu->regs.ri[in->r1];
+
+	pre_fetched(gbcpu, in);
+	gbcpu->regs.ri[in->r1] = old + 1;
+	alu_inc(gbcpu, old);
+}
+
+static void pre_dec(struct gbcpu* const gbcpu, const struct gbcpu_insn *in)
+{
+	uint8_t old = gbcpu->regs.ri[in->r1];
+
+	pre_fetched(gbcpu, in);
+	gbcpu->regs.ri[in->r1] = old - 1;
+	alu_dec(gbcpu, old);
+}
+
+static void pre_alu(struct gbcpu* const gbcpu, const struct gbcpu_insn *in)
+{
+	uint8_t val = in->op & 0x40 ? in->imm : gbcpu->regs.ri[in->r2];
+
+	pre_fetched(gbcpu, in);
+	switch ((in->op >> 3) & 7) {
+		case 0: alu_add(gbcpu, val); break;
+		case 1: alu_adc(gbcpu, val); break;
+		case 2: alu_sub(gbcpu, val); break;
+		case 3: alu_sbc(gbcpu, val); break;
+		case 4: alu_and(gbcpu, val); break;
+		case 5: alu_xor(gbcpu, val); break;
+		case 6: alu_or(gbcpu, val); break;
+		case 7: alu_cp(gbcpu, val); break;
+	}
+}
+
+static void pre_ld_mem(struct gbcpu* const gbcpu, const struct gbcpu_insn *in)
+{
+	pre_fetched(gbcpu, in);
+	if (in->op & 0x10)
+		gbcpu->regs.rn.a = mem_get(gbcpu, in->imm);
+	else
+		mem_put(gbcpu, in->imm, gbcpu->regs.rn.a);
+}
+
+static void pre_jr(struct gbcpu* const gbcpu, const struct gbcpu_insn *in)
+{
+	pre_fetched(gbcpu, in);
+	if (in->r1 && gbcpu->ime == 0) {
+		/* jr $-2 with interrupts disabled */
+		gbcpu->halted = 1;
+	}
+	gbcpu->cycles += 4;
+	REGS16_W(gbcpu->regs, PC, in->imm);
+}
+
+static void pre_jp(struct gbcpu* const gbcpu, const struct gbcpu_insn *in)
+{
+	pre_fetched(gbcpu, in);
+	gbcpu->cycles += 4;
+	REGS16_W(gbcpu->regs, PC, in->imm);
+}
+
+static void pre_jp_cond(struct gbcpu* const gbcpu, const struct gbcpu_insn *in)
+{
+	pre_fetched(gbcpu, in);
+	if (!cond_met(gbcpu, in->op))
+		return;
+	gbcpu->cycles += 4;
+	REGS16_W(gbcpu->regs, PC, in->imm);
+}
+
+static void pre_call(struct gbcpu* const gbcpu, const struct gbcpu_insn *in)
+{
+	pre_fetched(gbcpu, in);
+	if (in->op != 0xcd && !cond_met(gbcpu, in->op))
+		return;
+	gbcpu->cycles += 4;
+	push(gbcpu, in->next);
+	REGS16_W(gbcpu->regs, PC, in->imm);
+}
+
+static void block_decode(struct gbcpu_block *blk, const uint8_t *page, uint16_t pc)
+{
+	long n = 0;
+
+	blk->page = page;
+	blk->pc = pc;
+	while (n < GBCPU_BLOCK_INSNS) {
+		struct gbcpu_insn *in = &blk->insn[n];
+		uint8_t op = page[pc & 0xff];
+		long len = opdecode[op] & 3;
+		long reg = (op >> 3) & 7;
+
+		if (len == 0 || (pc & 0xff) + len > 0x100)
+			break;
+
+		in->fn = pre_generic;
+		in->op = op;
+		in->len = len;
+		in->next = pc + len;
+		in->imm = len > 1 ? page[(pc + 1) & 0xff] : 0;
+		if (len > 2)
+			in->imm |= page[(pc + 2) & 0xff] << 8;
+		in->r1 = REGS8_IDX(reg);
+		in->r2 = REGS8_IDX(op & 7);
+
+		if (op >= 0x40 && op < 0x80) {
+			if (reg != 6 && (op & 7) != 6)
+				in->fn = pre_ld;
+		} else if (op >= 0x80 && op < 0xc0) {
+			if ((op & 7) != 6)
+				in->fn = pre_alu;
+		} else if ((op & 0xc7) == 0xc6) {
+			in->fn = pre_alu;
+		} else if ((op & 0xc7) == 0x06) {
+			if (reg != 6)
+				in->fn = pre_ld_imm8;
+		} else if ((op & 0xc7) == 0x04) {
+			if (reg != 6)
+				in->fn = pre_inc;
+		} else if ((op & 0xc7) == 0x05) {
+			if (reg != 6)
+				in->fn = pre_dec;
+		} else if ((op & 0xcf) == 0x01) {
+			in->fn = pre_ld_imm16;
+			in->r1 = ((op >> 4) & 3) + (op == 0x31); /* skip over AF */
+		} else {
+			switch (op) {
+			case 0xe0: case 0xf0:
+				in->fn = pre_ld_mem;
+				in->imm += 0xff00;
+				break;
+			case 0xea: case 0xfa:
+				in->fn = pre_ld_mem;
+				break;
+			case 0x18:
+				in->fn = pre_jr;
+				in->r1 = in->imm == 0xfe;
+				in->imm = in->next + (int8_t)in->imm;
+				break;
+			case 0x20: case 0x28: case 0x30: case 0x38:
+				in->fn = pre_jp_cond;
+				in->imm = in->next + (int8_t)in->imm;
+				break;
+			case 0xc3:
+				in->fn = pre_jp;
+				break;
+			case 0xc2: case 0xca: case 0xd2: case 0xda:
+				in->fn = pre_jp_cond;
+				break;
+			case 0xc4: case 0xcc: case 0xcd: case 0xd4: case 0xdc:
+				in->fn = pre_call;
+				break;
+			}
+		}
+		n++;
+		pc += len;
+		if ((opdecode[op] & BE) || (pc & 0xff) == 0)
+			break;
+	}
+	blk->count = n;
+}
+
+static inline const struct gbcpu_block *block_lookup(struct gbcpu* const gbcpu, uint16_t pc)
+{
+	const uint8_t *page = gbcpu->getlookup[pc >> 8].ptr;
+	struct gbcpu_block *blk;
+
+	if (page == NULL || gbcpu->putlookup[pc >> 8].ptr != NULL)
+		return NULL; /* not plain ROM */
+
+	blk = &gbcpu->blocks[(pc ^ (pc >> 6)) & (GBCPU_BLOCK_CACHE_SIZE - 1)];
+	if (blk->page != page || blk->pc != pc)
+		block_decode(blk, page, pc);
+	if (blk->count == 0)
+		return NULL;
+	return blk;
+}
+
+void gbcpu_set_block_cache(struct gbcpu* const gbcpu, long enable)
+{
+	if (!enable || DEBUG == 1) {
+		/* the debug tracer needs the plain interpreter */
+		free(gbcpu->blocks);
+		gbcpu->blocks = NULL;
+		return;
+	}
+	if (gbcpu->blocks)
+		return;
+	gbcpu->blocks = calloc(GBCPU_BLOCK_CACHE_SIZE, sizeof(*gbcpu->blocks));
+	if (gbcpu->blocks == NULL)
+		fprintf(stderr, "Memory allocation failed!\n");
+}
+
+/*
+ * Translate ROM code to native code instead.  Returns false if the JIT
+ * is not available in this build or could not be set up.
+ */
+long gbcpu_set_jit(struct gbcpu* const gbcpu, long enable)
+{
+#ifdef USE_JIT
+	if (!enable || DEBUG == 1) {
+		gbjit_free(gbcpu->jit);
+		gbcpu->jit = NULL;
+		return !enable;
+	}
+	if (gbcpu->jit == NULL)
+		gbcpu->jit = gbjit_new();
+	return gbcpu->jit != NULL;
+#else
+	UNUSED(gbcpu);
+	return !enable;
+#endif
+}
+
+long gbcpu_op_len(uint8_t op)
+{
+	return opdecode[op] & 3;
+}
+
+long gbcpu_op_ends_block(uint8_t op)
+{
+	return (opdecode[op] & BE) != 0;
+}
+
+/*
+ * Execute an instruction whose opcode has already been fetched, PC
+ * points to its first operand.  Returns the cycles taken.
+ */
+long gbcpu_exec_op(struct gbcpu* const gbcpu, uint8_t op)
+{
+	gbcpu->cycles = 4;
+	ops[op].fn(gbcpu, op, &ops[op]);
+	return gbcpu->cycles;
+}
+
+void gbcpu_cleanup(struct gbcpu* const gbcpu)
+{
+	gbcpu_set_block_cache(gbcpu, 0);
+	gbcpu_set_jit(gbcpu, 0);
+}
+
 #if DEBUG == 1
 static void dump_regs(struct gbcpu* const gbcpu)
 {
 	long i;
 
+	flags_sync(gbcpu);
 	DPRINTF("; ");
 	for (i=0; i<8; i++) {
 		DPRINTF("%c=%02x ", regnames[i], REGS8_R(gbcpu->regs, i));
@@ -1554,6 +1992,7 @@ static void show_reg_diffs(struct gbcpu* const gbcpu, const struct opinfo *oi)
 {
 	long i;
 
+	flags_sync(gbcpu);
 	DPRINTF("\t\t; ");
 	for (i=0; i<3; i++) {
 		if (REGS16_R(gbcpu->regs, i) != REGS16_R(gbcpu->oldregs, i)) {
@@ -1600,22 +2039,71 @@ void gbcpu_add_mem(struct gbcpu* const gbcpu, uint32_t start, uint32_t end, gbcp
 	for (i=start; i<=end; i++) {
 		gbcpu->putlookup[i].put = putfn;
 		gbcpu->putlookup[i].priv = priv;
+		gbcpu->putlookup[i].ptr = NULL;
 		gbcpu->getlookup[i].get = getfn;
 		gbcpu->getlookup[i].priv = priv;
+		gbcpu->getlookup[i].ptr = NULL;
 	}
 }
 
+/*
+ * Let reads and/or writes of a page registered by gbcpu_add_mem() go
+ * straight to memory instead of through the callbacks.  A NULL pointer
+ * reverts to the callback.  Pages that have been taken over by another
+ * owner in the meantime (e.g. the boot ROM) are left alone.
+ */
+void gbcpu_map_page(struct gbcpu* const gbcpu, uint32_t page, void *priv, const uint8_t *getptr, uint8_t *putptr)
+{
+	if (gbcpu->getlookup[page].priv == priv)
+		gbcpu->getlookup[page].ptr = getptr;
+	if (gbcpu->putlookup[page].priv == priv)
+		gbcpu->putlookup[page].ptr = putptr;
+}
+
 void gbcpu_init(struct gbcpu* const gbcpu)
 {
 	assert(sizeof(gbcpu->regs) == sizeof(gbcpu_regs_u));
 	memset(&gbcpu->regs, 0, sizeof(gbcpu->regs));
+	gbcpu->lf_op = LF_NONE;
 	gbcpu->halted = 0;
 	gbcpu->stopped = 0;
 	gbcpu->ime = 0;
 	gbcpu->halt_at_pc = -1;
+	gbcpu->sync = 0;
+	gbcpu->run_cycles = 0;
 	DEB(dump_regs(gbcpu));
 }
 
+void gbcpu_state(struct gbcpu* const gbcpu, struct gbstate *st)
+{
+	long i;
+
+	for (i=BC; i<=PC; i++) {
+		uint16_t val = REGS16_R(gbcpu->regs, i);
+		gbstate_u16(st, &val);
+		REGS16_W(gbcpu->regs, i, val);
+	}
+	gbstate_long(st, &gbcpu->halt_at_pc);
+	gbstate_long(st, &gbcpu->halted);
+	gbstate_long(st, &gbcpu->ime);
+	gbstate_long(st, &gbcpu->stopped);
+	gbstate_cycles(st, &gbcpu->cycles);
+	gbstate_long(st, &gbcpu->sync);
+	gbstate_cycles(st, &gbcpu->run_cycles);
+	gbstate_u8(st, &gbcpu->lf_op);
+	gbstate_u8(st, &gbcpu->lf_a);
+	gbstate_u8(st, &gbcpu->lf_b);
+	gbstate_u8(st, &gbcpu->lf_c);
+	if (st->load && gbcpu->lf_op > LF_DEC)
+		st->error = true;
+}
+
+/* Evaluate pending flags so that regs.rn.f is current. */
+void gbcpu_flags_sync(struct gbcpu* const gbcpu)
+{
+	flags_sync(gbcpu);
+}
+
 void gbcpu_intr(struct gbcpu* const gbcpu, long vec)
 {
 	DPRINTF("gbcpu_intr(%04lx)\n", vec);
@@ -1625,6 +2113,16 @@ void gbcpu_intr(struct gbcpu* const gbcpu, long vec)
 	REGS16_W(gbcpu->regs, PC, vec);
 }
 
+static inline void check_halt_at_pc(struct gbcpu* const gbcpu)
+{
+	if (gbcpu->halt_at_pc != -1 &&
+	    REGS16_R(gbcpu->regs, PC) == gbcpu->halt_at_pc) {
+		DPRINTF("halted at PC %04lx\n", gbcpu->halt_at_pc);
+		gbcpu->halted = 1;
+		gbcpu->ime = 1;
+	}
+}
+
 long gbcpu_step(struct gbcpu* const gbcpu)
 {
 	uint8_t op;
@@ -1637,14 +2135,707 @@ long gbcpu_step(struct gbcpu* const gbcpu)
 
 		DEB(show_reg_diffs(gbcpu, &ops[op]));
 
-		if (gbcpu->halt_at_pc != -1 &&
-		    REGS16_R(gbcpu->regs, PC) == gbcpu->halt_at_pc) {
-			DPRINTF("halted at PC %04lx\n", gbcpu->halt_at_pc);
-			gbcpu->halted = 1;
-			gbcpu->ime = 1;
-		}
+		check_halt_at_pc(gbcpu);
 		return gbcpu->cycles;
 	}
 	if (gbcpu->stopped) return -1;
 	return 16;
 }
+
+#if defined(__GNUC__) && DEBUG == 0
+#define GBCPU_THREADED 1
+
+/*
+ * Threaded interpreter for gbcpu_run().
+ *
+ * Every opcode has its own label and ends with a jump straight to the
+ * label of the next opcode through a table of label addresses (a GNU C
+ * extension), so the indirect branches are spread over all opcodes
+ * instead of sharing the single call site of the ops[] loop.  The
+ * registers and the lazy flag state are kept in locals and are only
+ * written back to struct gbcpu on the way out and around the unknown
+ * opcodes, which still go through ops[].  Memory callbacks never look
+ * at the registers, they only need run_cycles, which is stored right
+ * before each of them.
+ */
+
+static inline uint8_t run_get(struct gbcpu* const gbcpu, uint32_t addr, cycles_t run, long *sync)
+{
+	const struct get_entry *e = &gbcpu->getlookup[(addr >> 8) & 0xff];
+	uint8_t val;
+
+	if (e->ptr)
+		return e->ptr[addr & 0xff];
+	gbcpu->run_cycles = run;
+	val = e->get(e->priv, addr);
+	*sync |= gbcpu->sync;
+	return val;
+}
+
+static inline void run_put(struct gbcpu* const gbcpu, uint32_t addr, uint8_t val, cycles_t run, long *sync)
+{
+	const struct put_entry *e = &gbcpu->putlookup[(addr >> 8) & 0xff];
+
+	if (e->ptr) {
+		e->ptr[addr & 0xff] = val;
+		return;
+	}
+	gbcpu->run_cycles = run;
+	e->put(e->priv, addr, val);
+	*sync |= gbcpu->sync;
+}
+
+#define RD(addr) (cyc += 4, run_get(gbcpu, (addr), run, &sync))
+#define WR(addr, v) do { cyc += 4; run_put(gbcpu, (addr), (v), run, &sync); } while (0)
+
+#define PAIR(hi, lo) ((uint16_t)((hi) << 8 | (lo)))
+#define SET16(hi, lo, v) do { uint16_t v_ = (v); hi = v_ >> 8; lo = v_; } while (0)
+
+#define FETCH8(dst) do { dst = RD(r_pc); r_pc++; } while (0)
+#define FETCH16(dst) do { \
+		uint32_t pc_ = r_pc; \
+		r_pc += 2; \
+		dst = RD(pc_); \
+		dst |= RD(pc_ + 1) << 8; \
+	} while (0)
+
+#define PUSH(v) do { \
+		uint32_t sp_ = (uint32_t)r_sp - 2; \
+		uint16_t v_ = (v); \
+		r_sp = sp_; \
+		WR(sp_, v_ & 0xff); \
+		WR(sp_ + 1, v_ >> 8); \
+	} while (0)
+#define POP(dst) do { \
+		uint32_t sp_ = r_sp; \
+		dst = RD(sp_); \
+		dst |= RD(sp_ + 1) << 8; \
+		r_sp = sp_ + 2; \
+	} while (0)
+
+#define FSYNC() do { \
+		if (lf_op != LF_NONE) { \
+			r_f = lf_eval(lf_op, lf_a, lf_b, lf_c); \
+			lf_op = LF_NONE; \
+		} \
+	} while (0)
+#define LF_SET(op, a, b, c) do { lf_op = (op); lf_a = (a); lf_b = (b); lf_c = (c); } while (0)
+#define CARRY() lf_carry(lf_op, lf_a, lf_b, lf_c, r_f)
+#define INC_FLAGS(old) do { uint8_t k_ = lf_kept(lf_op, lf_a, lf_b, lf_c, r_f); LF_SET(LF_INC, old, 0, k_); } while (0)
+#define DEC_FLAGS(old) do { uint8_t k_ = lf_kept(lf_op, lf_a, lf_b, lf_c, r_f); LF_SET(LF_DEC, old, 0, k_); } while (0)
+#define INC8(r) do { uint8_t o_ = r; r = o_ + 1; INC_FLAGS(o_); } while (0)
+#define DEC8(r) do { uint8_t o_ = r; r = o_ - 1; DEC_FLAGS(o_); } while (0)
+
+#define ALU_ADD(v) do { uint8_t v_ = (v); LF_SET(LF_ADD, r_a, v_, 0); r_a += v_; } while (0)
+#define ALU_ADC(v) do { uint8_t v_ = (v), c_ = CARRY(); LF_SET(LF_ADD, r_a, v_, c_); r_a += v_ + c_; } while (0)
+#define ALU_SUB(v) do { uint8_t v_ = (v); LF_SET(LF_SUB, r_a, v_, 0); r_a -= v_; } while (0)
+#define ALU_SBC(v) do { uint8_t v_ = (v), c_ = CARRY(); LF_SET(LF_SUB, r_a, v_, c_); r_a -= v_ + c_; } while (0)
+#define ALU_CP(v)  do { uint8_t v_ = (v); LF_SET(LF_SUB, r_a, v_, 0); } while (0)
+#define ALU_AND(v) do { r_a &= (v); r_f = r_a ? HF : HF | ZF; lf_op = LF_NONE; } while (0)
+#define ALU_XOR(v) do { r_a ^= (v); r_f = r_a ? 0 : ZF; lf_op = LF_NONE; } while (0)
+#define ALU_OR(v)  do { r_a |= (v); r_f = r_a ? 0 : ZF; lf_op = LF_NONE; } while (0)
+
+#define ADD_HL(v) do { \
+		uint16_t old_ = PAIR(r_h, r_l); \
+		uint16_t new_ = old_ + (v); \
+		FSYNC(); \
+		SET16(r_h, r_l, new_); \
+		r_f &= ~(NF | CF | HF); \
+		if (old_ > new_) r_f |= CF; \
+		if ((old_ & 0xfff) > (new_ & 0xfff)) r_f |= HF; \
+		cyc += 4; \
+	} while (0)
+/* SP plus the signed immediate into addr, for ADD SP,e and LD HL,SP+e */
+#define SP_OFS() do { \
+		FETCH8(val); \
+		FSYNC(); \
+		addr = (uint16_t)(r_sp + (int8_t)val); \
+		r_f = 0; \
+		if ((r_sp & 0xff) > (addr & 0xff)) r_f |= CF; \
+		if ((r_sp & 0xf) > (addr & 0xf)) r_f |= HF; \
+	} while (0)
+#define DAA() do { \
+		long a_ = r_a; \
+		FSYNC(); \
+		if (r_f & NF) { \
+			if (r_f & HF) a_ = (a_ - 0x06) & 0xff; \
+			if (r_f & CF) a_ -= 0x60; \
+		} else { \
+			if (r_f & HF || (a_ & 0xf) > 9) a_ += 0x06; \
+			if (r_f & CF || a_ > 0x9f) a_ += 0x60; \
+		} \
+		r_f &= ~(HF | ZF); \
+		if (a_ > 0xff) r_f |= CF; \
+		r_a = a_; \
+		if (r_a == 0) r_f |= ZF; \
+	} while (0)
+
+/* jr $-2 with interrupts disabled halts for good */
+#define JR() do { \
+		FETCH8(val); \
+		cyc += 4; \
+		r_pc += (int8_t)val; \
+		if ((int8_t)val == -2 && !ime) { \
+			gbcpu->halted = 1; \
+			NEXT_STOP; \
+		} \
+		NEXT; \
+	} while (0)
+#define JR_COND(cond) do { \
+		FETCH8(val); \
+		FSYNC(); \
+		if (cond) { \
+			cyc += 4; \
+			r_pc += (int8_t)val; \
+		} \
+	} while (0)
+#define JP_COND(cond) do { \
+		FETCH16(addr); \
+		FSYNC(); \
+		if (cond) { \
+			cyc += 4; \
+			r_pc = addr; \
+		} \
+	} while (0)
+#define CALL_COND(cond) do { \
+		FETCH16(addr); \
+		FSYNC(); \
+		if (cond) { \
+			cyc += 4; \
+			PUSH(r_pc); \
+			r_pc = addr; \
+		} \
+	} while (0)
+#define RET_COND(cond) do { \
+		FSYNC(); \
+		cyc += 4; \
+		if (cond) { \
+			cyc += 4; \
+			POP(addr); \
+			r_pc = addr; \
+		} \
+	} while (0)
+
+/* end of an instruction, same checks as the ops[] loop in gbcpu_run() */
+#define NEXT do { \
+		run += cyc; \
+		if (r_pc == halt_at) \
+			goto at_halt_pc; \
+		if (run >= (cycles_t)budget || sync) \
+			goto out; \
+		cyc = 0; \
+		op = RD(r_pc); \
+		r_pc++; \
+		goto *labels[op]; \
+	} while (0)
+/* end of an instruction after which the caller has to look at the CPU */
+#define NEXT_STOP do { \
+		run += cyc; \
+		if (r_pc == halt_at) \
+			goto at_halt_pc; \
+		goto out; \
+	} while (0)
+
+#define LOAD_REGS do { \
+		r_a = gbcpu->regs.rn.a; r_f = gbcpu->regs.rn.f; \
+		r_b = gbcpu->regs.rn.b; r_c = gbcpu->regs.rn.c; \
+		r_d = gbcpu->regs.rn.d; r_e = gbcpu->regs.rn.e; \
+		r_h = gbcpu->regs.rn.h; r_l = gbcpu->regs.rn.l; \
+		r_sp = gbcpu->regs.rn.sp; r_pc = gbcpu->regs.rn.pc; \
+		lf_op = gbcpu->lf_op; lf_a = gbcpu->lf_a; \
+		lf_b = gbcpu->lf_b; lf_c = gbcpu->lf_c; \
+	} while (0)
+#define SAVE_REGS do { \
+		gbcpu->regs.rn.a = r_a; gbcpu->regs.rn.f = r_f; \
+		gbcpu->regs.rn.b = r_b; gbcpu->regs.rn.c = r_c; \
+		gbcpu->regs.rn.d = r_d; gbcpu->regs.rn.e = r_e; \
+		gbcpu->regs.rn.h = r_h; gbcpu->regs.rn.l = r_l; \
+		gbcpu->regs.rn.sp = r_sp; gbcpu->regs.rn.pc = r_pc; \
+		gbcpu->lf_op = lf_op; gbcpu->lf_a = lf_a; \
+		gbcpu->lf_b = lf_b; gbcpu->lf_c = lf_c; \
+	} while (0)
+
+static long gbcpu_run_threaded(struct gbcpu* const gbcpu, long budget)
+{
+	static const void *const labels[256] = {
+		&&op_00, &&op_01, &&op_02, &&op_03, &&op_04, &&op_05, &&op_06, &&op_07,
+		&&op_08, &&op_09, &&op_0a, &&op_0b, &&op_0c, &&op_0d, &&op_0e, &&op_0f,
+		&&op_10, &&op_11, &&op_12, &&op_13, &&op_14, &&op_15, &&op_16, &&op_17,
+		&&op_18, &&op_19, &&op_1a, &&op_1b, &&op_1c, &&op_1d, &&op_1e, &&op_1f,
+		&&op_20, &&op_21, &&op_22, &&op_23, &&op_24, &&op_25, &&op_26, &&op_27,
+		&&op_28, &&op_29, &&op_2a, &&op_2b, &&op_2c, &&op_2d, &&op_2e, &&op_2f,
+		&&op_30, &&op_31, &&op_32, &&op_33, &&op_34, &&op_35, &&op_36, &&op_37,
+		&&op_38, &&op_39, &&op_3a, &&op_3b, &&op_3c, &&op_3d, &&op_3e, &&op_3f,
+		&&op_40, &&op_41, &&op_42, &&op_43, &&op_44, &&op_45, &&op_46, &&op_47,
+		&&op_48, &&op_49, &&op_4a, &&op_4b, &&op_4c, &&op_4d, &&op_4e, &&op_4f,
+		&&op_50, &&op_51, &&op_52, &&op_53, &&op_54, &&op_55, &&op_56, &&op_57,
+		&&op_58, &&op_59, &&op_5a, &&op_5b, &&op_5c, &&op_5d, &&op_5e, &&op_5f,
+		&&op_60, &&op_61, &&op_62, &&op_63, &&op_64, &&op_65, &&op_66, &&op_67,
+		&&op_68, &&op_69, &&op_6a, &&op_6b, &&op_6c, &&op_6d, &&op_6e, &&op_6f,
+		&&op_70, &&op_71, &&op_72, &&op_73, &&op_74, &&op_75, &&op_76, &&op_77,
+		&&op_78, &&op_79, &&op_7a, &&op_7b, &&op_7c, &&op_7d, &&op_7e, &&op_7f,
+		&&op_80, &&op_81, &&op_82, &&op_83, &&op_84, &&op_85, &&op_86, &&op_87,
+		&&op_88, &&op_89, &&op_8a, &&op_8b, &&op_8c, &&op_8d, &&op_8e, &&op_8f,
+		&&op_90, &&op_91, &&op_92, &&op_93, &&op_94, &&op_95, &&op_96, &&op_97,
+		&&op_98, &&op_99, &&op_9a, &&op_9b, &&op_9c, &&op_9d, &&op_9e, &&op_9f,
+		&&op_a0, &&op_a1, &&op_a2, &&op_a3, &&op_a4, &&op_a5, &&op_a6, &&op_a7,
+		&&op_a8, &&op_a9, &&op_aa, &&op_ab, &&op_ac, &&op_ad, &&op_ae, &&op_af,
+		&&op_b0, &&op_b1, &&op_b2, &&op_b3, &&op_b4, &&op_b5, &&op_b6, &&op_b7,
+		&&op_b8, &&op_b9, &&op_ba, &&op_bb, &&op_bc, &&op_bd, &&op_be, &&op_bf,
+		&&op_c0, &&op_c1, &&op_c2, &&op_c3, &&op_c4, &&op_c5, &&op_c6, &&op_c7,
+		&&op_c8, &&op_c9, &&op_ca, &&op_cb, &&op_cc, &&op_cd, &&op_ce, &&op_cf,
+		&&op_d0, &&op_d1, &&op_d2, &&generic, &&op_d4, &&op_d5, &&op_d6, &&op_d7,
+		&&op_d8, &&op_d9, &&op_da, &&generic, &&op_dc, &&generic, &&op_de, &&op_df,
+		&&op_e0, &&op_e1, &&op_e2, &&generic, &&generic, &&op_e5, &&op_e6, &&op_e7,
+		&&op_e8, &&op_e9, &&op_ea, &&generic, &&generic, &&generic, &&op_ee, &&op_ef,
+		&&op_f0, &&op_f1, &&op_f2, &&op_f3, &&generic, &&op_f5, &&op_f6, &&op_f7,
+		&&op_f8, &&op_f9, &&op_fa, &&op_fb, &&generic, &&generic, &&op_fe, &&op_ff,
+	};
+	const long ime = gbcpu->ime;
+	const long halt_at = gbcpu->halt_at_pc;
+	uint8_t r_a, r_f, r_b, r_c, r_d, r_e, r_h, r_l;
+	uint16_t r_sp, r_pc;
+	uint8_t lf_op, lf_a, lf_b, lf_c;
+	cycles_t run = 0;
+	long cyc = 0;
+	long sync = 0;
+	uint32_t op, val, addr;
+
+	LOAD_REGS;
+	op = RD(r_pc);
+	r_pc++;
+	goto *labels[op];
+
+	op_00: NEXT;
+	op_01: FETCH16(addr); r_b = addr >> 8; r_c = addr; NEXT;
+	op_02: WR(PAIR(r_b, r_c), r_a); NEXT;
+	op_03: SET16(r_b, r_c, PAIR(r_b, r_c) + 1); cyc += 4; NEXT;
+	op_04: INC8(r_b); NEXT;
+	op_05: DEC8(r_b); NEXT;
+	op_06: FETCH8(r_b); NEXT;
+	op_07: FSYNC(); r_f = (r_a >> 7) << 4; r_a = r_a << 1 | r_a >> 7; NEXT;
+	op_08: FETCH16(addr); WR(addr, r_sp & 0xff); WR(addr + 1, r_sp >> 8); NEXT;
+	op_09: ADD_HL(PAIR(r_b, r_c)); NEXT;
+	op_0a: r_a = RD(PAIR(r_b, r_c)); NEXT;
+	op_0b: SET16(r_b, r_c, PAIR(r_b, r_c) - 1); cyc += 4; NEXT;
+	op_0c: INC8(r_c); NEXT;
+	op_0d: DEC8(r_c); NEXT;
+	op_0e: FETCH8(r_c); NEXT;
+	op_0f: FSYNC(); r_f = (r_a & 1) << 4; r_a = r_a >> 1 | r_a << 7; NEXT;
+	op_10: NEXT;  /* STOP */
+	op_11: FETCH16(addr); r_d = addr >> 8; r_e = addr; NEXT;
+	op_12: WR(PAIR(r_d, r_e), r_a); NEXT;
+	op_13: SET16(r_d, r_e, PAIR(r_d, r_e) + 1); cyc += 4; NEXT;
+	op_14: INC8(r_d); NEXT;
+	op_15: DEC8(r_d); NEXT;
+	op_16: FETCH8(r_d); NEXT;
+	op_17: FSYNC(); val = r_a; r_a = r_a << 1 | (r_f & CF) >> 4; r_f = (val >> 7) << 4; NEXT;
+	op_18: JR();
+	op_19: ADD_HL(PAIR(r_d, r_e)); NEXT;
+	op_1a: r_a = RD(PAIR(r_d, r_e)); NEXT;
+	op_1b: SET16(r_d, r_e, PAIR(r_d, r_e) - 1); cyc += 4; NEXT;
+	op_1c: INC8(r_e); NEXT;
+	op_1d: DEC8(r_e); NEXT;
+	op_1e: FETCH8(r_e); NEXT;
+	op_1f: FSYNC(); val = r_a; r_a = r_a >> 1 | (r_f & CF) << 3; r_f = (val & 1) << 4; NEXT;
+	op_20: JR_COND(!(r_f & ZF)); NEXT;
+	op_21: FETCH16(addr); r_h = addr >> 8; r_l = addr; NEXT;
+	op_22: addr = PAIR(r_h, r_l); WR(addr, r_a); SET16(r_h, r_l, addr + 1); NEXT;
+	op_23: SET16(r_h, r_l, PAIR(r_h, r_l) + 1); cyc += 4; NEXT;
+	op_24: INC8(r_h); NEXT;
+	op_25: DEC8(r_h); NEXT;
+	op_26: FETCH8(r_h); NEXT;
+	op_27: DAA(); NEXT;
+	op_28: JR_COND(r_f & ZF); NEXT;
+	op_29: ADD_HL(PAIR(r_h, r_l)); NEXT;
+	op_2a: addr = PAIR(r_h, r_l); r_a = RD(addr); SET16(r_h, r_l, addr + 1); NEXT;
+	op_2b: SET16(r_h, r_l, PAIR(r_h, r_l) - 1); cyc += 4; NEXT;
+	op_2c: INC8(r_l); NEXT;
+	op_2d: DEC8(r_l); NEXT;
+	op_2e: FETCH8(r_l); NEXT;
+	op_2f: FSYNC(); r_a = ~r_a; r_f |= NF | HF; NEXT;
+	op_30: JR_COND(!(r_f & CF)); NEXT;
+	op_31: FETCH16(r_sp); NEXT;
+	op_32: addr = PAIR(r_h, r_l); WR(addr, r_a); SET16(r_h, r_l, addr - 1); NEXT;
+	op_33: r_sp++; cyc += 4; NEXT;
+	op_34: addr = PAIR(r_h, r_l); val = RD(addr); WR(addr, val + 1); INC_FLAGS(val); NEXT;
+	op_35: addr = PAIR(r_h, r_l); val = RD(addr); WR(addr, val - 1); DEC_FLAGS(val); NEXT;
+	op_36: FETCH8(val); WR(PAIR(r_h, r_l), val); NEXT;
+	op_37: FSYNC(); r_f = (r_f | CF) & ~(NF | HF); NEXT;
+	op_38: JR_COND(r_f & CF); NEXT;
+	op_39: ADD_HL(r_sp); NEXT;
+	op_3a: addr = PAIR(r_h, r_l); r_a = RD(addr); SET16(r_h, r_l, addr - 1); NEXT;
+	op_3b: r_sp--; cyc += 4; NEXT;
+	op_3c: INC8(r_a); NEXT;
+	op_3d: DEC8(r_a); NEXT;
+	op_3e: FETCH8(r_a); NEXT;
+	op_3f: FSYNC(); r_f = (r_f ^ CF) & ~(NF | HF); NEXT;
+	op_40: NEXT;
+	op_41: r_b = r_c; NEXT;
+	op_42: r_b = r_d; NEXT;
+	op_43: r_b = r_e; NEXT;
+	op_44: r_b = r_h; NEXT;
+	op_45: r_b = r_l; NEXT;
+	op_46: r_b = RD(PAIR(r_h, r_l)); NEXT;
+	op_47: r_b = r_a; NEXT;
+	op_48: r_c = r_b; NEXT;
+	op_49: NEXT;
+	op_4a: r_c = r_d; NEXT;
+	op_4b: r_c = r_e; NEXT;
+	op_4c: r_c = r_h; NEXT;
+	op_4d: r_c = r_l; NEXT;
+	op_4e: r_c = RD(PAIR(r_h, r_l)); NEXT;
+	op_4f: r_c = r_a; NEXT;
+	op_50: r_d = r_b; NEXT;
+	op_51: r_d = r_c; NEXT;
+	op_52: NEXT;
+	op_53: r_d = r_e; NEXT;
+	op_54: r_d = r_h; NEXT;
+	op_55: r_d = r_l; NEXT;
+	op_56: r_d = RD(PAIR(r_h, r_l)); NEXT;
+	op_57: r_d = r_a; NEXT;
+	op_58: r_e = r_b; NEXT;
+	op_59: r_e = r_c; NEXT;
+	op_5a: r_e = r_d; NEXT;
+	op_5b: NEXT;
+	op_5c: r_e = r_h; NEXT;
+	op_5d: r_e = r_l; NEXT;
+	op_5e: r_e = RD(PAIR(r_h, r_l)); NEXT;
+	op_5f: r_e = r_a; NEXT;
+	op_60: r_h = r_b; NEXT;
+	op_61: r_h = r_c; NEXT;
+	op_62: r_h = r_d; NEXT;
+	op_63: r_h = r_e; NEXT;
+	op_64: NEXT;
+	op_65: r_h = r_l; NEXT;
+	op_66: r_h = RD(PAIR(r_h, r_l)); NEXT;
+	op_67: r_h = r_a; NEXT;
+	op_68: r_l = r_b; NEXT;
+	op_69: r_l = r_c; NEXT;
+	op_6a: r_l = r_d; NEXT;
+	op_6b: r_l = r_e; NEXT;
+	op_6c: r_l = r_h; NEXT;
+	op_6d: NEXT;
+	op_6e: r_l = RD(PAIR(r_h, r_l)); NEXT;
+	op_6f: r_l = r_a; NEXT;
+	op_70: WR(PAIR(r_h, r_l), r_b); NEXT;
+	op_71: WR(PAIR(r_h, r_l), r_c); NEXT;
+	op_72: WR(PAIR(r_h, r_l), r_d); NEXT;
+	op_73: WR(PAIR(r_h, r_l), r_e); NEXT;
+	op_74: WR(PAIR(r_h, r_l), r_h); NEXT;
+	op_75: WR(PAIR(r_h, r_l), r_l); NEXT;
+	op_76: gbcpu->halted = 1; NEXT_STOP;
+	op_77: WR(PAIR(r_h, r_l), r_a); NEXT;
+	op_78: r_a = r_b; NEXT;
+	op_79: r_a = r_c; NEXT;
+	op_7a: r_a = r_d; NEXT;
+	op_7b: r_a = r_e; NEXT;
+	op_7c: r_a = r_h; NEXT;
+	op_7d: r_a = r_l; NEXT;
+	op_7e: r_a = RD(PAIR(r_h, r_l)); NEXT;
+	op_7f: NEXT;
+	op_80: ALU_ADD(r_b); NEXT;
+	op_81: ALU_ADD(r_c); NEXT;
+	op_82: ALU_ADD(r_d); NEXT;
+	op_83: ALU_ADD(r_e); NEXT;
+	op_84: ALU_ADD(r_h); NEXT;
+	op_85: ALU_ADD(r_l); NEXT;
+	op_86: ALU_ADD(RD(PAIR(r_h, r_l))); NEXT;
+	op_87: ALU_ADD(r_a); NEXT;
+	op_88: ALU_ADC(r_b); NEXT;
+	op_89: ALU_ADC(r_c); NEXT;
+	op_8a: ALU_ADC(r_d); NEXT;
+	op_8b: ALU_ADC(r_e); NEXT;
+	op_8c: ALU_ADC(r_h); NEXT;
+	op_8d: ALU_ADC(r_l); NEXT;
+	op_8e: ALU_ADC(RD(PAIR(r_h, r_l))); NEXT;
+	op_8f: ALU_ADC(r_a); NEXT;
+	op_90: ALU_SUB(r_b); NEXT;
+	op_91: ALU_SUB(r_c); NEXT;
+	op_92: ALU_SUB(r_d); NEXT;
+	op_93: ALU_SUB(r_e); NEXT;
+	op_94: ALU_SUB(r_h); NEXT;
+	op_95: ALU_SUB(r_l); NEXT;
+	op_96: ALU_SUB(RD(PAIR(r_h, r_l))); NEXT;
+	op_97: ALU_SUB(r_a); NEXT;
+	op_98: ALU_SBC(r_b); NEXT;
+	op_99: ALU_SBC(r_c); NEXT;
+	op_9a: ALU_SBC(r_d); NEXT;
+	op_9b: ALU_SBC(r_e); NEXT;
+	op_9c: ALU_SBC(r_h); NEXT;
+	op_9d: ALU_SBC(r_l); NEXT;
+	op_9e: ALU_SBC(RD(PAIR(r_h, r_l))); NEXT;
+	op_9f: ALU_SBC(r_a); NEXT;
+	op_a0: ALU_AND(r_b); NEXT;
+	op_a1: ALU_AND(r_c); NEXT;
+	op_a2: ALU_AND(r_d); NEXT;
+	op_a3: ALU_AND(r_e); NEXT;
+	op_a4: ALU_AND(r_h); NEXT;
+	op_a5: ALU_AND(r_l); NEXT;
+	op_a6: ALU_AND(RD(PAIR(r_h, r_l))); NEXT;
+	op_a7: ALU_AND(r_a); NEXT;
+	op_a8: ALU_XOR(r_b); NEXT;
+	op_a9: ALU_XOR(r_c); NEXT;
+	op_aa: ALU_XOR(r_d); NEXT;
+	op_ab: ALU_XOR(r_e); NEXT;
+	op_ac: ALU_XOR(r_h); NEXT;
+	op_ad: ALU_XOR(r_l); NEXT;
+	op_ae: ALU_XOR(RD(PAIR(r_h, r_l))); NEXT;
+	op_af: ALU_XOR(r_a); NEXT;
+	op_b0: ALU_OR(r_b); NEXT;
+	op_b1: ALU_OR(r_c); NEXT;
+	op_b2: ALU_OR(r_d); NEXT;
+	op_b3: ALU_OR(r_e); NEXT;
+	op_b4: ALU_OR(r_h); NEXT;
+	op_b5: ALU_OR(r_l); NEXT;
+	op_b6: ALU_OR(RD(PAIR(r_h, r_l))); NEXT;
+	op_b7: ALU_OR(r_a); NEXT;
+	op_b8: ALU_CP(r_b); NEXT;
+	op_b9: ALU_CP(r_c); NEXT;
+	op_ba: ALU_CP(r_d); NEXT;
+	op_bb: ALU_CP(r_e); NEXT;
+	op_bc: ALU_CP(r_h); NEXT;
+	op_bd: ALU_CP(r_l); NEXT;
+	op_be: ALU_CP(RD(PAIR(r_h, r_l))); NEXT;
+	op_bf: ALU_CP(r_a); NEXT;
+	op_c0: RET_COND(!(r_f & ZF)); NEXT;
+	op_c1: POP(addr); SET16(r_b, r_c, addr); NEXT;
+	op_c2: JP_COND(!(r_f & ZF)); NEXT;
+	op_c3: FETCH16(addr); cyc += 4; r_pc = addr; NEXT;
+	op_c4: CALL_COND(!(r_f & ZF)); NEXT;
+	op_c5: PUSH(PAIR(r_b, r_c)); cyc += 4; NEXT;
+	op_c6: FETCH8(val); ALU_ADD(val); NEXT;
+	op_c7: PUSH(r_pc); r_pc = 0x00; cyc += 4; NEXT;
+	op_c8: RET_COND(r_f & ZF); NEXT;
+	op_c9: POP(addr); r_pc = addr; cyc += 4; NEXT;
+	op_ca: JP_COND(r_f & ZF); NEXT;
+	op_cb: goto cbprefix;
+	op_cc: CALL_COND(r_f & ZF); NEXT;
+	op_cd: FETCH16(addr); PUSH(r_pc); r_pc = addr; cyc += 4; NEXT;
+	op_ce: FETCH8(val); ALU_ADC(val); NEXT;
+	op_cf: PUSH(r_pc); r_pc = 0x08; cyc += 4; NEXT;
+	op_d0: RET_COND(!(r_f & CF)); NEXT;
+	op_d1: POP(addr); SET16(r_d, r_e, addr); NEXT;
+	op_d2: JP_COND(!(r_f & CF)); NEXT;
+	op_d4: CALL_COND(!(r_f & CF)); NEXT;
+	op_d5: PUSH(PAIR(r_d, r_e)); cyc += 4; NEXT;
+	op_d6: FETCH8(val); ALU_SUB(val); NEXT;
+	op_d7: PUSH(r_pc); r_pc = 0x10; cyc += 4; NEXT;
+	op_d8: RET_COND(r_f & CF); NEXT;
+	op_d9: POP(addr); r_pc = addr; cyc += 4; gbcpu->ime = 1; if (!ime) NEXT_STOP; NEXT;
+	op_da: JP_COND(r_f & CF); NEXT;
+	op_dc: CALL_COND(r_f & CF); NEXT;
+	op_de: FETCH8(val); ALU_SBC(val); NEXT;
+	op_df: PUSH(r_pc); r_pc = 0x18; cyc += 4; NEXT;
+	op_e0: FETCH8(val); WR(0xff00 + val, r_a); NEXT;
+	op_e1: POP(addr); SET16(r_h, r_l, addr); NEXT;
+	op_e2: WR(0xff00 + r_c, r_a); NEXT;
+	op_e5: PUSH(PAIR(r_h, r_l)); cyc += 4; NEXT;
+	op_e6: FETCH8(val); ALU_AND(val); NEXT;
+	op_e7: PUSH(r_pc); r_pc = 0x20; cyc += 4; NEXT;
+	op_e8: SP_OFS(); r_sp = addr; cyc += 8; NEXT;
+	op_e9: r_pc = PAIR(r_h, r_l); NEXT;
+	op_ea: FETCH16(addr); WR(addr, r_a); NEXT;
+	op_ee: FETCH8(val); ALU_XOR(val); NEXT;
+	op_ef: PUSH(r_pc); r_pc = 0x28; cyc += 4; NEXT;
+	op_f0: FETCH8(val); r_a = RD(0xff00 + val); NEXT;
+	op_f1: POP(addr); r_a = addr >> 8; r_f = addr & 0xf0; lf_op = LF_NONE; NEXT;
+	op_f2: r_a = RD(0xff00 + r_c); NEXT;
+	op_f3: gbcpu->ime = 0; if (ime) NEXT_STOP; NEXT;
+	op_f5: FSYNC(); PUSH(r_a << 8 | r_f); cyc += 4; NEXT;
+	op_f6: FETCH8(val); ALU_OR(val); NEXT;
+	op_f7: PUSH(r_pc); r_pc = 0x30; cyc += 4; NEXT;
+	op_f8: SP_OFS(); SET16(r_h, r_l, addr); cyc += 4; NEXT;
+	op_f9: r_sp = PAIR(r_h, r_l); cyc += 4; NEXT;
+	op_fa: FETCH16(addr); r_a = RD(addr); NEXT;
+	op_fb: gbcpu->ime = 1; if (!ime) NEXT_STOP; NEXT;
+	op_fe: FETCH8(val); ALU_CP(val); NEXT;
+	op_ff: PUSH(r_pc); r_pc = 0x38; cyc += 4; NEXT;
+
+cbprefix:
+	FETCH8(op);
+	if (op < 0x80)
+		FSYNC(); /* rotates, shifts and BIT */
+	switch (op & 7) {
+		case 0: val = r_b; break;
+		case 1: val = r_c; break;
+		case 2: val = r_d; break;
+		case 3: val = r_e; break;
+		case 4: val = r_h; break;
+		case 5: val = r_l; break;
+		case 6: val = RD(PAIR(r_h, r_l)); break;
+		default: val = r_a; break;
+	}
+	switch (op >> 3) {
+		case 0: r_f = (val >> 7) << 4; val = val << 1 | val >> 7; break; /* RLC */
+		case 1: r_f = (val & 1) << 4; val = val >> 1 | val << 7; break; /* RRC */
+		case 2: addr = val; val = val << 1 | (r_f & CF) >> 4; r_f = (addr >> 7) << 4; break; /* RL */
+		case 3: addr = val; val = val >> 1 | (r_f & CF) << 3; r_f = (addr & 1) << 4; break; /* RR */
+		case 4: r_f = (val >> 7) << 4; val = val << 1; break; /* SLA */
+		case 5: r_f = (val & 1) << 4; val = val >> 1 | (val & 0x80); break; /* SRA */
+		case 6: r_f = 0; val = val >> 4 | val << 4; break; /* SWAP */
+		case 7: r_f = (val & 1) << 4; val = val >> 1; break; /* SRL */
+		case 8: case 9: case 10: case 11: case 12: case 13: case 14: case 15:
+			/* BIT */
+			r_f = (r_f & ~NF) | HF | ZF;
+			r_f ^= ((val << 8) >> (((op >> 3) & 7) + 1)) & ZF;
+			NEXT;
+		case 16: case 17: case 18: case 19: case 20: case 21: case 22: case 23:
+			val &= ~(1 << ((op >> 3) & 7)); /* RES */
+			break;
+		default:
+			val |= 1 << ((op >> 3) & 7); /* SET */
+			break;
+	}
+	val &= 0xff;
+	if (op < 0x40 && val == 0)
+		r_f |= ZF;
+	switch (op & 7) {
+		case 0: r_b = val; break;
+		case 1: r_c = val; break;
+		case 2: r_d = val; break;
+		case 3: r_e = val; break;
+		case 4: r_h = val; break;
+		case 5: r_l = val; break;
+		case 6: WR(PAIR(r_h, r_l), val); break;
+		default: r_a = val; break;
+	}
+	NEXT;
+
+generic:
+	/* unknown opcodes, left to ops[] with the registers written back */
+	SAVE_REGS;
+	gbcpu->cycles = cyc;
+	gbcpu->run_cycles = run;
+	ops[op].fn(gbcpu, op, &ops[op]);
+	sync |= gbcpu->sync;
+	cyc = gbcpu->cycles;
+	LOAD_REGS;
+	NEXT;
+
+at_halt_pc:
+	DPRINTF("halted at PC %04lx\n", gbcpu->halt_at_pc);
+	gbcpu->halted = 1;
+	gbcpu->ime = 1;
+out:
+	SAVE_REGS;
+	gbcpu->cycles = cyc;
+	gbcpu->run_cycles = run;
+	return run;
+}
+
+#undef RD
+#undef WR
+#undef PAIR
+#undef SET16
+#undef FETCH8
+#undef FETCH16
+#undef PUSH
+#undef POP
+#undef FSYNC
+#undef LF_SET
+#undef CARRY
+#undef INC_FLAGS
+#undef DEC_FLAGS
+#undef INC8
+#undef DEC8
+#undef ALU_ADD
+#undef ALU_ADC
+#undef ALU_SUB
+#undef ALU_SBC
+#undef ALU_CP
+#undef ALU_AND
+#undef ALU_XOR
+#undef ALU_OR
+#undef ADD_HL
+#undef SP_OFS
+#undef DAA
+#undef JR
+#undef JR_COND
+#undef JP_COND
+#undef CALL_COND
+#undef RET_COND
+#undef NEXT
+#undef NEXT_STOP
+#undef LOAD_REGS
+#undef SAVE_REGS
+
+#endif /* __GNUC__ && DEBUG == 0 */
+
+/*
+ * Run instructions back to back until at least budget cycles are used
+ * up or something happens that the caller has to react to before the
+ * next instruction: the CPU halted, IME changed (so pending interrupts
+ * need to be rechecked) or a memory callback set gbcpu->sync.
+ *
+ * run_cycles always holds the cycles of the instructions completed so
+ * far, so memory callbacks can catch up on the elapsed time.
+ *
+ * A halted CPU idles through the whole budget in 16 cycle steps at
+ * once.  The caller checks for interrupts before calling and nothing
+ * can raise one before the budget (the next vblank or timer event) is
+ * used up.
+ */
+long gbcpu_run(struct gbcpu* const gbcpu, long budget)
+{
+	const long ime = gbcpu->ime;
+	cycles_t run = 0;
+
+	if (gbcpu->halted) {
+		if (gbcpu->stopped) return -1;
+		return (budget + 15) & ~15L;
+	}
+
+	gbcpu->sync = 0;
+	gbcpu->run_cycles = 0;
+#ifdef GBCPU_THREADED
+	if (gbcpu->blocks == NULL && gbcpu->jit == NULL)
+		return gbcpu_run_threaded(gbcpu, budget);
+#endif
+	do {
+		const struct gbcpu_block *blk = NULL;
+		uint8_t op;
+
+#ifdef USE_JIT
+		if (gbcpu->jit) {
+			gbjit_fn fn = gbjit_lookup(gbcpu, gbcpu->regs.rn.pc);
+			if (fn) {
+				run = fn(gbcpu, run, budget);
+				gbcpu->run_cycles = run;
+				continue;
+			}
+		}
+#endif
+		if (gbcpu->blocks)
+			blk = block_lookup(gbcpu, gbcpu->regs.rn.pc);
+		if (blk) {
+			const struct gbcpu_insn *in = blk->insn;
+			const struct gbcpu_insn *end = in + blk->count;
+			const struct get_entry *page = &gbcpu->getlookup[blk->pc >> 8];
+
+			do {
+				in->fn(gbcpu, in);
+				check_halt_at_pc(gbcpu);
+				run += gbcpu->cycles;
+				gbcpu->run_cycles = run;
+			} while (++in < end && run < (cycles_t)budget &&
+				 !gbcpu->halted && !gbcpu->sync && gbcpu->ime == ime &&
+				 page->ptr == blk->page);
+			continue;
+		}
+
+		op = mem_get(gbcpu, gbcpu->regs.rn.pc++);
+		gbcpu->cycles = 4;
+		DPRINTF("%04x: %02x", gbcpu->regs.rn.pc - 1, op);
+		ops[op].fn(gbcpu, op, &ops[op]);
+
+		DEB(show_reg_diffs(gbcpu, &ops[op]));
+
+		check_halt_at_pc(gbcpu);
+		run += gbcpu->cycles;
+		gbcpu->run_cycles = run;
+	} while (run < (cycles_t)budget &&
+		 !gbcpu->halted && !gbcpu->sync && gbcpu->ime == ime);
+
+	return run;
+}
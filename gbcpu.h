@@ -64,6 +64,7 @@ static inline void foo(void)
 #define REGS16_W(r, i, x) (r.rw[i]) = x
 #define REGS8_R(r, i) (r.ri[i^1])
 #define REGS8_W(r, i, x) (r.ri[i^1]) = x
+#define REGS8_IDX(i) ((i)^1)
 
 typedef union {
 		uint8_t ri[12];
@@ -88,6 +89,7 @@ typedef union {
 #define REGS16_W(r, i, x) (r.rw[i]) = x
 #define REGS8_R(r, i) (r.ri[i])
 #define REGS8_W(r, i, x) (r.ri[i]) = x
+#define REGS8_IDX(i) (i)
 
 typedef union {
 		uint8_t ri[12];
@@ -108,21 +110,36 @@ typedef union {
 
 #endif
 
+/* pending flag computations, see lf_op */
+enum {
+	LF_NONE, /* regs.rn.f is up to date */
+	LF_ADD,  /* lf_a + lf_b + lf_c */
+	LF_SUB,  /* lf_a - lf_b - lf_c */
+	LF_INC,  /* lf_a + 1, lf_c holds the unaffected flag bits */
+	LF_DEC,  /* lf_a - 1, lf_c holds the unaffected flag bits */
+};
+
 typedef void (*gbcpu_put_fn)(void *priv, uint32_t addr, uint8_t val);
 typedef uint32_t (*gbcpu_get_fn)(void *priv, uint32_t addr);
 
 struct get_entry {
 	void *priv;
 	gbcpu_get_fn get;
+	const uint8_t *ptr;  /* plain memory page, bypasses get if set */
 };
 
 struct put_entry {
 	void *priv;
 	gbcpu_put_fn put;
+	uint8_t *ptr;        /* plain memory page, bypasses put if set */
 };
 
 #define GBCPU_LOOKUP_SIZE 256
 
+struct gbcpu_block;
+struct gbjit;
+struct gbstate;
+
 struct gbcpu {
 	gbcpu_regs_u regs;
 	long halt_at_pc;
@@ -132,19 +149,40 @@ struct gbcpu {
 	long stopped;
 	cycles_t cycles;
 
+	long sync;           /* set by memory callbacks to end gbcpu_run() early */
+	cycles_t run_cycles; /* cycles of completed instructions in gbcpu_run() */
+
+	uint8_t lf_op;       /* pending flag computation, regs.rn.f is stale unless 0 */
+	uint8_t lf_a;        /* operands of the pending flag computation */
+	uint8_t lf_b;
+	uint8_t lf_c;
+
 #if DEBUG == 1
 	gbcpu_regs_u oldregs;
 #endif
 	
 	struct get_entry getlookup[GBCPU_LOOKUP_SIZE];
 	struct put_entry putlookup[GBCPU_LOOKUP_SIZE];
+
+	struct gbcpu_block *blocks; /* predecoded ROM code, NULL if disabled */
+	struct gbjit *jit;          /* translated ROM code, NULL if disabled */
 };
 
 void gbcpu_add_mem(struct gbcpu* const gbcpu, uint32_t start, uint32_t end, gbcpu_put_fn putfn, gbcpu_get_fn getfn, void *priv);
+void gbcpu_map_page(struct gbcpu* const gbcpu, uint32_t page, void *priv, const uint8_t *getptr, uint8_t *putptr);
 void gbcpu_init(struct gbcpu* const gbcpu);
 void gbcpu_init_struct(struct gbcpu* const gbcpu);
+void gbcpu_cleanup(struct gbcpu* const gbcpu);
+void gbcpu_set_block_cache(struct gbcpu* const gbcpu, long enable);
+long gbcpu_set_jit(struct gbcpu* const gbcpu, long enable);
+long gbcpu_op_len(uint8_t op);
+long gbcpu_op_ends_block(uint8_t op);
+long gbcpu_exec_op(struct gbcpu* const gbcpu, uint8_t op);
 long gbcpu_step(struct gbcpu* const gbcpu);
+long gbcpu_run(struct gbcpu* const gbcpu, long budget);
 void gbcpu_intr(struct gbcpu* const gbcpu, long vec);
+void gbcpu_flags_sync(struct gbcpu* const gbcpu);
+void gbcpu_state(struct gbcpu* const gbcpu, struct gbstate *st);
 uint8_t gbcpu_mem_get(struct gbcpu* const gbcpu, uint16_t addr);
 void gbcpu_mem_put(struct gbcpu* const gbcpu, uint16_t addr, uint8_t val);
 
@@ -17,13 +17,16 @@
 
 #include "gbcpu.h"
 #include "gbhw.h"
+#include "gbstate.h"
 #include "impulse.h"
+#include "impulsegen.h"
 
 #define FILTER_CONST_OFF 1.0
 /* From blargg's "Game Boy Sound Operation" doc */
 #define FILTER_CONST_DMG 0.999958
 #define FILTER_CONST_CGB 0.998943
 
+#define REG_DIV  0x04
 #define REG_TIMA 0x05
 #define REG_TMA  0x06
 #define REG_TAC  0x07
@@ -77,14 +80,59 @@ static const long vblankclocks = 4560;
 
 static const long msec_cycles = GBHW_CLOCK/1000;
 
-#define SOUND_DIV_MULT 0x10000LL
+#define IMPULSE_WIDTH(gbhw) (1L << (gbhw)->impulse_w_shift)
+#define IMPULSE_N_MASK(gbhw) ((1L << (gbhw)->impulse_n_shift) - 1)
 
-#define IMPULSE_WIDTH (1 << IMPULSE_W_SHIFT)
-#define IMPULSE_N (1 << IMPULSE_N_SHIFT)
-#define IMPULSE_N_MASK (IMPULSE_N - 1)
+/*
+ * Impulse table parameters per resampling quality.  All tables are
+ * precomputed into impulse.h at build time and shared read-only by
+ * all instances.
+ */
+struct impulse_preset {
+	long w_shift;
+	long n_shift;
+	const int32_t *table;
+};
+
+static const struct impulse_preset impulse_presets[] = {
+	[QUALITY_DRAFT]  = { IMPULSE_DRAFT_W_SHIFT, IMPULSE_DRAFT_N_SHIFT, draft_impulse },
+	[QUALITY_NORMAL] = { IMPULSE_W_SHIFT, IMPULSE_N_SHIFT, base_impulse },
+	[QUALITY_HQ]     = { IMPULSE_HQ_W_SHIFT, IMPULSE_HQ_N_SHIFT, hq_impulse },
+};
 
 static const long sweep_div_tc = 2048;
 
+#if defined(__GNUC__)
+/*
+ * Four unsigned lanes for the impulse accumulation in gb_change_level().
+ * Unsigned wraparound gives the same low 32 bits as the scalar
+ * multiply-then-store, so the output stays bit-identical.
+ * The buffer is only 8-byte aligned, hence aligned(4).
+ */
+typedef uint32_t gbhw_v4u32 __attribute__((vector_size(16), aligned(4), may_alias));
+#define GBHW_ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define GBHW_ALWAYS_INLINE inline
+#endif
+
+static inline uint16_t gbhw_bswap16(uint16_t x)
+{
+#if defined(__GNUC__)
+	return __builtin_bswap16(x);
+#else
+	return (uint16_t)((x >> 8) | (x << 8));
+#endif
+}
+
+static inline uint32_t gbhw_bswap32(uint32_t x)
+{
+#if defined(__GNUC__)
+	return __builtin_bswap32(x);
+#else
+	return (x >> 24) | ((x >> 8) & 0xff00) | ((x << 8) & 0xff0000) | (x << 24);
+#endif
+}
+
 static inline long timertc_from_tac(uint8_t tac)
 {
 	static const long tac_to_cycles[4] = {
@@ -100,32 +148,58 @@ static inline long timertc_from_tac(uint8_t tac)
 }
 
 void gbhw_init_struct(struct gbhw *gbhw) {
+	long i;
+
 	gbhw->apu_on = 1;
 	gbhw->io_written = 0;
+	gbhw->irq_check = 1;
 
 	gbhw->filter_constant = FILTER_CONST_DMG;
 	gbhw->filter_enabled = 1;
 	gbhw->cap_factor = 0x10000;
 
+	gbhw->output_format = OUTPUT_S16;
+	gbhw->output_swap = 0;
+
 	gbhw->update_level = 0;
 	gbhw->sequence_ctr = 0;
 
 	gbhw->timertc = 16;
 
 	gbhw->rom_lockout = 1;
+	gbhw->render = 1;
 
 	gbhw->soundbuf = NULL; /* externally visible output buffer */
 	gbhw->impbuf = NULL;   /* internal impulse output buffer */
+	for (i=0; i<4; i++) {
+		gbhw->stembuf[i] = NULL;
+		gbhw->stemimp[i] = NULL;
+		gbhw->stem_l_value[i] = 0;
+		gbhw->stem_r_value[i] = 0;
+	}
+	gbhw->stem_callback = NULL;
 
 	gblfsr_reset(&gbhw->lfsr);
 
-	gbhw->sound_div_tc = 0;
+	gbhw->synthesis = SYNTH_STEP;
+	gbhw->os = NULL;
+	for (i=0; i<4; i++)
+		gbhw->stemos[i] = NULL;
+	gbhw->os_taps = NULL;
+	gbhw->os_width = 0;
+
+	gbhw->sample_clock = 0;
+	gbhw->impulse = base_impulse;
+	gbhw->impulse_w_shift = IMPULSE_W_SHIFT;
+	gbhw->impulse_n_shift = IMPULSE_N_SHIFT;
 
 	gbhw->last_l_value = 0;
 	gbhw->last_r_value = 0;
 	gbhw->ch3_next_nibble = 0;
+	gbhw->ch3_next_level = -15;
 
 	gbcpu_init_struct(&gbhw->gbcpu);
+	gbcpu_set_block_cache(&gbhw->gbcpu, 1);
 }
 
 static uint32_t bootrom_get(void *priv, uint32_t addr)
@@ -145,12 +219,33 @@ static void bootrom_put(void *priv, uint32_t addr, uint8_t val)
 		gbhw->boot_shadow_put.priv, addr, val);
 }
 
+static void gb_sound(struct gbhw *gbhw, cycles_t cycles);
+static void gb_wave_update(struct gbhw *gbhw);
+
+/*
+ * gbcpu_run() executes several instructions before gbhw_step() gets to
+ * account for them.  Catch up on the instructions completed so far before
+ * an I/O register is accessed, so sum_cycles and the APU state are
+ * exactly what they would be when single-stepping.
+ */
+static void gbhw_sync(struct gbhw *gbhw)
+{
+	cycles_t done = gbhw->gbcpu.run_cycles - gbhw->run_synced;
+
+	if (done == 0)
+		return;
+	gbhw->run_synced += done;
+	gbhw->sum_cycles += done;
+	gb_sound(gbhw, done);
+}
+
 static uint32_t io_get(void *priv, uint32_t addr)
 {
 	struct gbhw *gbhw = priv;
 	if (addr >= 0xff80 && addr <= 0xfffe) {
 		return gbhw->hiram[addr & GBHW_HIRAM_MASK];
 	}
+	gbhw_sync(gbhw);
 	if (addr >= 0xff10 &&
 	           addr <= 0xff3f) {
 		uint8_t val = gbhw->ioregs[addr & GBHW_IOREGS_MASK];
@@ -224,13 +319,14 @@ static void apu_reset(struct gbhw *gbhw)
 	}
 	assert(sizeof(gbhw->ch) == sizeof(struct gbhw_channel) * 4);
 	memset(gbhw->ch, 0, sizeof(gbhw->ch));
+	memset(gbhw->ch_cold, 0, sizeof(gbhw->ch_cold));
 	for (i = 0xff10; i < 0xff26; i++) {
 		gbhw->ioregs[i & GBHW_IOREGS_MASK] = 0;
 	}
 	for (i = 0; i < 4; i++) {
-		gbhw->ch[i].len = 0;
-		gbhw->ch[i].len_gate = 0;
-		gbhw->ch[i].volume = 0;
+		gbhw->ch_cold[i].len = 0;
+		gbhw->ch_cold[i].len_gate = 0;
+		gbhw->ch_cold[i].volume = 0;
 		gbhw->ch[i].env_volume = 0;
 		gbhw->ch[i].duty_ctr = 0;
 		gbhw->ch[i].div_tc = 1;
@@ -239,6 +335,7 @@ static void apu_reset(struct gbhw *gbhw)
 		gbhw->ch[i].mute = mute_tmp[i];
 	}
 	gbhw->sequence_ctr = 0;
+	gb_wave_update(gbhw);
 }
 
 static void linkport_atexit(void);
@@ -278,28 +375,30 @@ static void linkport_atexit(void)
 
 static void sequencer_update_len(struct gbhw *gbhw, long chn)
 {
-	if (gbhw->ch[chn].len_enable && gbhw->ch[chn].len_gate) {
-		gbhw->ch[chn].len++;
-		gbhw->ch[chn].len &= len_mask[chn];
-		if (gbhw->ch[chn].len == 0) {
+	if (gbhw->ch_cold[chn].len_enable && gbhw->ch_cold[chn].len_gate) {
+		gbhw->ch_cold[chn].len++;
+		gbhw->ch_cold[chn].len &= len_mask[chn];
+		if (gbhw->ch_cold[chn].len == 0) {
 			gbhw->ch[chn].env_volume = 0;
-			gbhw->ch[chn].env_tc = 0;
+			gbhw->ch_cold[chn].env_tc = 0;
 			gbhw->ch[chn].running = 0;
-			gbhw->ch[chn].len_gate = 0;
+			gbhw->ch_cold[chn].len_gate = 0;
+			if (chn == 2)
+				gb_wave_update(gbhw);
 		}
 	}
 }
 
 static long sweep_check_overflow(struct gbhw *gbhw)
 {
-	long val = (2048 - gbhw->ch[0].div_tc_shadow) >> gbhw->ch[0].sweep_shift;
+	long val = (2048 - gbhw->ch_cold[0].div_tc_shadow) >> gbhw->ch_cold[0].sweep_shift;
 
-	if (gbhw->ch[0].sweep_shift == 0) {
+	if (gbhw->ch_cold[0].sweep_shift == 0) {
 		return 1;
 	}
 
-	if (!gbhw->ch[0].sweep_dir) {
-		if (gbhw->ch[0].div_tc_shadow <= val) {
+	if (!gbhw->ch_cold[0].sweep_dir) {
+		if (gbhw->ch_cold[0].div_tc_shadow <= val) {
 			gbhw->ch[0].running = 0;
 			return 0;
 		}
@@ -307,6 +406,42 @@ static long sweep_check_overflow(struct gbhw *gbhw)
 	return 1;
 }
 
+/*
+ * Without rendering the peaks are estimated from the registers: every
+ * audible channel swings by its level range around the center, 256
+ * per level step.  With nothing audible minimum and maximum are equal,
+ * as for silent output, so silence detection keeps working.
+ */
+static void gb_register_peaks(struct gbhw *gbhw)
+{
+	long l_peak = 0, r_peak = 0;
+	long i;
+
+	for (i=0; i<4; i++) {
+		const struct gbhw_channel *ch = &gbhw->ch[i];
+		long swing = 2 * ch->env_volume;
+
+		if (!ch->running || !ch->master || ch->mute)
+			continue;
+		if (i == 2) {
+			long j, min = 15, max = -15;
+			for (j=0; j<32; j++) {
+				if (gbhw->ch3_level[j] < min) min = gbhw->ch3_level[j];
+				if (gbhw->ch3_level[j] > max) max = gbhw->ch3_level[j];
+			}
+			swing = max - min;
+		}
+		l_peak += ch->leftgate * swing;
+		r_peak += ch->rightgate * swing;
+	}
+	l_peak *= 128;
+	r_peak *= 128;
+	if (gbhw->lminval > -l_peak) gbhw->lminval = -l_peak;
+	if (gbhw->lmaxval < l_peak) gbhw->lmaxval = l_peak;
+	if (gbhw->rminval > -r_peak) gbhw->rminval = -r_peak;
+	if (gbhw->rmaxval < r_peak) gbhw->rmaxval = r_peak;
+}
+
 static void io_put(void *priv, uint32_t addr, uint8_t val)
 {
 	struct gbhw *gbhw = priv;
@@ -317,7 +452,9 @@ static void io_put(void *priv, uint32_t addr, uint8_t val)
 		return;
 	}
 
+	gbhw_sync(gbhw);
 	gbhw->io_written = 1;
+	gbhw->gbcpu.sync = 1;
 
 	if (gbhw->iocallback)
 		gbhw->iocallback(gbhw->sum_cycles, addr, val, gbhw->iocallback_priv);
@@ -347,11 +484,12 @@ static void io_put(void *priv, uint32_t addr, uint8_t val)
 			}
 			break;
 		case 0xff0f:  // IF
+			gbhw->irq_check = 1;
 			break;
 		case 0xff10:
-			gbhw->ch[0].sweep_ctr = gbhw->ch[0].sweep_tc = ((val >> 4) & 7);
-			gbhw->ch[0].sweep_dir = (val >> 3) & 1;
-			gbhw->ch[0].sweep_shift = val & 7;
+			gbhw->ch_cold[0].sweep_ctr = gbhw->ch_cold[0].sweep_tc = ((val >> 4) & 7);
+			gbhw->ch_cold[0].sweep_dir = (val >> 3) & 1;
+			gbhw->ch_cold[0].sweep_shift = val & 7;
 
 			break;
 		case 0xff11:
@@ -362,8 +500,8 @@ static void io_put(void *priv, uint32_t addr, uint8_t val)
 				long len = val & 0x3f;
 
 				gbhw->ch[chn].duty_val = dutylookup[duty_ctr];
-				gbhw->ch[chn].len = len;
-				gbhw->ch[chn].len_gate = 1;
+				gbhw->ch_cold[chn].len = len;
+				gbhw->ch_cold[chn].len_gate = 1;
 
 				break;
 			}
@@ -375,9 +513,9 @@ static void io_put(void *priv, uint32_t addr, uint8_t val)
 				long envdir = (val >> 3) & 1;
 				long envspd = val & 7;
 
-				gbhw->ch[chn].volume = vol;
-				gbhw->ch[chn].env_dir = envdir;
-				gbhw->ch[chn].env_ctr = gbhw->ch[chn].env_tc = envspd;
+				gbhw->ch_cold[chn].volume = vol;
+				gbhw->ch_cold[chn].env_dir = envdir;
+				gbhw->ch_cold[chn].env_ctr = gbhw->ch_cold[chn].env_tc = envspd;
 
 				gbhw->ch[chn].master = (val & 0xf8) != 0;
 				if (!gbhw->ch[chn].master) {
@@ -393,7 +531,7 @@ static void io_put(void *priv, uint32_t addr, uint8_t val)
 		case 0xff1e:
 			{
 				long div = gbhw->ioregs[0x13 + 5*chn];
-				long old_len_enable = gbhw->ch[chn].len_enable;
+				long old_len_enable = gbhw->ch_cold[chn].len_enable;
 
 				div |= ((long)gbhw->ioregs[0x14 + 5*chn] & 7) << 8;
 				gbhw->ch[chn].div_tc = 2048 - div;
@@ -402,13 +540,13 @@ static void io_put(void *priv, uint32_t addr, uint8_t val)
 				    addr == 0xff18 ||
 				    addr == 0xff1d) break;
 
-				gbhw->ch[chn].len_enable = (gbhw->ioregs[0x14 + 5*chn] & 0x40) > 0;
+				gbhw->ch_cold[chn].len_enable = (gbhw->ioregs[0x14 + 5*chn] & 0x40) > 0;
 				if ((val & 0x80) == 0x80) {
-					gbhw->ch[chn].env_volume = gbhw->ch[chn].volume;
-					if (!gbhw->ch[chn].len_gate) {
-						gbhw->ch[chn].len_gate = 1;
+					gbhw->ch[chn].env_volume = gbhw->ch_cold[chn].volume;
+					if (!gbhw->ch_cold[chn].len_gate) {
+						gbhw->ch_cold[chn].len_gate = 1;
 						if (old_len_enable == 1 &&
-						    gbhw->ch[chn].len_enable == 1 &&
+						    gbhw->ch_cold[chn].len_enable == 1 &&
 						    (gbhw->sequence_ctr & 1) == 1) {
 							// Trigger that un-freezes enabled length should clock it
 							sequencer_update_len(gbhw, chn);
@@ -419,21 +557,22 @@ static void io_put(void *priv, uint32_t addr, uint8_t val)
 					}
 					if (addr == 0xff1e) {
 						gbhw->ch3pos = 0;
+						gb_wave_update(gbhw);
 					}
 					if (addr == 0xff14) {
-						gbhw->ch[0].div_tc_shadow = gbhw->ch[0].div_tc;
+						gbhw->ch_cold[0].div_tc_shadow = gbhw->ch[0].div_tc;
 						sweep_check_overflow(gbhw);
 					}
 				}
 				if (old_len_enable == 0 &&
-				    gbhw->ch[chn].len_enable == 1 &&
+				    gbhw->ch_cold[chn].len_enable == 1 &&
 				    (gbhw->sequence_ctr & 1) == 1) {
 					// Enabling in first half of length period should clock length
 					sequencer_update_len(gbhw, chn);
 				}
 			}
 
-//			printf(" ch%ld: vol=%02d envd=%ld envspd=%ld duty_ctr=%ld len=%03d len_en=%ld key=%04d gate=%ld%ld\n", chn, gbhw->ch[chn].volume, gbhw->ch[chn].env_dir, gbhw->ch[chn].env_tc, gbhw->ch[chn].duty_ctr, gbhw->ch[chn].len, gbhw->ch[chn].len_enable, gbhw->ch[chn].div_tc, gbhw->ch[chn].leftgate, gbhw->ch[chn].rightgate);
+//			printf(" ch%ld: vol=%02d envd=%ld envspd=%ld duty_ctr=%ld len=%03d len_en=%ld key=%04d gate=%ld%ld\n", chn, gbhw->ch_cold[chn].volume, gbhw->ch_cold[chn].env_dir, gbhw->ch_cold[chn].env_tc, gbhw->ch[chn].duty_ctr, gbhw->ch_cold[chn].len, gbhw->ch_cold[chn].len_enable, gbhw->ch[chn].div_tc, gbhw->ch[chn].leftgate, gbhw->ch[chn].rightgate);
 			break;
 		case 0xff15:
 			break;
@@ -444,13 +583,14 @@ static void io_put(void *priv, uint32_t addr, uint8_t val)
 			}
 			break;
 		case 0xff1b:
-			gbhw->ch[2].len = val;
-			gbhw->ch[2].len_gate = 1;
+			gbhw->ch_cold[2].len = val;
+			gbhw->ch_cold[2].len_gate = 1;
 			break;
 		case 0xff1c:
 			{
 				long vol = (gbhw->ioregs[0x1c] >> 5) & 3;
-				gbhw->ch[2].env_volume = gbhw->ch[2].volume = vol;
+				gbhw->ch[2].env_volume = gbhw->ch_cold[2].volume = vol;
+				gb_wave_update(gbhw);
 				break;
 			}
 		case 0xff1f:
@@ -461,22 +601,22 @@ static void io_put(void *priv, uint32_t addr, uint8_t val)
 				long reg = gbhw->ioregs[0x22];
 				long shift = reg >> 4;
 				long rate = reg & 7;
-				long old_len_enable = gbhw->ch[chn].len_enable;
+				long old_len_enable = gbhw->ch_cold[chn].len_enable;
 				gbhw->ch[3].div_ctr = 0;
 				gbhw->ch[3].div_tc = 16 << shift;
 				gblfsr_set_narrow(&gbhw->lfsr, (reg & 8) > 0);
 				if (rate) gbhw->ch[3].div_tc *= rate;
 				else gbhw->ch[3].div_tc /= 2;
-				gbhw->ch[chn].len_enable = (gbhw->ioregs[0x23] & 0x40) > 0;
+				gbhw->ch_cold[chn].len_enable = (gbhw->ioregs[0x23] & 0x40) > 0;
 				if (addr == 0xff22) break;
 
 				if (val & 0x80) {  /* trigger */
 					gblfsr_trigger(&gbhw->lfsr);
-					gbhw->ch[chn].env_volume = gbhw->ch[chn].volume;
-					if (!gbhw->ch[chn].len_gate) {
-						gbhw->ch[chn].len_gate = 1;
+					gbhw->ch[chn].env_volume = gbhw->ch_cold[chn].volume;
+					if (!gbhw->ch_cold[chn].len_gate) {
+						gbhw->ch_cold[chn].len_gate = 1;
 						if (old_len_enable == 1 &&
-						    gbhw->ch[chn].len_enable == 1 &&
+						    gbhw->ch_cold[chn].len_enable == 1 &&
 						    (gbhw->sequence_ctr & 1) == 1) {
 							// Trigger that un-freezes enabled length should clock it
 							sequencer_update_len(gbhw, chn);
@@ -487,12 +627,12 @@ static void io_put(void *priv, uint32_t addr, uint8_t val)
 					}
 				}
 				if (old_len_enable == 0 &&
-				    gbhw->ch[chn].len_enable == 1 &&
+				    gbhw->ch_cold[chn].len_enable == 1 &&
 				    (gbhw->sequence_ctr & 1) == 1) {
 					// Enabling in first half of length period should clock length
 					sequencer_update_len(gbhw, chn);
 				}
-//				printf(" ch4: vol=%02d envd=%ld envspd=%ld duty_ctr=%ld len=%03d len_en=%ld key=%04d gate=%ld%ld\n", gbhw->ch[3].volume, gbhw->ch[3].env_dir, gbhw->ch[3].env_ctr, gbhw->ch[3].duty_ctr, gbhw->ch[3].len, gbhw->ch[3].len_enable, gbhw->ch[3].div_tc, gbhw->ch[3].leftgate, gbhw->ch[3].rightgate);
+//				printf(" ch4: vol=%02d envd=%ld envspd=%ld duty_ctr=%ld len=%03d len_en=%ld key=%04d gate=%ld%ld\n", gbhw->ch_cold[3].volume, gbhw->ch_cold[3].env_dir, gbhw->ch_cold[3].env_ctr, gbhw->ch[3].duty_ctr, gbhw->ch_cold[3].len, gbhw->ch_cold[3].len_enable, gbhw->ch[3].div_tc, gbhw->ch[3].leftgate, gbhw->ch[3].rightgate);
 			}
 			break;
 		case 0xff25:
@@ -518,17 +658,6 @@ static void io_put(void *priv, uint32_t addr, uint8_t val)
 		case 0xff70:
 			WARN_ONCE("iowrite to SVBK (CGB mode) ignored.\n");
 			break;
-		case 0xff00:
-		case 0xff24:
-		case 0xff27:
-		case 0xff28:
-		case 0xff29:
-		case 0xff2a:
-		case 0xff2b:
-		case 0xff2c:
-		case 0xff2d:
-		case 0xff2e:
-		case 0xff2f:
 		case 0xff30:
 		case 0xff31:
 		case 0xff32:
@@ -545,17 +674,34 @@ static void io_put(void *priv, uint32_t addr, uint8_t val)
 		case 0xff3d:
 		case 0xff3e:
 		case 0xff3f:
+			gb_wave_update(gbhw);
+			/* fall through */
+		case 0xff00:
+		case 0xff24:
+		case 0xff27:
+		case 0xff28:
+		case 0xff29:
+		case 0xff2a:
+		case 0xff2b:
+		case 0xff2c:
+		case 0xff2d:
+		case 0xff2e:
+		case 0xff2f:
 		case 0xff50: /* bootrom lockout reg */
 			if (val == 0x01) {
 				gbhw->rom_lockout = 1;
 			}
 			break;
-		case 0xffff:
+		case 0xffff:  // IE
+			gbhw->irq_check = 1;
 			break;
 		default:
 			WARN_ONCE("iowrite to 0x%04x unimplemented (val=%02x).\n", addr, val);
 			break;
 	}
+	/* catch channels that are only briefly audible between two flushes */
+	if (!gbhw->render && addr >= 0xff10 && addr < 0xff40)
+		gb_register_peaks(gbhw);
 }
 
 static void intram_put(void *priv, uint32_t addr, uint8_t val)
@@ -584,19 +730,19 @@ static void sequencer_step(struct gbhw *gbhw)
 
 	gbhw->sequence_ctr++;
 
-	if (clock_sweep && gbhw->ch[0].sweep_tc) {
-		gbhw->ch[0].sweep_ctr--;
-		if (gbhw->ch[0].sweep_ctr < 0) {
-			long val = (2048 - gbhw->ch[0].div_tc_shadow) >> gbhw->ch[0].sweep_shift;
+	if (clock_sweep && gbhw->ch_cold[0].sweep_tc) {
+		gbhw->ch_cold[0].sweep_ctr--;
+		if (gbhw->ch_cold[0].sweep_ctr < 0) {
+			long val = (2048 - gbhw->ch_cold[0].div_tc_shadow) >> gbhw->ch_cold[0].sweep_shift;
 
-			gbhw->ch[0].sweep_ctr = gbhw->ch[0].sweep_tc;
+			gbhw->ch_cold[0].sweep_ctr = gbhw->ch_cold[0].sweep_tc;
 			if (sweep_check_overflow(gbhw)) {
-				if (gbhw->ch[0].sweep_dir) {
-					gbhw->ch[0].div_tc_shadow += val;
+				if (gbhw->ch_cold[0].sweep_dir) {
+					gbhw->ch_cold[0].div_tc_shadow += val;
 				} else {
-					gbhw->ch[0].div_tc_shadow -= val;
+					gbhw->ch_cold[0].div_tc_shadow -= val;
 				}
-				gbhw->ch[0].div_tc = gbhw->ch[0].div_tc_shadow;
+				gbhw->ch[0].div_tc = gbhw->ch_cold[0].div_tc_shadow;
 			}
 		}
 	}
@@ -604,12 +750,12 @@ static void sequencer_step(struct gbhw *gbhw)
 		sequencer_update_len(gbhw, i);
 	}
 	for (i=0; clock_env && i<4; i++) {
-		if (gbhw->ch[i].env_tc) {
-			gbhw->ch[i].env_ctr--;
-			if (gbhw->ch[i].env_ctr <=0 ) {
-				gbhw->ch[i].env_ctr = gbhw->ch[i].env_tc;
+		if (gbhw->ch_cold[i].env_tc) {
+			gbhw->ch_cold[i].env_ctr--;
+			if (gbhw->ch_cold[i].env_ctr <=0 ) {
+				gbhw->ch_cold[i].env_ctr = gbhw->ch_cold[i].env_tc;
 				if (gbhw->ch[i].running) {
-					if (!gbhw->ch[i].env_dir) {
+					if (!gbhw->ch_cold[i].env_dir) {
 						if (gbhw->ch[i].env_volume > 0)
 							gbhw->ch[i].env_volume--;
 					} else {
@@ -650,94 +796,539 @@ void gbhw_master_fade(struct gbhw* const gbhw, long millis, long dstvol)
 	long shift = (~(n) & 1) << 2; \
 	(((p)[index] >> shift) & 0xf); })
 
-void gbhw_flush_buffer(struct gbhw *gbhw)
+static inline long gb_wave_level(long nibble, long volume)
+{
+	return (volume ? nibble >> (volume - 1) : 0) - 15;
+}
+
+/*
+ * Decode wave RAM into channel 3 output levels for the current volume,
+ * along with the length of the run of equal levels at each position.
+ */
+static void gb_wave_update(struct gbhw *gbhw)
+{
+	long vol = gbhw->ch[2].env_volume;
+	long i, run = 0;
+
+	for (i=0; i<32; i++) {
+		gbhw->ch3_wave[i] = GET_NIBBLE(&gbhw->ioregs[0x30], i) * 2;
+		gbhw->ch3_level[i] = gb_wave_level(gbhw->ch3_wave[i], vol);
+	}
+	/* walk the ring backwards twice so runs can wrap around */
+	for (i=63; i>=0; i--) {
+		if (i < 63 && gbhw->ch3_level[i & 31] == gbhw->ch3_level[(i + 1) & 31])
+			run++;
+		else run = 1;
+		if (run > 32)
+			run = 32;
+		if (i < 32)
+			gbhw->ch3_run[i] = run;
+	}
+	/* the sample already fetched keeps its nibble, not its level */
+	gbhw->ch3_next_level = gb_wave_level(gbhw->ch3_next_nibble, vol);
+}
+
+static inline long gb_frame_bytes(const struct gbhw *gbhw)
+{
+	return gbhw->output_format == OUTPUT_S16 ? 2 * sizeof(int16_t) : 2 * sizeof(int32_t);
+}
+
+/*
+ * Integrate, filter and scale one soundbuf worth of impulses,
+ * consuming them from the imp ring into out.
+ * Always inlined (where the compiler supports forcing it) with
+ * constant filter/unity/format/swap flags so each combination gets
+ * its own branch-free loop with all state kept in registers.
+ * The high-pass is a recurrence on the previous output and has to
+ * stay sequential to remain bit-exact.
+ * OUTPUT_S32 and OUTPUT_FLOAT are taken from the 16.16 fixed point
+ * value before it is shifted down to 16 bit, so they keep the
+ * fractional bits and are not wrapped at the 16 bit range.
+ * Only the mix updates the peak values (peaks != 0), stems don't.
+ */
+static GBHW_ALWAYS_INLINE void gb_flush_samples(struct gbhw *gbhw, struct gbhw_buffer *imp, struct gbhw_buffer *outbuf, long peaks, const long filter, const long unity, const enum gbs_output_format format, const long swap)
+{
+	int16_t *out16 = outbuf->data;
+	uint32_t *out32 = outbuf->data;
+	long ofs = imp->ofs;
+	long left = outbuf->samples;
+	const long cap_factor = gbhw->cap_factor;
+	const long volume = gbhw->master_volume;
+	/* 1.0 is the full scale of the 16 bit output */
+	const float fscale = (float)volume / MASTER_VOL_MAX / 2147483648.0f;
+	long l_smpl = outbuf->l_lvl;
+	long r_smpl = outbuf->r_lvl;
+	long l_cap = outbuf->l_cap;
+	long r_cap = outbuf->r_cap;
+	long lmin = gbhw->lminval, lmax = gbhw->lmaxval;
+	long rmin = gbhw->rminval, rmax = gbhw->rmaxval;
+
+	/* at most two contiguous runs, before and after the ring wraps */
+	while (left) {
+		int32_t *in = imp->data32 + ofs*2;
+		long n = imp->mask + 1 - ofs;
+		long i;
+
+		if (n > left)
+			n = left;
+		left -= n;
+		ofs = (ofs + n) & imp->mask;
+		for (i=0; i<n; i++) {
+			long l_out, r_out;
+			long l_fine, r_fine;
+			l_smpl += in[i*2  ];
+			r_smpl += in[i*2+1];
+			/* clear as we go, the slot is reused at the end of the ring */
+			in[i*2  ] = 0;
+			in[i*2+1] = 0;
+			if (filter) {
+				/*
+				 * RC High-pass & DC decoupling filter. Gameboy
+				 * Classic uses 1uF and 510 Ohms in series,
+				 * followed by 10K Ohms pot to ground between
+				 * CPU output and amplifier input, which gives a
+				 * cutoff frequency of 15.14Hz.
+				 */
+				l_fine = l_smpl - l_cap;
+				r_fine = r_smpl - r_cap;
+				l_out = l_fine >> 16;
+				r_out = r_fine >> 16;
+				/* cap factor is 0x10000 for a factor of 1.0 */
+				l_cap = l_smpl - l_out * cap_factor;
+				r_cap = r_smpl - r_out * cap_factor;
+			} else {
+				l_fine = l_smpl;
+				r_fine = r_smpl;
+				l_out = l_smpl >> 16;
+				r_out = r_smpl >> 16;
+			}
+			if (format == OUTPUT_S16) {
+				uint16_t l16, r16;
+				if (unity) {
+					l16 = l_out;
+					r16 = r_out;
+				} else {
+					/* constant divisor, compiles to a multiply and shift */
+					l16 = l_out * volume / MASTER_VOL_MAX;
+					r16 = r_out * volume / MASTER_VOL_MAX;
+				}
+				out16[i*2  ] = swap ? gbhw_bswap16(l16) : l16;
+				out16[i*2+1] = swap ? gbhw_bswap16(r16) : r16;
+			} else {
+				uint32_t l32, r32;
+				if (format == OUTPUT_S32) {
+					int64_t l64 = (int64_t)l_fine * volume / MASTER_VOL_MAX;
+					int64_t r64 = (int64_t)r_fine * volume / MASTER_VOL_MAX;
+					l32 = l64 > INT32_MAX ? INT32_MAX : l64 < INT32_MIN ? INT32_MIN : l64;
+					r32 = r64 > INT32_MAX ? INT32_MAX : r64 < INT32_MIN ? INT32_MIN : r64;
+				} else {
+					float l_f = l_fine * fscale;
+					float r_f = r_fine * fscale;
+					memcpy(&l32, &l_f, sizeof(l32));
+					memcpy(&r32, &r_f, sizeof(r32));
+				}
+				out32[i*2  ] = swap ? gbhw_bswap32(l32) : l32;
+				out32[i*2+1] = swap ? gbhw_bswap32(r32) : r32;
+			}
+			lmax = l_out > lmax ? l_out : lmax;
+			lmin = l_out < lmin ? l_out : lmin;
+			rmax = r_out > rmax ? r_out : rmax;
+			rmin = r_out < rmin ? r_out : rmin;
+		}
+		out16 += n*2;
+		out32 += n*2;
+	}
+
+	outbuf->pos = outbuf->samples;
+	outbuf->l_lvl = l_smpl;
+	outbuf->r_lvl = r_smpl;
+	outbuf->l_cap = l_cap;
+	outbuf->r_cap = r_cap;
+	imp->ofs = ofs;
+	if (peaks) {
+		gbhw->lminval = lmin;
+		gbhw->lmaxval = lmax;
+		gbhw->rminval = rmin;
+		gbhw->rmaxval = rmax;
+	}
+}
+
+/* the 32 bit formats scale with a multiply anyway, only 16 bit has a unity variant */
+#define GB_FLUSH_VARIANTS(unity, format) do { \
+		if (filter && swap) gb_flush_samples(gbhw, imp, out, peaks, 1, unity, format, 1); \
+		else if (filter)    gb_flush_samples(gbhw, imp, out, peaks, 1, unity, format, 0); \
+		else if (swap)      gb_flush_samples(gbhw, imp, out, peaks, 0, unity, format, 1); \
+		else                gb_flush_samples(gbhw, imp, out, peaks, 0, unity, format, 0); \
+	} while (0)
+
+static void gb_flush_run(struct gbhw *gbhw, struct gbhw_buffer *imp, struct gbhw_buffer *out, long peaks)
+{
+	long filter = gbhw->filter_enabled && gbhw->cap_factor <= 0x10000;
+	long unity = gbhw->master_volume == MASTER_VOL_MAX;
+	long swap = gbhw->output_swap;
+
+	switch (gbhw->output_format) {
+	case OUTPUT_S16:
+		if (unity) GB_FLUSH_VARIANTS(1, OUTPUT_S16);
+		else GB_FLUSH_VARIANTS(0, OUTPUT_S16);
+		break;
+	case OUTPUT_S32:
+		GB_FLUSH_VARIANTS(0, OUTPUT_S32);
+		break;
+	case OUTPUT_FLOAT:
+		GB_FLUSH_VARIANTS(0, OUTPUT_FLOAT);
+		break;
+	}
+}
+
+/*
+ * SYNTH_OVERSAMPLE writes the levels out at GBHW_CLOCK >> OS_SHIFT
+ * instead of adding a band-limited step for every change, and a
+ * polyphase low-pass turns them into output samples when flushing.
+ * The work depends on the playing time only, so it wins over the
+ * steps when levels change very often.
+ * The decimated samples go into the impulse ring as differences, so
+ * the rest of the flush is shared with SYNTH_STEP.
+ */
+#define OS_SHIFT GBHW_OVERSAMPLE_SHIFT
+#define OS_PHASE_SHIFT 4  /* 16 filter phases, one per cycle */
+
+static inline long long gb_floor_div(long long a, long long b)
+{
+	return a / b - (a % b < 0);
+}
+
+/* Write the current level up to entry upto, without moving fill. */
+static void gb_os_fill(struct gbhw_oversample *os, long long upto)
+{
+	long i = os->fill - os->start;
+	long n = upto - os->start;
+
+	assert(n <= os->size);
+	for (; i<n; i++) {
+		os->l_data[i] = os->l_lvl;
+		os->r_data[i] = os->r_lvl;
+	}
+}
+
+static void gb_os_change(struct gbhw *gbhw, struct gbhw_oversample *os, long l_ofs, long r_ofs)
+{
+	/* the new level starts with the first entry at or after this cycle */
+	long long now = (gbhw->impbuf->cycles + (1 << OS_SHIFT) - 1) >> OS_SHIFT;
+
+	if (now > os->fill) {
+		gb_os_fill(os, now);
+		os->fill = now;
+	}
+	os->l_lvl += l_ofs;
+	os->r_lvl += r_ofs;
+}
+
+static inline void gb_os_dot(const int32_t *taps, const int32_t *l, const int32_t *r, long width, long *l_out, long *r_out)
+{
+	long t;
+#if defined(__GNUC__)
+	/* wrapping lane sums give the same low 32 bits, the result fits */
+	gbhw_v4u32 l_acc = { 0, 0, 0, 0 };
+	gbhw_v4u32 r_acc = { 0, 0, 0, 0 };
+
+	for (t=0; t<width; t+=4) {
+		const gbhw_v4u32 h = *(const gbhw_v4u32 *)&taps[t];
+		l_acc += h * *(const gbhw_v4u32 *)&l[t];
+		r_acc += h * *(const gbhw_v4u32 *)&r[t];
+	}
+	*l_out = (int32_t)(l_acc[0] + l_acc[1] + l_acc[2] + l_acc[3]);
+	*r_out = (int32_t)(r_acc[0] + r_acc[1] + r_acc[2] + r_acc[3]);
+#else
+	uint32_t l_acc = 0, r_acc = 0;
+
+	for (t=0; t<width; t++) {
+		l_acc += (uint32_t)taps[t] * (uint32_t)l[t];
+		r_acc += (uint32_t)taps[t] * (uint32_t)r[t];
+	}
+	*l_out = (int32_t)l_acc;
+	*r_out = (int32_t)r_acc;
+#endif
+}
+
+/*
+ * Decimate the n samples starting with the one at the ring read
+ * position (sample number impbuf->base) into imp.  Positions are
+ * tracked in 1/16 entries with an exact remainder, so there is no
+ * division per sample.
+ */
+static void gb_os_decimate(struct gbhw *gbhw, struct gbhw_oversample *os, struct gbhw_buffer *imp, long n)
 {
+	const long width = gbhw->os_width;
+	const long rate = gbhw->sample_clock;
+	const long long step = 1LL << (GBHW_CLOCK_SHIFT - OS_SHIFT + OS_PHASE_SHIFT);
+	const long step_q = step / rate;
+	const long step_r = step % rate;
+	/* band-limited steps come out 1.5 samples early, stay in line with them */
+	const long long lead = step + step/2;
+	long long first = gbhw->impbuf->base * step + lead;
+	long long pos = gb_floor_div(first, rate);
+	long rem = first - pos * rate;
+	long long end, now, keep;
+	long s, dirty = 0;
+
+	if (n == 0)
+		return;
+
+	/*
+	 * Up to the emulated time the level is final, beyond that it
+	 * stays as it is unless a change comes before the next flush.
+	 */
+	end = (gb_floor_div((gbhw->impbuf->base + n - 1) * step + lead, rate) >> OS_PHASE_SHIFT) + width/2 + 1;
+	now = (gbhw->impbuf->cycles + (1 << OS_SHIFT) - 1) >> OS_SHIFT;
+	gb_os_fill(os, end);
+	if (end > now)
+		end = now;
+	if (end > os->fill)
+		os->fill = end;
+
+	for (s=0; s<n; s++) {
+		const int32_t *taps = gbhw->os_taps + (pos & ((1 << OS_PHASE_SHIFT) - 1)) * width;
+		long idx = (pos >> OS_PHASE_SHIFT) - width/2 + 1 - os->start;
+		long slot = (imp->ofs + s) & imp->mask;
+		long l, r;
+
+		gb_os_dot(taps, &os->l_data[idx], &os->r_data[idx], width, &l, &r);
+		imp->data32[slot*2  ] = l - os->l_out;
+		imp->data32[slot*2+1] = r - os->r_out;
+		dirty |= (l - os->l_out) | (r - os->r_out);
+		os->l_out = l;
+		os->r_out = r;
+
+		pos += step_q;
+		rem += step_r;
+		if (rem >= rate) {
+			rem -= rate;
+			pos++;
+		}
+	}
+	if (dirty && imp->dirty < n)
+		imp->dirty = n;
+
+	/* drop what the next sample does not need anymore */
+	keep = (pos >> OS_PHASE_SHIFT) - width/2 + 1;
+	if (keep > os->fill)
+		keep = os->fill;
+	if (keep > os->start) {
+		long len = os->fill - keep;
+		memmove(os->l_data, &os->l_data[keep - os->start], len * sizeof(int32_t));
+		memmove(os->r_data, &os->r_data[keep - os->start], len * sizeof(int32_t));
+		os->start = keep;
+	}
+}
+
+/*
+ * Without impulses in this part of the ring the level stays constant
+ * and the high-pass decays towards a fixed point where the capacitor
+ * no longer moves.  From there on every sample is the same, so only
+ * the first one is computed and then repeated.
+ */
+static long gb_flush_settled(struct gbhw *gbhw, struct gbhw_buffer *imp, struct gbhw_buffer *out, long peaks)
+{
+	struct gbhw_buffer first = *out;
+	long ofs = imp->ofs;
+	long frame = gb_frame_bytes(gbhw);
+	uint8_t *data = out->data;
 	long i;
-	long overlap;
-	long l_smpl, r_smpl;
-	long l_cap, r_cap;
+
+	if (imp->dirty > 0 || out->samples == 0)
+		return 0;
+
+	first.samples = 1;
+	gb_flush_run(gbhw, imp, &first, peaks);
+	if (first.l_cap != out->l_cap || first.r_cap != out->r_cap) {
+		/* still decaying, the sample gets recomputed by the full run */
+		imp->ofs = ofs;
+		return 0;
+	}
+
+	for (i=1; i<out->samples; i++)
+		memcpy(data + i*frame, data, frame);
+	imp->ofs = (ofs + out->samples) & imp->mask;
+	out->pos = out->samples;
+	return 1;
+}
+
+static void gb_flush_one(struct gbhw *gbhw, struct gbhw_oversample *os, struct gbhw_buffer *imp, struct gbhw_buffer *out, long peaks)
+{
+	if (os != NULL)
+		gb_os_decimate(gbhw, os, imp, out->samples);
+	if (!gb_flush_settled(gbhw, imp, out, peaks))
+		gb_flush_run(gbhw, imp, out, peaks);
+	imp->dirty -= out->samples;
+	if (imp->dirty < 0)
+		imp->dirty = 0;
+}
+
+/* Follow the cycle counter of impbuf moving back by GBHW_CLOCK. */
+static void gb_os_rebase(struct gbhw_oversample *os)
+{
+	if (os == NULL)
+		return;
+	os->start -= GBHW_CLOCK >> OS_SHIFT;
+	os->fill -= GBHW_CLOCK >> OS_SHIFT;
+}
+
+void gbhw_flush_buffer(struct gbhw *gbhw)
+{
+	long ch;
 
 	assert(gbhw->soundbuf != NULL);
 	assert(gbhw->impbuf != NULL);
+	assert(gbhw->soundbuf->bytes == gbhw->soundbuf->samples*gb_frame_bytes(gbhw));
+
+	/*
+	 * The overlap stays where it is, the rings just move on.
+	 * The consumed samples are zeroed while reading them, and
+	 * the output buffers are completely overwritten every flush.
+	 */
+	if (gbhw->render) {
+		gb_flush_one(gbhw, gbhw->os, gbhw->impbuf, gbhw->soundbuf, 1);
+		if (gbhw->callback != NULL) gbhw->callback(gbhw->callbackpriv);
+	} else {
+		gb_register_peaks(gbhw);
+	}
+	gbhw->soundbuf->pos = 0;
 
-	/* integrate buffer */
-	l_smpl = gbhw->soundbuf->l_lvl;
-	r_smpl = gbhw->soundbuf->r_lvl;
-	l_cap = gbhw->soundbuf->l_cap;
-	r_cap = gbhw->soundbuf->r_cap;
-	for (i=0; i<gbhw->soundbuf->samples; i++) {
-		long l_out, r_out;
-		l_smpl = l_smpl + gbhw->impbuf->data32[i*2  ];
-		r_smpl = r_smpl + gbhw->impbuf->data32[i*2+1];
-		if (gbhw->filter_enabled && gbhw->cap_factor <= 0x10000) {
-			/*
-			 * RC High-pass & DC decoupling filter. Gameboy
-			 * Classic uses 1uF and 510 Ohms in series,
-			 * followed by 10K Ohms pot to ground between
-			 * CPU output and amplifier input, which gives a
-			 * cutoff frequency of 15.14Hz.
-			 */
-			l_out = (l_smpl - l_cap) >> 16;
-			r_out = (r_smpl - r_cap) >> 16;
-			/* cap factor is 0x10000 for a factor of 1.0 */
-			l_cap = l_smpl - l_out * gbhw->cap_factor;
-			r_cap = r_smpl - r_out * gbhw->cap_factor;
-		} else {
-			l_out = l_smpl >> 16;
-			r_out = r_smpl >> 16;
+	if (gbhw->render && gbhw->stem_callback != NULL) {
+		for (ch=0; ch<4; ch++)
+			gb_flush_one(gbhw, gbhw->stemos[ch], gbhw->stemimp[ch], gbhw->stembuf[ch], 0);
+		gbhw->stem_callback(gbhw->stem_callback_priv);
+		for (ch=0; ch<4; ch++)
+			gbhw->stembuf[ch]->pos = 0;
+	}
+
+	/*
+	 * GBHW_CLOCK cycles are exactly sample_clock samples, so moving
+	 * both back by that much keeps the product in gb_sample_pos()
+	 * small without changing any position.
+	 */
+	gbhw->impbuf->base += gbhw->soundbuf->samples;
+	while (gbhw->impbuf->cycles >= GBHW_CLOCK && gbhw->impbuf->base >= gbhw->sample_clock) {
+		gbhw->impbuf->cycles -= GBHW_CLOCK;
+		gbhw->impbuf->base -= gbhw->sample_clock;
+		gb_os_rebase(gbhw->os);
+		for (ch=0; ch<4; ch++)
+			gb_os_rebase(gbhw->stemos[ch]);
+	}
+}
+
+/*
+ * Add one band-limited step of l_ofs/r_ofs to an impulse ring.
+ * pos and ptr are the same for the mix and all stems.
+ */
+static inline void gb_add_impulse(struct gbhw *gbhw, struct gbhw_buffer *impbuf, long pos, const int32_t *ptr, long l_ofs, long r_ofs)
+{
+	const long width = IMPULSE_WIDTH(gbhw);
+	const long mask = impbuf->mask;
+	int32_t *data32 = impbuf->data32;
+	long start = (impbuf->ofs + pos - width/2) & mask;
+	long i;
+
+	if (start + width > mask + 1) {
+		/* impulse wraps around the end of the ring */
+		for (i=0; i<width; i++) {
+			long bufi = (start + i) & mask;
+			data32[bufi*2  ] += ptr[i] * l_ofs;
+			data32[bufi*2+1] += ptr[i] * r_ofs;
 		}
-		gbhw->soundbuf->data[i*2  ] = l_out * gbhw->master_volume / MASTER_VOL_MAX;
-		gbhw->soundbuf->data[i*2+1] = r_out * gbhw->master_volume / MASTER_VOL_MAX;
-		if (l_out > gbhw->lmaxval) gbhw->lmaxval = l_out;
-		if (l_out < gbhw->lminval) gbhw->lminval = l_out;
-		if (r_out > gbhw->rmaxval) gbhw->rmaxval = r_out;
-		if (r_out < gbhw->rminval) gbhw->rminval = r_out;
-	}
-	gbhw->soundbuf->pos = gbhw->soundbuf->samples;
-	gbhw->soundbuf->l_lvl = l_smpl;
-	gbhw->soundbuf->r_lvl = r_smpl;
-	gbhw->soundbuf->l_cap = l_cap;
-	gbhw->soundbuf->r_cap = r_cap;
-
-	if (gbhw->callback != NULL) gbhw->callback(gbhw->callbackpriv);
-
-	overlap = gbhw->impbuf->samples - gbhw->soundbuf->samples;
-	memmove(gbhw->impbuf->data32, gbhw->impbuf->data32+(2*gbhw->soundbuf->samples), 8*overlap);
-	memset(gbhw->impbuf->data32 + 2*overlap, 0, gbhw->impbuf->bytes - 8*overlap);
-	assert(gbhw->impbuf->bytes == gbhw->impbuf->samples*8);
-	assert(gbhw->soundbuf->bytes == gbhw->soundbuf->samples*4);
-	memset(gbhw->soundbuf->data, 0, gbhw->soundbuf->bytes);
-	gbhw->soundbuf->pos = 0;
+	} else {
+#if defined(__GNUC__)
+		/* Two stereo frames per vector, the compiler picks SSE2/AVX2/NEON. */
+		const gbhw_v4u32 ofs = { (uint32_t)l_ofs, (uint32_t)r_ofs, (uint32_t)l_ofs, (uint32_t)r_ofs };
+		gbhw_v4u32 *buf = (gbhw_v4u32 *)&data32[start*2];
+		for (i=0; i<width/2; i++) {
+			const gbhw_v4u32 imp = {
+				(uint32_t)ptr[2*i], (uint32_t)ptr[2*i],
+				(uint32_t)ptr[2*i+1], (uint32_t)ptr[2*i+1],
+			};
+			buf[i] += imp * ofs;
+		}
+#else
+		for (i=0; i<width; i++) {
+			data32[(start+i)*2  ] += ptr[i] * l_ofs;
+			data32[(start+i)*2+1] += ptr[i] * r_ofs;
+		}
+#endif
+	}
 
-	gbhw->impbuf->cycles -= (gbhw->sound_div_tc * gbhw->soundbuf->samples) / SOUND_DIV_MULT;
+	impbuf->l_lvl += l_ofs*256;
+	impbuf->r_lvl += r_ofs*256;
+	if (impbuf->dirty < pos - width/2 + width)
+		impbuf->dirty = pos - width/2 + width;
+}
+
+/*
+ * Ring position and impulse phase of the current cycle.  A cycle lasts
+ * sample_clock/GBHW_CLOCK samples, and as GBHW_CLOCK is a power of two
+ * the exact sample time is a multiply and a shift, without the
+ * rounding error of a fixed point cycles-per-sample divisor.
+ */
+static inline long gb_sample_pos(const struct gbhw *gbhw, long *imp_idx)
+{
+	uint64_t time = gbhw->impbuf->cycles * gbhw->sample_clock;
+
+	*imp_idx = (long)(time >> (GBHW_CLOCK_SHIFT - gbhw->impulse_n_shift)) & IMPULSE_N_MASK(gbhw);
+	return (long)((long long)(time >> GBHW_CLOCK_SHIFT) - gbhw->impbuf->base);
 }
 
 static void gb_change_level(struct gbhw *gbhw, long l_ofs, long r_ofs)
 {
 	long pos;
 	long imp_idx;
-	long imp_l = -IMPULSE_WIDTH/2;
-	long imp_r = IMPULSE_WIDTH/2;
-	long i;
-	const int32_t *ptr = base_impulse;
+	const long width = IMPULSE_WIDTH(gbhw);
 
 	assert(gbhw->impbuf != NULL);
-	pos = (long)(gbhw->impbuf->cycles * SOUND_DIV_MULT / gbhw->sound_div_tc);
-	imp_idx = (long)((gbhw->impbuf->cycles << IMPULSE_N_SHIFT)*SOUND_DIV_MULT / gbhw->sound_div_tc) & IMPULSE_N_MASK;
-	assert(pos + imp_r < gbhw->impbuf->samples);
-	assert(pos + imp_l >= 0);
+	if (gbhw->os != NULL) {
+		gb_os_change(gbhw, gbhw->os, l_ofs, r_ofs);
+		return;
+	}
+	pos = gb_sample_pos(gbhw, &imp_idx);
+	assert(pos + width/2 < gbhw->impbuf->samples);
+	assert(pos - width/2 >= 0);
 
-	ptr += imp_idx * IMPULSE_WIDTH;
+	gb_add_impulse(gbhw, gbhw->impbuf, pos, gbhw->impulse + imp_idx * width, l_ofs, r_ofs);
+}
 
-	for (i=imp_l; i<imp_r; i++) {
-		long bufi = pos + i;
-		long impi = i + IMPULSE_WIDTH/2;
-		gbhw->impbuf->data32[bufi*2  ] += ptr[impi] * l_ofs;
-		gbhw->impbuf->data32[bufi*2+1] += ptr[impi] * r_ofs;
+/*
+ * Per-channel version of gb_change_level() for stem rendering.
+ * Stems ignore the channel mute flags, they only affect the mix.
+ */
+static void gb_stems_update_level(struct gbhw *gbhw)
+{
+	long pos = -1;
+	const int32_t *ptr = NULL;
+	long ch;
+
+	for (ch=0; ch<4; ch++) {
+		long l_lvl = gbhw->ch[ch].leftgate * gbhw->ch[ch].lvl;
+		long r_lvl = gbhw->ch[ch].rightgate * gbhw->ch[ch].lvl;
+		long l_chg = l_lvl - gbhw->stem_l_value[ch];
+		long r_chg = r_lvl - gbhw->stem_r_value[ch];
+
+		if (!l_chg && !r_chg)
+			continue;
+
+		if (gbhw->stemos[ch] != NULL) {
+			gb_os_change(gbhw, gbhw->stemos[ch], l_chg, r_chg);
+			gbhw->stem_l_value[ch] = l_lvl;
+			gbhw->stem_r_value[ch] = r_lvl;
+			continue;
+		}
+		if (pos < 0) {
+			long imp_idx;
+			pos = gb_sample_pos(gbhw, &imp_idx);
+			ptr = gbhw->impulse + imp_idx * IMPULSE_WIDTH(gbhw);
+		}
+		gb_add_impulse(gbhw, gbhw->stemimp[ch], pos, ptr, l_chg, r_chg);
+		gbhw->stem_l_value[ch] = l_lvl;
+		gbhw->stem_r_value[ch] = r_lvl;
 	}
-
-	gbhw->impbuf->l_lvl += l_ofs*256;
-	gbhw->impbuf->r_lvl += r_ofs*256;
 }
 
 static void gb_sound_update_level(struct gbhw *gbhw)
@@ -745,6 +1336,8 @@ static void gb_sound_update_level(struct gbhw *gbhw)
 	long l_lvl, l_chg, r_lvl, r_chg;
 
 	gbhw->update_level = 0;
+	if (!gbhw->render)
+		return;
 	l_lvl = (gbhw->ch[0].leftgate & ~gbhw->ch[0].mute) * gbhw->ch[0].lvl
 	      + (gbhw->ch[1].leftgate & ~gbhw->ch[1].mute) * gbhw->ch[1].lvl
 	      + (gbhw->ch[2].leftgate & ~gbhw->ch[2].mute) * gbhw->ch[2].lvl
@@ -762,6 +1355,9 @@ static void gb_sound_update_level(struct gbhw *gbhw)
 		gbhw->last_l_value = l_lvl;
 		gbhw->last_r_value = r_lvl;
 	}
+
+	if (gbhw->stem_callback != NULL)
+		gb_stems_update_level(gbhw);
 }
 
 static void gb_sound_substep(struct gbhw *gbhw)
@@ -771,14 +1367,11 @@ static void gb_sound_substep(struct gbhw *gbhw)
 	if (gbhw->ch[2].running) {
 		gbhw->ch[2].div_ctr--;
 		if (gbhw->ch[2].div_ctr <= 0) {
-			long val = gbhw->ch3_next_nibble;
-			long pos = gbhw->ch3pos++;
-			gbhw->ch3_next_nibble = GET_NIBBLE(&gbhw->ioregs[0x30], pos) * 2;
+			long pos = gbhw->ch3pos++ & 31;
+			gbhw->ch[2].lvl = gbhw->ch3_next_level;
+			gbhw->ch3_next_nibble = gbhw->ch3_wave[pos];
+			gbhw->ch3_next_level = gbhw->ch3_level[pos];
 			gbhw->ch[2].div_ctr = gbhw->ch[2].div_tc*2;
-			if (gbhw->ch[2].env_volume) {
-				val = val >> (gbhw->ch[2].env_volume-1);
-			} else val = 0;
-			gbhw->ch[2].lvl = val - 15;
 			update = 1;
 		}
 	}
@@ -829,55 +1422,229 @@ static void gb_sound_mainstep(struct gbhw *gbhw)
 	}
 }
 
+/*
+ * A channel that is neither routed to an output nor heard in a stem
+ * can change its level without anything observable happening.
+ */
+static inline long gb_channel_silent(const struct gbhw *gbhw, long i)
+{
+	return !gbhw->render ||
+	       (!gbhw->ch[i].leftgate && !gbhw->ch[i].rightgate) ||
+	       (gbhw->ch[i].mute && gbhw->stem_callback == NULL);
+}
+
+/*
+ * Number of 4 cycle steps (at most max) during which nothing observable
+ * happens: no audible square channel changes its output level, no
+ * audible wave or noise sample is due and the frame sequencer is not
+ * clocked.
+ */
+static long gb_sound_idle_steps(const struct gbhw *gbhw, long max)
+{
+	long i, n = max;
+
+	if (n > sweep_div_tc - 1 - gbhw->sweep_div)
+		n = sweep_div_tc - 1 - gbhw->sweep_div;
+
+	for (i=0; i<2; i++) if (gbhw->ch[i].running) {
+		const struct gbhw_channel *ch = &gbhw->ch[i];
+		long bit = (ch->duty_val >> ch->duty_ctr) & 1;
+		long j;
+
+		/* a sweep with shift 0 can leave a period of 0 or less */
+		if (ch->div_tc < 1 || ch->div_ctr < 1)
+			return 0;
+		if (gb_channel_silent(gbhw, i))
+			continue;
+		if (bit * 2 * ch->env_volume - 15 != ch->lvl)
+			return 0;
+		if (ch->env_volume == 0)
+			continue;
+		/* find the next duty position with a different output */
+		for (j=1; j<8; j++)
+			if (((ch->duty_val >> ((ch->duty_ctr + j) & 7)) & 1) != bit)
+				break;
+		if (j < 8 && n > ch->div_ctr + (j - 1) * ch->div_tc)
+			n = ch->div_ctr + (j - 1) * ch->div_tc;
+	}
+
+	if (gbhw->ch[2].running) {
+		const struct gbhw_channel *ch = &gbhw->ch[2];
+		long steps = (ch->div_ctr - 1) / 4;
+
+		/* so do wave samples, using the precomputed runs */
+		if (ch->div_ctr >= 1 && gb_channel_silent(gbhw, 2)) {
+			steps = n;
+		} else if (ch->div_ctr >= 1 && ch->lvl == gbhw->ch3_next_level) {
+			long pos = gbhw->ch3pos & 31;
+			long same = 1;
+			if (gbhw->ch3_level[pos] == ch->lvl) {
+				if (gbhw->ch3_run[pos] == 32)
+					same = n * 4 / (ch->div_tc * 2) + 1;
+				else same += gbhw->ch3_run[pos];
+			}
+			steps = (ch->div_ctr - 1 + same * ch->div_tc * 2) / 4;
+		}
+		if (n > steps) n = steps;
+	}
+
+	if (gbhw->ch[3].running) {
+		const struct gbhw_channel *ch = &gbhw->ch[3];
+		long steps = (ch->div_ctr - 1) / 4;
+
+		/* noise samples that repeat the current level change nothing, */
+		if (ch->div_ctr >= 1 && gb_channel_silent(gbhw, 3)) {
+			steps = n;
+		} else if (ch->div_ctr >= 1 && ch->lvl == ch->env_volume * 2 * (gbhw->lfsr.lfsr & 1) - 15) {
+			long same = n * 4 / ch->div_tc + 1;
+			if (ch->env_volume)
+				same = gblfsr_run_length(&gbhw->lfsr, same);
+			steps = (ch->div_ctr - 1 + same * ch->div_tc) / 4;
+		}
+		if (n > steps) n = steps;
+	}
+
+	return n > 0 ? n : 0;
+}
+
+/*
+ * Advance n idle steps as found by gb_sound_idle_steps() at once.
+ * Each channel is left with the level its last sample or step would
+ * have set, which only differs from the current one for silent
+ * channels.
+ */
+static void gb_sound_skip(struct gbhw *gbhw, long n)
+{
+	long i;
+
+	gbhw->impbuf->cycles += 4 * n;
+	gbhw->sweep_div += n;
+
+	for (i=0; i<2; i++) if (gbhw->ch[i].running) {
+		struct gbhw_channel *ch = &gbhw->ch[i];
+		/* the level is taken from the duty position before the last step */
+		long last = n - 1 < ch->div_ctr ? 0 : 1 + (n - 1 - ch->div_ctr) / ch->div_tc;
+		long bit = (ch->duty_val >> ((ch->duty_ctr + last) & 7)) & 1;
+		ch->lvl = bit * 2 * ch->env_volume - 15;
+		if (n < ch->div_ctr) {
+			ch->div_ctr -= n;
+		} else {
+			long m = n - ch->div_ctr;
+			ch->duty_ctr = (ch->duty_ctr + 1 + m / ch->div_tc) & 7;
+			ch->div_ctr = ch->div_tc - m % ch->div_tc;
+		}
+	}
+
+	if (gbhw->ch[2].running) {
+		struct gbhw_channel *ch = &gbhw->ch[2];
+		if (4 * n < ch->div_ctr) {
+			ch->div_ctr -= 4 * n;
+		} else {
+			long m = 4 * n - ch->div_ctr;
+			long k = 1 + m / (ch->div_tc * 2);
+			long pos = (gbhw->ch3pos + k - 1) & 31;
+			if (k > 1)
+				ch->lvl = gbhw->ch3_level[(pos - 1) & 31];
+			else ch->lvl = gbhw->ch3_next_level;
+			gbhw->ch3_next_nibble = gbhw->ch3_wave[pos];
+			gbhw->ch3_next_level = gbhw->ch3_level[pos];
+			gbhw->ch3pos += k;
+			ch->div_ctr = ch->div_tc * 2 - m % (ch->div_tc * 2);
+		}
+	}
+
+	if (gbhw->ch[3].running) {
+		struct gbhw_channel *ch = &gbhw->ch[3];
+		if (4 * n < ch->div_ctr) {
+			ch->div_ctr -= 4 * n;
+		} else {
+			long m = 4 * n - ch->div_ctr;
+			gblfsr_skip(&gbhw->lfsr, 1 + m / ch->div_tc);
+			ch->div_ctr = ch->div_tc - m % ch->div_tc;
+			ch->lvl = ch->env_volume * 2 * (gbhw->lfsr.lfsr & 1) - 15;
+		}
+	}
+}
+
+/* One 4 cycle step that ends before the impulse buffer limit. */
+static void gb_sound_step(struct gbhw *gbhw)
+{
+	if (gbhw->ch[2].div_ctr > 4 && gbhw->ch[3].div_ctr > 4) {
+		/* can skip calling gb_sound_substep, only update counters */
+		gbhw->impbuf->cycles += 4;
+		gbhw->ch[2].div_ctr -= gbhw->ch[2].running * 4;
+		gbhw->ch[3].div_ctr -= gbhw->ch[3].running * 4;
+	} else {
+		gbhw->impbuf->cycles++;
+		gb_sound_substep(gbhw);
+		gbhw->impbuf->cycles++;
+		gb_sound_substep(gbhw);
+		gbhw->impbuf->cycles++;
+		gb_sound_substep(gbhw);
+		gbhw->impbuf->cycles++;
+		gb_sound_substep(gbhw);
+	}
+	gb_sound_mainstep(gbhw);
+}
+
+/* First cycle whose sample is too close to the end of the impulse buffer. */
+static uint64_t gb_impbuf_max_cycles(const struct gbhw *gbhw)
+{
+	uint64_t limit = (uint64_t)(gbhw->impbuf->base + gbhw->impbuf->samples - IMPULSE_WIDTH(gbhw)/2) << GBHW_CLOCK_SHIFT;
+
+	return (limit + gbhw->sample_clock - 1) / gbhw->sample_clock;
+}
+
 static void gb_sound(struct gbhw *gbhw, cycles_t cycles)
 {
 	cycles_t i;
-	uint64_t impbuf_max_cycles, impbuf_left;
 	assert(gbhw->impbuf != NULL);
 	assert(cycles % 4 == 0);  /* cycles is always a multiple of 4 */
-	impbuf_max_cycles = gbhw->sound_div_tc*(gbhw->impbuf->samples - IMPULSE_WIDTH/2)/SOUND_DIV_MULT;
-	impbuf_left = impbuf_max_cycles - gbhw->impbuf->cycles;
 
 	if (gbhw->update_level) {
 		/* gating register was updated */
 		gb_sound_update_level(gbhw);
 	}
 
-	if (impbuf_left >= cycles) {
-		for (i=cycles; i; i-=4) {
-			if (gbhw->ch[2].div_ctr > 4 && gbhw->ch[3].div_ctr > 4) {
-				/* can skip calling gb_sound_substep, only update counters */
-				gbhw->impbuf->cycles += 4;
-				gbhw->ch[2].div_ctr -= gbhw->ch[2].running * 4;
-				gbhw->ch[3].div_ctr -= gbhw->ch[3].running * 4;
-			} else {
-				gbhw->impbuf->cycles++;
-				gb_sound_substep(gbhw);
-				gbhw->impbuf->cycles++;
-				gb_sound_substep(gbhw);
-				gbhw->impbuf->cycles++;
-				gb_sound_substep(gbhw);
-				gbhw->impbuf->cycles++;
-				gb_sound_substep(gbhw);
+	while (cycles) {
+		uint64_t impbuf_max_cycles = gb_impbuf_max_cycles(gbhw);
+		uint64_t impbuf_left = impbuf_max_cycles - gbhw->impbuf->cycles;
+		cycles_t fast = 0;
+
+		/*
+		 * Take the fast path for all steps that end before the
+		 * buffer limit, so the flush always happens on the same
+		 * cycle, no matter how the elapsed time is split up into
+		 * calls.
+		 */
+		if (impbuf_left > 4)
+			fast = (impbuf_left - 1) & ~3;
+		if (fast > cycles)
+			fast = cycles;
+		cycles -= fast;
+		for (i=fast; i; i-=4) {
+			/* jump straight to the next step that changes anything */
+			long idle = gb_sound_idle_steps(gbhw, i/4 - 1);
+
+			if (idle) {
+				gb_sound_skip(gbhw, idle);
+				i -= 4 * idle;
 			}
-			gb_sound_mainstep(gbhw);
+			gb_sound_step(gbhw);
 		}
-	} else {
-		for (i=cycles; i; i-=4) {
-			if (++gbhw->impbuf->cycles >= impbuf_max_cycles)
-				gbhw_flush_buffer(gbhw);
-			gb_sound_substep(gbhw);
-			if (++gbhw->impbuf->cycles >= impbuf_max_cycles)
-				gbhw_flush_buffer(gbhw);
-			gb_sound_substep(gbhw);
-			if (++gbhw->impbuf->cycles >= impbuf_max_cycles)
-				gbhw_flush_buffer(gbhw);
-			gb_sound_substep(gbhw);
-			if (++gbhw->impbuf->cycles >= impbuf_max_cycles)
+		if (cycles == 0)
+			break;
+
+		/* the buffer limit is reached within the next step */
+		for (i=0; i<4; i++) {
+			if (++gbhw->impbuf->cycles >= impbuf_max_cycles) {
 				gbhw_flush_buffer(gbhw);
+				impbuf_max_cycles = gb_impbuf_max_cycles(gbhw);
+			}
 			gb_sound_substep(gbhw);
-			gb_sound_mainstep(gbhw);
 		}
+		gb_sound_mainstep(gbhw);
+		cycles -= 4;
 	}
 }
 
@@ -899,36 +1666,335 @@ void gbhw_set_step_callback(struct gbhw *gbhw, gbhw_stepcallback_fn fn, void *pr
 	gbhw->stepcallback_priv = priv;
 }
 
+void gbhw_set_intr_callback(struct gbhw *gbhw, gbhw_intrcallback_fn fn, void *priv)
+{
+	gbhw->intrcallback = fn;
+	gbhw->intrcallback_priv = priv;
+}
+
+static void gbhw_impbuf_clear(struct gbhw_buffer *impbuf)
+{
+	impbuf->l_lvl = 0;
+	impbuf->r_lvl = 0;
+	impbuf->ofs = 0;
+	impbuf->dirty = 0;
+	memset(impbuf->data32, 0, impbuf->bytes);
+}
+
+/* start the level stream at zero just before the next sample to flush */
+static void gbhw_os_clear(struct gbhw *gbhw, struct gbhw_oversample *os)
+{
+	long long first;
+
+	if (os == NULL)
+		return;
+	first = gb_floor_div(gbhw->impbuf->base * (1LL << (GBHW_CLOCK_SHIFT - OS_SHIFT)), gbhw->sample_clock);
+	os->start = first - gbhw->os_width/2;
+	os->fill = os->start;
+	os->l_lvl = 0;
+	os->r_lvl = 0;
+	os->l_out = 0;
+	os->r_out = 0;
+}
+
+/*
+ * Room for the level entries between the flushes plus the filter
+ * window on both ends.
+ */
+static struct gbhw_oversample *gbhw_os_alloc(struct gbhw *gbhw)
+{
+	struct gbhw_oversample *os;
+	long per_sample = ((1L << (GBHW_CLOCK_SHIFT - OS_SHIFT)) + gbhw->sample_clock - 1) / gbhw->sample_clock;
+	long size = (gbhw->impbuf->samples + IMPULSE_WIDTH(gbhw)) * per_sample + 2 * gbhw->os_width + 16;
+
+	os = malloc(sizeof(*os) + 2 * size * sizeof(int32_t));
+	if (os == NULL) {
+		fprintf(stderr, "%s", _("Memory allocation failed!\n"));
+		return NULL;
+	}
+	memset(os, 0, sizeof(*os));
+	os->l_data = (void*)(os+1);
+	os->r_data = os->l_data + size;
+	os->size = size;
+	gbhw_os_clear(gbhw, os);
+	return os;
+}
+
+/*
+ * The filter passes up to the Nyquist frequency of the output and
+ * spans as many output samples as a band-limited step.
+ */
+static long gbhw_os_setup(struct gbhw *gbhw)
+{
+	const double ratio = (double)(1L << (GBHW_CLOCK_SHIFT - OS_SHIFT)) / gbhw->sample_clock;
+	long width = (long)(IMPULSE_WIDTH(gbhw) * ratio) & ~3L;
+
+	if (width < 4)
+		width = 4;
+	free(gbhw->os_taps);
+	gbhw->os_taps = gen_decimatetab(width, 1 << OS_PHASE_SHIFT, ratio, 1.0);
+	gbhw->os_width = width;
+	if (gbhw->os_taps == NULL) {
+		fprintf(stderr, "%s", _("Memory allocation failed!\n"));
+		return 0;
+	}
+	gbhw->os = gbhw_os_alloc(gbhw);
+	return gbhw->os != NULL;
+}
+
 static void gbhw_impbuf_reset(struct gbhw *gbhw)
 {
-	assert(gbhw->sound_div_tc != 0);
-	gbhw->impbuf->cycles = (long)(gbhw->sound_div_tc * IMPULSE_WIDTH/2 / SOUND_DIV_MULT);
-	gbhw->impbuf->l_lvl = 0;
-	gbhw->impbuf->r_lvl = 0;
-	memset(gbhw->impbuf->data32, 0, gbhw->impbuf->bytes);
+	long ch;
+
+	assert(gbhw->sample_clock != 0);
+	gbhw_impbuf_clear(gbhw->impbuf);
+	/* cycle 0 is half an impulse into the ring */
+	gbhw->impbuf->cycles = 0;
+	gbhw->impbuf->base = -IMPULSE_WIDTH(gbhw)/2;
+	gbhw_os_clear(gbhw, gbhw->os);
+	for (ch=0; ch<4; ch++) {
+		if (gbhw->stemimp[ch])
+			gbhw_impbuf_clear(gbhw->stemimp[ch]);
+		gbhw_os_clear(gbhw, gbhw->stemos[ch]);
+	}
 }
 
-void gbhw_set_buffer(struct gbhw* const gbhw, struct gbhw_buffer *buffer)
+static struct gbhw_buffer *gbhw_impbuf_alloc(struct gbhw *gbhw)
 {
-	long impbuf_bytes;
+	struct gbhw_buffer *impbuf;
+	long impbuf_samples = gbhw->soundbuf->samples + IMPULSE_WIDTH(gbhw) + 1;
+	long ring_samples = IMPULSE_WIDTH(gbhw);
+
+	while (ring_samples < impbuf_samples)
+		ring_samples <<= 1;
+	impbuf = malloc(sizeof(*impbuf) + ring_samples * 8);
+	if (impbuf == NULL) {
+		fprintf(stderr, "%s", _("Memory allocation failed!\n"));
+		return NULL;
+	}
+	memset(impbuf, 0, sizeof(*impbuf));
+	impbuf->data32 = (void*)(impbuf+1);
+	impbuf->bytes = ring_samples * 8;
+	impbuf->samples = impbuf_samples;
+	impbuf->mask = ring_samples - 1;
+	return impbuf;
+}
 
+static void gbhw_stems_free(struct gbhw *gbhw)
+{
+	long ch;
+
+	for (ch=0; ch<4; ch++) {
+		free(gbhw->stembuf[ch]);
+		free(gbhw->stemimp[ch]);
+		free(gbhw->stemos[ch]);
+		gbhw->stembuf[ch] = NULL;
+		gbhw->stemimp[ch] = NULL;
+		gbhw->stemos[ch] = NULL;
+	}
+}
+
+/*
+ * One output buffer and impulse ring per channel, sized like the mix.
+ * On failure the stem callback is dropped along with the buffers.
+ */
+static long gbhw_stems_alloc(struct gbhw *gbhw)
+{
+	long ch;
+
+	gbhw_stems_free(gbhw);
+	for (ch=0; ch<4; ch++) {
+		struct gbhw_buffer *buf = malloc(sizeof(*buf) + gbhw->soundbuf->bytes);
+		if (buf == NULL) {
+			fprintf(stderr, "%s", _("Memory allocation failed!\n"));
+			goto exit_free;
+		}
+		memset(buf, 0, sizeof(*buf));
+		buf->data = (void*)(buf+1);
+		buf->bytes = gbhw->soundbuf->bytes;
+		buf->samples = gbhw->soundbuf->samples;
+		gbhw->stembuf[ch] = buf;
+		gbhw->stemimp[ch] = gbhw_impbuf_alloc(gbhw);
+		if (gbhw->stemimp[ch] == NULL)
+			goto exit_free;
+		gbhw_impbuf_clear(gbhw->stemimp[ch]);
+		if (gbhw->os != NULL) {
+			gbhw->stemos[ch] = gbhw_os_alloc(gbhw);
+			if (gbhw->stemos[ch] == NULL)
+				goto exit_free;
+		}
+	}
+	return 1;
+
+exit_free:
+	gbhw_stems_free(gbhw);
+	gbhw->stem_callback = NULL;
+	gbhw->stem_callback_priv = NULL;
+	return 0;
+}
+
+/*
+ * Start the output over from silence at the current cycle, as after
+ * gbhw_init().  The next sound step steps to the current levels.
+ */
+static void gb_output_reset(struct gbhw *gbhw)
+{
+	long i;
+
+	if (gbhw->impbuf)
+		gbhw_impbuf_reset(gbhw);
+	if (gbhw->soundbuf) {
+		gbhw->soundbuf->pos = 0;
+		gbhw->soundbuf->l_lvl = 0;
+		gbhw->soundbuf->r_lvl = 0;
+		gbhw->soundbuf->l_cap = 0;
+		gbhw->soundbuf->r_cap = 0;
+	}
+	for (i=0; i<4; i++) {
+		if (gbhw->stembuf[i]) {
+			gbhw->stembuf[i]->pos = 0;
+			gbhw->stembuf[i]->l_lvl = 0;
+			gbhw->stembuf[i]->r_lvl = 0;
+			gbhw->stembuf[i]->l_cap = 0;
+			gbhw->stembuf[i]->r_cap = 0;
+		}
+		gbhw->stem_l_value[i] = 0;
+		gbhw->stem_r_value[i] = 0;
+	}
+	gbhw->lminval = gbhw->rminval = INT_MAX;
+	gbhw->lmaxval = gbhw->rmaxval = INT_MIN;
+	gbhw->last_l_value = 0;
+	gbhw->last_r_value = 0;
+	gbhw->update_level = 1;
+}
+
+/*
+ * Without rendering only the emulation runs: all channels count as
+ * silent, so the sound steps skip from one sequencer clock to the next,
+ * and no impulses, samples or sound callbacks are produced.  The peaks
+ * come from gb_register_peaks() instead.  Turning rendering back on
+ * restarts the output from silence.
+ */
+void gbhw_set_render(struct gbhw* const gbhw, long render)
+{
+	if (render && !gbhw->render)
+		gb_output_reset(gbhw);
+	gbhw->render = render;
+}
+
+void gbhw_set_buffer(struct gbhw* const gbhw, struct gbhw_buffer *buffer)
+{
 	gbhw->soundbuf = buffer;
-	gbhw->soundbuf->samples = gbhw->soundbuf->bytes / 4;
+	gbhw->soundbuf->samples = gbhw->soundbuf->bytes / gb_frame_bytes(gbhw);
 
 	if (gbhw->impbuf) free(gbhw->impbuf);
-	impbuf_bytes = (gbhw->soundbuf->samples + IMPULSE_WIDTH + 1) * 8;
-	gbhw->impbuf = malloc(sizeof(*gbhw->impbuf) + impbuf_bytes);
-	if (gbhw->impbuf == NULL) {
-		fprintf(stderr, "%s", _("Memory allocation failed!\n"));
+	free(gbhw->os);
+	gbhw->os = NULL;
+	gbhw->impbuf = gbhw_impbuf_alloc(gbhw);
+	if (gbhw->impbuf == NULL)
 		return;
-	}
-	memset(gbhw->impbuf, 0, sizeof(*gbhw->impbuf));
-	gbhw->impbuf->data32 = (void*)(gbhw->impbuf+1);
-	gbhw->impbuf->bytes = impbuf_bytes;
-	gbhw->impbuf->samples = impbuf_bytes / 8;
+	if (gbhw->synthesis == SYNTH_OVERSAMPLE && !gbhw_os_setup(gbhw))
+		return;
+	if (gbhw->stem_callback != NULL)
+		gbhw_stems_alloc(gbhw);
 	gbhw_impbuf_reset(gbhw);
 }
 
+long gbhw_set_stem_callback(struct gbhw* const gbhw, gbhw_callback_fn fn, void *priv)
+{
+	gbhw->stem_callback = fn;
+	gbhw->stem_callback_priv = priv;
+
+	gbhw_stems_free(gbhw);
+	if (fn != NULL && gbhw->soundbuf != NULL)
+		return gbhw_stems_alloc(gbhw);
+	return 1;
+}
+
+long gbhw_set_quality(struct gbhw* const gbhw, enum gbs_quality quality)
+{
+	const struct impulse_preset *preset;
+
+	switch (quality) {
+	case QUALITY_DRAFT:
+	case QUALITY_NORMAL:
+	case QUALITY_HQ:
+		preset = &impulse_presets[quality];
+		break;
+
+	default:
+		return 0; // invalid
+	}
+
+	gbhw->impulse = preset->table;
+	gbhw->impulse_w_shift = preset->w_shift;
+	gbhw->impulse_n_shift = preset->n_shift;
+
+	/* the impulse width determines the impbuf overlap */
+	if (gbhw->soundbuf)
+		gbhw_set_buffer(gbhw, gbhw->soundbuf);
+
+	return 1;
+}
+
+long gbhw_set_synthesis(struct gbhw* const gbhw, enum gbs_synthesis synthesis)
+{
+	switch (synthesis) {
+	case SYNTH_STEP:
+	case SYNTH_OVERSAMPLE:
+		break;
+
+	default:
+		return 0; // invalid
+	}
+
+	gbhw->synthesis = synthesis;
+
+	/* the level streams are sized from the output buffer */
+	if (gbhw->soundbuf)
+		gbhw_set_buffer(gbhw, gbhw->soundbuf);
+
+	return 1;
+}
+
+long gbhw_set_output_format(struct gbhw* const gbhw, enum gbs_output_format format, enum gbs_output_endian endian)
+{
+	switch (format) {
+	case OUTPUT_S16:
+	case OUTPUT_S32:
+	case OUTPUT_FLOAT:
+		break;
+
+	default:
+		return 0; // invalid
+	}
+
+	switch (endian) {
+	case OUTPUT_ENDIAN_NATIVE:
+		gbhw->output_swap = 0;
+		break;
+
+	case OUTPUT_ENDIAN_LITTLE:
+		gbhw->output_swap = !is_le_machine();
+		break;
+
+	case OUTPUT_ENDIAN_BIG:
+		gbhw->output_swap = !is_be_machine();
+		break;
+
+	default:
+		return 0; // invalid
+	}
+
+	gbhw->output_format = format;
+
+	/* the sample size determines how many samples fit into soundbuf */
+	if (gbhw->soundbuf)
+		gbhw_set_buffer(gbhw, gbhw->soundbuf);
+
+	return 1;
+}
+
 static void gbhw_update_filter(struct gbhw *gbhw)
 {
 	double cap_constant = pow(gbhw->filter_constant, (double)GBHW_CLOCK / gbhw->sample_rate);
@@ -965,7 +2031,7 @@ long gbhw_set_filter(struct gbhw* const gbhw, enum gbs_filter_type type)
 void gbhw_set_rate(struct gbhw* const gbhw, long rate)
 {
 	gbhw->sample_rate = rate;
-	gbhw->sound_div_tc = GBHW_CLOCK*SOUND_DIV_MULT/rate;
+	gbhw->sample_clock = rate;
 	gbhw_update_filter(gbhw);
 }
 
@@ -1002,22 +2068,13 @@ void gbhw_init(struct gbhw* const gbhw)
 	gbhw->vblankctr = vblanktc;
 	gbhw->timerctr = 0;
 	gbhw->divoffset = 0;
+	gbhw->irq_check = 1;
 	gbhw->sweep_div = 0;
 
-	if (gbhw->impbuf)
-		gbhw_impbuf_reset(gbhw);
+	gb_output_reset(gbhw);
 	gbhw->master_volume = MASTER_VOL_MAX;
 	gbhw->master_fade = 0;
 	gbhw->apu_on = 1;
-	if (gbhw->soundbuf) {
-		gbhw->soundbuf->pos = 0;
-		gbhw->soundbuf->l_lvl = 0;
-		gbhw->soundbuf->r_lvl = 0;
-		gbhw->soundbuf->l_cap = 0;
-		gbhw->soundbuf->r_cap = 0;
-	}
-	gbhw->lminval = gbhw->rminval = INT_MAX;
-	gbhw->lmaxval = gbhw->rmaxval = INT_MIN;
 	apu_reset(gbhw);
 	assert(sizeof(gbhw->intram) == GBHW_INTRAM_SIZE);
 	memset(gbhw->intram, 0, sizeof(gbhw->intram));
@@ -1028,15 +2085,19 @@ void gbhw_init(struct gbhw* const gbhw)
 	}
 
 	gbhw->sum_cycles = 0;
+	gbhw->run_synced = 0;
 	gbhw->ch[0].duty_ctr = 0;
 	gbhw->ch[1].duty_ctr = 0;
 	gbhw->ch3pos = 0;
 	gbhw->ch3_next_nibble = 0;
-	gbhw->last_l_value = 0;
-	gbhw->last_r_value = 0;
+	gb_wave_update(gbhw);
 
 	gbcpu_init(&gbhw->gbcpu);
 	gbcpu_add_mem(&gbhw->gbcpu, 0xc0, 0xfe, intram_put, intram_get, gbhw);
+	for (i=0xc0; i<=0xfe; i++) {
+		uint8_t *page = &gbhw->intram[(i << 8) & GBHW_INTRAM_MASK];
+		gbcpu_map_page(&gbhw->gbcpu, i, gbhw, page, page);
+	}
 	gbcpu_add_mem(&gbhw->gbcpu, 0xff, 0xff, io_put, io_get, gbhw);
 
 	gbhw->iocallback = saved_callback;  /* restore IO callback */
@@ -1045,6 +2106,10 @@ void gbhw_init(struct gbhw* const gbhw)
 void gbhw_cleanup(struct gbhw* const gbhw)
 {
 	if (gbhw->impbuf) free(gbhw->impbuf);
+	free(gbhw->os);
+	free(gbhw->os_taps);
+	gbhw_stems_free(gbhw);
+	gbcpu_cleanup(&gbhw->gbcpu);
 }
 
 void gbhw_enable_bootrom(struct gbhw* const gbhw, const uint8_t *rombuf)
@@ -1056,6 +2121,229 @@ void gbhw_enable_bootrom(struct gbhw* const gbhw, const uint8_t *rombuf)
 	gbcpu_add_mem(&gbhw->gbcpu, 0x00, 0x00, bootrom_put, bootrom_get, gbhw);
 }
 
+/*
+ * Everything the snapshot layout depends on.  A snapshot only loads
+ * into an instance that agrees on all of it.
+ */
+void gbhw_state_config(struct gbhw* const gbhw, struct gbstate *st)
+{
+	gbstate_check(st, gbhw->sample_clock);
+	gbstate_check(st, gbhw->impulse_w_shift);
+	gbstate_check(st, gbhw->impulse_n_shift);
+	gbstate_check(st, gbhw->synthesis);
+	gbstate_check(st, gbhw->os_width);
+	gbstate_check(st, gbhw->impbuf->samples);
+	gbstate_check(st, gbhw->impbuf->mask);
+	gbstate_check(st, gbhw->stemimp[0] != NULL);
+}
+
+/* The pending impulses from the read position on, and the levels. */
+static void gb_impbuf_state(struct gbhw_buffer *imp, struct gbstate *st)
+{
+	long dirty = imp->dirty;
+	long i;
+
+	gbstate_long(st, &dirty);
+	if (dirty < 0 || dirty > imp->mask + 1)
+		st->error = true;
+	if (st->error)
+		return;
+	if (st->load) {
+		gbhw_impbuf_clear(imp);
+		imp->dirty = dirty;
+	}
+	for (i=0; i<dirty*2; i++) {
+		long slot = (imp->ofs + i/2) & imp->mask;
+		gbstate_i32(st, &imp->data32[slot*2 + (i & 1)]);
+	}
+	gbstate_long(st, &imp->l_lvl);
+	gbstate_long(st, &imp->r_lvl);
+}
+
+/* The output side of a buffer pair: integrator and high-pass capacitor. */
+static void gb_outbuf_state(struct gbhw_buffer *out, struct gbstate *st)
+{
+	gbstate_long(st, &out->l_lvl);
+	gbstate_long(st, &out->r_lvl);
+	gbstate_long(st, &out->l_cap);
+	gbstate_long(st, &out->r_cap);
+}
+
+/* The final part of the level stream, the rest is rewritten anyway. */
+static void gb_os_state(struct gbhw_oversample *os, struct gbstate *st)
+{
+	long long start = os->start;
+	long long fill = os->fill;
+
+	gbstate_llong(st, &start);
+	gbstate_llong(st, &fill);
+	if (fill < start || fill - start > os->size)
+		st->error = true;
+	if (st->error)
+		return;
+	os->start = start;
+	os->fill = fill;
+	gbstate_bytes(st, os->l_data, (fill - start) * sizeof(int32_t));
+	gbstate_bytes(st, os->r_data, (fill - start) * sizeof(int32_t));
+	gbstate_long(st, &os->l_lvl);
+	gbstate_long(st, &os->r_lvl);
+	gbstate_long(st, &os->l_out);
+	gbstate_long(st, &os->r_out);
+}
+
+static void gb_channel_state(struct gbhw_channel *ch, struct gbhw_channel_cold *cold, struct gbstate *st)
+{
+	/* mute is a setting, not state */
+	gbstate_long(st, &ch->div_ctr);
+	gbstate_long(st, &ch->div_tc);
+	gbstate_i16(st, &ch->lvl);
+	gbstate_i8(st, &ch->running);
+	gbstate_i8(st, &ch->env_volume);
+	gbstate_u8(st, &ch->duty_val);
+	gbstate_i8(st, &ch->duty_ctr);
+	gbstate_i8(st, &ch->leftgate);
+	gbstate_i8(st, &ch->rightgate);
+	gbstate_i8(st, &ch->master);
+
+	gbstate_long(st, &cold->volume);
+	gbstate_long(st, &cold->env_dir);
+	gbstate_long(st, &cold->env_tc);
+	gbstate_long(st, &cold->env_ctr);
+	gbstate_long(st, &cold->sweep_dir);
+	gbstate_long(st, &cold->sweep_tc);
+	gbstate_long(st, &cold->sweep_ctr);
+	gbstate_long(st, &cold->sweep_shift);
+	gbstate_long(st, &cold->len);
+	gbstate_long(st, &cold->len_enable);
+	gbstate_long(st, &cold->len_gate);
+	gbstate_long(st, &cold->div_tc_shadow);
+
+	/* shift counts, divisors and table indices */
+	if (st->load &&
+	    (ch->div_tc < 1 || ch->duty_ctr < 0 || ch->duty_ctr > 7 ||
+	     ch->env_volume < 0 || ch->env_volume > 15 ||
+	     cold->volume < 0 || cold->volume > 15 ||
+	     cold->sweep_shift < 0 || cold->sweep_shift > 7))
+		st->error = true;
+}
+
+/*
+ * Save or load the complete emulation state, see gbs_save_state().
+ * The memory map has to be set up by gbhw_init() and the mapper
+ * before loading.  Values are range checked as they are loaded, so
+ * on error the instance is left partially loaded.
+ */
+void gbhw_state(struct gbhw* const gbhw, struct gbstate *st)
+{
+	long i;
+
+	for (i=0; i<4; i++)
+		gb_channel_state(&gbhw->ch[i], &gbhw->ch_cold[i], st);
+	gbstate_long(st, &gbhw->sweep_div);
+	gbstate_long(st, &gbhw->update_level);
+	gbstate_long(st, &gbhw->ch3pos);
+	gbstate_long(st, &gbhw->last_l_value);
+	gbstate_long(st, &gbhw->last_r_value);
+	gbstate_long(st, &gbhw->ch3_next_nibble);
+	gbstate_u16(st, &gbhw->lfsr.lfsr);
+	gbstate_bool(st, &gbhw->lfsr.narrow);
+
+	gbstate_long(st, &gbhw->apu_on);
+	gbstate_long(st, &gbhw->io_written);
+	gbstate_long(st, &gbhw->irq_check);
+	gbstate_long(st, &gbhw->irq_ime);
+	gbstate_long(st, &gbhw->lminval);
+	gbstate_long(st, &gbhw->lmaxval);
+	gbstate_long(st, &gbhw->rminval);
+	gbstate_long(st, &gbhw->rmaxval);
+	gbstate_long(st, &gbhw->master_volume);
+	gbstate_long(st, &gbhw->master_fade);
+	gbstate_long(st, &gbhw->master_fade_remainder);
+	gbstate_long(st, &gbhw->master_dstvol);
+	gbstate_long(st, &gbhw->sequence_ctr);
+	gbstate_long(st, &gbhw->vblankctr);
+	gbstate_long(st, &gbhw->timertc);
+	gbstate_long(st, &gbhw->timerctr);
+	gbstate_long(st, &gbhw->divoffset);
+	gbstate_cycles(st, &gbhw->sum_cycles);
+	gbstate_cycles(st, &gbhw->run_synced);
+	if (st->load &&
+	    (gbhw->sweep_div < 0 || gbhw->sweep_div >= sweep_div_tc ||
+	     gbhw->master_volume < MASTER_VOL_MIN || gbhw->master_volume > MASTER_VOL_MAX ||
+	     gbhw->master_dstvol < MASTER_VOL_MIN || gbhw->master_dstvol > MASTER_VOL_MAX ||
+	     gbhw->vblankctr <= 0 || gbhw->vblankctr > vblanktc ||
+	     gbhw->timertc <= 0 || gbhw->timerctr < 0 || gbhw->timerctr > gbhw->timertc))
+		st->error = true;
+
+	gbstate_long(st, &gbhw->rom_lockout);
+	if (gbhw->rom_lockout == 0) {
+		uint8_t boot_rom[GBHW_BOOT_ROM_SIZE];
+
+		memcpy(boot_rom, gbhw->boot_rom, sizeof(boot_rom));
+		gbstate_bytes(st, boot_rom, sizeof(boot_rom));
+		if (st->load && !st->error) {
+			if (gbhw->gbcpu.getlookup[0].get != bootrom_get)
+				gbhw_enable_bootrom(gbhw, boot_rom);
+			else
+				memcpy(gbhw->boot_rom, boot_rom, sizeof(boot_rom));
+		}
+	}
+
+	gbstate_bytes(st, gbhw->ioregs, sizeof(gbhw->ioregs));
+	gbstate_bytes(st, gbhw->hiram, sizeof(gbhw->hiram));
+	gbstate_bytes(st, gbhw->intram, sizeof(gbhw->intram));
+	gbcpu_state(&gbhw->gbcpu, st);
+
+	gbstate_cycles(st, &gbhw->impbuf->cycles);
+	gbstate_llong(st, &gbhw->impbuf->base);
+	gb_impbuf_state(gbhw->impbuf, st);
+	gb_outbuf_state(gbhw->soundbuf, st);
+	if (gbhw->os != NULL)
+		gb_os_state(gbhw->os, st);
+	for (i=0; i<4; i++) {
+		gbstate_long(st, &gbhw->stem_l_value[i]);
+		gbstate_long(st, &gbhw->stem_r_value[i]);
+		if (gbhw->stemimp[i] == NULL)
+			continue;
+		gb_impbuf_state(gbhw->stemimp[i], st);
+		gb_outbuf_state(gbhw->stembuf[i], st);
+		if (gbhw->stemos[i] != NULL)
+			gb_os_state(gbhw->stemos[i], st);
+	}
+
+	if (st->load && !st->error)
+		gb_wave_update(gbhw);
+}
+
+/*
+ * Hash of the state that decides what the CPU does next: registers,
+ * memories and the sound and interrupt registers.  The free running
+ * DIV and TIMA are left out, the sound generator internals follow from
+ * the registers.  The phase between vblank and timer only counts if
+ * both interrupts are used.
+ */
+uint64_t gbhw_state_hash(struct gbhw* const gbhw, uint64_t hash)
+{
+	struct gbcpu *gbcpu = &gbhw->gbcpu;
+	uint8_t ioregs[GBHW_IOREGS_SIZE];
+	long phase = 0;
+
+	gbcpu_flags_sync(gbcpu);
+	hash = gbstate_hash(hash, gbcpu->regs.ri, sizeof(gbcpu->regs.ri));
+	hash = gbstate_hash(hash, &gbcpu->ime, sizeof(gbcpu->ime));
+
+	memcpy(ioregs, gbhw->ioregs, sizeof(ioregs));
+	ioregs[REG_DIV] = 0;
+	if ((ioregs[REG_IE] & 0x05) == 0x05 && (ioregs[REG_TAC] & 4))
+		phase = gbhw->vblankctr - gbhw->timerctr;
+	else
+		ioregs[REG_TIMA] = 0;
+	hash = gbstate_hash(hash, ioregs, sizeof(ioregs));
+	hash = gbstate_hash(hash, &phase, sizeof(phase));
+	hash = gbstate_hash(hash, gbhw->hiram, sizeof(gbhw->hiram));
+	return gbstate_hash(hash, gbhw->intram, sizeof(gbhw->intram));
+}
+
 /* internal for gbs.c, not exported from libgbs */
 void gbhw_io_put(struct gbhw* const gbhw, uint16_t addr, uint8_t val) {
 	if (addr != 0xffff && (addr < 0xff00 || addr > 0xff7f))
@@ -1081,6 +2369,19 @@ static uint8_t gbhw_clz_lookup[] = {
 };
 
 
+/*
+ * When the interrupt was raised, which is earlier than it is taken if
+ * the CPU was busy.  Counts in whole events, unlike sum_cycles.
+ */
+static cycles_t gbhw_intr_raised(const struct gbhw *gbhw, uint8_t hit)
+{
+	switch (hit) {
+	case 0: return gbhw->sum_cycles - (vblanktc - gbhw->vblankctr);
+	case 2: return gbhw->sum_cycles - (gbhw->timertc - gbhw->timerctr);
+	default: return gbhw->sum_cycles;
+	}
+}
+
 static void gbhw_check_if(struct gbhw *gbhw, struct gbcpu *gbcpu)
 {
 	/* lowest bit is highest priority irq */
@@ -1093,6 +2394,60 @@ static void gbhw_check_if(struct gbhw *gbhw, struct gbcpu *gbcpu)
 			uint8_t vec = 0x40 + (hit * 8);
 			gbhw->ioregs[REG_IF] &= ~(1 << hit);
 			gbcpu_intr(gbcpu, vec);
+			if (gbhw->intrcallback)
+				gbhw->intrcallback(gbhw_intr_raised(gbhw, hit), vec, gbhw->intrcallback_priv);
+		}
+	}
+	gbhw->irq_check = 0;
+	gbhw->irq_ime = gbcpu->ime;
+}
+
+/*
+ * The result of gbhw_check_if() only changes when IF or IE are written,
+ * an interrupt source fires, IME changes or the CPU enters halt.
+ */
+static inline bool gbhw_irq_check_needed(const struct gbhw *gbhw, const struct gbcpu *gbcpu)
+{
+	return gbhw->irq_check || gbhw->irq_ime != gbcpu->ime || gbcpu->halted;
+}
+
+/*
+ * Cycles until the next vblank or timer event, at most limit.
+ *
+ * This only bounds the CPU slice; it is not a general deadline queue.
+ * The frame sequencer, channel periods and buffer flushes are still
+ * advanced by gb_sound() after each slice and on IO access.
+ */
+static long gbhw_next_event(const struct gbhw *gbhw, long limit)
+{
+	if (gbhw->vblankctr > 0 && gbhw->vblankctr < limit) limit = gbhw->vblankctr;
+	if (gbhw->timerctr > 0 && gbhw->timerctr < limit) limit = gbhw->timerctr;
+	return limit;
+}
+
+/* Advance vblank and timer counters and raise their interrupts. */
+static void gbhw_advance_events(struct gbhw *gbhw, cycles_t cycles)
+{
+	gbhw->vblankctr -= cycles;
+	if (gbhw->vblankctr <= 0) {
+		gbhw->vblankctr += vblanktc;
+		gbhw->ioregs[REG_IF] |= 0x01;
+		gbhw->irq_check = 1;
+		DPRINTF("vblank_interrupt\n");
+	}
+
+	if (gbhw->ioregs[REG_TAC] & 4) {
+		if (gbhw->timerctr > 0) gbhw->timerctr -= cycles;
+		while (gbhw->timerctr <= 0) {
+			gbhw->timerctr += gbhw->timertc;
+			gbhw->ioregs[REG_TIMA]++;
+			//DPRINTF("TIMA=%02x\n", ioregs[REG_TIMA]);
+			if (gbhw->ioregs[REG_TIMA] == 0) {
+				gbhw->ioregs[REG_TIMA] = gbhw->ioregs[REG_TMA];
+				gbhw->ioregs[REG_IF] |= 0x04;
+				gbhw->irq_check = 1;
+				DPRINTF("timer_interrupt\n");
+			}
 		}
 	}
 }
@@ -1109,17 +2464,26 @@ cycles_t gbhw_step(struct gbhw *gbhw, long time_to_work)
 	time_to_work *= msec_cycles;
 	
 	while (cycles_total < time_to_work) {
-		long maxcycles = time_to_work - cycles_total;
+		long maxcycles = gbhw_next_event(gbhw, time_to_work - cycles_total);
 		cycles_t cycles = 0;
 
-		if (gbhw->vblankctr > 0 && gbhw->vblankctr < maxcycles) maxcycles = gbhw->vblankctr;
-		if (gbhw->timerctr > 0 && gbhw->timerctr < maxcycles) maxcycles = gbhw->timerctr;
-
+		/*
+		 * IO writes end the slice so that vblank and timer
+		 * state is settled before the next access sees it.
+		 * DIV, TIMA, STAT and LY reads rely on this, so the
+		 * drop-out stays until those are derived from time.
+		 */
 		gbhw->io_written = 0;
 		while (cycles < maxcycles && !gbhw->io_written) {
 			long step;
-			gbhw_check_if(gbhw, gbcpu);
-			step = gbcpu_step(gbcpu);
+			if (gbhw_irq_check_needed(gbhw, gbcpu))
+				gbhw_check_if(gbhw, gbcpu);
+			if (gbhw->stepcallback) {
+				/* callback wants to see every instruction */
+				step = gbcpu_step(gbcpu);
+			} else {
+				step = gbcpu_run(gbcpu, maxcycles - cycles);
+			}
 			if (gbcpu->halted) {
 				if (gbcpu->ime == 0 && gbhw->ioregs[REG_IE] == 0) {
 					/* Locked in halt state */
@@ -1128,31 +2492,15 @@ cycles_t gbhw_step(struct gbhw *gbhw, long time_to_work)
 			}
 			if (step < 0) return step;
 			cycles += step;
+			step -= gbhw->run_synced;
+			gbhw->run_synced = 0;
+			gbcpu->run_cycles = 0;
 			gbhw->sum_cycles += step;
 			gb_sound(gbhw, step);
 			if (gbhw->stepcallback)
 			   gbhw->stepcallback(gbhw->sum_cycles, gbhw->ch, gbhw->stepcallback_priv);
 		}
-		gbhw->vblankctr -= cycles;
-		if (gbhw->vblankctr <= 0) {
-			gbhw->vblankctr += vblanktc;
-			gbhw->ioregs[REG_IF] |= 0x01;
-			DPRINTF("vblank_interrupt\n");
-		}
-
-		if (gbhw->ioregs[REG_TAC] & 4) {
-			if (gbhw->timerctr > 0) gbhw->timerctr -= cycles;
-			while (gbhw->timerctr <= 0) {
-				gbhw->timerctr += gbhw->timertc;
-				gbhw->ioregs[REG_TIMA]++;
-				//DPRINTF("TIMA=%02x\n", ioregs[REG_TIMA]);
-				if (gbhw->ioregs[REG_TIMA] == 0) {
-					gbhw->ioregs[REG_TIMA] = gbhw->ioregs[REG_TMA];
-					gbhw->ioregs[REG_IF] |= 0x04;
-					DPRINTF("timer_interrupt\n");
-				}
-			}
-		}
+		gbhw_advance_events(gbhw, cycles);
 		cycles_total += cycles;
 	}
 
@@ -17,7 +17,10 @@
 #include "gbcpu.h"
 #include "gblfsr.h"
 
+struct gbstate;
+
 #define GBHW_CLOCK 4194304
+#define GBHW_CLOCK_SHIFT 22  /* GBHW_CLOCK is a power of two */
 
 #define GBHW_INTRAM_SIZE 0x2000
 #define GBHW_INTRAM_MASK (GBHW_INTRAM_SIZE - 1)
@@ -28,10 +31,16 @@
 
 #define GBHW_BOOT_ROM_SIZE 256
 
+#define GBHW_OVERSAMPLE_SHIFT 4  /* SYNTH_OVERSAMPLE runs at GBHW_CLOCK >> 4 */
+
 struct gbhw_buffer {
-	int16_t *data;   /* only for soundbuf */
+	void *data;      /* only for soundbuf, see gbhw->output_format */
 	int32_t *data32; /* only for impbuf */
 	long pos;
+	long ofs;        /* only for impbuf: ring index of sample 0 */
+	long mask;       /* only for impbuf: ring size - 1, power of two */
+	long dirty;      /* only for impbuf: samples from ofs that may hold impulses */
+	long long base;  /* only for impbuf: sample number of ring slot ofs, see gb_sample_pos() */
 	long l_lvl;
 	long r_lvl;
 	long l_cap;
@@ -41,15 +50,44 @@ struct gbhw_buffer {
 	cycles_t cycles;
 };
 
+/*
+ * Level stream of SYNTH_OVERSAMPLE, one entry per 16 cycles, numbered
+ * like the cycles of impbuf.  The entries before fill are final, the
+ * rest is only written tentatively to decimate up to a flush.
+ */
+struct gbhw_oversample {
+	int32_t *l_data;
+	int32_t *r_data;
+	long size;        /* entries in l_data and r_data */
+	long long start;  /* number of the entry in l_data[0] */
+	long long fill;   /* first entry not written for good */
+	long l_lvl;       /* level from fill onwards */
+	long r_lvl;
+	long l_out;       /* last decimated output sample */
+	long r_out;
+};
+
+/*
+ * Channel state read on every sound step, kept small so that all four
+ * channels share two cache lines.  Also passed to the step callback.
+ */
 struct gbhw_channel {
-	long mute;
-	long running;
-	long master;
-	long leftgate;
-	long rightgate;
-	long lvl;
+	long div_ctr;
+	long div_tc;
+	int16_t lvl;
+	int8_t running;
+	int8_t env_volume;
+	uint8_t duty_val;
+	int8_t duty_ctr;
+	int8_t leftgate;
+	int8_t rightgate;
+	int8_t mute;
+	int8_t master;
+};
+
+/* Channel state only touched by register writes and the frame sequencer. */
+struct gbhw_channel_cold {
 	long volume;
-	long env_volume;
 	long env_dir;
 	long env_tc;
 	long env_ctr;
@@ -60,32 +98,58 @@ struct gbhw_channel {
 	long len;
 	long len_enable;
 	long len_gate;
-	long div_tc;
 	long div_tc_shadow;
-	long div_ctr;
-	long duty_val;
-	long duty_ctr;
 };
 
 typedef void (*gbhw_callback_fn)(void *priv);
 typedef void (*gbhw_iocallback_fn)(cycles_t cycles, uint32_t addr, uint8_t value, void *priv);
 typedef void (*gbhw_stepcallback_fn)(const cycles_t cycles, const struct gbhw_channel[], void *priv);
+typedef void (*gbhw_intrcallback_fn)(cycles_t raised, long vec, void *priv);
 
 struct gbhw {
+	/* sound state used by every step of gb_sound() */
+	struct gbhw_channel ch[4];
+	struct gbhw_buffer *impbuf;   /* internal impulse output buffer */
+	long long sample_clock; /* output samples per GBHW_CLOCK cycles */
+	const int32_t *impulse; /* band-limited step table, see impulsegen.c */
+	long impulse_w_shift;   /* log2 of the taps per impulse */
+	long impulse_n_shift;   /* log2 of the sub-sample phases */
+	long sweep_div;
+	long update_level;
+	long ch3pos;
+	long last_l_value, last_r_value;
+	long ch3_next_nibble;
+	long ch3_next_level;
+	struct gblfsr lfsr;
+	/* wave RAM decoded by gb_wave_update() on wave RAM and volume changes */
+	uint8_t ch3_wave[32];  /* nibble * 2 */
+	int8_t ch3_level[32];  /* output level at the current volume */
+	uint8_t ch3_run[32];   /* equal levels starting here, 32 if flat */
+
 	long apu_on;
 	long io_written;
+	long irq_check;  /* IF or IE changed since the last interrupt check */
+	long irq_ime;    /* IME as of the last interrupt check */
 
 	long lminval, lmaxval, rminval, rmaxval;
 	double filter_constant;
 	int filter_enabled;
 	long cap_factor;
 
+	enum gbs_synthesis synthesis;
+	struct gbhw_oversample *os;        /* only with SYNTH_OVERSAMPLE */
+	struct gbhw_oversample *stemos[4]; /* the same per channel, only with stems */
+	int32_t *os_taps;  /* polyphase decimation filter, see gen_decimatetab() */
+	long os_width;     /* taps per phase, a multiple of 4 */
+
+	enum gbs_output_format output_format;
+	long output_swap;  /* output byte order is not the native one */
+
 	long master_volume;
 	long master_fade;
 	long master_fade_remainder;
 	long master_dstvol;
 	long sample_rate;
-	long update_level;
 	long sequence_ctr;
 
 	long vblankctr;
@@ -94,13 +158,20 @@ struct gbhw {
 	long divoffset;
 
 	cycles_t sum_cycles;
+	cycles_t run_synced; /* part of gbcpu.run_cycles already accounted for */
 
 	long rom_lockout;
+	long render;  /* produce output, see gbhw_set_render() */
 
 	gbhw_callback_fn callback;
 	void *callbackpriv;
 	struct gbhw_buffer *soundbuf; /* externally visible output buffer */
-	struct gbhw_buffer *impbuf;   /* internal impulse output buffer */
+	struct gbhw_buffer *stembuf[4]; /* per-channel output, only with stem callback */
+	struct gbhw_buffer *stemimp[4]; /* per-channel impulse buffers */
+	long stem_l_value[4], stem_r_value[4];
+
+	gbhw_callback_fn stem_callback;
+	void *stem_callback_priv;
 
 	gbhw_iocallback_fn iocallback;
 	void *iocallback_priv;
@@ -108,22 +179,18 @@ struct gbhw {
 	gbhw_stepcallback_fn stepcallback;
 	void *stepcallback_priv;
 
-	struct gblfsr lfsr;
+	gbhw_intrcallback_fn intrcallback;  /* called when an interrupt is taken */
+	void *intrcallback_priv;
 
-	long long sound_div_tc;
-	long sweep_div;
+	struct gbhw_channel_cold ch_cold[4];
 
-	long ch3pos;
-	long last_l_value, last_r_value;
-	long ch3_next_nibble;
+	/* the small memories before the big ones */
+	uint8_t ioregs[GBHW_IOREGS_SIZE];
+	uint8_t hiram[GBHW_HIRAM_SIZE];
 
 	struct gbcpu gbcpu;
 
-	struct gbhw_channel ch[4];
-
-	uint8_t hiram[GBHW_HIRAM_SIZE];
 	uint8_t intram[GBHW_INTRAM_SIZE];
-	uint8_t ioregs[GBHW_IOREGS_SIZE];
 
 	uint8_t boot_rom[GBHW_BOOT_ROM_SIZE];
 	struct get_entry boot_shadow_get;
@@ -131,10 +198,16 @@ struct gbhw {
 };
 
 void gbhw_set_callback(struct gbhw* const gbhw, gbhw_callback_fn fn, void *priv);
+long gbhw_set_stem_callback(struct gbhw* const gbhw, gbhw_callback_fn fn, void *priv);
 void gbhw_set_io_callback(struct gbhw* const gbhw, gbhw_iocallback_fn fn, void *priv);
 void gbhw_set_step_callback(struct gbhw* const gbhw, gbhw_stepcallback_fn fn, void *priv);
+void gbhw_set_intr_callback(struct gbhw* const gbhw, gbhw_intrcallback_fn fn, void *priv);
 long gbhw_set_filter(struct gbhw* const gbhw, enum gbs_filter_type type);
+long gbhw_set_quality(struct gbhw* const gbhw, enum gbs_quality quality);
+long gbhw_set_synthesis(struct gbhw* const gbhw, enum gbs_synthesis synthesis);
+long gbhw_set_output_format(struct gbhw* const gbhw, enum gbs_output_format format, enum gbs_output_endian endian);
 void gbhw_set_rate(struct gbhw* const gbhw, long rate);
+void gbhw_set_render(struct gbhw* const gbhw, long render);
 void gbhw_set_buffer(struct gbhw* const gbhw, struct gbhw_buffer *buffer);
 void gbhw_init(struct gbhw* const gbhw);
 void gbhw_init_struct(struct gbhw* const gbhw);
@@ -148,5 +221,8 @@ uint8_t gbhw_io_peek(const struct gbhw* const gbhw, uint16_t addr);  /* unmasked
 void gbhw_io_put(struct gbhw* const gbhw, uint16_t addr, uint8_t val);
 bool gbhw_locked_up(struct gbhw* const gbhw);
 void gbhw_flush_buffer(struct gbhw *gbhw);
+void gbhw_state_config(struct gbhw* const gbhw, struct gbstate *st);
+void gbhw_state(struct gbhw* const gbhw, struct gbstate *st);
+uint64_t gbhw_state_hash(struct gbhw* const gbhw, uint64_t hash);
 
 #endif
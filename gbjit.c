@@ -0,0 +1,683 @@
+/*
+ * gbsplay is a Gameboy sound player
+ *
+ * 2003-2021 (C) by Tobias Diedrich <ranma+gbsplay@tdiedrich.de>
+ *                  Christian Garbs <mitch@cgarbs.de>
+ *
+ * Licensed under GNU GPL v1 or, at your option, any later version.
+ */
+
+/* MAP_ANONYMOUS is hidden by -std=c17 */
+#define _DEFAULT_SOURCE 1
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "gbjit.h"
+
+/*
+ * x86-64 translation of ROM code.
+ *
+ * Basic blocks of plain ROM pages are translated to native code on
+ * first use, following the same rules as the predecoded block cache in
+ * gbcpu.c: a block never crosses a page boundary, ends at the first
+ * control transfer and is keyed by the page data it was translated
+ * from, so a bank switch simply misses.  Translations are kept until
+ * the code buffer or the block table runs full, then all of them are
+ * dropped at once.
+ *
+ * Register loads, 8-bit arithmetic except ADC/SBC, immediate loads and
+ * jumps are emitted inline and work on struct gbcpu directly.  All
+ * other instructions call gbcpu_exec_op(), so every memory access
+ * still goes through mem_get()/mem_put() and the I/O callbacks, with
+ * run_cycles stored right before.  After each instruction the
+ * generated code performs the same checks as the interpreter loop:
+ * halt_at_pc, the cycle budget and, after calls into C, sync, halted,
+ * ime and the current bank.  Cycle counts are therefore identical to
+ * the interpreter.
+ *
+ * Every translated block is listed in /tmp/perf-PID.map so that perf
+ * can attribute samples to it.
+ *
+ * Native code register use (all callee-saved):
+ *   rbx  struct gbcpu
+ *   r12  run (cycles done so far)
+ *   r13  budget
+ *   r14  ime on entry
+ */
+
+#define GBJIT_CODE_SIZE   (256 * 1024)
+#define GBJIT_BUCKETS     1024
+#define GBJIT_BLOCKS      4096
+#define GBJIT_BLOCK_INSNS 32
+#define GBJIT_INSN_MAX    256  /* upper bound of native bytes per instruction */
+#define GBJIT_BLOCK_MAX   (GBJIT_BLOCK_INSNS * GBJIT_INSN_MAX + 128)
+#define GBJIT_FIXUPS      (GBJIT_BLOCK_INSNS * 8)
+
+enum {
+	TO_EXIT,
+	TO_HALT,
+};
+
+struct emitter {
+	uint8_t *start;
+	uint8_t *p;
+	long nfix;
+	struct {
+		uint8_t *rel;   /* rel32 field to patch */
+		long target;    /* TO_EXIT or TO_HALT */
+	} fix[GBJIT_FIXUPS];
+};
+
+struct gbjit_entry {
+	const uint8_t *page;
+	uint16_t pc;
+	gbjit_fn fn;  /* NULL if the first instruction can't be translated */
+	struct gbjit_entry *next;
+};
+
+struct gbjit {
+	uint8_t *code;
+	size_t used;
+	FILE *perf_map;
+	struct emitter emitter;
+	long nblocks;
+	struct gbjit_entry *bucket[GBJIT_BUCKETS];
+	struct gbjit_entry block[GBJIT_BLOCKS];
+};
+
+#define OFS(field) ((int32_t)offsetof(struct gbcpu, field))
+#define OFS_R8(i) (OFS(regs) + REGS8_IDX(i))  /* register numbers as in opcodes */
+#define OFS_A OFS(regs.rn.a)
+#define OFS_F OFS(regs.rn.f)
+#define OFS_PC OFS(regs.rn.pc)
+
+#define R8_HL 6  /* (HL) in place of a register */
+
+static void emit8(struct emitter *e, uint8_t b)
+{
+	*e->p++ = b;
+}
+
+static void emit32(struct emitter *e, uint32_t v)
+{
+	emit8(e, v);
+	emit8(e, v >> 8);
+	emit8(e, v >> 16);
+	emit8(e, v >> 24);
+}
+
+static void emit64(struct emitter *e, uint64_t v)
+{
+	emit32(e, v);
+	emit32(e, v >> 32);
+}
+
+/* opcode bytes followed by a [rbx+disp32] operand with the given reg field */
+static void emit_rbx(struct emitter *e, long prefix, uint8_t op, long reg, int32_t disp)
+{
+	if (prefix)
+		emit8(e, prefix);
+	emit8(e, op);
+	emit8(e, 0x83 | (reg << 3));
+	emit32(e, disp);
+}
+
+static void emit_jump(struct emitter *e, uint8_t cc, long target)
+{
+	if (cc) {
+		emit8(e, 0x0f);
+		emit8(e, cc);
+	} else {
+		emit8(e, 0xe9);
+	}
+	e->fix[e->nfix].rel = e->p;
+	e->fix[e->nfix].target = target;
+	e->nfix++;
+	emit32(e, 0);
+}
+
+#define JMP 0
+#define JE  0x84
+#define JNE 0x85
+#define JAE 0x83
+
+static void emit_call(struct emitter *e, const void *fn)
+{
+	emit8(e, 0x48); emit8(e, 0x89); emit8(e, 0xdf);  /* mov rdi, rbx */
+	emit8(e, 0x48); emit8(e, 0xb8);                   /* mov rax, imm64 */
+	emit64(e, (uintptr_t)fn);
+	emit8(e, 0xff); emit8(e, 0xd0);                   /* call rax */
+}
+
+static void emit_set_pc(struct emitter *e, uint16_t pc)
+{
+	emit8(e, 0x66);
+	emit_rbx(e, 0, 0xc7, 0, OFS_PC);                  /* mov word [pc], imm16 */
+	emit8(e, pc);
+	emit8(e, pc >> 8);
+}
+
+static void emit_add_run(struct emitter *e, uint8_t cycles)
+{
+	emit8(e, 0x49); emit8(e, 0x83); emit8(e, 0xc4);   /* add r12, imm8 */
+	emit8(e, cycles);
+}
+
+/* check_halt_at_pc() for a known PC */
+static void emit_halt_check(struct emitter *e, uint16_t pc)
+{
+	emit_rbx(e, 0x48, 0x81, 7, OFS(halt_at_pc));      /* cmp qword [halt_at_pc], imm32 */
+	emit32(e, pc);
+	emit_jump(e, JE, TO_HALT);
+}
+
+/* check_halt_at_pc() for the PC in memory */
+static void emit_halt_check_dyn(struct emitter *e)
+{
+	emit8(e, 0x0f);
+	emit_rbx(e, 0, 0xb7, 0, OFS_PC);                  /* movzx eax, word [pc] */
+	emit_rbx(e, 0x48, 0x3b, 0, OFS(halt_at_pc));      /* cmp rax, [halt_at_pc] */
+	emit_jump(e, JE, TO_HALT);
+}
+
+/* leave if a call into C ended the run or switched banks */
+static void emit_state_check(struct emitter *e, uint16_t pc, const uint8_t *page)
+{
+	int32_t ptr = OFS(getlookup) + (pc >> 8) * sizeof(struct get_entry) + offsetof(struct get_entry, ptr);
+
+	emit_rbx(e, 0x48, 0x8b, 0, OFS(sync));            /* mov rax, [sync] */
+	emit_rbx(e, 0x48, 0x0b, 0, OFS(halted));          /* or rax, [halted] */
+	emit_jump(e, JNE, TO_EXIT);
+	emit_rbx(e, 0x4c, 0x39, 6, OFS(ime));             /* cmp [ime], r14 */
+	emit_jump(e, JNE, TO_EXIT);
+	emit8(e, 0x48); emit8(e, 0xb8);                   /* mov rax, imm64 */
+	emit64(e, (uintptr_t)page);
+	emit_rbx(e, 0x48, 0x39, 0, ptr);                  /* cmp [getlookup[].ptr], rax */
+	emit_jump(e, JNE, TO_EXIT);
+}
+
+static void emit_budget_check(struct emitter *e)
+{
+	emit8(e, 0x4d); emit8(e, 0x39); emit8(e, 0xec);   /* cmp r12, r13 */
+	emit_jump(e, JAE, TO_EXIT);
+}
+
+/* interpret the instruction at pc */
+static void emit_generic(struct emitter *e, uint16_t pc, uint8_t op)
+{
+	emit_set_pc(e, pc + 1);
+	emit_rbx(e, 0x4c, 0x89, 4, OFS(run_cycles));      /* mov [run_cycles], r12 */
+	emit8(e, 0xbe);                                   /* mov esi, op */
+	emit32(e, op);
+	emit_call(e, (const void *)gbcpu_exec_op);
+	emit8(e, 0x49); emit8(e, 0x01); emit8(e, 0xc4);   /* add r12, rax */
+}
+
+/* flags_sync() unless F is already current */
+static void emit_flags_sync(struct emitter *e)
+{
+	emit_rbx(e, 0, 0x80, 7, OFS(lf_op));              /* cmp byte [lf_op], 0 */
+	emit8(e, LF_NONE);
+	emit8(e, 0x74); emit8(e, 15);                     /* je past the call */
+	emit_call(e, (const void *)gbcpu_flags_sync);
+}
+
+/* short forward jump, returns the rel8 field for patch8() */
+static uint8_t *emit_jump8(struct emitter *e, uint8_t op)
+{
+	emit8(e, op);
+	emit8(e, 0);
+	return e->p - 1;
+}
+
+static void patch8(struct emitter *e, uint8_t *rel)
+{
+	*rel = e->p - rel - 1;
+}
+
+#define JMP8 0xeb
+#define JE8  0x74
+#define JNE8 0x75
+#define JAE8 0x73
+
+/*
+ * Memory accesses read plain pages through getlookup/putlookup directly
+ * and call gbcpu_mem_get()/gbcpu_mem_put() for everything else.  The
+ * address is expected in esi, the value to write in edx, a read value
+ * ends up in al.
+ */
+static void emit_page_ptr(struct emitter *e, int32_t lookup)
+{
+	emit8(e, 0x89); emit8(e, 0xf0);                   /* mov eax, esi */
+	emit8(e, 0xc1); emit8(e, 0xe8); emit8(e, 8);      /* shr eax, 8 */
+	emit8(e, 0x6b); emit8(e, 0xc0);                   /* imul eax, eax, sizeof */
+	emit8(e, sizeof(struct get_entry));
+	emit8(e, 0x48); emit8(e, 0x8b); emit8(e, 0x8c);   /* mov rcx, [rbx+rax+lookup] */
+	emit8(e, 0x03);
+	emit32(e, lookup);
+	emit8(e, 0x48); emit8(e, 0x85); emit8(e, 0xc9);   /* test rcx, rcx */
+}
+
+static void emit_read(struct emitter *e)
+{
+	uint8_t *slow, *done;
+
+	emit_page_ptr(e, OFS(getlookup) + offsetof(struct get_entry, ptr));
+	slow = emit_jump8(e, JE8);
+	emit8(e, 0x40); emit8(e, 0x0f); emit8(e, 0xb6); emit8(e, 0xc6); /* movzx eax, sil */
+	emit8(e, 0x0f); emit8(e, 0xb6); emit8(e, 0x04); emit8(e, 0x01); /* movzx eax, byte [rcx+rax] */
+	done = emit_jump8(e, JMP8);
+	patch8(e, slow);
+	emit_rbx(e, 0x4c, 0x89, 4, OFS(run_cycles));      /* mov [run_cycles], r12 */
+	emit_call(e, (const void *)gbcpu_mem_get);
+	patch8(e, done);
+}
+
+static void emit_write(struct emitter *e)
+{
+	uint8_t *slow, *done;
+
+	emit_page_ptr(e, OFS(putlookup) + offsetof(struct put_entry, ptr));
+	slow = emit_jump8(e, JE8);
+	emit8(e, 0x40); emit8(e, 0x0f); emit8(e, 0xb6); emit8(e, 0xc6); /* movzx eax, sil */
+	emit8(e, 0x88); emit8(e, 0x14); emit8(e, 0x01);   /* mov [rcx+rax], dl */
+	done = emit_jump8(e, JMP8);
+	patch8(e, slow);
+	emit_rbx(e, 0x4c, 0x89, 4, OFS(run_cycles));      /* mov [run_cycles], r12 */
+	emit_call(e, (const void *)gbcpu_mem_put);
+	patch8(e, done);
+}
+
+/* address in esi: register pair, 0xff00 + C, or immediate */
+static void emit_addr(struct emitter *e, uint8_t op, uint16_t imm)
+{
+	switch (op) {
+	case 0x02: case 0x0a:
+		emit8(e, 0x0f);
+		emit_rbx(e, 0, 0xb7, 6, OFS(regs) + 2 * BC); /* movzx esi, word [bc] */
+		break;
+	case 0x12: case 0x1a:
+		emit8(e, 0x0f);
+		emit_rbx(e, 0, 0xb7, 6, OFS(regs) + 2 * DE); /* movzx esi, word [de] */
+		break;
+	case 0xe2: case 0xf2:
+		emit8(e, 0x0f);
+		emit_rbx(e, 0, 0xb6, 6, OFS_R8(1));       /* movzx esi, byte [c] */
+		emit8(e, 0x81); emit8(e, 0xce);           /* or esi, 0xff00 */
+		emit32(e, 0xff00);
+		break;
+	case 0xe0: case 0xf0:
+		emit8(e, 0xbe);                           /* mov esi, 0xff00 + imm8 */
+		emit32(e, 0xff00 + imm);
+		break;
+	case 0xea: case 0xfa:
+		emit8(e, 0xbe);                           /* mov esi, imm16 */
+		emit32(e, imm);
+		break;
+	default:
+		emit8(e, 0x0f);
+		emit_rbx(e, 0, 0xb7, 6, OFS(regs) + 2 * HL); /* movzx esi, word [hl] */
+		break;
+	}
+}
+
+/* A op= cl */
+static void emit_alu(struct emitter *e, long kind)
+{
+	emit_rbx(e, 0, 0x8a, 0, OFS_A);                   /* mov al, [a] */
+
+	switch (kind) {
+	case 0: /* ADD */
+	case 2: /* SUB */
+	case 7: /* CP */
+		emit_rbx(e, 0, 0x88, 0, OFS(lf_a));       /* mov [lf_a], al */
+		emit_rbx(e, 0, 0x88, 1, OFS(lf_b));       /* mov [lf_b], cl */
+		emit_rbx(e, 0, 0xc6, 0, OFS(lf_c));       /* mov byte [lf_c], 0 */
+		emit8(e, 0);
+		emit_rbx(e, 0, 0xc6, 0, OFS(lf_op));      /* mov byte [lf_op], LF_x */
+		emit8(e, kind == 0 ? LF_ADD : LF_SUB);
+		if (kind == 7)
+			return;
+		emit8(e, kind == 0 ? 0x00 : 0x28);        /* add/sub al, cl */
+		emit8(e, 0xc8);
+		emit_rbx(e, 0, 0x88, 0, OFS_A);           /* mov [a], al */
+		return;
+	default: /* AND, XOR, OR */
+		emit8(e, kind == 4 ? 0x20 : kind == 5 ? 0x30 : 0x08);
+		emit8(e, 0xc8);                           /* and/xor/or al, cl */
+		emit_rbx(e, 0, 0x88, 0, OFS_A);           /* mov [a], al */
+		emit8(e, 0x0f); emit8(e, 0x94); emit8(e, 0xc1); /* sete cl */
+		emit8(e, 0xc0); emit8(e, 0xe1); emit8(e, 7);    /* shl cl, 7 */
+		if (kind == 4) {
+			emit8(e, 0x80); emit8(e, 0xc9); emit8(e, HF); /* or cl, HF */
+		}
+		emit_rbx(e, 0, 0x88, 1, OFS_F);           /* mov [f], cl */
+		emit_rbx(e, 0, 0xc6, 0, OFS(lf_op));      /* mov byte [lf_op], LF_NONE */
+		emit8(e, LF_NONE);
+		return;
+	}
+}
+
+/* INC r and DEC r, the flags they keep follow flags_kept() */
+static void emit_incdec(struct emitter *e, long r, long dec)
+{
+	uint8_t *keep, *none, *store;
+
+	emit_rbx(e, 0, 0x8a, 0, OFS(lf_op));              /* mov al, [lf_op] */
+	emit8(e, 0x3c); emit8(e, LF_INC);                 /* cmp al, LF_INC */
+	keep = emit_jump8(e, JAE8);                       /* LF_INC or LF_DEC */
+	emit8(e, 0x84); emit8(e, 0xc0);                   /* test al, al */
+	none = emit_jump8(e, JE8);
+	emit_call(e, (const void *)gbcpu_flags_sync);     /* LF_ADD or LF_SUB */
+	patch8(e, none);
+	emit_rbx(e, 0, 0x8a, 1, OFS_F);                   /* mov cl, [f] */
+	emit8(e, 0x80); emit8(e, 0xe1); emit8(e, CF);     /* and cl, CF */
+	store = emit_jump8(e, JMP8);
+	patch8(e, keep);
+	emit_rbx(e, 0, 0x8a, 1, OFS(lf_c));               /* mov cl, [lf_c] */
+	patch8(e, store);
+	emit_rbx(e, 0, 0x8a, 0, OFS_R8(r));               /* mov al, [r] */
+	emit_rbx(e, 0, 0x88, 0, OFS(lf_a));               /* mov [lf_a], al */
+	emit_rbx(e, 0, 0xc6, 0, OFS(lf_b));               /* mov byte [lf_b], 0 */
+	emit8(e, 0);
+	emit_rbx(e, 0, 0x88, 1, OFS(lf_c));               /* mov [lf_c], cl */
+	emit_rbx(e, 0, 0xc6, 0, OFS(lf_op));              /* mov byte [lf_op], LF_INC/LF_DEC */
+	emit8(e, dec ? LF_DEC : LF_INC);
+	emit8(e, 0xfe); emit8(e, dec ? 0xc8 : 0xc0);      /* inc/dec al */
+	emit_rbx(e, 0, 0x88, 0, OFS_R8(r));               /* mov [r], al */
+}
+
+/* JP, JR and their conditional forms, always the last instruction */
+static void emit_branch(struct emitter *e, uint16_t pc, uint8_t op, uint16_t next, uint16_t target)
+{
+	long is_jr = op < 0x40;
+	uint8_t taken = is_jr ? 12 : 16;
+
+	if (op == 0x18 && target == pc) {
+		/* jr $-2 with interrupts disabled halts */
+		emit_rbx(e, 0x48, 0x83, 7, OFS(ime));     /* cmp qword [ime], 0 */
+		emit8(e, 0);
+		emit8(e, 0x75); emit8(e, 11);             /* jne past the store */
+		emit_rbx(e, 0x48, 0xc7, 0, OFS(halted));  /* mov qword [halted], 1 */
+		emit32(e, 1);
+	}
+	if (op != 0x18 && op != 0xc3) {
+		long cond = (op >> 3) & 3;
+		uint8_t *skip;
+
+		emit_flags_sync(e);
+		emit_rbx(e, 0, 0xf6, 0, OFS_F);           /* test byte [f], mask */
+		emit8(e, cond < 2 ? ZF : CF);
+		/* not taken: NZ/NC with the flag set, Z/C with it clear */
+		emit8(e, cond & 1 ? 0x74 : 0x75);         /* jz/jnz rel8 */
+		skip = e->p;
+		emit8(e, 0);
+		emit_set_pc(e, target);
+		emit_add_run(e, taken);
+		emit_halt_check(e, target);
+		emit_jump(e, JMP, TO_EXIT);
+		*skip = e->p - skip - 1;
+		emit_set_pc(e, next);
+		emit_add_run(e, taken - 4);
+		emit_halt_check(e, next);
+		return;
+	}
+	emit_set_pc(e, target);
+	emit_add_run(e, taken);
+	emit_halt_check(e, target);
+}
+
+/* emit one instruction, returns true if it called into C */
+static long emit_insn(struct emitter *e, uint16_t pc, uint8_t op, uint16_t imm, long len)
+{
+	uint16_t next = pc + len;
+	long dst = (op >> 3) & 7;
+	long src = op & 7;
+	long cycles = 4 * len;
+	long called = 0;
+
+	if (op >= 0x40 && op < 0x80 && dst != R8_HL && src != R8_HL) {
+		if (dst != src) {
+			emit_rbx(e, 0, 0x8a, 0, OFS_R8(src)); /* mov al, [src] */
+			emit_rbx(e, 0, 0x88, 0, OFS_R8(dst)); /* mov [dst], al */
+		}
+	} else if (op >= 0x40 && op < 0x80 && op != 0x76) {
+		emit_addr(e, op, imm);
+		if (dst == R8_HL) {
+			emit8(e, 0x0f);
+			emit_rbx(e, 0, 0xb6, 2, OFS_R8(src)); /* movzx edx, byte [src] */
+			emit_write(e);
+		} else {
+			emit_read(e);
+			emit_rbx(e, 0, 0x88, 0, OFS_R8(dst)); /* mov [dst], al */
+		}
+		cycles += 4;
+		called = 1;
+	} else if (op == 0x36) {
+		emit_addr(e, op, imm);
+		emit8(e, 0xba);                           /* mov edx, imm8 */
+		emit32(e, imm);
+		emit_write(e);
+		cycles += 4;
+		called = 1;
+	} else if (op == 0x02 || op == 0x12 || op == 0x22 || op == 0x32 ||
+		   op == 0xe0 || op == 0xe2 || op == 0xea) {
+		emit_addr(e, op, imm);
+		emit8(e, 0x0f);
+		emit_rbx(e, 0, 0xb6, 2, OFS_A);           /* movzx edx, byte [a] */
+		emit_write(e);
+		cycles += 4;
+		called = 1;
+	} else if (op == 0x0a || op == 0x1a || op == 0x2a || op == 0x3a ||
+		   op == 0xf0 || op == 0xf2 || op == 0xfa) {
+		emit_addr(e, op, imm);
+		emit_read(e);
+		emit_rbx(e, 0, 0x88, 0, OFS_A);           /* mov [a], al */
+		cycles += 4;
+		called = 1;
+	} else if ((op & 0xc7) == 0x06 && dst != R8_HL) {
+		emit_rbx(e, 0, 0xc6, 0, OFS_R8(dst));     /* mov byte [r], imm8 */
+		emit8(e, imm);
+	} else if ((op & 0xcf) == 0x01) {
+		long r16 = ((op >> 4) & 3) + (op == 0x31);        /* skip over AF */
+		emit8(e, 0x66);
+		emit_rbx(e, 0, 0xc7, 0, OFS(regs) + 2 * r16);     /* mov word [rr], imm16 */
+		emit8(e, imm);
+		emit8(e, imm >> 8);
+	} else if ((op & 0xc7) == 0x03) {
+		long r16 = ((op >> 4) & 3) + (op == 0x33 || op == 0x3b);
+		emit8(e, 0x66);
+		emit_rbx(e, 0, 0xff, (op >> 3) & 1, OFS(regs) + 2 * r16); /* inc/dec word [rr] */
+		cycles += 4;
+	} else if (((op & 0xc7) == 0x04 || (op & 0xc7) == 0x05) && dst != R8_HL) {
+		emit_incdec(e, dst, op & 1);
+	} else if (((op >= 0x80 && op < 0xc0) || (op & 0xc7) == 0xc6) &&
+		   dst != 1 && dst != 3) {
+		if (op & 0x40) {
+			emit8(e, 0xb1); emit8(e, imm);    /* mov cl, imm8 */
+		} else if (src == R8_HL) {
+			emit_addr(e, op, imm);
+			emit_read(e);
+			emit8(e, 0x89); emit8(e, 0xc1);   /* mov ecx, eax */
+			cycles += 4;
+			called = 1;
+		} else {
+			emit_rbx(e, 0, 0x8a, 1, OFS_R8(src)); /* mov cl, [src] */
+		}
+		emit_alu(e, dst);
+	} else if (op == 0x18 || op == 0xc3 ||
+		   op == 0x20 || op == 0x28 || op == 0x30 || op == 0x38 ||
+		   op == 0xc2 || op == 0xca || op == 0xd2 || op == 0xda) {
+		uint16_t target = op < 0x40 ? next + (int8_t)imm : imm;
+		emit_branch(e, pc, op, next, target);
+		return 0;
+	} else {
+		emit_generic(e, pc, op);
+		emit_halt_check_dyn(e);
+		return 1;
+	}
+	if (op == 0x22 || op == 0x2a) {
+		emit8(e, 0x66);
+		emit_rbx(e, 0, 0xff, 0, OFS(regs) + 2 * HL);  /* inc word [hl] */
+	} else if (op == 0x32 || op == 0x3a) {
+		emit8(e, 0x66);
+		emit_rbx(e, 0, 0xff, 1, OFS(regs) + 2 * HL);  /* dec word [hl] */
+	}
+	emit_set_pc(e, next);
+	emit_add_run(e, cycles);
+	emit_halt_check(e, next);
+	return called;
+}
+
+static void perf_map_add(struct gbjit *jit, const uint8_t *code, size_t size, uint16_t pc)
+{
+	if (jit->perf_map == NULL)
+		return;
+	fprintf(jit->perf_map, "%lx %lx gbs_%04x\n", (unsigned long)(uintptr_t)code, (unsigned long)size, pc);
+	fflush(jit->perf_map);
+}
+
+static gbjit_fn translate(struct gbjit *jit, const uint8_t *page, uint16_t pc)
+{
+	struct emitter *e = &jit->emitter;
+	uint16_t start = pc;
+	uint8_t *exit, *halt;
+	long n, i;
+
+	if (mprotect(jit->code, GBJIT_CODE_SIZE, PROT_READ | PROT_WRITE) != 0)
+		return NULL;
+
+	e->start = e->p = jit->code + jit->used;
+	e->nfix = 0;
+
+	emit8(e, 0x53);                                   /* push rbx */
+	emit8(e, 0x41); emit8(e, 0x54);                   /* push r12 */
+	emit8(e, 0x41); emit8(e, 0x55);                   /* push r13 */
+	emit8(e, 0x41); emit8(e, 0x56);                   /* push r14 */
+	emit8(e, 0x55);                                   /* push rbp, aligns the stack */
+	emit8(e, 0x48); emit8(e, 0x89); emit8(e, 0xfb);   /* mov rbx, rdi */
+	emit8(e, 0x49); emit8(e, 0x89); emit8(e, 0xf4);   /* mov r12, rsi */
+	emit8(e, 0x49); emit8(e, 0x89); emit8(e, 0xd5);   /* mov r13, rdx */
+	emit_rbx(e, 0x4c, 0x8b, 6, OFS(ime));             /* mov r14, [ime] */
+
+	for (n = 0; n < GBJIT_BLOCK_INSNS; n++) {
+		uint8_t op = page[pc & 0xff];
+		long len = gbcpu_op_len(op);
+		uint16_t imm = 0;
+		long last, called;
+
+		if (len == 0 || (pc & 0xff) + len > 0x100)
+			break;
+		if (len > 1)
+			imm = page[(pc + 1) & 0xff];
+		if (len > 2)
+			imm |= page[(pc + 2) & 0xff] << 8;
+
+		called = emit_insn(e, pc, op, imm, len);
+		pc += len;
+		last = gbcpu_op_ends_block(op) || (pc & 0xff) == 0 || n + 1 == GBJIT_BLOCK_INSNS;
+		if (last) {
+			n++;
+			break;
+		}
+		if (called)
+			emit_state_check(e, start, page);
+		emit_budget_check(e);
+	}
+
+	exit = e->p;
+	emit8(e, 0x4c); emit8(e, 0x89); emit8(e, 0xe0);   /* mov rax, r12 */
+	emit8(e, 0x5d);                                   /* pop rbp */
+	emit8(e, 0x41); emit8(e, 0x5e);                   /* pop r14 */
+	emit8(e, 0x41); emit8(e, 0x5d);                   /* pop r13 */
+	emit8(e, 0x41); emit8(e, 0x5c);                   /* pop r12 */
+	emit8(e, 0x5b);                                   /* pop rbx */
+	emit8(e, 0xc3);                                   /* ret */
+
+	halt = e->p;
+	emit_rbx(e, 0x48, 0xc7, 0, OFS(halted));          /* mov qword [halted], 1 */
+	emit32(e, 1);
+	emit_rbx(e, 0x48, 0xc7, 0, OFS(ime));             /* mov qword [ime], 1 */
+	emit32(e, 1);
+	emit8(e, 0xe9);                                   /* jmp exit */
+	emit32(e, exit - (e->p + 4));
+
+	for (i = 0; i < e->nfix; i++) {
+		uint8_t *to = e->fix[i].target == TO_EXIT ? exit : halt;
+		uint32_t rel = to - (e->fix[i].rel + 4);
+		memcpy(e->fix[i].rel, &rel, sizeof(rel));
+	}
+
+	if (mprotect(jit->code, GBJIT_CODE_SIZE, PROT_READ | PROT_EXEC) != 0)
+		return NULL;
+	if (n == 0)
+		return NULL;
+
+	jit->used += e->p - e->start;
+	perf_map_add(jit, e->start, e->p - e->start, start);
+	return (gbjit_fn)(uintptr_t)e->start;
+}
+
+gbjit_fn gbjit_lookup(struct gbcpu* const gbcpu, uint16_t pc)
+{
+	struct gbjit *jit = gbcpu->jit;
+	const uint8_t *page = gbcpu->getlookup[pc >> 8].ptr;
+	struct gbjit_entry *ent;
+	long hash;
+
+	if (page == NULL || gbcpu->putlookup[pc >> 8].ptr != NULL)
+		return NULL; /* not plain ROM */
+
+	hash = (pc ^ (pc >> 6) ^ ((uintptr_t)page >> 8)) & (GBJIT_BUCKETS - 1);
+	for (ent = jit->bucket[hash]; ent != NULL; ent = ent->next) {
+		if (ent->page == page && ent->pc == pc)
+			return ent->fn;
+	}
+
+	if (jit->nblocks == GBJIT_BLOCKS || jit->used + GBJIT_BLOCK_MAX > GBJIT_CODE_SIZE) {
+		/* out of space, start over */
+		memset(jit->bucket, 0, sizeof(jit->bucket));
+		jit->nblocks = 0;
+		jit->used = 0;
+	}
+	ent = &jit->block[jit->nblocks++];
+	ent->page = page;
+	ent->pc = pc;
+	ent->fn = translate(jit, page, pc);
+	ent->next = jit->bucket[hash];
+	jit->bucket[hash] = ent;
+	return ent->fn;
+}
+
+struct gbjit *gbjit_new(void)
+{
+	struct gbjit *jit = calloc(1, sizeof(*jit));
+	char path[64];
+
+	if (jit == NULL)
+		return NULL;
+	jit->code = mmap(NULL, GBJIT_CODE_SIZE, PROT_READ | PROT_EXEC,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (jit->code == MAP_FAILED) {
+		free(jit);
+		return NULL;
+	}
+	snprintf(path, sizeof(path), "/tmp/perf-%ld.map", (long)getpid());
+	jit->perf_map = fopen(path, "a");
+	return jit;
+}
+
+void gbjit_free(struct gbjit *jit)
+{
+	if (jit == NULL)
+		return;
+	if (jit->perf_map)
+		fclose(jit->perf_map);
+	munmap(jit->code, GBJIT_CODE_SIZE);
+	free(jit);
+}
@@ -0,0 +1,25 @@
+/*
+ * gbsplay is a Gameboy sound player
+ *
+ * 2003-2021 (C) by Tobias Diedrich <ranma+gbsplay@tdiedrich.de>
+ *                  Christian Garbs <mitch@cgarbs.de>
+ *
+ * Licensed under GNU GPL v1 or, at your option, any later version.
+ */
+
+#ifndef _GBJIT_H_
+#define _GBJIT_H_
+
+#include "gbcpu.h"
+
+/*
+ * Translated basic block.  Runs from the current PC and returns run
+ * plus the cycles taken, with PC and the other registers updated.
+ */
+typedef cycles_t (*gbjit_fn)(struct gbcpu* const gbcpu, cycles_t run, cycles_t budget);
+
+struct gbjit *gbjit_new(void);
+void gbjit_free(struct gbjit *jit);
+gbjit_fn gbjit_lookup(struct gbcpu* const gbcpu, uint16_t pc);
+
+#endif
@@ -7,6 +7,9 @@
  * Licensed under GNU GPL v1 or, at your option, any later version.
  */
 
+#include <stdatomic.h>
+#include <stdlib.h>
+
 #include "gblfsr.h"
 #include "test.h"
 
@@ -14,6 +17,30 @@
 #define MASK_FULL	((1 << 15) - 1)
 #define MASK_NARROW	((1 << 7) - 1)
 
+#define PERIOD_FULL	32767
+#define PERIOD_NARROW	127
+
+/*
+ * Output sequences, bit p is the output at position p.  Stored twice
+ * plus padding so that any 64 bits starting within the first period
+ * can be read without wrapping.
+ * As the LFSR shifts right, the state at a position consists of the
+ * next outputs: bit i of the state is the output i steps later.
+ */
+struct gblfsr_tables {
+	uint64_t seq_full[(2 * PERIOD_FULL + 127) / 64];
+	uint64_t seq_narrow[(2 * PERIOD_NARROW + 127) / 64];
+	/* position of each (nonzero) state in the sequences */
+	uint16_t pos_full[MASK_FULL + 1];
+	uint8_t pos_narrow[MASK_NARROW + 1];
+};
+
+/*
+ * Built on first use and shared by all instances.  A thread that
+ * loses the race to publish its copy frees it and uses the winner's.
+ */
+static const struct gblfsr_tables *_Atomic shared_tables;
+
 void gblfsr_reset(struct gblfsr* gblfsr) {
 	gblfsr->lfsr = MASK_FULL;
 	gblfsr->narrow = false;
@@ -38,6 +65,170 @@ int gblfsr_next_value(struct gblfsr* gblfsr) {
 	return new & 1;
 }
 
+static void seq_set(uint64_t *seq, long p, long period)
+{
+	seq[p / 64] |= 1ULL << (p % 64);
+	p += period;
+	seq[p / 64] |= 1ULL << (p % 64);
+}
+
+/* 64 sequence bits starting at position p */
+static inline uint64_t seq_get64(const uint64_t *seq, long p)
+{
+	uint64_t w = seq[p / 64] >> (p % 64);
+
+	if (p % 64)
+		w |= seq[p / 64 + 1] << (64 - p % 64);
+	return w;
+}
+
+static inline long ctz64(uint64_t w)
+{
+#if defined(__GNUC__)
+	return __builtin_ctzll(w);
+#else
+	long n = 0;
+
+	while ((w & 1) == 0) {
+		w >>= 1;
+		n++;
+	}
+	return n;
+#endif
+}
+
+static struct gblfsr_tables *gblfsr_build_tables(void)
+{
+	struct gblfsr_tables *t = calloc(1, sizeof(*t));
+	struct gblfsr state;
+	long p;
+
+	if (t == NULL)
+		return NULL;
+
+	gblfsr_reset(&state);
+	for (p = 0; p < PERIOD_FULL; p++) {
+		t->pos_full[state.lfsr] = p;
+		if (state.lfsr & 1)
+			seq_set(t->seq_full, p, PERIOD_FULL);
+		gblfsr_next_value(&state);
+	}
+
+	/* in narrow mode only the low 7 bits decide the output */
+	gblfsr_set_narrow(&state, true);
+	gblfsr_trigger(&state);
+	for (p = 0; p < PERIOD_NARROW; p++) {
+		t->pos_narrow[state.lfsr & MASK_NARROW] = p;
+		if (state.lfsr & 1)
+			seq_set(t->seq_narrow, p, PERIOD_NARROW);
+		gblfsr_next_value(&state);
+	}
+
+	return t;
+}
+
+/* NULL only if the tables could not be allocated */
+static const struct gblfsr_tables *gblfsr_tables(void)
+{
+	const struct gblfsr_tables *t = atomic_load_explicit(&shared_tables, memory_order_acquire);
+	const struct gblfsr_tables *expected = NULL;
+	struct gblfsr_tables *mine;
+
+	if (t != NULL)
+		return t;
+
+	mine = gblfsr_build_tables();
+	if (mine == NULL)
+		return NULL;
+	if (atomic_compare_exchange_strong_explicit(&shared_tables, &expected, mine,
+	                                            memory_order_acq_rel, memory_order_acquire))
+		return mine;
+	free(mine);
+	return expected;
+}
+
+/*
+ * Narrow mode feeds the xor output into bit 14 as well, so after 8
+ * steps bits 7-14 hold the outputs from one step before up to six
+ * steps after the current position.
+ */
+static uint16_t narrow_state_at(const struct gblfsr_tables *t, long p)
+{
+	uint64_t w = seq_get64(t->seq_narrow, (p + PERIOD_NARROW - 1) % PERIOD_NARROW);
+
+	return ((w >> 1) & MASK_NARROW) | ((w & 0xff) << 7);
+}
+
+/* Same as calling gblfsr_next_value() n times, but in constant time. */
+void gblfsr_skip(struct gblfsr* gblfsr, long n) {
+	const struct gblfsr_tables *t = gblfsr_tables();
+	long p;
+
+	if (t == NULL) {
+		for (; n > 0; n--)
+			gblfsr_next_value(gblfsr);
+		return;
+	}
+
+	if (!gblfsr->narrow) {
+		/* zero is the only state outside the sequence, it stays zero */
+		if (gblfsr->lfsr == 0)
+			return;
+		p = (t->pos_full[gblfsr->lfsr] + n) % PERIOD_FULL;
+		gblfsr->lfsr = seq_get64(t->seq_full, p) & MASK_FULL;
+		return;
+	}
+
+	/* step until bits 7-14 follow the low bits, zero stays zero */
+	while (n > 0 && (gblfsr->lfsr & MASK_NARROW) != 0 &&
+	       gblfsr->lfsr != narrow_state_at(t, t->pos_narrow[gblfsr->lfsr & MASK_NARROW])) {
+		gblfsr_next_value(gblfsr);
+		n--;
+	}
+	if ((gblfsr->lfsr & MASK_NARROW) == 0) {
+		for (; n > 0 && gblfsr->lfsr != 0; n--)
+			gblfsr_next_value(gblfsr);
+		return;
+	}
+	if (n == 0)
+		return;
+	p = (t->pos_narrow[gblfsr->lfsr & MASK_NARROW] + n) % PERIOD_NARROW;
+	gblfsr->lfsr = narrow_state_at(t, p);
+}
+
+/*
+ * Number of upcoming gblfsr_next_value() results that are equal to
+ * the last one (bit 0 of the state), at most max.
+ */
+long gblfsr_run_length(const struct gblfsr* gblfsr, long max) {
+	const struct gblfsr_tables *t = gblfsr_tables();
+	uint64_t w;
+	long run;
+
+	if (t == NULL) {
+		struct gblfsr state = *gblfsr;
+		int bit = state.lfsr & 1;
+
+		for (run = 0; run < max && gblfsr_next_value(&state) == bit; run++);
+		return run;
+	}
+
+	if (gblfsr->narrow) {
+		if ((gblfsr->lfsr & MASK_NARROW) == 0)
+			return max;
+		w = seq_get64(t->seq_narrow, t->pos_narrow[gblfsr->lfsr & MASK_NARROW] + 1);
+	} else {
+		if (gblfsr->lfsr == 0)
+			return max;
+		w = seq_get64(t->seq_full, t->pos_full[gblfsr->lfsr] + 1);
+	}
+	/* the longest run of an m-sequence is as long as the register */
+	if (gblfsr->lfsr & 1)
+		w = ~w;
+	run = ctz64(w);
+	return run < max ? run : max;
+}
+
 test void test_lsfr(void)
 {
 	struct gblfsr state;
@@ -89,4 +280,33 @@ test void test_lsfr(void)
 	ASSERT_EQUAL("%08x", x, 0xcbc8b8b3);
 }
 TEST(test_lsfr);
+
+test void test_lsfr_skip(void)
+{
+	static const long skips[] = { 0, 1, 7, 8, 9, 126, 127, 128, 1000, 32767, 70000 };
+	struct gblfsr state, ref;
+	long i, k, n, run;
+	int bit;
+
+	for (i = 0; i < 1000; i++) {
+		for (k = 0; k < (long)ARRAY_SIZE(skips); k++) {
+			/* arbitrary states, including unsynced narrow ones */
+			state.lfsr = (i * 40503 + k * 977) & MASK_FULL;
+			state.narrow = i & 1;
+			ref = state;
+
+			run = gblfsr_run_length(&state, 99);
+			bit = ref.lfsr & 1;
+			for (n = 0; n < 99 && gblfsr_next_value(&ref) == bit; n++);
+			ASSERT_EQUAL("%ld", run, n);
+
+			ref = state;
+			for (n = 0; n < skips[k]; n++)
+				gblfsr_next_value(&ref);
+			gblfsr_skip(&state, skips[k]);
+			ASSERT_EQUAL("%04x", state.lfsr, ref.lfsr);
+		}
+	}
+}
+TEST(test_lsfr_skip);
 TEST_EOF;
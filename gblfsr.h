@@ -24,5 +24,7 @@ void gblfsr_reset(struct gblfsr* gblfsr);
 void gblfsr_trigger(struct gblfsr* gblfsr);
 void gblfsr_set_narrow(struct gblfsr* gblfsr, bool narrow);
 int gblfsr_next_value(struct gblfsr* gblfsr);
+void gblfsr_skip(struct gblfsr* gblfsr, long n);
+long gblfsr_run_length(const struct gblfsr* gblfsr, long max);
 
 #endif
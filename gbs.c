@@ -7,6 +7,7 @@
  * Licensed under GNU GPL v1 or, at your option, any later version.
  */
 
+#include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
@@ -23,7 +24,9 @@
 #include "gbcpu.h"
 #include "libgbs.h"
 #include "gbs_internal.h"
+#include "gbstate.h"
 #include "crc32.h"
+#include "lencache.h"
 
 #ifdef USE_ZLIB
 #include <zlib.h>
@@ -56,6 +59,25 @@ enum filetype {
 struct gbs_subsong_info {
 	uint32_t len;  /* GBS_LEN_DIV (1024) == 1 second */
 	char *title;
+	uint8_t flags;     /* LENCACHE_LOOP and LENCACHE_SILENCE */
+	uint8_t channels;  /* bit n set if channel n+1 was heard */
+	long long loop_start;
+	long long loop_length;
+};
+
+#define GBS_KEYFRAME_SECONDS 10
+#define GBS_KEYFRAME_TICKS   ((long long)GBS_KEYFRAME_SECONDS * GBHW_CLOCK)
+
+struct gbs_keyframe {
+	long long ticks;
+	void *state;  /* from gbs_save_state(), NULL if not taken yet */
+	long len;
+};
+
+/* Keyframe n is taken at or shortly after n * GBS_KEYFRAME_TICKS. */
+struct gbs_keyframes {
+	struct gbs_keyframe *frames;
+	long count;
 };
 
 struct gbs {
@@ -80,6 +102,7 @@ struct gbs {
 	uint32_t crc;
 	uint32_t crcnow;
 	struct gbs_subsong_info *subsong_info;
+	struct lencache *lencache;  /* NULL if not set, see gbs_set_cache() */
 	char *strings;
 	char v1strings[33*3];
 	uint8_t *rom;
@@ -102,6 +125,10 @@ struct gbs {
 	gbs_sound_cb sound_cb;
 	void *sound_cb_priv;
 
+	gbs_stem_cb stem_cb;
+	void *stem_cb_priv;
+	struct gbs_output_buffer stem_bufs[4];
+
 	gbs_nextsubsong_cb nextsubsong_cb;
 	void *nextsubsong_cb_priv;
 
@@ -111,6 +138,7 @@ struct gbs {
 	struct gbhw_buffer gbhw_buf;
 	struct gbhw gbhw;
 	struct mapper *mapper;
+	struct gbs_keyframes *keyframes;  /* one per subsong, see gbs_seek() */
 
 	enum filetype filetype;
 };
@@ -359,10 +387,139 @@ void gbs_set_sound_callback(struct gbs* const gbs, gbs_sound_cb fn, void *priv)
 	gbhw_set_callback(&gbs->gbhw, wrap_sound_callback, gbs);
 }
 
+static void wrap_stem_callback(void *priv)
+{
+	struct gbs* gbs = priv;
+	long ch;
+
+	for (ch=0; ch<4; ch++) {
+		gbs->stem_bufs[ch].data = gbs->gbhw.stembuf[ch]->data;
+		gbs->stem_bufs[ch].bytes = gbs->gbhw.stembuf[ch]->bytes;
+		gbs->stem_bufs[ch].pos = gbs->gbhw.stembuf[ch]->pos;
+	}
+	gbs->stem_cb(gbs, gbs->stem_bufs, gbs->stem_cb_priv);
+}
+
+long gbs_set_stem_callback(struct gbs* const gbs, gbs_stem_cb fn, void *priv)
+{
+	gbs->stem_cb = fn;
+	gbs->stem_cb_priv = priv;
+	if (!gbhw_set_stem_callback(&gbs->gbhw, fn ? wrap_stem_callback : NULL, gbs)) {
+		gbs->stem_cb = NULL;
+		gbs->stem_cb_priv = NULL;
+		return 0;
+	}
+	return 1;
+}
+
 long gbs_set_filter(struct gbs* const gbs, enum gbs_filter_type type) {
 	return gbhw_set_filter(&gbs->gbhw, type);
 }
 
+long gbs_set_cpu_core(struct gbs* const gbs, enum gbs_cpu_core core) {
+	switch (core) {
+	case CPU_CORE_INTERP:
+		gbcpu_set_block_cache(&gbs->gbhw.gbcpu, 0);
+		gbcpu_set_jit(&gbs->gbhw.gbcpu, 0);
+		break;
+
+	case CPU_CORE_CACHED:
+		gbcpu_set_block_cache(&gbs->gbhw.gbcpu, 1);
+		gbcpu_set_jit(&gbs->gbhw.gbcpu, 0);
+		break;
+
+	case CPU_CORE_JIT:
+		if (!gbcpu_set_jit(&gbs->gbhw.gbcpu, 1))
+			return 0; // not available
+		gbcpu_set_block_cache(&gbs->gbhw.gbcpu, 0);
+		break;
+
+	default:
+		return 0; // invalid
+	}
+
+	return 1;
+}
+
+long gbs_set_quality(struct gbs* const gbs, enum gbs_quality quality) {
+	return gbhw_set_quality(&gbs->gbhw, quality);
+}
+
+long gbs_set_synthesis(struct gbs* const gbs, enum gbs_synthesis synthesis) {
+	return gbhw_set_synthesis(&gbs->gbhw, synthesis);
+}
+
+long gbs_set_render_mode(struct gbs* const gbs, enum gbs_render_mode mode) {
+	switch (mode) {
+	case RENDER_SOUND:
+		gbhw_set_render(&gbs->gbhw, 1);
+		break;
+
+	case RENDER_REGISTERS:
+		gbhw_set_render(&gbs->gbhw, 0);
+		break;
+
+	default:
+		return 0; // invalid
+	}
+	return 1;
+}
+
+long gbs_set_output_format(struct gbs* const gbs, enum gbs_output_format format, enum gbs_output_endian endian) {
+	return gbhw_set_output_format(&gbs->gbhw, format, endian);
+}
+
+/* Take over what is known about the subsongs of this file. */
+static void gbs_cache_fill(struct gbs* const gbs)
+{
+	struct lencache_entry e;
+	long i;
+
+	for (i=0; i<gbs->songs; i++) {
+		struct gbs_subsong_info *info = &gbs->subsong_info[i];
+
+		if (!lencache_find(gbs->lencache, gbs->crcnow, gbs->filesize, i, &e))
+			continue;
+		info->len = e.len;
+		info->flags = e.flags;
+		info->channels = e.channels;
+		info->loop_start = e.loop_start;
+		info->loop_length = e.loop_length;
+	}
+}
+
+long gbs_set_cache(struct gbs* const gbs, const char *path)
+{
+	lencache_close(gbs->lencache);
+	gbs->lencache = NULL;
+	if (path == NULL)
+		return true;
+
+	gbs->lencache = lencache_open(path);
+	if (gbs->lencache == NULL)
+		return false;
+	gbs_cache_fill(gbs);
+	return true;
+}
+
+static void gbs_cache_store(const struct gbs* const gbs, long subsong)
+{
+	const struct gbs_subsong_info *info = &gbs->subsong_info[subsong];
+	struct lencache_entry e;
+
+	if (gbs->lencache == NULL)
+		return;
+	e.crc = gbs->crcnow;
+	e.size = gbs->filesize;
+	e.subsong = subsong;
+	e.flags = info->flags;
+	e.channels = info->channels;
+	e.len = info->len;
+	e.loop_start = info->loop_start;
+	e.loop_length = info->loop_length;
+	lencache_store(gbs->lencache, &e);
+}
+
 static long gbs_nextsubsong(struct gbs* const gbs)
 {
 	if (gbs->nextsubsong_cb != NULL) {
@@ -434,6 +591,8 @@ long gbs_step(struct gbs* const gbs, long time_to_work)
 	    (gbs->ticks - gbs->silence_start) / GBHW_CLOCK >= gbs->silence_timeout) {
 		if (gbs->subsong_info[gbs->subsong].len == 0) {
 			gbs->subsong_info[gbs->subsong].len = gbs->ticks * GBS_LEN_DIV / GBHW_CLOCK;
+			gbs->subsong_info[gbs->subsong].flags |= LENCACHE_SILENCE;
+			gbs_cache_store(gbs, gbs->subsong);
 		}
 		gbhw_flush_buffer(&gbs->gbhw);
 		return gbs_nextsubsong(gbs);
@@ -527,9 +686,459 @@ long gbs_toggle_mute(struct gbs* const gbs, long channel) {
 	return gbs->gbhw.ch[channel].mute ^= 1;
 }
 
+#define GBS_STATE_MAGIC   "GBSS"
+#define GBS_STATE_VERSION 1
+
+/*
+ * Snapshot header: magic, version, payload length and CRC, followed
+ * by everything that has to match for the payload to fit.  All of it
+ * is checked before the emulator is touched.
+ */
+static void gbs_state_header(struct gbs* const gbs, struct gbstate *st, uint32_t *len, uint32_t *crc)
+{
+	char magic[4];
+
+	memcpy(magic, GBS_STATE_MAGIC, sizeof(magic));
+	gbstate_bytes(st, magic, sizeof(magic));
+	if (memcmp(magic, GBS_STATE_MAGIC, sizeof(magic)) != 0)
+		st->error = true;
+	gbstate_check(st, GBS_STATE_VERSION);
+	gbstate_u32(st, len);
+	gbstate_u32(st, crc);
+	gbstate_check(st, gbs->crcnow);
+	gbstate_check(st, gbs->songs);
+	gbstate_check(st, gbs->mapper != NULL);
+	gbhw_state_config(&gbs->gbhw, st);
+}
+
+static void gbs_state_payload(struct gbs* const gbs, struct gbstate *st)
+{
+	int32_t subsong = gbs->subsong;
+	long i;
+
+	gbstate_llong(st, &gbs->ticks);
+	gbstate_i16(st, &gbs->lmin);
+	gbstate_i16(st, &gbs->lmax);
+	gbstate_i16(st, &gbs->lvol);
+	gbstate_i16(st, &gbs->rmin);
+	gbstate_i16(st, &gbs->rmax);
+	gbstate_i16(st, &gbs->rvol);
+	gbstate_llong(st, &gbs->silence_start);
+	gbstate_i32(st, &subsong);
+	if (subsong < 0 || subsong >= gbs->songs)
+		st->error = true;
+	if (st->error)
+		return;
+	gbs->subsong = subsong;
+	/* lengths found by silence detection */
+	for (i=0; i<gbs->songs; i++)
+		gbstate_u32(st, &gbs->subsong_info[i].len);
+	if (gbs->mapper)
+		mapper_state(gbs->mapper, st);
+	gbhw_state(&gbs->gbhw, st);
+}
+
+long gbs_save_state(struct gbs* const gbs, void *buf, long size)
+{
+	struct gbstate st;
+	uint32_t len = 0, crc = 0;
+	long hdr_len;
+
+	if (gbs->gbhw.impbuf == NULL)
+		return 0;  /* no output configured yet */
+
+	gbstate_init_save(&st, NULL, 0);
+	gbs_state_header(gbs, &st, &len, &crc);
+	hdr_len = st.pos;
+	gbs_state_payload(gbs, &st);
+	if (buf == NULL || st.pos > size)
+		return st.pos;
+
+	gbstate_init_save(&st, (uint8_t *)buf + hdr_len, size - hdr_len);
+	gbs_state_payload(gbs, &st);
+	len = st.pos;
+	crc = gbs_crc32(0, (const char *)buf + hdr_len, len);
+	gbstate_init_save(&st, buf, hdr_len);
+	gbs_state_header(gbs, &st, &len, &crc);
+	if (st.error)
+		return 0;
+	return hdr_len + len;
+}
+
+/* Start loading buf, false if the header or the CRC does not match. */
+static long gbs_state_open(struct gbs* const gbs, struct gbstate *st, const void *buf, long size)
+{
+	uint32_t len = 0, crc = 0;
+
+	gbstate_init_load(st, buf, size);
+	gbs_state_header(gbs, st, &len, &crc);
+	return !st->error && len == size - st->pos &&
+		gbs_crc32(0, (const char *)buf + st->pos, len) == crc;
+}
+
+long gbs_load_state(struct gbs* const gbs, const void *buf, long size)
+{
+	struct gbstate st;
+	long backup_len;
+	void *backup;
+
+	if (gbs->gbhw.impbuf == NULL || !gbs_state_open(gbs, &st, buf, size))
+		return false;
+
+	/*
+	 * The payload values are range checked while they are loaded, so
+	 * keep the current state to go back to if one of them is invalid.
+	 */
+	backup_len = gbs_save_state(gbs, NULL, 0);
+	backup = malloc(backup_len);
+	if (backup == NULL)
+		return false;
+	gbs_save_state(gbs, backup, backup_len);
+
+	/* fresh memory map, then the state on top of it */
+	gbhw_init(&gbs->gbhw);
+	gbs_state_payload(gbs, &st);
+	if (st.error) {
+		long restored = gbs_state_open(gbs, &st, backup, backup_len);
+
+		gbhw_init(&gbs->gbhw);
+		gbs_state_payload(gbs, &st);
+		assert(restored && !st.error);
+		(void)restored;
+		free(backup);
+		return false;
+	}
+	free(backup);
+	update_status_on_subsong_change(gbs);
+	return true;
+}
+
+static void gbs_keyframes_clear(struct gbs* const gbs)
+{
+	long i, j;
+
+	if (gbs->keyframes == NULL)
+		return;
+	for (i=0; i<gbs->songs; i++) {
+		for (j=0; j<gbs->keyframes[i].count; j++)
+			free(gbs->keyframes[i].frames[j].state);
+		free(gbs->keyframes[i].frames);
+		gbs->keyframes[i].frames = NULL;
+		gbs->keyframes[i].count = 0;
+	}
+}
+
+/* Snapshot the current position if its keyframe is still missing. */
+static void gbs_keyframe_add(struct gbs* const gbs)
+{
+	struct gbs_keyframes *kf = &gbs->keyframes[gbs->subsong];
+	long n = gbs->ticks / GBS_KEYFRAME_TICKS;
+	struct gbs_keyframe *frame;
+
+	if (n >= kf->count) {
+		struct gbs_keyframe *frames = realloc(kf->frames, (n + 1) * sizeof(*frames));
+		if (frames == NULL)
+			return;
+		memset(&frames[kf->count], 0, (n + 1 - kf->count) * sizeof(*frames));
+		kf->frames = frames;
+		kf->count = n + 1;
+	}
+	frame = &kf->frames[n];
+	if (frame->state != NULL)
+		return;
+	frame->len = gbs_save_state(gbs, NULL, 0);
+	frame->state = malloc(frame->len);
+	if (frame->state == NULL)
+		return;
+	gbs_save_state(gbs, frame->state, frame->len);
+	frame->ticks = gbs->ticks;
+}
+
+/* The latest keyframe at or before ticks, NULL if there is none. */
+static const struct gbs_keyframe *gbs_keyframe_find(const struct gbs* const gbs, long long ticks)
+{
+	const struct gbs_keyframes *kf = &gbs->keyframes[gbs->subsong];
+	long n = ticks / GBS_KEYFRAME_TICKS;
+
+	if (n >= kf->count)
+		n = kf->count - 1;
+	for (; n >= 0; n--) {
+		const struct gbs_keyframe *frame = &kf->frames[n];
+		if (frame->state != NULL && frame->ticks <= ticks)
+			return frame;
+	}
+	return NULL;
+}
+
+long gbs_seek(struct gbs* const gbs, long millis)
+{
+	struct gbhw *gbhw = &gbs->gbhw;
+	long long target = (long long)millis * GBHW_CLOCK / 1000;
+	const struct gbs_keyframe *frame;
+	gbhw_iocallback_fn iocallback;
+	gbhw_stepcallback_fn stepcallback;
+	long render = gbhw->render;
+	long ok = true;
+
+	if (millis < 0 || gbhw->impbuf == NULL)
+		return false;
+	if (gbs->keyframes == NULL) {
+		gbs->keyframes = calloc(gbs->songs, sizeof(*gbs->keyframes));
+		if (gbs->keyframes == NULL)
+			return false;
+	}
+
+	/* restart from the nearest keyframe unless playback is closer */
+	frame = gbs_keyframe_find(gbs, target);
+	if (gbs->ticks > target || (frame != NULL && frame->ticks > gbs->ticks)) {
+		if (frame != NULL && !gbs_load_state(gbs, frame->state, frame->len)) {
+			/* taken with another output configuration */
+			gbs_keyframes_clear(gbs);
+			frame = NULL;
+		}
+		if (frame == NULL && !gbs_init(gbs, gbs->subsong))
+			return false;
+	}
+
+	/* nothing is rendered and nobody is told about the IO on the way */
+	iocallback = gbhw->iocallback;
+	stepcallback = gbhw->stepcallback;
+	gbhw->iocallback = NULL;
+	gbhw->stepcallback = NULL;
+	gbhw_set_render(gbhw, 0);
+	while (gbs->ticks < target) {
+		long long next = (gbs->ticks / GBS_KEYFRAME_TICKS + 1) * GBS_KEYFRAME_TICKS;
+		long msec_cycles = GBHW_CLOCK / 1000;
+		cycles_t cycles;
+
+		gbs_keyframe_add(gbs);
+		if (next > target)
+			next = target;
+		cycles = gbhw_step(gbhw, (next - gbs->ticks + msec_cycles - 1) / msec_cycles);
+		if ((int64_t)cycles < 0) {
+			ok = false;
+			break;
+		}
+		gbs->ticks += cycles;
+	}
+	gbhw->iocallback = iocallback;
+	gbhw->stepcallback = stepcallback;
+	gbhw_set_render(gbhw, render);
+	gbs->silence_start = 0;
+	return ok;
+}
+
+#define GBS_LOOP_CONFIRM_TICKS ((long long)3 * GBHW_CLOCK)
+#define GBS_LOOP_SILENCE_TICKS ((long long)GBHW_CLOCK)
+
+/*
+ * Loop detector, see gbs_detect_loop().  The machine state is hashed
+ * every time an interrupt is taken, and the table maps every hash to
+ * the first interrupt it was seen at.  A repeated hash is a loop
+ * candidate that has to keep repeating for a whole loop and at least
+ * GBS_LOOP_CONFIRM_TICKS.
+ */
+struct gbs_loop_detect {
+	struct gbs *gbs;
+	uint64_t *hashes;     /* per interrupt */
+	cycles_t *cycles;     /* per interrupt, when it was raised */
+	long count;
+	long alloc;
+	long *table;          /* interrupt number + 1, 0 if free */
+	long table_mask;
+	uint8_t *mapper_buf;  /* mapper state, hashed as well */
+	long mapper_len;
+	long start;           /* first interrupt of the candidate, -1 if none */
+	long repeat;          /* interrupt where the candidate started over */
+	bool found;
+	bool error;
+};
+
+static long *gbs_loop_slot(struct gbs_loop_detect *d, uint64_t hash)
+{
+	long i = hash & d->table_mask;
+
+	while (d->table[i] && d->hashes[d->table[i] - 1] != hash)
+		i = (i + 1) & d->table_mask;
+	return &d->table[i];
+}
+
+static bool gbs_loop_grow(struct gbs_loop_detect *d)
+{
+	long alloc = d->alloc ? 2 * d->alloc : 4096;
+	uint64_t *hashes = realloc(d->hashes, alloc * sizeof(*hashes));
+	cycles_t *cycles;
+	long i;
+
+	if (hashes == NULL)
+		return false;
+	d->hashes = hashes;
+	cycles = realloc(d->cycles, alloc * sizeof(*cycles));
+	if (cycles == NULL)
+		return false;
+	d->cycles = cycles;
+	d->alloc = alloc;
+
+	/* at most half full, so probing stays short */
+	free(d->table);
+	d->table_mask = 2 * alloc - 1;
+	d->table = calloc(2 * alloc, sizeof(*d->table));
+	if (d->table == NULL)
+		return false;
+	for (i=0; i<d->count; i++) {
+		long *slot = gbs_loop_slot(d, d->hashes[i]);
+		if (*slot == 0)
+			*slot = i + 1;
+	}
+	return true;
+}
+
+static void gbs_loop_intr(cycles_t raised, long vec, void *priv)
+{
+	struct gbs_loop_detect *d = priv;
+	uint64_t hash = 0;
+	long i = d->count;
+	long *slot;
+
+	UNUSED(vec);
+
+	if (d->found || d->error)
+		return;
+	if (i == d->alloc && !gbs_loop_grow(d)) {
+		d->error = true;
+		return;
+	}
+	if (d->mapper_buf) {
+		struct gbstate st;
+		gbstate_init_save(&st, d->mapper_buf, d->mapper_len);
+		mapper_state(d->gbs->mapper, &st);
+		hash = gbstate_hash(hash, d->mapper_buf, d->mapper_len);
+	}
+	hash = gbhw_state_hash(&d->gbs->gbhw, hash);
+	d->hashes[i] = hash;
+	d->cycles[i] = raised;
+	d->count++;
+
+	if (d->start >= 0) {
+		long period = d->repeat - d->start;
+		if (d->hashes[d->start + (i - d->repeat) % period] == hash) {
+			d->found = i - d->repeat >= period &&
+				d->cycles[i] - d->cycles[d->repeat] >= GBS_LOOP_CONFIRM_TICKS;
+			return;
+		}
+		d->start = -1;
+	}
+	slot = gbs_loop_slot(d, hash);
+	if (*slot) {
+		d->start = *slot - 1;
+		d->repeat = i;
+	} else {
+		*slot = i + 1;
+	}
+}
+
+long gbs_detect_loop(struct gbs* const gbs, long subsong, long max_seconds, struct gbs_loop *loop)
+{
+	struct gbhw *gbhw = &gbs->gbhw;
+	struct gbs_loop_detect d;
+	gbhw_iocallback_fn iocallback = gbhw->iocallback;
+	gbhw_stepcallback_fn stepcallback = gbhw->stepcallback;
+	long render = gbhw->render;
+	long long limit = (long long)max_seconds * GBHW_CLOCK;
+	long long audible = 0;
+	long long len;
+	struct gbs_subsong_info *info;
+	long channels = 0;
+
+	if (gbhw->impbuf == NULL || !gbs_init(gbs, subsong))
+		return false;
+	subsong = gbs->subsong;
+	info = &gbs->subsong_info[subsong];
+	if (info->flags & LENCACHE_LOOP) {
+		/* seen before, see gbs_set_cache() */
+		loop->start = info->loop_start;
+		loop->length = info->loop_length;
+		loop->channels = info->channels;
+		return true;
+	}
+
+	memset(&d, 0, sizeof(d));
+	d.gbs = gbs;
+	d.start = -1;
+	if (gbs->mapper) {
+		struct gbstate st;
+		gbstate_init_save(&st, NULL, 0);
+		mapper_state(gbs->mapper, &st);
+		d.mapper_len = st.pos;
+		d.mapper_buf = malloc(d.mapper_len);
+		d.error = d.mapper_buf == NULL;
+	}
+
+	/* like gbs_seek(), but from the start with the detector attached */
+	gbhw->iocallback = NULL;
+	gbhw->stepcallback = NULL;
+	gbhw_set_intr_callback(gbhw, gbs_loop_intr, &d);
+	gbhw_set_render(gbhw, 0);
+	while (!d.found && !d.error && (long long)gbhw->sum_cycles < limit) {
+		int16_t lmin = 0, lmax = 0, rmin = 0, rmax = 0;
+		struct gbhw_channel ch[4];
+		long i;
+
+		if ((int64_t)gbhw_step(gbhw, 10) < 0)
+			break;
+		gbhw_calc_minmax(gbhw, &lmin, &lmax, &rmin, &rmax);
+		if (lmin != lmax || rmin != rmax)
+			audible = gbhw->sum_cycles;
+		/* usage of the file, not of the current mute settings */
+		memcpy(ch, gbhw->ch, sizeof(ch));
+		for (i=0; i<4; i++) {
+			ch[i].mute = 0;
+			if (ch[i].running && chvol(ch, i))
+				channels |= 1 << i;
+		}
+	}
+	gbhw_set_intr_callback(gbhw, NULL, NULL);
+	gbhw->iocallback = iocallback;
+	gbhw->stepcallback = stepcallback;
+	gbhw_set_render(gbhw, render);
+
+	if (d.found) {
+		long long now = d.cycles[d.count - 1];
+		long long quiet;
+
+		loop->start = d.cycles[d.start];
+		loop->length = d.cycles[d.repeat] - d.cycles[d.start];
+		quiet = loop->length > GBS_LOOP_SILENCE_TICKS ? loop->length : GBS_LOOP_SILENCE_TICKS;
+		if (audible + quiet <= now) {
+			/* the song stopped and only the silence loops */
+			if (audible > loop->start)
+				loop->start = audible;
+			loop->length = 0;
+		}
+		loop->channels = channels;
+		len = (loop->start + loop->length) * GBS_LEN_DIV / GBHW_CLOCK;
+		info->len = len > 0 ? len : 1;
+		info->flags = LENCACHE_LOOP | (loop->length ? 0 : LENCACHE_SILENCE);
+		info->channels = channels;
+		info->loop_start = loop->start;
+		info->loop_length = loop->length;
+		gbs_cache_store(gbs, subsong);
+	}
+	free(d.hashes);
+	free(d.cycles);
+	free(d.table);
+	free(d.mapper_buf);
+
+	/* back to the start for playback */
+	return gbs_init(gbs, subsong) && d.found;
+}
+
 static void gbs_free(struct gbs* const gbs)
 {
+	gbs_keyframes_clear(gbs);
+	free(gbs->keyframes);
 	gbhw_cleanup(&gbs->gbhw);
+	lencache_close(gbs->lencache);
 	if (gbs->mapper)
 		mapper_free(gbs->mapper);
 	if (gbs->buf && gbs->buf_owned)
@@ -0,0 +1,320 @@
+/*
+ * gbsplay is a Gameboy sound player
+ *
+ * 2003-2021 (C) by Tobias Diedrich <ranma+gbsplay@tdiedrich.de>
+ *                  Christian Garbs <mitch@cgarbs.de>
+ *
+ * Licensed under GNU GPL v1 or, at your option, any later version.
+ */
+
+#include <limits.h>
+#include <string.h>
+
+#include "gbstate.h"
+#include "test.h"
+
+void gbstate_init_save(struct gbstate *st, void *data, long size)
+{
+	st->data = data;
+	st->size = data ? size : 0;
+	st->pos = 0;
+	st->load = false;
+	st->error = false;
+}
+
+void gbstate_init_load(struct gbstate *st, const void *data, long size)
+{
+	/* loading never writes to data */
+	st->data = (uint8_t *)data;
+	st->size = size;
+	st->pos = 0;
+	st->load = true;
+	st->error = false;
+}
+
+/* Reserve len bytes, returns NULL if only measuring or out of space. */
+static uint8_t *gbstate_take(struct gbstate *st, long len)
+{
+	uint8_t *ptr;
+
+	if (st->error)
+		return NULL;
+	if (st->data == NULL) {
+		st->pos += len;
+		return NULL;
+	}
+	if (len > st->size - st->pos) {
+		st->error = true;
+		return NULL;
+	}
+	ptr = st->data + st->pos;
+	st->pos += len;
+	return ptr;
+}
+
+static uint64_t gbstate_raw(struct gbstate *st, uint64_t val, long bytes)
+{
+	uint8_t *ptr = gbstate_take(st, bytes);
+	long i;
+
+	if (ptr == NULL)
+		return 0;
+	if (st->load) {
+		val = 0;
+		for (i=bytes-1; i>=0; i--)
+			val = val << 8 | ptr[i];
+	} else {
+		for (i=0; i<bytes; i++)
+			ptr[i] = val >> (8 * i);
+	}
+	return val;
+}
+
+void gbstate_u8(struct gbstate *st, uint8_t *val)
+{
+	uint8_t v = gbstate_raw(st, *val, 1);
+	if (st->load && !st->error)
+		*val = v;
+}
+
+void gbstate_i8(struct gbstate *st, int8_t *val)
+{
+	int8_t v = (int8_t)gbstate_raw(st, (uint8_t)*val, 1);
+	if (st->load && !st->error)
+		*val = v;
+}
+
+void gbstate_u16(struct gbstate *st, uint16_t *val)
+{
+	uint16_t v = gbstate_raw(st, *val, 2);
+	if (st->load && !st->error)
+		*val = v;
+}
+
+void gbstate_i16(struct gbstate *st, int16_t *val)
+{
+	int16_t v = (int16_t)gbstate_raw(st, (uint16_t)*val, 2);
+	if (st->load && !st->error)
+		*val = v;
+}
+
+void gbstate_u32(struct gbstate *st, uint32_t *val)
+{
+	uint32_t v = gbstate_raw(st, *val, 4);
+	if (st->load && !st->error)
+		*val = v;
+}
+
+void gbstate_i32(struct gbstate *st, int32_t *val)
+{
+	int32_t v = (int32_t)gbstate_raw(st, (uint32_t)*val, 4);
+	if (st->load && !st->error)
+		*val = v;
+}
+
+void gbstate_long(struct gbstate *st, long *val)
+{
+	int64_t v = (int64_t)gbstate_raw(st, (uint64_t)(int64_t)*val, 8);
+	if (st->load && !st->error) {
+		if (v < LONG_MIN || v > LONG_MAX)
+			st->error = true; /* from a machine with a bigger long */
+		else
+			*val = v;
+	}
+}
+
+void gbstate_llong(struct gbstate *st, long long *val)
+{
+	int64_t v = (int64_t)gbstate_raw(st, (uint64_t)*val, 8);
+	if (st->load && !st->error)
+		*val = v;
+}
+
+void gbstate_cycles(struct gbstate *st, cycles_t *val)
+{
+	cycles_t v = gbstate_raw(st, *val, 8);
+	if (st->load && !st->error)
+		*val = v;
+}
+
+void gbstate_bool(struct gbstate *st, bool *val)
+{
+	uint8_t v = gbstate_raw(st, *val, 1);
+	if (st->load && !st->error) {
+		if (v > 1)
+			st->error = true;
+		else
+			*val = v;
+	}
+}
+
+void gbstate_bytes(struct gbstate *st, void *buf, long len)
+{
+	uint8_t *ptr = gbstate_take(st, len);
+
+	if (ptr == NULL)
+		return;
+	if (st->load)
+		memcpy(buf, ptr, len);
+	else
+		memcpy(ptr, buf, len);
+}
+
+void gbstate_check(struct gbstate *st, long long val)
+{
+	long long v = val;
+
+	gbstate_llong(st, &v);
+	if (st->load && v != val)
+		st->error = true;
+}
+
+/*
+ * Fast 64 bit hash of machine state, chained via hash, for comparing
+ * states within one run.  Words are mixed in host byte order.
+ */
+uint64_t gbstate_hash(uint64_t hash, const void *data, long len)
+{
+	const uint8_t *ptr = data;
+	uint64_t word = 0;
+
+	hash = (hash ^ (uint64_t)len) * 0x9e3779b97f4a7c15ULL;
+	for (; len >= 8; ptr += 8, len -= 8) {
+		memcpy(&word, ptr, 8);
+		hash = (hash ^ word) * 0x9e3779b97f4a7c15ULL;
+		hash ^= hash >> 29;
+	}
+	word = 0;
+	memcpy(&word, ptr, len);
+	hash = (hash ^ word) * 0x9e3779b97f4a7c15ULL;
+	return hash ^ hash >> 32;
+}
+
+test void test_gbstate_roundtrip(void)
+{
+	uint8_t buf[64];
+	struct gbstate st;
+	uint8_t u8 = 0xa5;
+	int8_t i8 = -3;
+	uint16_t u16 = 0xbeef;
+	int16_t i16 = -12345;
+	int32_t i32 = -123456789;
+	long l = -42;
+	long long ll = -0x123456789abLL;
+	cycles_t cyc = 0xfedcba9876543210ULL;
+	bool b = true;
+	char bytes[4] = "gbs";
+
+	gbstate_init_save(&st, NULL, 0);
+	gbstate_u8(&st, &u8);
+	gbstate_i8(&st, &i8);
+	gbstate_u16(&st, &u16);
+	gbstate_i16(&st, &i16);
+	gbstate_i32(&st, &i32);
+	gbstate_long(&st, &l);
+	gbstate_llong(&st, &ll);
+	gbstate_cycles(&st, &cyc);
+	gbstate_bool(&st, &b);
+	gbstate_bytes(&st, bytes, sizeof(bytes));
+	ASSERT_EQUAL("%ld", st.pos, 39L);
+
+	gbstate_init_save(&st, buf, st.pos);
+	gbstate_u8(&st, &u8);
+	gbstate_i8(&st, &i8);
+	gbstate_u16(&st, &u16);
+	gbstate_i16(&st, &i16);
+	gbstate_i32(&st, &i32);
+	gbstate_long(&st, &l);
+	gbstate_llong(&st, &ll);
+	gbstate_cycles(&st, &cyc);
+	gbstate_bool(&st, &b);
+	gbstate_bytes(&st, bytes, sizeof(bytes));
+	ASSERT_EQUAL("%d", st.error, false);
+	/* little endian on every host */
+	ASSERT_EQUAL("%02x", buf[2], 0xef);
+	ASSERT_EQUAL("%02x", buf[3], 0xbe);
+
+	u8 = i8 = u16 = i16 = i32 = l = ll = cyc = b = 0;
+	memset(bytes, 0, sizeof(bytes));
+	gbstate_init_load(&st, buf, 39);
+	gbstate_u8(&st, &u8);
+	gbstate_i8(&st, &i8);
+	gbstate_u16(&st, &u16);
+	gbstate_i16(&st, &i16);
+	gbstate_i32(&st, &i32);
+	gbstate_long(&st, &l);
+	gbstate_llong(&st, &ll);
+	gbstate_cycles(&st, &cyc);
+	gbstate_bool(&st, &b);
+	gbstate_bytes(&st, bytes, sizeof(bytes));
+	ASSERT_EQUAL("%d", st.error, false);
+	ASSERT_EQUAL("%d", u8, 0xa5);
+	ASSERT_EQUAL("%d", i8, -3);
+	ASSERT_EQUAL("%d", u16, 0xbeef);
+	ASSERT_EQUAL("%d", i16, -12345);
+	ASSERT_EQUAL("%d", i32, -123456789);
+	ASSERT_EQUAL("%ld", l, -42L);
+	ASSERT_EQUAL("%lld", ll, -0x123456789abLL);
+	ASSERT_EQUAL("%llx", (unsigned long long)cyc, 0xfedcba9876543210ULL);
+	ASSERT_EQUAL("%d", b, true);
+	ASSERT_STRING_EQUAL("bytes", bytes, "gbs");
+}
+TEST(test_gbstate_roundtrip);
+
+test void test_gbstate_bounds(void)
+{
+	uint8_t buf[4] = { 1, 2, 3, 4 };
+	uint8_t buf8[8];
+	struct gbstate st;
+	int32_t i32 = 0;
+	int16_t i16 = 7;
+	bool b = false;
+
+	/* saving into a short buffer fails without writing past it */
+	gbstate_init_save(&st, buf, 3);
+	gbstate_i32(&st, &i32);
+	ASSERT_EQUAL("%d", st.error, true);
+	ASSERT_EQUAL("%d", buf[0], 1);
+
+	/* loading a truncated snapshot leaves the value alone */
+	gbstate_init_load(&st, buf, 1);
+	gbstate_i16(&st, &i16);
+	ASSERT_EQUAL("%d", st.error, true);
+	ASSERT_EQUAL("%d", i16, 7);
+
+	/* and so do values that cannot come from gbstate_bool() */
+	gbstate_init_load(&st, buf + 1, 1);
+	gbstate_bool(&st, &b);
+	ASSERT_EQUAL("%d", st.error, true);
+	ASSERT_EQUAL("%d", b, false);
+
+	/* configuration values only load into the same configuration */
+	gbstate_init_save(&st, buf8, sizeof(buf8));
+	gbstate_check(&st, 44100);
+	gbstate_init_load(&st, buf8, sizeof(buf8));
+	gbstate_check(&st, 44100);
+	ASSERT_EQUAL("%d", st.error, false);
+	gbstate_init_load(&st, buf8, sizeof(buf8));
+	gbstate_check(&st, 48000);
+	ASSERT_EQUAL("%d", st.error, true);
+}
+TEST(test_gbstate_bounds);
+
+test void test_gbstate_hash(void)
+{
+	uint8_t a[13] = "loop detect!";
+	uint8_t b[13] = "loop detect!";
+	uint64_t h = gbstate_hash(0, a, sizeof(a));
+
+	ASSERT_EQUAL("%d", gbstate_hash(0, b, sizeof(b)) == h, true);
+	/* every byte counts, including the tail and the length */
+	b[11] = '?';
+	ASSERT_EQUAL("%d", gbstate_hash(0, b, sizeof(b)) == h, false);
+	b[11] = '!';
+	b[0] = 'L';
+	ASSERT_EQUAL("%d", gbstate_hash(0, b, sizeof(b)) == h, false);
+	ASSERT_EQUAL("%d", gbstate_hash(0, a, sizeof(a) - 1) == h, false);
+	ASSERT_EQUAL("%d", gbstate_hash(1, a, sizeof(a)) == h, false);
+}
+TEST(test_gbstate_hash);
+TEST_EOF;
@@ -0,0 +1,49 @@
+/*
+ * gbsplay is a Gameboy sound player
+ *
+ * 2003-2021 (C) by Tobias Diedrich <ranma+gbsplay@tdiedrich.de>
+ *                  Christian Garbs <mitch@cgarbs.de>
+ *
+ * Licensed under GNU GPL v1 or, at your option, any later version.
+ */
+
+#ifndef _GBSTATE_H_
+#define _GBSTATE_H_
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+#include "common.h"
+
+/*
+ * Cursor for state snapshots, see gbs_save_state().  The same function
+ * walks the fields for saving and loading, so both always agree on the
+ * layout.  Values are stored little endian with a fixed width, so
+ * snapshots can be moved between machines.
+ */
+struct gbstate {
+	uint8_t *data;  /* NULL when saving only measures the size */
+	long size;
+	long pos;
+	bool load;
+	bool error;     /* out of space, truncated or invalid value */
+};
+
+void gbstate_init_save(struct gbstate *st, void *data, long size);
+void gbstate_init_load(struct gbstate *st, const void *data, long size);
+void gbstate_u8(struct gbstate *st, uint8_t *val);
+void gbstate_i8(struct gbstate *st, int8_t *val);
+void gbstate_u16(struct gbstate *st, uint16_t *val);
+void gbstate_i16(struct gbstate *st, int16_t *val);
+void gbstate_u32(struct gbstate *st, uint32_t *val);
+void gbstate_i32(struct gbstate *st, int32_t *val);
+void gbstate_long(struct gbstate *st, long *val);  /* stored as 64 bit */
+void gbstate_llong(struct gbstate *st, long long *val);
+void gbstate_cycles(struct gbstate *st, cycles_t *val);
+void gbstate_bool(struct gbstate *st, bool *val);
+void gbstate_bytes(struct gbstate *st, void *buf, long len);
+void gbstate_check(struct gbstate *st, long long val);  /* must load as saved */
+
+uint64_t gbstate_hash(uint64_t hash, const void *data, long len);
+
+#endif
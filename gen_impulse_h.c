@@ -16,32 +16,45 @@
 #define IMPULSE_W_SHIFT 5 /* 32 samples per impulse */
 #define IMPULSE_CUTOFF 1.0 /* Cutoff at nyquist limit (no cutoff) */
 
-#define IMPULSE_WIDTH (1 << IMPULSE_W_SHIFT)
-#define IMPULSE_W_MASK (IMPULSE_WIDTH - 1)
-#define IMPULSE_N (1 << IMPULSE_N_SHIFT)
-#define IMPULSE_N_MASK (IMPULSE_N - 1)
+/* Tables for the draft and high quality resampling presets */
+#define IMPULSE_DRAFT_N_SHIFT 6
+#define IMPULSE_DRAFT_W_SHIFT 4
+#define IMPULSE_HQ_N_SHIFT 8
+#define IMPULSE_HQ_W_SHIFT 6
 
-int main(int argc, char **argv)
+static int print_impulsetab(const char *prefix, const char *name, long w_shift, long n_shift, double cutoff)
 {
-	int32_t *impulsetab = gen_impulsetab(IMPULSE_W_SHIFT, IMPULSE_N_SHIFT, IMPULSE_CUTOFF);
-	int n = (1 << IMPULSE_N_SHIFT) * (1 << IMPULSE_W_SHIFT);
-	int i;
+	int32_t *impulsetab = gen_impulsetab(w_shift, n_shift, cutoff);
+	long w_mask = (1L << w_shift) - 1;
+	long n = (1L << n_shift) << w_shift;
+	long i;
 
 	if (impulsetab == NULL) {
 		fprintf(stderr, "Failed to generate impulse table.");
 		return 1;
 	}
 
-	printf("#define IMPULSE_N_SHIFT %d\n", IMPULSE_N_SHIFT);
-	printf("#define IMPULSE_W_SHIFT %d\n", IMPULSE_W_SHIFT);
-	printf("static const int32_t base_impulse[] = {");
+	printf("#define %sN_SHIFT %ld\n", prefix, n_shift);
+	printf("#define %sW_SHIFT %ld\n", prefix, w_shift);
+	printf("static const int32_t %s[] = {", name);
 	for (i=0; i<n; i++) {
-		if ((i & IMPULSE_W_MASK) == 0) {
+		if ((i & w_mask) == 0) {
 			printf("\n\t");
 		}
 		printf("%9d,", impulsetab[i]);
 	}
 	printf("\n};\n");
+	free(impulsetab);
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	if (print_impulsetab("IMPULSE_", "base_impulse", IMPULSE_W_SHIFT, IMPULSE_N_SHIFT, IMPULSE_CUTOFF) ||
+	    print_impulsetab("IMPULSE_DRAFT_", "draft_impulse", IMPULSE_DRAFT_W_SHIFT, IMPULSE_DRAFT_N_SHIFT, IMPULSE_CUTOFF) ||
+	    print_impulsetab("IMPULSE_HQ_", "hq_impulse", IMPULSE_HQ_W_SHIFT, IMPULSE_HQ_N_SHIFT, IMPULSE_CUTOFF))
+		return 1;
 
 	return 0;
 }
@@ -85,6 +85,70 @@ int32_t *gen_impulsetab(long w_shift, long n_shift, double cutoff)
 	return pulsetab;
 }
 
+/*
+ * Polyphase low-pass for decimating a level stream, width taps for
+ * each of the phases.  Tap t of phase p weighs the input sample that
+ * is t - width/2 + 1 - p/phases input samples away from the output
+ * sample, and step is the distance of two output samples in input
+ * samples.  Like the impulses every phase adds up to IMPULSE_HEIGHT,
+ * so a constant level comes out exactly.
+ */
+int32_t *gen_decimatetab(long width, long phases, double step, double cutoff)
+{
+	int32_t *tab = malloc(width * phases * sizeof(int32_t));
+	double *xd = malloc(width * sizeof(double));
+	long p, t;
+
+	if (!tab || !xd) {
+		free(tab);
+		free(xd);
+		return NULL;
+	}
+
+	for (p = 0; p < phases; p++) {
+		int32_t *ptr = &tab[p * width];
+		double dsum = 0.0;
+		int64_t sum = 0;
+
+		for (t = 0; t < width; t++) {
+			double d = t - width/2 + 1 - (double)p / phases;
+			double x = d / step;
+
+			xd[t] = (x == 0.0 ? 1.0 : sinc(x*cutoff)) * blackman(d + width/2, width);
+			dsum += xd[t];
+		}
+		for (t = 0; t < width; t++) {
+			ptr[t] = rint(xd[t] * IMPULSE_HEIGHT / dsum);
+			sum += ptr[t];
+		}
+		ptr[width/2 - 1] += IMPULSE_HEIGHT - sum;
+	}
+
+	free(xd);
+	return tab;
+}
+
+test void test_gen_decimatetab(void)
+{
+	const long width = 24;
+	const long phases = 4;
+	int32_t *tab = gen_decimatetab(width, phases, 6.0, 1.0);
+	long p, t;
+
+	for (p = 0; p < phases; p++) {
+		int64_t sum = 0;
+		for (t = 0; t < width; t++)
+			sum += tab[p * width + t];
+		ASSERT_EQUAL("%ld", (long)sum, (long)IMPULSE_HEIGHT);
+	}
+	/* phase 0 is centered on a tap and symmetric around it, up to rounding */
+	for (t = 1; t < width/2; t++)
+		ASSERT_EQUAL("%d", labs((long)tab[width/2 - 1 - t] - tab[width/2 - 1 + t]) <= 1, 1);
+	ASSERT_EQUAL("%d", tab[width - 1], 0);
+	free(tab);
+}
+TEST(test_gen_decimatetab);
+
 test void test_gen_impulsetab(void)
 {
 	const long n_shift = 3;
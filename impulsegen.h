@@ -14,5 +14,6 @@
 #define IMPULSE_HEIGHT (double)(1 << 24)
 
 int32_t *gen_impulsetab(long w_shift, long n_shift, double cutoff);
+int32_t *gen_decimatetab(long width, long phases, double step, double cutoff);
 
 #endif /* _IMPULSEGEN_H_ */
@@ -0,0 +1,295 @@
+/*
+ * gbsplay is a Gameboy sound player
+ *
+ * 2003-2021 (C) by Tobias Diedrich <ranma+gbsplay@tdiedrich.de>
+ *                  Christian Garbs <mitch@cgarbs.de>
+ *
+ * Licensed under GNU GPL v1 or, at your option, any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "lencache.h"
+#include "test.h"
+
+/*
+ * The cache file is a header followed by fixed size records that are
+ * only ever appended, all little endian.  A later record for the same
+ * subsong replaces the earlier one.  A record cut short by an
+ * interrupted write is padded by the next append and then fails its
+ * check byte.
+ */
+#define LENCACHE_MAGIC   "GBSL"
+#define LENCACHE_VERSION 1
+#define LENCACHE_HEADER  8
+#define LENCACHE_RECORD  32
+
+struct lencache {
+	char *path;
+	struct lencache_entry *entries;
+	long count;
+	long alloc;
+	long *table;  /* entry index + 1, 0 if free */
+	long mask;
+};
+
+static void le_put(uint8_t *ptr, uint64_t val, long bytes)
+{
+	long i;
+
+	for (i=0; i<bytes; i++)
+		ptr[i] = val >> (8 * i);
+}
+
+static uint64_t le_get(const uint8_t *ptr, long bytes)
+{
+	uint64_t val = 0;
+	long i;
+
+	for (i=bytes-1; i>=0; i--)
+		val = val << 8 | ptr[i];
+	return val;
+}
+
+static uint8_t lencache_check(const uint8_t *rec)
+{
+	uint8_t check = 0x5a;
+	long i;
+
+	for (i=0; i<LENCACHE_RECORD; i++) {
+		if (i != 11)
+			check = (check << 1 | check >> 7) ^ rec[i];
+	}
+	return check;
+}
+
+static void lencache_encode(uint8_t *rec, const struct lencache_entry *e)
+{
+	le_put(&rec[0], e->crc, 4);
+	le_put(&rec[4], e->size, 4);
+	rec[8] = e->subsong;
+	rec[9] = e->flags;
+	rec[10] = e->channels;
+	le_put(&rec[12], e->len, 4);
+	le_put(&rec[16], e->loop_start, 8);
+	le_put(&rec[24], e->loop_length, 8);
+	rec[11] = lencache_check(rec);
+}
+
+static void lencache_decode(struct lencache_entry *e, const uint8_t *rec)
+{
+	e->crc = le_get(&rec[0], 4);
+	e->size = le_get(&rec[4], 4);
+	e->subsong = rec[8];
+	e->flags = rec[9];
+	e->channels = rec[10];
+	e->len = le_get(&rec[12], 4);
+	e->loop_start = (int64_t)le_get(&rec[16], 8);
+	e->loop_length = (int64_t)le_get(&rec[24], 8);
+}
+
+static bool lencache_same(const struct lencache_entry *a, const struct lencache_entry *b)
+{
+	return a->crc == b->crc && a->size == b->size && a->subsong == b->subsong &&
+		a->flags == b->flags && a->channels == b->channels && a->len == b->len &&
+		a->loop_start == b->loop_start && a->loop_length == b->loop_length;
+}
+
+static long *lencache_slot(const struct lencache *cache, uint32_t crc, uint32_t size, long subsong)
+{
+	uint64_t hash = ((uint64_t)crc << 32 | size) ^ (uint64_t)subsong << 56;
+	long i;
+
+	hash *= 0x9e3779b97f4a7c15ULL;
+	for (i = hash >> 32 & cache->mask; cache->table[i]; i = (i + 1) & cache->mask) {
+		const struct lencache_entry *e = &cache->entries[cache->table[i] - 1];
+		if (e->crc == crc && e->size == size && e->subsong == subsong)
+			break;
+	}
+	return &cache->table[i];
+}
+
+/* Add or replace an entry in memory. */
+static bool lencache_insert(struct lencache *cache, const struct lencache_entry *entry)
+{
+	long *slot;
+
+	if (cache->count == cache->alloc) {
+		long alloc = cache->alloc ? 2 * cache->alloc : 256;
+		struct lencache_entry *entries = realloc(cache->entries, alloc * sizeof(*entries));
+		long *table;
+		long i;
+
+		if (entries == NULL)
+			return false;
+		cache->entries = entries;
+		/* at most half full, so probing stays short */
+		table = calloc(2 * alloc, sizeof(*table));
+		if (table == NULL)
+			return false;
+		free(cache->table);
+		cache->table = table;
+		cache->mask = 2 * alloc - 1;
+		cache->alloc = alloc;
+		for (i=0; i<cache->count; i++) {
+			const struct lencache_entry *e = &cache->entries[i];
+			*lencache_slot(cache, e->crc, e->size, e->subsong) = i + 1;
+		}
+	}
+
+	slot = lencache_slot(cache, entry->crc, entry->size, entry->subsong);
+	if (*slot == 0)
+		*slot = ++cache->count;
+	cache->entries[*slot - 1] = *entry;
+	return true;
+}
+
+void lencache_close(struct lencache *cache)
+{
+	if (cache == NULL)
+		return;
+	free(cache->path);
+	free(cache->entries);
+	free(cache->table);
+	free(cache);
+}
+
+struct lencache *lencache_open(const char *path)
+{
+	uint8_t rec[LENCACHE_RECORD];
+	struct lencache_entry entry;
+	struct lencache *cache;
+	FILE *f;
+	bool ok = true;
+
+	if ((cache = calloc(1, sizeof(*cache))) == NULL)
+		return NULL;
+
+	if ((f = fopen(path, "rb")) != NULL) {
+		if (fread(rec, LENCACHE_HEADER, 1, f) != 1 ||
+		    memcmp(rec, LENCACHE_MAGIC, 4) != 0 ||
+		    le_get(&rec[4], 4) != LENCACHE_VERSION)
+			ok = false;
+		while (ok && fread(rec, LENCACHE_RECORD, 1, f) == 1) {
+			if (rec[11] != lencache_check(rec))
+				continue;
+			lencache_decode(&entry, rec);
+			ok = lencache_insert(cache, &entry);
+		}
+		fclose(f);
+	}
+	if (ok)
+		ok = (cache->path = strdup(path)) != NULL;
+	if (!ok) {
+		lencache_close(cache);
+		return NULL;
+	}
+	return cache;
+}
+
+/* Copies the entry out, false if the subsong is not in the cache. */
+bool lencache_find(const struct lencache *cache, uint32_t crc, uint32_t size, long subsong, struct lencache_entry *entry)
+{
+	long *slot;
+
+	if (cache->count == 0)
+		return false;
+	slot = lencache_slot(cache, crc, size, subsong);
+	if (*slot == 0)
+		return false;
+	*entry = cache->entries[*slot - 1];
+	return true;
+}
+
+bool lencache_store(struct lencache *cache, const struct lencache_entry *entry)
+{
+	struct lencache_entry old;
+	uint8_t rec[LENCACHE_HEADER + 2 * LENCACHE_RECORD];
+	long size, ofs = 0;
+	FILE *f;
+	bool ok;
+
+	if (lencache_find(cache, entry->crc, entry->size, entry->subsong, &old) &&
+	    lencache_same(&old, entry))
+		return true;
+
+	if ((f = fopen(cache->path, "ab")) == NULL)
+		return false;
+	if (fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) < 0) {
+		fclose(f);
+		return false;
+	}
+	memset(rec, 0, sizeof(rec));
+	if (size == 0) {
+		memcpy(rec, LENCACHE_MAGIC, 4);
+		le_put(&rec[4], LENCACHE_VERSION, 4);
+		ofs = LENCACHE_HEADER;
+	} else if (size > LENCACHE_HEADER && (size - LENCACHE_HEADER) % LENCACHE_RECORD) {
+		/* complete a cut off record to get back in step */
+		ofs = LENCACHE_RECORD - (size - LENCACHE_HEADER) % LENCACHE_RECORD;
+	}
+	lencache_encode(&rec[ofs], entry);
+	ok = fwrite(rec, ofs + LENCACHE_RECORD, 1, f) == 1;
+	ok = fclose(f) == 0 && ok;
+	return ok && lencache_insert(cache, entry);
+}
+
+test void test_lencache(void)
+{
+	const char *name = "lencache.tmp";
+	struct lencache_entry a = { 0xc2809587, 0x4600, 0, LENCACHE_LOOP, 0x0f, 183823, 240582912, 512354304 };
+	struct lencache_entry b = { 0xc2809587, 0x4600, 1, LENCACHE_SILENCE, 0x01, 2048, 0, 0 };
+	struct lencache_entry e;
+	struct lencache *cache;
+	FILE *f;
+
+	remove(name);
+	cache = lencache_open(name);
+	ASSERT_EQUAL("%d", cache != NULL, true);
+	ASSERT_EQUAL("%d", lencache_find(cache, a.crc, a.size, 0, &e), false);
+	ASSERT_EQUAL("%d", lencache_store(cache, &a), true);
+	ASSERT_EQUAL("%d", lencache_store(cache, &b), true);
+	b.len = 4096;
+	ASSERT_EQUAL("%d", lencache_store(cache, &b), true);
+	lencache_close(cache);
+
+	/* the last record wins after reading the file back */
+	cache = lencache_open(name);
+	ASSERT_EQUAL("%d", cache != NULL, true);
+	ASSERT_EQUAL("%d", lencache_find(cache, a.crc, a.size, 0, &e) && lencache_same(&e, &a), true);
+	ASSERT_EQUAL("%d", lencache_find(cache, b.crc, b.size, 1, &e), true);
+	ASSERT_EQUAL("%ld", (long)e.len, 4096L);
+	ASSERT_EQUAL("%d", lencache_find(cache, a.crc, a.size + 1, 0, &e), false);
+	ASSERT_EQUAL("%d", lencache_find(cache, a.crc, a.size, 2, &e), false);
+	lencache_close(cache);
+
+	/* an interrupted append loses only its own record */
+	f = fopen(name, "ab");
+	fwrite("\x87\x95\x80\xc2\x00\x46\x00\x00\x02", 9, 1, f);
+	fclose(f);
+	cache = lencache_open(name);
+	ASSERT_EQUAL("%d", cache != NULL, true);
+	ASSERT_EQUAL("%d", lencache_find(cache, b.crc, b.size, 1, &e), true);
+	ASSERT_EQUAL("%d", lencache_find(cache, a.crc, a.size, 2, &e), false);
+	b.subsong = 3;
+	ASSERT_EQUAL("%d", lencache_store(cache, &b), true);
+	lencache_close(cache);
+	cache = lencache_open(name);
+	ASSERT_EQUAL("%d", cache != NULL, true);
+	ASSERT_EQUAL("%d", lencache_find(cache, a.crc, a.size, 2, &e), false);
+	ASSERT_EQUAL("%d", lencache_find(cache, b.crc, b.size, 3, &e) && lencache_same(&e, &b), true);
+	lencache_close(cache);
+
+	/* other files are left alone */
+	f = fopen(name, "wb");
+	fwrite("not a cache", 11, 1, f);
+	fclose(f);
+	ASSERT_EQUAL("%p", (void *)lencache_open(name), NULL);
+
+	remove(name);
+}
+TEST(test_lencache);
+TEST_EOF;
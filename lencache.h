@@ -0,0 +1,38 @@
+/*
+ * gbsplay is a Gameboy sound player
+ *
+ * 2003-2021 (C) by Tobias Diedrich <ranma+gbsplay@tdiedrich.de>
+ *                  Christian Garbs <mitch@cgarbs.de>
+ *
+ * Licensed under GNU GPL v1 or, at your option, any later version.
+ */
+
+#ifndef _LENCACHE_H_
+#define _LENCACHE_H_
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+#define LENCACHE_LOOP    0x01  /* loop_start and loop_length are known */
+#define LENCACHE_SILENCE 0x02  /* the subsong ends in silence after len */
+
+struct lencache;
+
+/* What is known about one subsong of one file, see gbs_set_cache(). */
+struct lencache_entry {
+	uint32_t crc;        /* of the whole file */
+	uint32_t size;       /* file size, against CRC collisions */
+	uint8_t subsong;
+	uint8_t flags;
+	uint8_t channels;    /* bit n set if channel n+1 was heard */
+	uint32_t len;        /* GBS_LEN_DIV (1024) == 1 second */
+	long long loop_start;   /* cycles */
+	long long loop_length;  /* cycles */
+};
+
+struct lencache *lencache_open(const char *path);
+void lencache_close(struct lencache *cache);
+bool lencache_find(const struct lencache *cache, uint32_t crc, uint32_t size, long subsong, struct lencache_entry *entry);
+bool lencache_store(struct lencache *cache, const struct lencache_entry *entry);
+
+#endif
@@ -59,7 +59,9 @@ struct gbs_metadata {
 /**
  * Sound output buffer.  Contains the next bit of calculated sound
  * output that can be passed to an audio driver or be processed
- * otherwise.
+ * otherwise.  The samples are interleaved stereo in the format set
+ * via gbs_set_output_format(), data has to be cast accordingly for
+ * formats other than OUTPUT_S16.  pos counts stereo samples.
  */
 struct gbs_output_buffer {
 	int16_t *data;
@@ -104,6 +106,18 @@ struct gbs_status {
 	struct gbs_channel_status ch[4];
 };
 
+/**
+ * Loop of a subsong as found by gbs_detect_loop().  Both values are
+ * hardware cycles (4194304 per second).  A subsong that ends in
+ * silence has a length of 0 and starts to "loop" where the sound
+ * stopped.
+ */
+struct gbs_loop {
+	long long start;   /* cycles from the start of the subsong */
+	long long length;  /* cycles per loop, 0 at the end of the subsong */
+	long channels;     /* bit n set if channel n+1 was heard */
+};
+
 //
 //////  enums
 //
@@ -118,6 +132,66 @@ enum gbs_filter_type {
 	FILTER_CGB, /**< Gameboy Color high-pass filter */
 };
 
+/**
+ * Resampling quality.  Selects the band-limited impulse table used to
+ * convert the Gameboy sound output to the output sample rate.
+ */
+enum gbs_quality {
+	QUALITY_DRAFT,  /**< 16 taps, for slow machines */
+	QUALITY_NORMAL, /**< 32 taps (default) */
+	QUALITY_HQ,     /**< 64 taps, for archival renders */
+};
+
+/**
+ * Synthesis backend.  Both sound the same, they differ in what the
+ * time is spent on, so the cheaper one can be picked per file.
+ */
+enum gbs_synthesis {
+	SYNTH_STEP,       /**< band-limited step per level change (default), cost grows with the number of level changes */
+	SYNTH_OVERSAMPLE, /**< levels at 262144Hz decimated by a polyphase filter, cost only depends on the playing time */
+};
+
+/**
+ * What gets rendered.  Without sound the registers, counters, channel
+ * status and IO callbacks behave exactly the same, for exporters and
+ * analysis that never look at the samples.
+ */
+enum gbs_render_mode {
+	RENDER_SOUND,     /**< render samples for the sound and stem callbacks (default) */
+	RENDER_REGISTERS, /**< no samples and no sound callbacks, peaks are estimated from the registers */
+};
+
+/**
+ * Output sample format.  Selects the sample format of the sound
+ * output buffer.  The 32 bit formats keep the fractional bits that
+ * OUTPUT_S16 drops.
+ */
+enum gbs_output_format {
+	OUTPUT_S16,   /**< signed 16 bit integer (default) */
+	OUTPUT_S32,   /**< signed 32 bit integer */
+	OUTPUT_FLOAT, /**< 32 bit float, 1.0 is the OUTPUT_S16 full scale, not clipped */
+};
+
+/**
+ * Output byte order.  Selects the byte order of the samples in the
+ * sound output buffer.
+ */
+enum gbs_output_endian {
+	OUTPUT_ENDIAN_NATIVE, /**< byte order of the host (default) */
+	OUTPUT_ENDIAN_LITTLE, /**< little endian */
+	OUTPUT_ENDIAN_BIG,    /**< big endian */
+};
+
+/**
+ * CPU core.  Selects how the emulated CPU executes the GBS code.
+ * All cores produce identical output.
+ */
+enum gbs_cpu_core {
+	CPU_CORE_INTERP, /**< plain instruction interpreter */
+	CPU_CORE_CACHED, /**< interpreter with predecoded ROM code blocks */
+	CPU_CORE_JIT,    /**< ROM code translated to native x86-64 code, only available if built with JIT support */
+};
+
 //
 //////  typedefs
 //
@@ -158,6 +232,21 @@ typedef void (*gbs_step_cb)(struct gbs* const gbs, const cycles_t cycles, const
  */
 typedef void (*gbs_sound_cb)(struct gbs* const gbs, struct gbs_output_buffer *buf, void *priv);
 
+/**
+ * Stem callback.  This callback gets executed right after the sound
+ * callback and covers the same samples, but with every channel
+ * rendered into a separate stereo buffer.  Stems are rendered in the
+ * same emulation pass as the mix and ignore the channel mute flags.
+ * gbs_set_stem_callback() returns 0 if the stem buffers could not be
+ * allocated and the callback is not installed.  If they fail to
+ * allocate later in gbs_configure_output(), the callback is dropped.
+ *
+ * @param gbs   reference to the gbs instance that executed the IO
+ * @param bufs  array of 4 output buffers, one per channel
+ * @param priv  opaque private context pointer for the callback handler
+ */
+typedef void (*gbs_stem_cb)(struct gbs* const gbs, struct gbs_output_buffer bufs[], void *priv);
+
 /**
  * Next subsong callback.  This callback gets executed when the
  * current subsong has finished playing.  The caller can for example
@@ -201,11 +290,96 @@ void gbs_set_nextsubsong_cb(struct gbs* const gbs, gbs_nextsubsong_cb cb, void *
 void gbs_set_io_callback(struct gbs* const gbs, gbs_io_cb fn, void *priv);
 void gbs_set_step_callback(struct gbs* const gbs, gbs_step_cb fn, void *priv);
 void gbs_set_sound_callback(struct gbs* const gbs, gbs_sound_cb fn, void *priv);
+long gbs_set_stem_callback(struct gbs* const gbs, gbs_stem_cb fn, void *priv);
 long gbs_set_filter(struct gbs* const gbs, enum gbs_filter_type type);
+long gbs_set_cpu_core(struct gbs* const gbs, enum gbs_cpu_core core);
+long gbs_set_quality(struct gbs* const gbs, enum gbs_quality quality);
+long gbs_set_synthesis(struct gbs* const gbs, enum gbs_synthesis synthesis);
+long gbs_set_render_mode(struct gbs* const gbs, enum gbs_render_mode mode);
+long gbs_set_output_format(struct gbs* const gbs, enum gbs_output_format format, enum gbs_output_endian endian);
 void gbs_set_loop_mode(struct gbs* const gbs, enum gbs_loop_mode mode);
 void gbs_cycle_loop_mode(struct gbs* const gbs);
 long gbs_toggle_mute(struct gbs* const gbs, long channel);
 void gbs_close(struct gbs* const gbs);
 long gbs_write(const struct gbs* const gbs, const char* const name);
 
+/**
+ * Save a snapshot of the complete emulator state.  The snapshot is
+ * written to buf only if it fits into size bytes, so the required
+ * size can be queried with a NULL buffer first.  Settings like the
+ * channel mute flags or the filter are not part of the snapshot.
+ *
+ * Returns 0 if no output has been configured yet.
+ *
+ * @param gbs   the gbs instance to save
+ * @param buf   buffer for the snapshot or NULL
+ * @param size  size of buf in bytes
+ * @return size of the snapshot in bytes or 0 on error
+ */
+long gbs_save_state(struct gbs* const gbs, void *buf, long size);
+
+/**
+ * Restore a snapshot taken by gbs_save_state().  Playback continues
+ * exactly where the snapshot was taken.  The snapshot only loads into
+ * an instance of the same file with the same sample rate, buffer
+ * size, quality and synthesis settings and stems enabled or not.
+ *
+ * Returns false without changing anything if the snapshot does not
+ * match or is damaged.
+ *
+ * @param gbs   the gbs instance to restore
+ * @param buf   snapshot from gbs_save_state()
+ * @param size  size of the snapshot in bytes
+ * @return true on success, false on error
+ */
+long gbs_load_state(struct gbs* const gbs, const void *buf, long size);
+
+/**
+ * Seek to a position in the current subsong.  The emulation runs
+ * without rendering up to the position, and every 10 seconds a
+ * snapshot is kept, so later seeks in either direction only catch up
+ * from the nearest one.  No callbacks are called while seeking, the
+ * output restarts from silence at the new position.
+ *
+ * @param gbs     the gbs instance to seek
+ * @param millis  position from the start of the subsong in milliseconds
+ * @return true on success, false on error
+ */
+long gbs_seek(struct gbs* const gbs, long millis);
+
+/**
+ * Find the exact loop of a subsong.  The subsong is emulated without
+ * rendering and without callbacks, and the machine state is hashed on
+ * every interrupt until a state repeats for a whole loop.  On success
+ * the subsong length becomes the loop start plus one loop, or the end
+ * of the sound for subsongs that stop, see gbs_get_status().
+ *
+ * The subsong is left initialized at its start.  With a cache set by
+ * gbs_set_cache() every subsong is only examined once.
+ *
+ * @param gbs          the gbs instance to examine
+ * @param subsong      subsong number, -1 for the default subsong
+ * @param max_seconds  give up after this much playing time
+ * @param loop         filled with the loop on success
+ * @return true if a loop was found, false otherwise
+ */
+long gbs_detect_loop(struct gbs* const gbs, long subsong, long max_seconds, struct gbs_loop *loop);
+
+/**
+ * Keep subsong lengths in a cache file, keyed by the CRC32 and size
+ * of the file.  The lengths found by silence detection and
+ * gbs_detect_loop() are appended to the cache, and the lengths known
+ * for this file are taken over right away, so set the cache before
+ * gbs_init().  Every gbs instance has its own view of the cache,
+ * which is disabled by default and closed by gbs_close().
+ *
+ * A missing cache file is created by the first length stored, the
+ * directory has to exist.
+ *
+ * @param gbs   the gbs instance to use the cache for
+ * @param path  cache file, NULL to disable the cache
+ * @return true on success, false if the file is not a length cache
+ */
+long gbs_set_cache(struct gbs* const gbs, const char *path);
+
 #endif
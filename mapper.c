@@ -12,6 +12,7 @@
 #include "common.h"
 #include "gbcpu.h"
 #include "mapper.h"
+#include "gbstate.h"
 
 #define MAPPER_ROMBANK_SIZE 0x4000
 #define MAPPER_ROMBANK_MASK (MAPPER_ROMBANK_SIZE - 1)
@@ -25,6 +26,9 @@ struct bank {
 	uint32_t mask;
 	uint32_t banksize;
 	long enable;
+	long writable;
+	uint32_t first_page;
+	uint32_t last_page;
 	struct mapper *mapper;
 };
 
@@ -33,6 +37,7 @@ struct mbc1_regs {
 };
 
 struct mapper {
+	struct gbcpu *gbcpu;
 	const uint8_t *rom;
 	size_t rom_size;
 	size_t ram_size;
@@ -46,17 +51,50 @@ struct mapper {
 	uint8_t ram[MAPPER_MAX_EXTRAM_SIZE];
 };
 
+static uint32_t bank_get(void *priv, uint32_t addr);
+
 static void bank_init(struct bank *b, struct mapper *m, uint32_t banksize)
 {
 	b->mapper = m;
 	b->banksize = banksize;
 	b->mask = banksize - 1;
 	b->enable = 1;
+	b->first_page = 1;
+	b->last_page = 0;
+}
+
+/*
+ * Point the CPU page table directly at the currently mapped bank data.
+ * Pages not fully backed by data (or a disabled bank) keep using
+ * bank_get()/bank_put(); ROM writes always go to the MBC callback.
+ */
+static void bank_update_pages(struct bank *b)
+{
+	struct gbcpu *gbcpu = b->mapper->gbcpu;
+	uint32_t page;
+
+	for (page = b->first_page; page <= b->last_page; page++) {
+		uint32_t maddr = (page << 8) & b->mask;
+		uint8_t *ptr = NULL;
+		if (b->enable && b->data && maddr + 0x100 <= b->size)
+			ptr = b->data + maddr;
+		gbcpu_map_page(gbcpu, page, b, ptr, b->writable ? ptr : NULL);
+	}
 }
 
-static struct mapper *mapper_new(const uint8_t *rom, size_t rom_size, size_t ram_size)
+static void bank_add_mem(struct bank *b, uint32_t start, uint32_t end, gbcpu_put_fn putfn, long writable)
+{
+	gbcpu_add_mem(b->mapper->gbcpu, start, end, putfn, bank_get, b);
+	b->first_page = start;
+	b->last_page = end;
+	b->writable = writable;
+	bank_update_pages(b);
+}
+
+static struct mapper *mapper_new(struct gbcpu *gbcpu, const uint8_t *rom, size_t rom_size, size_t ram_size)
 {
 	struct mapper *m = calloc(sizeof(*m), 1);
+	m->gbcpu = gbcpu;
 	m->rom = rom;
 	m->rom_size = rom_size;
 	m->ram_size = ram_size;
@@ -70,14 +108,15 @@ static struct mapper *mapper_new(const uint8_t *rom, size_t rom_size, size_t ram
 static void mapper_map(struct bank *b, uint8_t *data, size_t size, long bank)
 {
 	size_t ofs = bank * b->banksize;
-	size_t len = size - ofs;
-	if (len <= 0) {
+	if (ofs >= size) {
 		WARN_ONCE("Bank %ld out of range (0-%ld)!\n", bank, size / b->banksize);
 		b->data = NULL;
 		b->size = 0;
+	} else {
+		b->data = data + ofs;
+		b->size = size - ofs;
 	}
-	b->data = data + ofs;
-	b->size = size - ofs;
+	bank_update_pages(b);
 }
 
 static void mapper_map_rom(struct bank *b, long bank)
@@ -96,7 +135,7 @@ static uint32_t bank_get(void *priv, uint32_t addr)
 {
 	struct bank *b = priv;
 	uint32_t maddr = addr & b->mask;
-	if (maddr > b->size || b->enable == 0) {
+	if (maddr >= b->size || b->enable == 0) {
 		return 0xff;
 	}
 	return b->data[maddr];
@@ -106,7 +145,7 @@ static void bank_put(void *priv, uint32_t addr, uint8_t val)
 {
 	struct bank *b = priv;
 	uint32_t maddr = addr & b->mask;
-	if (maddr > b->size || b->enable == 0) {
+	if (maddr >= b->size || b->enable == 0) {
 		return;
 	}
 	b->data[maddr] = val;
@@ -133,7 +172,7 @@ static void mbc1_rom_put(void *priv, uint32_t addr, uint8_t val)
 	/* store reg value */
 	m->mbc1.reg[addr / 0x2000] = val;
 
-	/* update mbc1 state */
+	/* update mbc1 state, the mapping below updates the page table */
 	m->extram.enable = m->mbc1.reg[0] == 0x0a;
 	rombank = m->mbc1.reg[1] & 0x1f;
 	rombank += rombank == 0;
@@ -172,7 +211,7 @@ static void mbc3_rom_put(void *priv, uint32_t addr, uint8_t val)
 	/* store reg value */
 	m->mbc1.reg[addr / 0x2000] = val;
 
-	/* update MBC3 state */
+	/* update MBC3 state, the mapping below updates the page table */
 	m->extram.enable = m->mbc1.reg[0] == 0x0a;
 	rombank = m->mbc1.reg[1] & 0x7f;
 	rombank += rombank == 0;
@@ -184,25 +223,25 @@ static void mbc3_rom_put(void *priv, uint32_t addr, uint8_t val)
 }
 
 struct mapper *mapper_gbs(struct gbcpu *gbcpu, const uint8_t *rom, size_t size) {
-	struct mapper *m = mapper_new(rom, size, MAPPER_RAMBANK_SIZE);
+	struct mapper *m = mapper_new(gbcpu, rom, size, MAPPER_RAMBANK_SIZE);
 	m->extram.enable = 1;
 	mapper_map_rom(&m->rom_lower, 0);
 	mapper_map_rom(&m->rom_upper, 1);
 	mapper_map_ram(&m->extram, 0);
-	gbcpu_add_mem(gbcpu, 0x00, 0x3f, gbs_rom_put, bank_get, &m->rom_lower);
-	gbcpu_add_mem(gbcpu, 0x40, 0x7f, gbs_rom_put, bank_get, &m->rom_upper);
-	gbcpu_add_mem(gbcpu, 0xa0, 0xbf, bank_put, bank_get, &m->extram);
+	bank_add_mem(&m->rom_lower, 0x00, 0x3f, gbs_rom_put, 0);
+	bank_add_mem(&m->rom_upper, 0x40, 0x7f, gbs_rom_put, 0);
+	bank_add_mem(&m->extram, 0xa0, 0xbf, bank_put, 1);
 	return m;
 }
 
 struct mapper *mapper_gbr(struct gbcpu *gbcpu, const uint8_t *rom, size_t size, uint8_t bank_lower, uint8_t bank_upper) {
-	struct mapper *m = mapper_new(rom, size, MAPPER_RAMBANK_SIZE);
+	struct mapper *m = mapper_new(gbcpu, rom, size, MAPPER_RAMBANK_SIZE);
 	mapper_map_rom(&m->rom_lower, bank_lower);
 	mapper_map_rom(&m->rom_upper, bank_upper);
 	mapper_map_ram(&m->extram, 0);
-	gbcpu_add_mem(gbcpu, 0x00, 0x3f, gbs_rom_put, bank_get, &m->rom_lower);
-	gbcpu_add_mem(gbcpu, 0x40, 0x7f, gbs_rom_put, bank_get, &m->rom_upper);
-	gbcpu_add_mem(gbcpu, 0xa0, 0xbf, bank_put, bank_get, &m->extram);
+	bank_add_mem(&m->rom_lower, 0x00, 0x3f, gbs_rom_put, 0);
+	bank_add_mem(&m->rom_upper, 0x40, 0x7f, gbs_rom_put, 0);
+	bank_add_mem(&m->extram, 0xa0, 0xbf, bank_put, 1);
 	return m;
 }
 
@@ -236,16 +275,16 @@ struct mapper *mapper_gb(struct gbcpu *gbcpu, const uint8_t *rom, size_t size, u
 	}
 
 	assert(ram_size <= MAPPER_MAX_EXTRAM_SIZE);
-	m = mapper_new(rom, size, ram_size);
+	m = mapper_new(gbcpu, rom, size, ram_size);
 
 	mapper_map_rom(&m->rom_lower, 0);
 	mapper_map_rom(&m->rom_upper, 1);
-	gbcpu_add_mem(gbcpu, 0x00, 0x3f, rom_put, bank_get, &m->rom_lower);
-	gbcpu_add_mem(gbcpu, 0x40, 0x7f, rom_put, bank_get, &m->rom_upper);
+	bank_add_mem(&m->rom_lower, 0x00, 0x3f, rom_put, 0);
+	bank_add_mem(&m->rom_upper, 0x40, 0x7f, rom_put, 0);
 
 	if (ram_size > 0) {
 		mapper_map_ram(&m->extram, 0);
-		gbcpu_add_mem(gbcpu, 0xa0, 0xbf, bank_put, bank_get, &m->extram);
+		bank_add_mem(&m->extram, 0xa0, 0xbf, bank_put, 1);
 	}
 
 	return m;
@@ -258,3 +297,35 @@ void mapper_free(struct mapper *m) {
 void mapper_init(struct mapper *m) {
 	memset(m->ram, 0, sizeof(m->ram));
 }
+
+static void bank_state(struct bank *b, struct gbstate *st, uint8_t *base, size_t size)
+{
+	int32_t bank = b->data ? (int32_t)((b->data - base) / b->banksize) : -1;
+	bool enable = b->enable;
+
+	gbstate_i32(st, &bank);
+	gbstate_bool(st, &enable);
+	if (!st->load || st->error)
+		return;
+
+	if (bank >= 0 && (size_t)bank * b->banksize >= size) {
+		st->error = true;
+		return;
+	}
+	b->enable = enable;
+	if (bank < 0) {
+		b->data = NULL;
+		b->size = 0;
+		bank_update_pages(b);
+	} else {
+		mapper_map(b, base, size, bank);
+	}
+}
+
+void mapper_state(struct mapper *m, struct gbstate *st) {
+	bank_state(&m->rom_lower, st, (uint8_t*)m->rom, m->rom_size);
+	bank_state(&m->rom_upper, st, (uint8_t*)m->rom, m->rom_size);
+	bank_state(&m->extram, st, m->ram, m->ram_size);
+	gbstate_bytes(st, m->mbc1.reg, sizeof(m->mbc1.reg));
+	gbstate_bytes(st, m->ram, m->ram_size);
+}
@@ -12,6 +12,7 @@
 #include <inttypes.h>
 
 struct gbcpu;
+struct gbstate;
 struct mapper;
 
 struct mapper *mapper_gbs(struct gbcpu *gbcpu, const uint8_t *rom, size_t size);
@@ -20,5 +21,6 @@ struct mapper *mapper_gb(struct gbcpu *gbcpu, const uint8_t *rom, size_t size, u
 void mapper_lockout(struct mapper *m);
 void mapper_free(struct mapper *m);
 void mapper_init(struct mapper *m);
+void mapper_state(struct mapper *m, struct gbstate *st);
 
 #endif
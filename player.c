@@ -13,6 +13,7 @@
 #include <unistd.h>
 #include <time.h>
 #include <strings.h>
+#include <sys/stat.h>
 
 #include "common.h"
 #include "util.h"
@@ -37,6 +38,53 @@ const struct filter_map FILTERS[] = {
 	{ NULL, -1 },
 };
 
+struct cpu_core_map {
+	char *name;
+	enum gbs_cpu_core core;
+};
+
+const struct cpu_core_map CPU_CORES[] = {
+	{ CFG_CPU_INTERP, CPU_CORE_INTERP },
+	{ CFG_CPU_CACHED, CPU_CORE_CACHED },
+	{ CFG_CPU_JIT,    CPU_CORE_JIT },
+	{ NULL, -1 },
+};
+
+struct quality_map {
+	char *name;
+	enum gbs_quality quality;
+};
+
+const struct quality_map QUALITIES[] = {
+	{ CFG_QUALITY_DRAFT,  QUALITY_DRAFT },
+	{ CFG_QUALITY_NORMAL, QUALITY_NORMAL },
+	{ CFG_QUALITY_HQ,     QUALITY_HQ },
+	{ NULL, -1 },
+};
+
+struct synthesis_map {
+	char *name;
+	enum gbs_synthesis synthesis;
+};
+
+const struct synthesis_map SYNTHESES[] = {
+	{ CFG_SYNTH_STEP,       SYNTH_STEP },
+	{ CFG_SYNTH_OVERSAMPLE, SYNTH_OVERSAMPLE },
+	{ NULL, -1 },
+};
+
+struct format_map {
+	char *name;
+	enum gbs_output_format format;
+};
+
+const struct format_map FORMATS[] = {
+	{ CFG_FORMAT_S16,   OUTPUT_S16 },
+	{ CFG_FORMAT_S32,   OUTPUT_S32 },
+	{ CFG_FORMAT_FLOAT, OUTPUT_FLOAT },
+	{ NULL, -1 },
+};
+
 static long *subsong_playlist;
 static long subsong_playlist_idx = 0;
 static long pause_mode = 0;
@@ -49,9 +97,11 @@ plugout_pause_fn sound_pause;
 plugout_io_fn    sound_io;
 plugout_step_fn  sound_step;
 plugout_write_fn sound_write;
+plugout_write_stem_fn sound_write_stem;
 plugout_close_fn sound_close;
 
 static struct plugout_cfg actual;
+static long frame_bytes;
 
 static long subsong_start = -1;
 static long subsong_stop = -1;
@@ -70,34 +120,34 @@ static struct gbs_output_buffer buf = {
 
 static struct timespec pause_wait_time;
 
-static void swap_endian(struct gbs_output_buffer *buf)
+static void iocallback(struct gbs *gbs, cycles_t cycles, uint32_t addr, uint8_t value, void *priv)
 {
-	unsigned long i;
+	UNUSED(gbs);
+	UNUSED(priv);
 
-	for (i=0; i<buf->bytes/sizeof(uint16_t); i++) {
-		uint16_t x = buf->data[i];
-		buf->data[i] = ((x & 0xff) << 8) | (x >> 8);
-	}
+	sound_io(cycles, addr, value);
 }
 
-static void iocallback(struct gbs *gbs, cycles_t cycles, uint32_t addr, uint8_t value, void *priv)
+static void callback(struct gbs *gbs, struct gbs_output_buffer *buf, void *priv)
 {
 	UNUSED(gbs);
 	UNUSED(priv);
 
-	sound_io(cycles, addr, value);
+	sound_write(buf->data, buf->pos*frame_bytes);
+	buf->pos = 0;
 }
 
-static void callback(struct gbs *gbs, struct gbs_output_buffer *buf, void *priv)
+static void stem_callback(struct gbs *gbs, struct gbs_output_buffer bufs[], void *priv)
 {
+	int ch;
+
 	UNUSED(gbs);
 	UNUSED(priv);
 
-	if (actual.endian != PLUGOUT_ENDIAN_NATIVE) {
-		swap_endian(buf);
+	for (ch=0; ch<4; ch++) {
+		sound_write_stem(ch, bufs[ch].data, bufs[ch].pos*frame_bytes);
+		bufs[ch].pos = 0;
 	}
-	sound_write(buf->data, buf->pos*2*sizeof(int16_t));
-	buf->pos = 0;
 }
 
 long *setup_playlist(long songs)
@@ -365,8 +415,10 @@ static void usage(long exitcode)
 		_("Usage: %s [OPTION]... [--] GBS-FILE [START-AT-SUBSONG [STOP-AFTER-SUBSONG] ]\n"
 		  "\n"
 		  "Available options are:\n"
+		  "  -C        select CPU core, interp, cached or jit (%s)\n"
 		  "  -E        endian, b == big, l == little, n == native (%s)\n"
 		  "  -f        set fadeout (%ld seconds)\n"
+		  "  -F        set sample format, s16, s32 or float (%s)\n"
 		  "  -g        set subsong gap (%ld seconds)\n"
 		  "  -h        display this help and exit\n"
 		  "  -H        set output high-pass type (%s)\n"
@@ -376,8 +428,10 @@ static void usage(long exitcode)
 		  "            'list' shows available plugins\n"
 		  "  -O        output filename pattern (%s)\n"
 		  "  -q        reduce verbosity\n"
+		  "  -Q        set resampling quality, draft, normal or hq (%s)\n"
 		  "  -r        set samplerate (%ldHz)\n"
 		  "  -R        set refresh delay (%ld milliseconds)\n"
+		  "  -S        set synthesis backend, step or oversample (%s)\n"
 		  "  -t        set subsong timeout (%ld seconds)\n"
 		  "  -T        set silence timeout (%ld seconds)\n"
 		  "  -v        increase verbosity\n"
@@ -387,14 +441,18 @@ static void usage(long exitcode)
 		  "  -1 to -4  mute a channel on startup\n"
 		  "  --        end options, next argument is GBS-FILE\n"),
 		myname,
+		cfg.cpu_core,
 		endian_str(cfg.requested_endian),
 		cfg.fadeout,
+		cfg.requested_format,
 		cfg.subsong_gap,
 		_(cfg.filter_type),
 		cfg.sound_name,
 		cfg.output_filename,
+		cfg.quality,
 		cfg.requested_rate,
 		cfg.refresh_delay,
+		cfg.synthesis,
 		cfg.subsong_timeout,
 		cfg.silence_timeout);
 	exit(exitcode);
@@ -404,7 +462,7 @@ static void parseopts(int *argc, char ***argv)
 {
 	long res;
 	myname = filename_only(*argv[0]);
-	while ((res = getopt(*argc, *argv, "1234c:E:f:g:hH:lLo:O:qr:R:t:T:vVzZ")) != -1) {
+	while ((res = getopt(*argc, *argv, "1234c:C:E:f:F:g:hH:lLo:O:qQ:r:R:S:t:T:vVzZ")) != -1) {
 		switch (res) {
 		default:
 			usage(1);
@@ -418,6 +476,9 @@ static void parseopts(int *argc, char ***argv)
 		case 'c':
 			cfg_parse(optarg);
 			break;
+		case 'C':
+			cfg.cpu_core = optarg;
+			break;
 		case 'E':
 			if (strcasecmp(optarg, "b") == 0) {
 				cfg.requested_endian = PLUGOUT_ENDIAN_BIG;
@@ -433,6 +494,9 @@ static void parseopts(int *argc, char ***argv)
 		case 'f':
 			sscanf(optarg, "%ld", &cfg.fadeout);
 			break;
+		case 'F':
+			cfg.requested_format = optarg;
+			break;
 		case 'g':
 			sscanf(optarg, "%ld", &cfg.subsong_gap);
 			break;
@@ -457,12 +521,18 @@ static void parseopts(int *argc, char ***argv)
 		case 'q':
 			cfg.verbosity -= 1;
 			break;
+		case 'Q':
+			cfg.quality = optarg;
+			break;
 		case 'r':
 			sscanf(optarg, "%ld", &cfg.requested_rate);
 			break;
 		case 'R':
 			sscanf(optarg, "%ld", &cfg.refresh_delay);
 			break;
+		case 'S':
+			cfg.synthesis = optarg;
+			break;
 		case 't':
 			sscanf(optarg, "%ld", &cfg.subsong_timeout);
 			break;
@@ -508,6 +578,7 @@ static void select_plugin(void)
 	sound_io = plugout->io;
 	sound_step = plugout->step;
 	sound_write = plugout->write;
+	sound_write_stem = plugout->write_stem;
 	sound_close = plugout->close;
 	sound_pause = plugout->pause;
 	sound_description = plugout->description;
@@ -526,6 +597,86 @@ static enum gbs_filter_type parse_filter(const char *filter_name) {
 	return -1;
 }
 
+static enum gbs_cpu_core parse_cpu_core(const char *core_name) {
+	for (const struct cpu_core_map *core = CPU_CORES; core->name != NULL; core++) {
+		if (strcasecmp(core_name, core->name) == 0) {
+			return core->core;
+		}
+	}
+	return -1;
+}
+
+static enum gbs_quality parse_quality(const char *quality_name) {
+	for (const struct quality_map *quality = QUALITIES; quality->name != NULL; quality++) {
+		if (strcasecmp(quality_name, quality->name) == 0) {
+			return quality->quality;
+		}
+	}
+	return -1;
+}
+
+static enum gbs_synthesis parse_synthesis(const char *synthesis_name) {
+	for (const struct synthesis_map *synthesis = SYNTHESES; synthesis->name != NULL; synthesis++) {
+		if (strcasecmp(synthesis_name, synthesis->name) == 0) {
+			return synthesis->synthesis;
+		}
+	}
+	return -1;
+}
+
+static long parse_format(const char *format_name, enum gbs_output_format *format) {
+	for (const struct format_map *entry = FORMATS; entry->name != NULL; entry++) {
+		if (strcasecmp(format_name, entry->name) == 0) {
+			*format = entry->format;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void make_dir(const char *path)
+{
+#ifdef HAVE_MINGW
+	mkdir(path);
+#else
+	mkdir(path, 0777);
+#endif
+}
+
+/* $XDG_CACHE_HOME/gbsplay/lengths.db, by default in ~/.cache */
+static void open_length_cache(struct gbs *gbs)
+{
+	const char *base = getenv("XDG_CACHE_HOME");
+	const char *suffix = "";
+	char *path, *sep;
+	long length;
+
+	if (base == NULL || *base == 0) {
+		base = getenv("HOME");
+		suffix = "/.cache";
+	}
+	if (base == NULL)
+		return;
+
+	length = strlen(base) + strlen(suffix) + sizeof("/gbsplay/lengths.db");
+	path = malloc(length);
+	if (path == NULL) {
+		fprintf(stderr, "%s\n", _("Memory allocation failed!"));
+		return;
+	}
+	snprintf(path, length, "%s%s/gbsplay/lengths.db", base, suffix);
+
+	/* create missing directories, existing ones fail harmlessly */
+	for (sep = strchr(path + 1, '/'); sep; sep = strchr(sep + 1, '/')) {
+		*sep = 0;
+		make_dir(path);
+		*sep = '/';
+	}
+	if (!gbs_set_cache(gbs, path))
+		fprintf(stderr, _("Could not use length cache %s\n"), path);
+	free(path);
+}
+
 struct gbs *common_init(int argc, char **argv)
 {
 	char *usercfg;
@@ -533,6 +684,7 @@ struct gbs *common_init(int argc, char **argv)
 	uint8_t songs;
 	uint8_t initial_subsong;
 	struct plugout_metadata metadata;
+	enum gbs_output_format requested_format;
 
 	i18n_init();
 
@@ -559,6 +711,14 @@ struct gbs *common_init(int argc, char **argv)
 	} else {
 		actual.endian = cfg.requested_endian;
 	}
+	if (!parse_format(cfg.requested_format, &requested_format)) {
+		fprintf(stderr, _("Invalid sample format \"%s\"\n"), cfg.requested_format);
+		exit(1);
+	}
+	actual.format = requested_format;
+	frame_bytes = actual.format == OUTPUT_S16 ? 2*sizeof(int16_t) : 2*sizeof(int32_t);
+	/* same default buffer length in samples for all formats */
+	buf.bytes = buf.bytes / (2*sizeof(int16_t)) * frame_bytes;
 	actual.rate = cfg.requested_rate;
 
 	metadata.player_name = myname;
@@ -576,6 +736,12 @@ struct gbs *common_init(int argc, char **argv)
 		exit(1);
 	}
 
+	if (actual.format != requested_format) {
+		fprintf(stderr, _("Unsupported sample format for output plugin \"%s\"\n"),
+		        cfg.sound_name);
+		exit(1);
+	}
+
 	if (cfg.requested_rate != actual.rate) {
 		fprintf(stderr, _("Requested rate %ldHz, got %dHz.\n"),
 			cfg.requested_rate, actual.rate);
@@ -599,15 +765,38 @@ struct gbs *common_init(int argc, char **argv)
 		exit(1);
 	}
 
+	if (cfg.length_cache)
+		open_length_cache(gbs);
+
 	if (sound_io)
 		gbs_set_io_callback(gbs, iocallback, NULL);
 	if (sound_write)
 		gbs_set_sound_callback(gbs, callback, NULL);
+	if (sound_write_stem && !gbs_set_stem_callback(gbs, stem_callback, NULL))
+		exit(1);
 	gbs_configure_output(gbs, &buf, actual.rate);
+	gbs_set_output_format(gbs, actual.format,
+			      actual.endian == PLUGOUT_ENDIAN_BIG ? OUTPUT_ENDIAN_BIG : OUTPUT_ENDIAN_LITTLE);
 	if (!gbs_set_filter(gbs, parse_filter(cfg.filter_type))) {
 		fprintf(stderr, _("Invalid filter type \"%s\"\n"), cfg.filter_type);
 		exit(1);
 	}
+	if (!gbs_set_cpu_core(gbs, parse_cpu_core(cfg.cpu_core))) {
+		fprintf(stderr, _("Invalid CPU core \"%s\"\n"), cfg.cpu_core);
+		exit(1);
+	}
+	if (!gbs_set_quality(gbs, parse_quality(cfg.quality))) {
+		fprintf(stderr, _("Invalid resampling quality \"%s\"\n"), cfg.quality);
+		exit(1);
+	}
+	if (!gbs_set_synthesis(gbs, parse_synthesis(cfg.synthesis))) {
+		fprintf(stderr, _("Invalid synthesis backend \"%s\"\n"), cfg.synthesis);
+		exit(1);
+	}
+	if (!sound_write && !sound_write_stem) {
+		/* exporters like iodumper, midi and vgm only need the registers */
+		gbs_set_render_mode(gbs, RENDER_REGISTERS);
+	}
 
 	/* sanitize commandline values */
 	songs = gbs_get_status(gbs)->songs;
@@ -29,6 +29,7 @@ extern plugout_pause_fn sound_pause;
 extern plugout_io_fn    sound_io;
 extern plugout_step_fn  sound_step;
 extern plugout_write_fn sound_write;
+extern plugout_write_stem_fn sound_write_stem;
 extern plugout_close_fn sound_close;
 
 struct displaytime {
@@ -16,6 +16,21 @@
 #define CFG_FILTER_DMG "dmg"
 #define CFG_FILTER_CGB "cgb"
 
+#define CFG_CPU_INTERP "interp"
+#define CFG_CPU_CACHED "cached"
+#define CFG_CPU_JIT    "jit"
+
+#define CFG_QUALITY_DRAFT  "draft"
+#define CFG_QUALITY_NORMAL "normal"
+#define CFG_QUALITY_HQ     "hq"
+
+#define CFG_SYNTH_STEP       "step"
+#define CFG_SYNTH_OVERSAMPLE "oversample"
+
+#define CFG_FORMAT_S16   "s16"
+#define CFG_FORMAT_S32   "s32"
+#define CFG_FORMAT_FLOAT "float"
+
 enum play_mode {
 	PLAY_MODE_LINEAR  = 1,
 	PLAY_MODE_RANDOM  = 2,
@@ -29,8 +44,10 @@ enum plugout_endian {
 };
 
 struct player_cfg {
+	char *cpu_core;
 	long fadeout;
 	char *filter_type;
+	int length_cache;
 	enum gbs_loop_mode loop_mode;
 	char *output_filename;
 	enum play_mode play_mode;
@@ -39,10 +56,13 @@ struct player_cfg {
 	char *sound_name;
 	long subsong_gap;
 	long subsong_timeout;
+	char *quality;
+	char *synthesis;
 	long verbosity;
 
 	// prepend with 'requested_' to signal possible override in struct plugout_cfg
 	enum plugout_endian requested_endian;
+	char *requested_format;
 	long requested_rate;
 };
 
@@ -52,6 +52,7 @@ extern const struct output_plugin plugout_vgm;
 #endif
 #ifdef PLUGOUT_WAV
 extern const struct output_plugin plugout_wav;
+extern const struct output_plugin plugout_wavstem;
 #endif
 
 typedef const struct output_plugin* output_plugin_const_t;
@@ -96,6 +97,7 @@ static output_plugin_const_t plugouts[] = {
 #endif
 #ifdef PLUGOUT_WAV
 	&plugout_wav,
+	&plugout_wavstem,
 #endif
 	NULL
 };
@@ -45,6 +45,7 @@ struct plugout_metadata {
 
 struct plugout_cfg {
 	enum plugout_endian endian;
+	enum gbs_output_format format;
 	long rate;
 };
 
@@ -60,6 +61,8 @@ typedef int     (*plugout_io_fn   )(cycles_t cycles, uint32_t addr, uint8_t val)
 typedef int     (*plugout_step_fn )(const cycles_t cycles, const struct gbs_channel_status[]);
 /* Callback for writing sample data. */
 typedef ssize_t (*plugout_write_fn)(const void *buf, size_t count);
+/* Callback for writing sample data of a single channel (0-3). */
+typedef ssize_t (*plugout_write_stem_fn)(int channel, const void *buf, size_t count);
 /* Close called on player exit. */
 typedef void    (*plugout_close_fn)(void);
 
@@ -75,6 +78,7 @@ struct output_plugin {
 	plugout_io_fn    io;
 	plugout_step_fn  step;
 	plugout_write_fn write;
+	plugout_write_stem_fn write_stem;
 	plugout_close_fn close;
 };
 
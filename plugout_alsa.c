@@ -24,11 +24,8 @@ snd_pcm_t *pcm_handle;
 
 bool can_pause;
 
-#if GBS_BYTE_ORDER == GBS_ORDER_LITTLE_ENDIAN
-#define SND_PCM_FORMAT_S16_NE SND_PCM_FORMAT_S16_LE
-#else
-#define SND_PCM_FORMAT_S16_NE SND_PCM_FORMAT_S16_BE
-#endif
+/* bytes per stereo sample */
+static long frame_bytes;
 
 static long alsa_open(struct plugout_cfg *actual, long *buffer_bytes, const struct plugout_metadata metadata)
 {
@@ -36,16 +33,19 @@ static long alsa_open(struct plugout_cfg *actual, long *buffer_bytes, const stru
 	int fmt, err;
 	unsigned exact_rate;
 	snd_pcm_hw_params_t *hwparams;
-	snd_pcm_uframes_t buffer_frames = *buffer_bytes / 4;
+	snd_pcm_uframes_t buffer_frames;
 	snd_pcm_uframes_t period_frames;
+	bool big = actual->endian == PLUGOUT_ENDIAN_BIG;
 
 	UNUSED(metadata);
 
-	switch (cfg.requested_endian) {
-	case PLUGOUT_ENDIAN_BIG:    fmt = SND_PCM_FORMAT_S16_BE; break;
-	case PLUGOUT_ENDIAN_LITTLE: fmt = SND_PCM_FORMAT_S16_LE; break;
-	default:                    fmt = SND_PCM_FORMAT_S16_NE; break;
+	switch (actual->format) {
+	case OUTPUT_S32:   fmt = big ? SND_PCM_FORMAT_S32_BE   : SND_PCM_FORMAT_S32_LE;   break;
+	case OUTPUT_FLOAT: fmt = big ? SND_PCM_FORMAT_FLOAT_BE : SND_PCM_FORMAT_FLOAT_LE; break;
+	default:           fmt = big ? SND_PCM_FORMAT_S16_BE   : SND_PCM_FORMAT_S16_LE;   break;
 	}
+	frame_bytes = actual->format == OUTPUT_S16 ? 4 : 8;
+	buffer_frames = *buffer_bytes / frame_bytes;
 
 	snd_pcm_hw_params_alloca(&hwparams);
 
@@ -95,7 +95,7 @@ static long alsa_open(struct plugout_cfg *actual, long *buffer_bytes, const stru
 		return -1;
 	}
 
-	*buffer_bytes = buffer_frames * 4;
+	*buffer_bytes = buffer_frames * frame_bytes;
 
 	can_pause = snd_pcm_hw_params_can_pause(hwparams);
 
@@ -128,7 +128,7 @@ static ssize_t alsa_write(const void *buf, size_t count)
 	snd_pcm_sframes_t retval;
 
 	do {
-		retval = snd_pcm_writei(pcm_handle, buf, count / 4);
+		retval = snd_pcm_writei(pcm_handle, buf, count / frame_bytes);
 		if (is_suspended(retval)) {
 			/* resume from suspend */
 			while (snd_pcm_resume(pcm_handle) == -EAGAIN)
@@ -30,6 +30,9 @@ static long devdsp_open(struct plugout_cfg *actual, long *buffer_bytes, const st
 	int flags;
 
 	UNUSED(metadata);
+
+	/* OSS has no portable 32 bit or float formats */
+	actual->format = OUTPUT_S16;
 	
 	if ((fd = open("/dev/dsp", O_WRONLY|O_NONBLOCK)) == -1) {
 		fprintf(stderr, _("Could not open /dev/dsp: %s\n"), strerror(errno));
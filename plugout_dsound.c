@@ -37,6 +37,7 @@ static long dsound_open(struct plugout_cfg *actual, long *buffer_bytes, const st
 	UNUSED(metadata);
 
 	actual->endian = PLUGOUT_ENDIAN_NATIVE;
+	actual->format = OUTPUT_S16;
 
 	hr = DirectSoundCreate8(NULL, &dsound_device, NULL);
 
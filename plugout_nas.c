@@ -110,10 +110,12 @@ static long nas_open(struct plugout_cfg *actual, long *buffer_bytes, const struc
 	AuStatus  status = AuBadValue;
 	AuDeviceID nas_device;
 
-	UNUSED(actual);
 	UNUSED(buffer_bytes);
 	UNUSED(metadata);
 
+	/* NAS only knows integer formats up to 16 bit */
+	actual->format = OUTPUT_S16;
+
 	switch (cfg.requested_endian) {
 	case PLUGOUT_ENDIAN_BIG:	nas_format = AuFormatLinearSigned16MSB;     break;
 	case PLUGOUT_ENDIAN_LITTLE:	nas_format = AuFormatLinearSigned16LSB;     break;
@@ -17,9 +17,8 @@
 #include "common.h"
 #include "plugout.h"
 
-static const int BYTES_PER_SAMPLE = 2;
 static const int CHANNELS = 2;
-static const int STRIDE = BYTES_PER_SAMPLE * CHANNELS;
+static int stride;
 
 static struct pipewire_data {
 	struct pw_thread_loop *loop;
@@ -39,22 +38,22 @@ static long pipewire_open(struct plugout_cfg *actual, long *buffer_bytes, const
 	struct spa_pod_builder pod_builder = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
 	enum spa_audio_format fmt;
 	int err;
+	bool big = actual->endian == PLUGOUT_ENDIAN_BIG;
 
-	UNUSED(actual);
-
-	// determine endianess
-	switch (cfg.requested_endian) {
-	case PLUGOUT_ENDIAN_BIG:    fmt = SPA_AUDIO_FORMAT_S16_BE; break;
-	case PLUGOUT_ENDIAN_LITTLE: fmt = SPA_AUDIO_FORMAT_S16_LE; break;
-	default:                    fmt = SPA_AUDIO_FORMAT_S16;    break;
+	// determine sample format and endianess, float is PipeWire's native format
+	switch (actual->format) {
+	case OUTPUT_S32:   fmt = big ? SPA_AUDIO_FORMAT_S32_BE : SPA_AUDIO_FORMAT_S32_LE; break;
+	case OUTPUT_FLOAT: fmt = big ? SPA_AUDIO_FORMAT_F32_BE : SPA_AUDIO_FORMAT_F32_LE; break;
+	default:           fmt = big ? SPA_AUDIO_FORMAT_S16_BE : SPA_AUDIO_FORMAT_S16_LE; break;
 	}
+	stride = (actual->format == OUTPUT_S16 ? 2 : 4) * CHANNELS;
 
 	// determine buffer wait time - use 25% gbsplay buffer length (~2 wait cycles on my machine)
 	pipewire_data.buffer_fill_wait_time.tv_sec = 0;
 	pipewire_data.buffer_fill_wait_time.tv_nsec =
 		1000000000                 // nanoseconds per second
 		/ cfg.requested_rate       // sample rate
-		* (*buffer_bytes / STRIDE) // samples in buffer
+		* (*buffer_bytes / stride) // samples in buffer
 		/ 4;                       // 25% of that
 
 	// init pipewire
@@ -131,7 +130,7 @@ static ssize_t pipewire_write(const void *buf, size_t count)
 	// repeat until the whole buffer is sent
 	while (buf_sent < count) {
 		
-		const int frames_to_send = (count - buf_sent) / STRIDE;
+		const int frames_to_send = (count - buf_sent) / stride;
 
 		// wait until data can be sent by us
 		while ((b = pw_stream_dequeue_buffer(pipewire_data.stream)) == NULL) {
@@ -146,7 +145,7 @@ static ssize_t pipewire_write(const void *buf, size_t count)
 		}
 
 		// check how much we can send
-		n_frames = spa_buf->datas[0].maxsize / STRIDE;
+		n_frames = spa_buf->datas[0].maxsize / stride;
 #if PW_CHECK_VERSION(0,3,49)
 		// unfortunately our CI pipeline runs Ubuntu 22.04LTS
 	        // which is on 0.3.48, so we have to do this version check
@@ -154,13 +153,13 @@ static ssize_t pipewire_write(const void *buf, size_t count)
 			n_frames = SPA_MIN((int)b->requested, n_frames);
 #endif
 		n_frames = SPA_MIN(n_frames, frames_to_send);
-		bytes_to_send = n_frames * STRIDE;
+		bytes_to_send = n_frames * stride;
 
 		// send audio data
 		memcpy(p, ((uint8_t *) buf) + buf_sent, bytes_to_send);
 
 		spa_buf->datas[0].chunk->offset = 0;
-		spa_buf->datas[0].chunk->stride = STRIDE;
+		spa_buf->datas[0].chunk->stride = stride;
 		spa_buf->datas[0].chunk->size = bytes_to_send;
  
 		pw_stream_queue_buffer(pipewire_data.stream, b);
@@ -25,14 +25,14 @@ static pa_sample_spec pulse_spec;
 static long pulse_open(struct plugout_cfg *actual, long *buffer_bytes, const struct plugout_metadata metadata)
 {
 	int err;
+	long big = actual->endian == PLUGOUT_ENDIAN_BIG;
 
-	UNUSED(actual);
 	UNUSED(buffer_bytes);
 
-	switch (cfg.requested_endian) {
-	case PLUGOUT_ENDIAN_BIG:    pulse_spec.format = PA_SAMPLE_S16BE; break;
-	case PLUGOUT_ENDIAN_LITTLE: pulse_spec.format = PA_SAMPLE_S16LE; break;
-	default:                    pulse_spec.format = PA_SAMPLE_S16NE; break;
+	switch (actual->format) {
+	case OUTPUT_S32:   pulse_spec.format = big ? PA_SAMPLE_S32BE     : PA_SAMPLE_S32LE;     break;
+	case OUTPUT_FLOAT: pulse_spec.format = big ? PA_SAMPLE_FLOAT32BE : PA_SAMPLE_FLOAT32LE; break;
+	default:           pulse_spec.format = big ? PA_SAMPLE_S16BE     : PA_SAMPLE_S16LE;     break;
 	}
 	pulse_spec.rate = cfg.requested_rate;
 	pulse_spec.channels = 2;
@@ -32,10 +32,12 @@
 
 int device;
 SDL_AudioSpec obtained;
+static long frame_bytes;
 
 static long sdl_open(struct plugout_cfg *actual, long *buffer_bytes, const struct plugout_metadata metadata)
 {
 	SDL_AudioSpec desired;
+	long big = actual->endian == PLUGOUT_ENDIAN_BIG;
 
 	if (SDL_Init(SDL_INIT_AUDIO) != 0) {
 		fprintf(stderr, _("Could not init SDL: %s\n"), SDL_GetError());
@@ -51,11 +53,12 @@ static long sdl_open(struct plugout_cfg *actual, long *buffer_bytes, const struc
 	desired.samples = 1024;
 	desired.callback = NULL;
 
-	switch (cfg.requested_endian) {
-	case PLUGOUT_ENDIAN_BIG:    desired.format = AUDIO_S16MSB; break;
-	case PLUGOUT_ENDIAN_LITTLE: desired.format = AUDIO_S16LSB; break;
-	default:                    desired.format = AUDIO_S16SYS; break;
+	switch (actual->format) {
+	case OUTPUT_S32:   desired.format = big ? AUDIO_S32MSB : AUDIO_S32LSB; break;
+	case OUTPUT_FLOAT: desired.format = big ? AUDIO_F32MSB : AUDIO_F32LSB; break;
+	default:           desired.format = big ? AUDIO_S16MSB : AUDIO_S16LSB; break;
 	}
+	frame_bytes = actual->format == OUTPUT_S16 ? 4 : 8;
 
 	device = SDL_OpenAudioDevice(NULL, PLAYBACK_MODE, &desired, &obtained, SDL_FLAGS);
 	if (device == 0) {
@@ -67,14 +70,14 @@ static long sdl_open(struct plugout_cfg *actual, long *buffer_bytes, const struc
 
 	SDL_PauseAudioDevice(device, UNPAUSE);
 
-	*buffer_bytes = obtained.samples * 4;
+	*buffer_bytes = obtained.samples * frame_bytes;
 	return 0;
 }
 
 static ssize_t sdl_write(const void *buf, size_t count)
 {
 	int overqueued = SDL_GetQueuedAudioSize(device) - obtained.size;
-	float delaynanos = (float)overqueued / 4.0 / obtained.freq * 1000000000.0;
+	float delaynanos = (float)overqueued / frame_bytes / obtained.freq * 1000000000.0;
 	struct timespec interval = {.tv_sec = 0, .tv_nsec = (long)delaynanos};
 	if (overqueued > 0) {
 		nanosleep(&interval, NULL);
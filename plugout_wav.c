@@ -21,24 +21,29 @@
 static const uint8_t blank_hdr[44];
 
 static FILE* file = NULL;
+static FILE* stem_file[4];
+static enum gbs_output_format sample_format;
 
-static int wav_write_header(void) {
+static int wav_write_header(FILE *f) {
 	const long sample_rate = cfg.requested_rate;
 	const uint32_t fmt_subchunk_length = 16;
 	const uint16_t audio_format_uncompressed_pcm = 1;
+	const uint16_t audio_format_ieee_float = 3;
+	const uint16_t audio_format = sample_format == OUTPUT_FLOAT ?
+		audio_format_ieee_float : audio_format_uncompressed_pcm;
 	const uint16_t num_channels = 2;
-	const uint16_t bits_per_sample = 16;
+	const uint16_t bits_per_sample = sample_format == OUTPUT_S16 ? 16 : 32;
 	const uint32_t byte_rate = sample_rate * num_channels * bits_per_sample / 8;
 	const uint16_t block_align = num_channels * bits_per_sample / 8;
 
-	long filesize = ftell(file);
+	long filesize = ftell(f);
 	if (filesize < 0 || filesize > 0xffffffff)
 		return -1;
 
-	fpackat(file, 0, "<{RIFF}d{WAVE}<{fmt }dwwddww{data}d",
+	fpackat(f, 0, "<{RIFF}d{WAVE}<{fmt }dwwddww{data}d",
 	        (uint32_t)filesize - 8,
 	        fmt_subchunk_length,
-	        audio_format_uncompressed_pcm,
+	        audio_format,
 	        num_channels,
 	        sample_rate,
 	        byte_rate,
@@ -48,24 +53,24 @@ static int wav_write_header(void) {
 	return 0;
 }
 
-static int wav_open_file(const int subsong) {
-	if ((file = file_open("wav", subsong)) == NULL)
-		return -1;
+static FILE *wav_open_file(const int subsong, const int channel) {
+	FILE *f;
+
+	if ((f = file_open_channel("wav", subsong, channel)) == NULL)
+		return NULL;
 
-	fwrite(blank_hdr, sizeof(blank_hdr), 1, file);
+	fwrite(blank_hdr, sizeof(blank_hdr), 1, f);
 	
-	return 0;
+	return f;
 }
 
-static int wav_close_file(void) {
-	int result;
-
-	if (wav_write_header())
+static int wav_close_file(FILE *f) {
+	if (wav_write_header(f)) {
+		fclose(f);
 		return -1;
+	}
 
-	result = fclose(file);
-	file = NULL;
-	return result;
+	return fclose(f);
 }
 
 static long wav_open(struct plugout_cfg *actual, long *buffer_bytes,
@@ -75,17 +80,24 @@ static long wav_open(struct plugout_cfg *actual, long *buffer_bytes,
 	UNUSED(metadata);
 
 	actual->endian = PLUGOUT_ENDIAN_LITTLE;
+	sample_format = actual->format;
 
 	return 0;
 }
 
 static int wav_skip(const int subsong)
 {
-	if (file != NULL)
-		if (wav_close_file())
+	if (file != NULL) {
+		int result = wav_close_file(file);
+		file = NULL;
+		if (result)
 			return -1;
+	}
+
+	if ((file = wav_open_file(subsong, 0)) == NULL)
+		return -1;
 
-	return wav_open_file(subsong);
+	return 0;
 }
 
 static ssize_t wav_write(const void *buf, const size_t count)
@@ -95,12 +107,54 @@ static ssize_t wav_write(const void *buf, const size_t count)
 
 static void wav_close(void)
 {
-	if (file != NULL)
-		wav_close_file();
+	if (file != NULL) {
+		wav_close_file(file);
+		file = NULL;
+	}
 
 	return;
 }
 
+static int wavstem_skip(const int subsong)
+{
+	int result = 0;
+	int ch;
+
+	for (ch=0; ch<4; ch++) {
+		if (stem_file[ch] != NULL) {
+			if (wav_close_file(stem_file[ch]))
+				result = -1;
+			stem_file[ch] = NULL;
+		}
+	}
+	if (result)
+		return result;
+
+	for (ch=0; ch<4; ch++) {
+		if ((stem_file[ch] = wav_open_file(subsong, ch + 1)) == NULL)
+			return -1;
+	}
+
+	return 0;
+}
+
+static ssize_t wavstem_write(const int channel, const void *buf, const size_t count)
+{
+	return fwrite(buf, count, 1, stem_file[channel]);
+}
+
+static void wavstem_close(void)
+{
+	int ch;
+
+	for (ch=0; ch<4; ch++) {
+		if (stem_file[ch] != NULL) {
+			wav_close_file(stem_file[ch]);
+			stem_file[ch] = NULL;
+		}
+	}
+}
+
 const struct output_plugin plugout_wav = {
 	.name = "wav",
 	.description = "WAV file writer",
@@ -109,3 +163,12 @@ const struct output_plugin plugout_wav = {
 	.write = wav_write,
 	.close = wav_close,
 };
+
+const struct output_plugin plugout_wavstem = {
+	.name = "wavstem",
+	.description = "WAV file writer, one file per channel",
+	.open = wav_open,
+	.skip = wavstem_skip,
+	.write_stem = wavstem_write,
+	.close = wavstem_close,
+};
@@ -14,11 +14,930 @@
 #include <errno.h>
 #include <string.h>
 #include <time.h>
+#include <math.h>
+#include <limits.h>
 
 #include "common.h"
 #include "libgbs.h"
 #include "util.h"
 
+#define COMPARE_RATE    44100
+#define COMPARE_SECONDS 60
+#define COMPARE_STEP_MS 100
+
+struct core_trace {
+	uint32_t hash;
+	long events;
+};
+
+static uint32_t trace_add(uint32_t hash, uint32_t val)
+{
+	/* FNV-1a, good enough to notice any divergence */
+	return (hash ^ val) * 16777619;
+}
+
+static void io_trace(struct gbs* const gbs, cycles_t cycles, uint32_t addr, uint8_t value, void *priv)
+{
+	struct core_trace *trace = priv;
+
+	UNUSED(gbs);
+
+	trace->hash = trace_add(trace->hash, cycles);
+	trace->hash = trace_add(trace->hash, cycles >> 32);
+	trace->hash = trace_add(trace->hash, addr << 8 | value);
+	trace->events++;
+}
+
+static void sound_trace(struct gbs* const gbs, struct gbs_output_buffer *buf, void *priv)
+{
+	struct core_trace *trace = priv;
+	long i;
+
+	UNUSED(gbs);
+
+	for (i = 0; i < buf->pos * 2; i++)
+		trace->hash = trace_add(trace->hash, (uint16_t)buf->data[i]);
+	trace->events += buf->pos;
+	buf->pos = 0;
+}
+
+struct core_run {
+	struct gbs *gbs;
+	struct gbs_output_buffer buf;
+	struct core_trace io;
+	struct core_trace sound;
+};
+
+static long core_open_synth(struct core_run *run, enum gbs_cpu_core core, enum gbs_synthesis synthesis)
+{
+	memset(run, 0, sizeof(*run));
+	run->io.hash = run->sound.hash = 2166136261u;
+	run->buf.bytes = 8192;
+	run->buf.data = malloc(run->buf.bytes);
+	run->gbs = gbs_open("examples/nightmode.gbs");
+	if (run->buf.data == NULL || run->gbs == NULL)
+		return false;
+	if (!gbs_set_cpu_core(run->gbs, core))
+		return false;
+	gbs_set_io_callback(run->gbs, io_trace, &run->io);
+	gbs_set_sound_callback(run->gbs, sound_trace, &run->sound);
+	gbs_configure_output(run->gbs, &run->buf, COMPARE_RATE);
+	if (!gbs_set_synthesis(run->gbs, synthesis))
+		return false;
+	gbs_configure(run->gbs, 0, COMPARE_SECONDS, 0, 0, 0);
+	return gbs_init(run->gbs, 0);
+}
+
+static long core_open(struct core_run *run, enum gbs_cpu_core core)
+{
+	return core_open_synth(run, core, SYNTH_STEP);
+}
+
+/* also safe on a zeroed run that was never opened */
+static void core_close(struct core_run *run)
+{
+	if (run->gbs)
+		gbs_close(run->gbs);
+	free(run->buf.data);
+}
+
+/* Run the same subsong on the interpreter and another CPU core in lockstep and compare IO and sound. */
+static long compare_cpu_core(const char *progname, enum gbs_cpu_core core, const char *name)
+{
+	struct core_run interp = { 0 }, other = { 0 };
+	long ms, ok = true;
+
+	if (!core_open(&interp, CPU_CORE_INTERP) || !core_open(&other, core)) {
+		fprintf(stderr, "%s: %s CPU core setup failed\n", progname, name);
+		ok = false;
+	}
+	for (ms = 0; ok && ms < COMPARE_SECONDS * 1000; ms += COMPARE_STEP_MS) {
+		long running_interp = gbs_step(interp.gbs, COMPARE_STEP_MS);
+		long running_other = gbs_step(other.gbs, COMPARE_STEP_MS);
+
+		if (running_interp != running_other ||
+		    interp.io.hash != other.io.hash ||
+		    interp.io.events != other.io.events ||
+		    interp.sound.hash != other.sound.hash ||
+		    interp.sound.events != other.sound.events) {
+			fprintf(stderr, "%s: %s CPU core diverged after %ldms (%ld/%ld IO writes, %ld/%ld samples)\n",
+				progname, name, ms + COMPARE_STEP_MS,
+				interp.io.events, other.io.events,
+				interp.sound.events, other.sound.events);
+			ok = false;
+		}
+		if (!running_interp)
+			break;
+	}
+	core_close(&interp);
+	core_close(&other);
+	return ok;
+}
+
+static long compare_cpu_cores(const char *progname)
+{
+	long ok = compare_cpu_core(progname, CPU_CORE_CACHED, "cached");
+#ifdef USE_JIT
+	char path[64];
+
+	ok = compare_cpu_core(progname, CPU_CORE_JIT, "jit") && ok;
+
+	/* the JIT core lists its code for perf */
+	snprintf(path, sizeof(path), "/tmp/perf-%ld.map", (long)getpid());
+	if (access(path, R_OK) != 0) {
+		fprintf(stderr, "%s: %s was not written\n", progname, path);
+		ok = false;
+	}
+	unlink(path);
+#endif
+	return ok;
+}
+
+/*
+ * Register songs: a tiny GBS whose play routine writes the next frame
+ * of (register, value) pairs from a table to the IO registers.  Frames
+ * end with 0xff.  They pin down the sound output for register settings
+ * the example file never uses.
+ */
+#define REGSONG_LOAD    0x400
+#define REGSONG_TABLE   0x1000
+#define REGSONG_END     0x8000  /* two full banks, so bank 1 exists */
+#define REGSONG_SECONDS 10
+
+static const uint8_t regsong_code[] = {
+	/* init: ld hl,table; ld a,l; ldh (0x80),a; ld a,h; ldh (0x81),a; ret */
+	0x21, REGSONG_TABLE & 0xff, REGSONG_TABLE >> 8,
+	0x7d, 0xe0, 0x80, 0x7c, 0xe0, 0x81, 0xc9,
+	/* play: ldh a,(0x80); ld l,a; ldh a,(0x81); ld h,a */
+	0xf0, 0x80, 0x6f, 0xf0, 0x81, 0x67,
+	/* ld a,(hl+); cp 0xff; jr z,+5; ld c,a; ld a,(hl+); ld (c),a; jr -10 */
+	0x2a, 0xfe, 0xff, 0x28, 0x05, 0x4f, 0x2a, 0xe2, 0x18, 0xf6,
+	/* ld a,l; ldh (0x80),a; ld a,h; ldh (0x81),a; ret */
+	0x7d, 0xe0, 0x80, 0x7c, 0xe0, 0x81, 0xc9,
+};
+#define REGSONG_PLAY (REGSONG_LOAD + 10)
+
+/* sound on, all channels on both sides at full volume */
+static const uint8_t regsong_setup[] = { 0x26, 0x80, 0x25, 0xff, 0x24, 0x77, 0xff };
+
+/* sweep shift 0 takes the channel 1 period to zero and below */
+static const uint8_t regsong_sweep0[] = {
+	0x10, 0x10, 0x11, 0x80, 0x12, 0xf0, 0x13, 0x00, 0x14, 0x84, 0xff,
+	0x13, 0x00, 0x14, 0x85, 0xff,
+	0x11, 0x40, 0x13, 0x00, 0x14, 0x86, 0xff,
+};
+
+/* the same with channel 1 taken off both outputs every other frame */
+static const uint8_t regsong_sweep0_gated[] = {
+	0x25, 0xee, 0x10, 0x10, 0x11, 0x80, 0x12, 0xf0, 0x13, 0x00, 0x14, 0x84, 0xff,
+	0x25, 0xff, 0x13, 0x00, 0x14, 0x85, 0xff,
+	0x25, 0xee, 0x11, 0x40, 0x13, 0x00, 0x14, 0x86, 0xff,
+	0x25, 0xff, 0xff,
+};
+
+/* the same with channel 2 playing next to the muted channel 1 */
+static const uint8_t regsong_sweep0_muted[] = {
+	0x10, 0x10, 0x11, 0x80, 0x12, 0xf0, 0x13, 0x00, 0x14, 0x84,
+	0x16, 0x80, 0x17, 0xf0, 0x18, 0x00, 0x19, 0x86, 0xff,
+	0x13, 0x00, 0x14, 0x85, 0xff,
+	0x11, 0x40, 0x13, 0x00, 0x14, 0x86, 0xff,
+};
+
+struct regsong {
+	const char *name;
+	const uint8_t *frames;  /* repeated until the table is full, or NULL */
+	size_t len;
+	uint32_t seed;          /* random frames from regsong_random() if frames is NULL */
+	long mute;              /* muted channels, bit 0 for channel 1 */
+	uint32_t hash;          /* sound_trace() hash of the reference output */
+};
+
+static const struct regsong regsongs[] = {
+	{ "sweep shift 0", regsong_sweep0, sizeof(regsong_sweep0), 0, 0, 0xf7f67a4d },
+	{ "random writes", NULL, 0, 17, 0, 0x9ce50062 },
+	{ "gated sweep shift 0", regsong_sweep0_gated, sizeof(regsong_sweep0_gated), 0, 0, 0x178b1381 },
+	{ "muted sweep shift 0", regsong_sweep0_muted, sizeof(regsong_sweep0_muted), 0, 1, 0xcb274149 },
+};
+
+/* xorshift32, the same sequence on every platform */
+static uint32_t regsong_rand(uint32_t *state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 17;
+	*state ^= *state << 5;
+	return *state;
+}
+
+/*
+ * Fill the table with frames of up to 5 random writes to the sound
+ * registers and wave RAM, biased towards the trigger registers, the
+ * way a fuzzer would.  Returns the bytes used.
+ */
+static size_t regsong_random(uint8_t *table, size_t size, uint32_t seed)
+{
+	static const uint8_t regs[] = {
+		0x10, 0x11, 0x12, 0x13, 0x14, 0x16, 0x17, 0x18, 0x19, 0x1a,
+		0x1b, 0x1c, 0x1d, 0x1e, 0x20, 0x21, 0x22, 0x23, 0x25,
+		0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37,
+		0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0x3e, 0x3f,
+		0x14, 0x19, 0x1e, 0x23, 0x14, 0x19, 0x1e, 0x23,
+	};
+	size_t len = 0;
+
+	while (len + 11 <= size) {
+		long n = regsong_rand(&seed) % 6;
+
+		while (n--) {
+			uint8_t reg = regs[regsong_rand(&seed) % sizeof(regs)];
+			uint8_t val = regsong_rand(&seed);
+
+			if ((reg == 0x14 || reg == 0x19 || reg == 0x1e || reg == 0x23) &&
+			    regsong_rand(&seed) % 5 < 3)
+				val |= 0x80;  /* trigger */
+			if (reg == 0x1a)
+				val |= 0x80;  /* wave DAC on */
+			if (reg == 0x10 && (val & 0x0f) == 0)
+				val |= 0x08;  /* no runaway sweep, see regsong_sweep0 */
+			table[len++] = reg;
+			table[len++] = val;
+		}
+		table[len++] = 0xff;
+	}
+	return len;
+}
+
+static long regsong_write(const char *path, const struct regsong *song)
+{
+	uint8_t rom[0x70 + REGSONG_END - REGSONG_LOAD];
+	uint8_t *table = &rom[0x70 + REGSONG_TABLE - REGSONG_LOAD];
+	size_t len = sizeof(regsong_setup), size = REGSONG_END - REGSONG_TABLE;
+	FILE *f;
+	long ok;
+
+	memset(rom, 0, sizeof(rom));
+	memcpy(rom, "GBS\1\1\1", 6);
+	rom[0x06] = REGSONG_LOAD & 0xff; rom[0x07] = REGSONG_LOAD >> 8;
+	rom[0x08] = REGSONG_LOAD & 0xff; rom[0x09] = REGSONG_LOAD >> 8;
+	rom[0x0a] = REGSONG_PLAY & 0xff; rom[0x0b] = REGSONG_PLAY >> 8;
+	rom[0x0c] = 0xfe; rom[0x0d] = 0xdf;
+	strcpy((char *)&rom[0x10], song->name);
+	memcpy(&rom[0x70], regsong_code, sizeof(regsong_code));
+	memcpy(table, regsong_setup, len);
+	if (song->frames == NULL) {
+		len += regsong_random(&table[len], size - len, song->seed);
+	} else {
+		while (len + song->len <= size) {
+			memcpy(&table[len], song->frames, song->len);
+			len += song->len;
+		}
+	}
+	memset(&table[len], 0xff, size - len);
+
+	if ((f = fopen(path, "wb")) == NULL)
+		return false;
+	ok = fwrite(rom, sizeof(rom), 1, f) == 1;
+	return fclose(f) == 0 && ok;
+}
+
+static long compare_regsong(const char *progname, const char *path, const struct regsong *song)
+{
+	struct core_run run = { 0 };
+	long ms, ok = true;
+
+	run.sound.hash = 2166136261u;
+	run.buf.bytes = 8192;
+	run.buf.data = malloc(run.buf.bytes);
+	if (run.buf.data == NULL || !regsong_write(path, song) ||
+	    (run.gbs = gbs_open(path)) == NULL) {
+		fprintf(stderr, "%s: %s: register song setup failed\n", progname, song->name);
+		unlink(path);
+		core_close(&run);
+		return false;
+	}
+	unlink(path);
+	gbs_set_sound_callback(run.gbs, sound_trace, &run.sound);
+	gbs_configure_output(run.gbs, &run.buf, COMPARE_RATE);
+	gbs_configure(run.gbs, 0, REGSONG_SECONDS, 0, 0, 0);
+	gbs_configure_channels(run.gbs, song->mute & 1, (song->mute >> 1) & 1,
+			       (song->mute >> 2) & 1, (song->mute >> 3) & 1);
+	ok = gbs_init(run.gbs, 0);
+	for (ms = 0; ok && ms < REGSONG_SECONDS * 1000; ms += COMPARE_STEP_MS)
+		gbs_step(run.gbs, COMPARE_STEP_MS);
+	if (ok && run.sound.hash != song->hash) {
+		fprintf(stderr, "%s: %s: sound hash %08lx, expected %08lx\n",
+			progname, song->name, (long)run.sound.hash, (long)song->hash);
+		ok = false;
+	}
+	core_close(&run);
+	return ok;
+}
+
+static long compare_regsongs(const char *progname, const char *path)
+{
+	long ok = true;
+	size_t i;
+
+	for (i = 0; i < sizeof(regsongs) / sizeof(regsongs[0]); i++)
+		ok = compare_regsong(progname, path, &regsongs[i]) && ok;
+	return ok;
+}
+
+struct stem_check {
+	const int16_t *mix;
+	long max_diff;
+	long samples;
+};
+
+static void stem_compare(struct gbs* const gbs, struct gbs_output_buffer bufs[], void *priv)
+{
+	struct stem_check *check = priv;
+	long i, ch;
+
+	UNUSED(gbs);
+
+	for (i = 0; i < bufs[0].pos * 2; i++) {
+		long sum = 0;
+		for (ch = 0; ch < 4; ch++)
+			sum += bufs[ch].data[i];
+		if (labs(sum - check->mix[i]) > check->max_diff)
+			check->max_diff = labs(sum - check->mix[i]);
+	}
+	check->samples += bufs[0].pos;
+	for (ch = 0; ch < 4; ch++)
+		bufs[ch].pos = 0;
+}
+
+/*
+ * Stems must not change the mix, and without the high-pass filter they
+ * have to add up to the mix except for the per-stem rounding.
+ */
+static long compare_stems(const char *progname, enum gbs_synthesis synthesis)
+{
+	struct core_run plain = { 0 }, stems = { 0 };
+	struct stem_check check = { NULL, 0, 0 };
+	long ms, ok = true;
+
+	if (!core_open_synth(&plain, CPU_CORE_CACHED, synthesis) || !core_open_synth(&stems, CPU_CORE_CACHED, synthesis)) {
+		fprintf(stderr, "%s: stem setup failed\n", progname);
+		ok = false;
+	} else {
+		check.mix = stems.buf.data;
+		gbs_set_filter(plain.gbs, FILTER_OFF);
+		gbs_set_filter(stems.gbs, FILTER_OFF);
+		gbs_set_stem_callback(stems.gbs, stem_compare, &check);
+	}
+	for (ms = 0; ok && ms < COMPARE_SECONDS * 1000; ms += COMPARE_STEP_MS) {
+		long running = gbs_step(plain.gbs, COMPARE_STEP_MS);
+
+		gbs_step(stems.gbs, COMPARE_STEP_MS);
+		if (plain.sound.hash != stems.sound.hash ||
+		    check.samples != stems.sound.events ||
+		    check.max_diff > 3) {
+			fprintf(stderr, "%s: stems diverged after %ldms (%ld/%ld samples, max difference %ld)\n",
+				progname, ms + COMPARE_STEP_MS,
+				check.samples, stems.sound.events, check.max_diff);
+			ok = false;
+		}
+		if (!running)
+			break;
+	}
+	core_close(&plain);
+	core_close(&stems);
+	return ok;
+}
+
+struct synth_check {
+	int16_t ref[16384];
+	long fill;
+	double diff;
+	double energy;
+};
+
+static void synth_store(struct gbs* const gbs, struct gbs_output_buffer *buf, void *priv)
+{
+	struct synth_check *check = priv;
+
+	UNUSED(gbs);
+
+	if (check->fill + buf->pos * 2 <= (long)(sizeof(check->ref) / sizeof(check->ref[0]))) {
+		memcpy(&check->ref[check->fill], buf->data, buf->pos * 4);
+		check->fill += buf->pos * 2;
+	}
+	buf->pos = 0;
+}
+
+static void synth_compare(struct gbs* const gbs, struct gbs_output_buffer *buf, void *priv)
+{
+	struct synth_check *check = priv;
+	long i, n = buf->pos * 2;
+
+	UNUSED(gbs);
+
+	if (n > check->fill)
+		n = check->fill;
+	for (i = 0; i < n; i++) {
+		double d = buf->data[i] - check->ref[i];
+		check->diff += d * d;
+		check->energy += (double)check->ref[i] * check->ref[i];
+	}
+	check->fill -= n;
+	memmove(check->ref, &check->ref[n], check->fill * sizeof(check->ref[0]));
+	buf->pos = 0;
+}
+
+/*
+ * Both synthesis backends band-limit the same levels, they only differ
+ * in the filter, so the outputs have to stay close.
+ */
+static long compare_synthesis(const char *progname)
+{
+	struct core_run step = { 0 }, oversample = { 0 };
+	struct synth_check check;
+	long ms, ok = true;
+
+	memset(&check, 0, sizeof(check));
+	if (!core_open(&step, CPU_CORE_CACHED) || !core_open_synth(&oversample, CPU_CORE_CACHED, SYNTH_OVERSAMPLE)) {
+		fprintf(stderr, "%s: synthesis setup failed\n", progname);
+		ok = false;
+	} else {
+		gbs_set_filter(step.gbs, FILTER_OFF);
+		gbs_set_filter(oversample.gbs, FILTER_OFF);
+		gbs_set_sound_callback(step.gbs, synth_store, &check);
+		gbs_set_sound_callback(oversample.gbs, synth_compare, &check);
+	}
+	for (ms = 0; ok && ms < COMPARE_SECONDS * 1000; ms += COMPARE_STEP_MS) {
+		long running = gbs_step(step.gbs, COMPARE_STEP_MS);
+
+		gbs_step(oversample.gbs, COMPARE_STEP_MS);
+		if (!running)
+			break;
+	}
+	if (ok && (check.energy == 0 || sqrt(check.diff / check.energy) > 0.03)) {
+		fprintf(stderr, "%s: synthesis backends differ by %.1f%%\n",
+			progname, check.energy ? 100 * sqrt(check.diff / check.energy) : 100.0);
+		ok = false;
+	}
+	core_close(&step);
+	core_close(&oversample);
+	return ok;
+}
+
+static void core_run_ms(struct core_run *run, long millis)
+{
+	long ms;
+
+	for (ms = 0; ms < millis; ms += COMPARE_STEP_MS)
+		gbs_step(run->gbs, COMPARE_STEP_MS);
+}
+
+static void core_reset_trace(struct core_run *run)
+{
+	run->io.hash = run->sound.hash = 2166136261u;
+	run->io.events = run->sound.events = 0;
+}
+
+static long core_same_trace(const struct core_run *a, const struct core_run *b)
+{
+	return a->io.hash == b->io.hash && a->io.events == b->io.events &&
+		a->sound.hash == b->sound.hash && a->sound.events == b->sound.events;
+}
+
+/* Plain bitwise CRC32 as used by the snapshot header. */
+static uint32_t state_crc32(const uint8_t *buf, long len)
+{
+	uint32_t crc = 0xffffffff;
+	long i, bit;
+
+	for (i = 0; i < len; i++) {
+		crc ^= buf[i];
+		for (bit = 0; bit < 8; bit++)
+			crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+	}
+	return ~crc;
+}
+
+static void state_put32(uint8_t *p, uint32_t val)
+{
+	p[0] = val;
+	p[1] = val >> 8;
+	p[2] = val >> 16;
+	p[3] = val >> 24;
+}
+
+/*
+ * A snapshot with an out of range subsong but a valid CRC has to be
+ * refused without touching the instance.  The payload length and CRC
+ * follow the 4 byte magic and the 8 byte version, the subsong comes
+ * after ticks, the six peak values and silence_start.
+ */
+static long refuse_bad_state(struct core_run *run, const uint8_t *state, long len)
+{
+	long payload_len = state[12] | state[13] << 8 | state[14] << 16 | (long)state[15] << 24;
+	long hdr_len = len - payload_len;
+	long before_len = gbs_save_state(run->gbs, NULL, 0);
+	uint8_t *bad = malloc(len);
+	uint8_t *before = malloc(before_len);
+	uint8_t *after = malloc(before_len);
+	long ok = bad != NULL && before != NULL && after != NULL;
+
+	if (ok) {
+		memcpy(bad, state, len);
+		state_put32(bad + hdr_len + 28, 0x7fffffff);
+		state_put32(bad + 16, state_crc32(bad + hdr_len, payload_len));
+		gbs_save_state(run->gbs, before, before_len);
+		ok = !gbs_load_state(run->gbs, bad, len) &&
+			gbs_save_state(run->gbs, after, before_len) == before_len &&
+			memcmp(before, after, before_len) == 0;
+	}
+	free(bad);
+	free(before);
+	free(after);
+	return ok;
+}
+
+/*
+ * Snapshot a subsong halfway, then continue it from the snapshot in
+ * the same and in a fresh instance.  All three have to match exactly.
+ */
+static long compare_state(const char *progname, enum gbs_synthesis synthesis)
+{
+	struct core_run orig = { 0 }, fresh = { 0 };
+	struct core_trace io, sound;
+	uint8_t *state = NULL;
+	long len = 0, ok = true;
+
+	if (!core_open_synth(&orig, CPU_CORE_CACHED, synthesis) ||
+	    !core_open_synth(&fresh, CPU_CORE_CACHED, synthesis)) {
+		fprintf(stderr, "%s: state setup failed\n", progname);
+		ok = false;
+	}
+	if (ok) {
+		core_run_ms(&orig, COMPARE_SECONDS * 1000 / 2);
+		len = gbs_save_state(orig.gbs, NULL, 0);
+		state = malloc(len);
+		if (len == 0 || state == NULL ||
+		    gbs_save_state(orig.gbs, state, len) != len) {
+			fprintf(stderr, "%s: gbs_save_state failed\n", progname);
+			ok = false;
+		}
+	}
+	if (ok) {
+		core_reset_trace(&orig);
+		core_run_ms(&orig, 5000);
+		io = orig.io;
+		sound = orig.sound;
+
+		if (!gbs_load_state(fresh.gbs, state, len) ||
+		    !gbs_load_state(orig.gbs, state, len)) {
+			fprintf(stderr, "%s: gbs_load_state failed\n", progname);
+			ok = false;
+		}
+	}
+	if (ok) {
+		core_reset_trace(&orig);
+		core_reset_trace(&fresh);
+		core_run_ms(&orig, 5000);
+		core_run_ms(&fresh, 5000);
+		if (!core_same_trace(&orig, &fresh) ||
+		    io.hash != orig.io.hash || io.events != orig.io.events ||
+		    sound.hash != orig.sound.hash || sound.events != orig.sound.events) {
+			fprintf(stderr, "%s: restored state diverged (%ld/%ld/%ld samples)\n",
+				progname, sound.events, orig.sound.events, fresh.sound.events);
+			ok = false;
+		}
+	}
+	if (ok && !refuse_bad_state(&fresh, state, len)) {
+		fprintf(stderr, "%s: invalid state was accepted or changed the instance\n", progname);
+		ok = false;
+	}
+	if (ok) {
+		/* damaged snapshots are refused */
+		state[len / 2] ^= 1;
+		if (gbs_load_state(fresh.gbs, state, len) ||
+		    gbs_load_state(fresh.gbs, state, len - 1)) {
+			fprintf(stderr, "%s: damaged state was accepted\n", progname);
+			ok = false;
+		}
+	}
+	free(state);
+	core_close(&orig);
+	core_close(&fresh);
+	return ok;
+}
+
+/*
+ * IO and channel status trace limited to a range of cycles.  Writes
+ * are stamped before and steps after their instruction, so an
+ * instruction ending at from is outside and one ending at to inside.
+ */
+struct seek_window {
+	long long from, to;
+	struct core_trace io;
+	struct core_trace ch;
+};
+
+static void window_io(struct gbs* const gbs, cycles_t cycles, uint32_t addr, uint8_t value, void *priv)
+{
+	struct seek_window *w = priv;
+
+	if ((long long)cycles >= w->from && (long long)cycles < w->to)
+		io_trace(gbs, cycles, addr, value, &w->io);
+}
+
+static void window_step(struct gbs* const gbs, const cycles_t cycles, const struct gbs_channel_status channels[], void *priv)
+{
+	struct seek_window *w = priv;
+	long ch;
+
+	UNUSED(gbs);
+
+	if ((long long)cycles <= w->from || (long long)cycles > w->to)
+		return;
+	w->ch.hash = trace_add(w->ch.hash, cycles);
+	for (ch = 0; ch < 4; ch++) {
+		w->ch.hash = trace_add(w->ch.hash, channels[ch].vol);
+		w->ch.hash = trace_add(w->ch.hash, channels[ch].div_tc);
+		w->ch.hash = trace_add(w->ch.hash, channels[ch].playing);
+	}
+	w->ch.events++;
+}
+
+static void window_open(struct core_run *run, struct seek_window *w, long long from)
+{
+	w->from = from;
+	w->to = LLONG_MAX;
+	w->io.hash = w->ch.hash = 2166136261u;
+	w->io.events = w->ch.events = 0;
+	gbs_set_io_callback(run->gbs, window_io, w);
+	gbs_set_step_callback(run->gbs, window_step, w);
+}
+
+/*
+ * A seek has to end up exactly where plain playback gets to.  The IO
+ * writes and channel status after the seek position are compared with
+ * a run that simply played up to there.  The samples themselves are
+ * not comparable, as the output restarts from silence after a seek.
+ */
+static long compare_seek_reference(const char *progname, long target)
+{
+	struct core_run seeked = { 0 }, played = { 0 };
+	struct seek_window sw, pw;
+	long ok = true;
+
+	if (!core_open(&seeked, CPU_CORE_CACHED) || !core_open(&played, CPU_CORE_CACHED) ||
+	    !gbs_seek(seeked.gbs, target)) {
+		fprintf(stderr, "%s: seek reference setup failed\n", progname);
+		ok = false;
+	}
+	if (ok) {
+		/* the last slice may run over by less than a millisecond */
+		long long start = (long long)target * 4194304 / 1000;
+		long long ticks = gbs_get_status(seeked.gbs)->ticks;
+
+		if (ticks < start || ticks >= start + 4194304 / 1000) {
+			fprintf(stderr, "%s: seek landed at %lld instead of %lld\n", progname, ticks, start);
+			ok = false;
+		}
+	}
+	if (ok) {
+		window_open(&seeked, &sw, gbs_get_status(seeked.gbs)->ticks);
+		core_run_ms(&seeked, 5000);
+		sw.to = gbs_get_status(seeked.gbs)->ticks;
+
+		window_open(&played, &pw, sw.from);
+		pw.to = sw.to;
+		while (ok && gbs_get_status(played.gbs)->ticks < pw.to)
+			ok = gbs_step(played.gbs, COMPARE_STEP_MS);
+		if (!ok || sw.io.events == 0 || seeked.sound.events == 0 ||
+		    sw.io.hash != pw.io.hash || sw.io.events != pw.io.events ||
+		    sw.ch.hash != pw.ch.hash || sw.ch.events != pw.ch.events) {
+			fprintf(stderr, "%s: seeking diverged from playback (%ld/%ld IO, %ld/%ld steps)\n",
+				progname, sw.io.events, pw.io.events, sw.ch.events, pw.ch.events);
+			ok = false;
+		}
+	}
+	core_close(&seeked);
+	core_close(&played);
+	return ok;
+}
+
+/*
+ * Seeking has to land on the same state no matter where it starts:
+ * from the beginning, from a keyframe going backwards, or in two
+ * hops.  The output is then compared for a while.
+ */
+static long compare_seek(const char *progname)
+{
+	struct core_run direct = { 0 }, hops = { 0 };
+	struct core_trace io, sound;
+	const long target = COMPARE_SECONDS * 1000 / 2 + 1234;
+	long ok = true;
+
+	if (!core_open(&direct, CPU_CORE_CACHED) || !core_open(&hops, CPU_CORE_CACHED)) {
+		fprintf(stderr, "%s: seek setup failed\n", progname);
+		ok = false;
+	}
+	if (ok && (!gbs_seek(direct.gbs, target) ||
+		   !gbs_seek(hops.gbs, target / 3) ||
+		   !gbs_seek(hops.gbs, target))) {
+		fprintf(stderr, "%s: gbs_seek failed\n", progname);
+		ok = false;
+	}
+	if (ok) {
+		core_reset_trace(&direct);
+		core_reset_trace(&hops);
+		core_run_ms(&direct, 5000);
+		core_run_ms(&hops, 5000);
+		io = direct.io;
+		sound = direct.sound;
+		if (!core_same_trace(&direct, &hops) || sound.events == 0) {
+			fprintf(stderr, "%s: seeking in two hops diverged\n", progname);
+			ok = false;
+		}
+	}
+	if (ok) {
+		/* backwards, restored from a keyframe */
+		core_reset_trace(&direct);
+		if (!gbs_seek(direct.gbs, target)) {
+			fprintf(stderr, "%s: gbs_seek failed\n", progname);
+			ok = false;
+		}
+		core_run_ms(&direct, 5000);
+		if (io.hash != direct.io.hash || io.events != direct.io.events ||
+		    sound.hash != direct.sound.hash || sound.events != direct.sound.events) {
+			fprintf(stderr, "%s: seeking back to a keyframe diverged\n", progname);
+			ok = false;
+		}
+	}
+	core_close(&direct);
+	core_close(&hops);
+	return ok && compare_seek_reference(progname, target);
+}
+
+/*
+ * Without rendering, registers, channel status and IO have to stay
+ * exactly as with sound, only the samples are gone.
+ */
+static long compare_render_mode(const char *progname)
+{
+	struct core_run sound = { 0 }, regs = { 0 };
+	long ms, ch, ok = true;
+
+	if (!core_open(&sound, CPU_CORE_CACHED) || !core_open(&regs, CPU_CORE_CACHED) ||
+	    !gbs_set_render_mode(regs.gbs, RENDER_REGISTERS)) {
+		fprintf(stderr, "%s: render mode setup failed\n", progname);
+		ok = false;
+	}
+	for (ms = 0; ok && ms < COMPARE_SECONDS * 1000; ms += COMPARE_STEP_MS) {
+		const struct gbs_status *a, *b;
+
+		gbs_step(sound.gbs, COMPARE_STEP_MS);
+		gbs_step(regs.gbs, COMPARE_STEP_MS);
+		a = gbs_get_status(sound.gbs);
+		b = gbs_get_status(regs.gbs);
+		for (ch = 0; ch < 4; ch++) {
+			if (a->ch[ch].vol != b->ch[ch].vol ||
+			    a->ch[ch].div_tc != b->ch[ch].div_tc ||
+			    a->ch[ch].playing != b->ch[ch].playing)
+				ok = false;
+		}
+		if (!ok || a->ticks != b->ticks ||
+		    sound.io.hash != regs.io.hash || sound.io.events != regs.io.events ||
+		    regs.sound.events != 0 || (a->lvol != 0) != (b->lvol != 0)) {
+			fprintf(stderr, "%s: register-only emulation diverged after %ldms\n",
+				progname, ms + COMPARE_STEP_MS);
+			ok = false;
+		}
+	}
+	core_close(&sound);
+	core_close(&regs);
+	return ok;
+}
+
+struct loop_window {
+	long long from;
+	long long to;
+	struct core_trace trace;
+};
+
+/*
+ * IO trace of each window.  Waking up from halt has a few cycles of
+ * jitter in the emulation, so only the order of the writes counts.
+ */
+static void loop_trace(struct gbs* const gbs, cycles_t cycles, uint32_t addr, uint8_t value, void *priv)
+{
+	struct loop_window *win = priv;
+	long i;
+
+	UNUSED(gbs);
+
+	for (i = 0; i < 2; i++) {
+		if ((long long)cycles >= win[i].from && (long long)cycles < win[i].to) {
+			win[i].trace.hash = trace_add(win[i].trace.hash, addr << 8 | value);
+			win[i].trace.events++;
+		}
+	}
+}
+
+/*
+ * The detected loop has to be in whole vblanks (70224 cycles) for a
+ * vblank driven subsong, and the IO after the loop start has to repeat
+ * exactly one loop later.
+ */
+static long compare_loop(const char *progname)
+{
+	struct core_run run = { 0 };
+	struct gbs_loop loop;
+	struct loop_window win[2];
+	const struct gbs_status *status;
+	long ok = true;
+
+	memset(win, 0, sizeof(win));
+	win[0].trace.hash = win[1].trace.hash = 2166136261u;
+	if (!core_open(&run, CPU_CORE_CACHED) ||
+	    !gbs_detect_loop(run.gbs, 0, 600, &loop)) {
+		fprintf(stderr, "%s: no loop detected\n", progname);
+		ok = false;
+	}
+	if (ok) {
+		status = gbs_get_status(run.gbs);
+		if (loop.length <= 0 || loop.length % 70224 != 0 || status->ticks != 0 ||
+		    status->subsong_len != (loop.start + loop.length) * 1024 / 4194304) {
+			fprintf(stderr, "%s: bad loop %lld+%lld\n", progname, loop.start, loop.length);
+			ok = false;
+		}
+	}
+	if (ok) {
+		win[0].from = loop.start;
+		win[1].from = loop.start + loop.length;
+		win[0].to = win[0].from + 5 * 4194304;
+		win[1].to = win[1].from + 5 * 4194304;
+		gbs_set_io_callback(run.gbs, loop_trace, win);
+		gbs_configure(run.gbs, 0, 0, 0, 0, 0);
+		while (gbs_get_status(run.gbs)->ticks < win[1].to)
+			gbs_step(run.gbs, 1000);
+		if (win[0].trace.events == 0 ||
+		    win[0].trace.hash != win[1].trace.hash ||
+		    win[0].trace.events != win[1].trace.events) {
+			fprintf(stderr, "%s: detected loop does not repeat\n", progname);
+			ok = false;
+		}
+	}
+	core_close(&run);
+	return ok;
+}
+
+/* Open the subsong again with the length cache set before gbs_init(). */
+static long core_open_cached(struct core_run *run, const char *cachefile)
+{
+	return core_open(run, CPU_CORE_CACHED) &&
+		gbs_set_cache(run->gbs, cachefile) &&
+		gbs_init(run->gbs, 0);
+}
+
+/*
+ * A loop found once is written to the length cache and comes back
+ * unchanged for the next instance that uses the same cache file.
+ * Instances without the cache do not see it.
+ */
+static long compare_length_cache(const char *progname, const char *cachefile)
+{
+	struct core_run run = { 0 }, plain = { 0 };
+	struct gbs_loop loop, cached;
+	long ok = true;
+
+	unlink(cachefile);
+	if (!core_open_cached(&run, cachefile) ||
+	    !gbs_detect_loop(run.gbs, 0, 600, &loop)) {
+		fprintf(stderr, "%s: no loop detected\n", progname);
+		ok = false;
+	}
+	core_close(&run);
+	/* a new instance reads the file back */
+	if (ok && (!core_open_cached(&run, cachefile) || !core_open(&plain, CPU_CORE_CACHED))) {
+		fprintf(stderr, "%s: reopening the subsong failed\n", progname);
+		ok = false;
+	}
+	if (ok) {
+		if (gbs_get_status(run.gbs)->subsong_len == 0 ||
+		    !gbs_detect_loop(run.gbs, 0, 0, &cached) ||
+		    cached.start != loop.start || cached.length != loop.length ||
+		    cached.channels != loop.channels) {
+			fprintf(stderr, "%s: length cache lost the loop %lld+%lld\n",
+				progname, loop.start, loop.length);
+			ok = false;
+		}
+		if (gbs_detect_loop(plain.gbs, 0, 0, &cached)) {
+			fprintf(stderr, "%s: length cache leaked into another instance\n", progname);
+			ok = false;
+		}
+	}
+	core_close(&run);
+	core_close(&plain);
+	unlink(cachefile);
+	return ok;
+}
+
 int main(int argc, char **argv)
 {
 	struct gbs *gbs;
@@ -40,5 +959,29 @@ int main(int argc, char **argv)
 		exit(3);
 	}
 	unlink(argv[1]);
+	gbs_close(gbs);
+
+	if (!compare_cpu_cores(argv[0]))
+		exit(4);
+	if (!compare_regsongs(argv[0], argv[1]))
+		exit(5);
+	if (!compare_stems(argv[0], SYNTH_STEP))
+		exit(6);
+	if (!compare_stems(argv[0], SYNTH_OVERSAMPLE))
+		exit(7);
+	if (!compare_synthesis(argv[0]))
+		exit(8);
+	if (!compare_state(argv[0], SYNTH_STEP))
+		exit(9);
+	if (!compare_state(argv[0], SYNTH_OVERSAMPLE))
+		exit(10);
+	if (!compare_seek(argv[0]))
+		exit(11);
+	if (!compare_render_mode(argv[0]))
+		exit(12);
+	if (!compare_loop(argv[0]))
+		exit(13);
+	if (!compare_length_cache(argv[0], argv[1]))
+		exit(14);
 	return 0;
 }